@@ -351,7 +351,7 @@ do
     -- m.Num is a numeric object holding either a bc integer for a Lua float
     -- m also redefines math fonctions
 
-    m = {}
+    m = m or {} -- may be a lazy stub (see package.lazy)
 
     local meta = {}
 
@@ -0,0 +1,378 @@
+--[[ BonaLuna compression benchmark
+
+Copyright (C) 2010-2020 Christophe Delord
+http://cdelord.fr/bl/bonaluna.html
+
+BonaLuna is based on Lua 5.3
+Copyright (C) 1994-2017 Lua.org, PUC-Rio
+
+Freely available under the terms of the MIT license.
+
+--]]
+
+-- bench.z(options) measures the compression libraries compiled in BonaLuna
+-- on a synthetic corpus (the same on all platforms) or on user files.
+-- bench.table(report) and bench.json(report) format the report
+-- and bench.main(args) is the command line interface (bl bench z ...).
+
+bench = bench or {} -- may be a lazy stub (see package.lazy)
+
+do
+
+    local clock = ps.clock
+    local MB = 1024*1024
+
+    local LIBRARIES = {"minilzo", "lzo", "qlz", "lz4", "lz4hc", "lzf", "zlib", "ucl", "lzma", "zstd"}
+    local Z_MODES = {"max", "balanced", "fast"}
+
+    -- codecs returns the codecs compiled in BonaLuna (names are library names or z:mode)
+    local function codecs()
+        local list = {}
+        for _, name in ipairs(LIBRARIES) do
+            local lib = rawget(_G, name)
+            if type(lib) == "table" and lib.compress then
+                list[#list+1] = {name=name, compress=lib.compress, decompress=lib.decompress, options={}}
+            end
+        end
+        for _, mode in ipairs(Z_MODES) do
+            list[#list+1] = {name="z:"..mode, compress=z.compress, decompress=z.decompress, options={mode=mode}}
+        end
+        return list
+    end
+
+    -- selected(codec, names) tells if codec is in names ("z" selects all the z modes)
+    local function selected(codec, names)
+        if not names then return true end
+        for _, name in ipairs(names) do
+            if name == codec.name or name == codec.name:match "^[^:]*" then return true end
+        end
+        return false
+    end
+
+    -- Synthetic corpus
+    -- The data is produced by a linear congruential generator
+    -- (integer arithmetic wraps around in Lua 5.3)
+    -- so that the corpus does not depend on the C library.
+
+    local function prng(seed)
+        local x = seed
+        local rnd = {}
+        function rnd.int(n)
+            x = x * 6364136223846793005 + 1442695040888963407
+            return (x >> 33) % n
+        end
+        function rnd.bits32()
+            x = x * 6364136223846793005 + 1442695040888963407
+            return x >> 32
+        end
+        return rnd
+    end
+
+    local function words(rnd, n)
+        local syllables = {"ka", "lo", "mi", "ne", "ru", "sa", "ti", "vo", "bel", "dor", "fen", "gal", "han", "jor", "mar", "pol", "qui", "tan", "ul", "zen"}
+        local list = {}
+        for i = 1, n do
+            local w = {}
+            for j = 1, 1 + rnd.int(3) do w[j] = syllables[1 + rnd.int(#syllables)] end
+            list[i] = table.concat(w)
+        end
+        -- frequent words first: rnd.int(rnd.int(n)+1) favours the beginning of the list
+        return function() return list[1 + rnd.int(rnd.int(n) + 1)] end
+    end
+
+    local generators = {}
+
+    function generators.text(rnd)
+        local word = words(rnd, 500)
+        return function()
+            local sentence = {}
+            for i = 1, 5 + rnd.int(12) do sentence[i] = word() end
+            local s = table.concat(sentence, " ")
+            return s:sub(1, 1):upper()..s:sub(2)..(rnd.int(5) == 0 and ".\n" or ". ")
+        end
+    end
+
+    function generators.log(rnd)
+        local levels = {"INFO", "INFO", "INFO", "DEBUG", "WARNING", "ERROR"}
+        local word = words(rnd, 100)
+        local t = 0
+        return function()
+            t = t + rnd.int(2000)
+            return ("2020-06-%02d %02d:%02d:%02d.%03d %-7s [worker-%d] %s %s %d served in %d ms\n"):format(
+                1 + t // 86400000 % 28, t // 3600000 % 24, t // 60000 % 60, t // 1000 % 60, t % 1000,
+                levels[1 + rnd.int(#levels)], rnd.int(16), word(), word(), rnd.int(100000), rnd.int(500))
+        end
+    end
+
+    function generators.records(rnd)
+        local word = words(rnd, 300)
+        local id = 0
+        return function()
+            id = id + 1 + rnd.int(10)
+            return ('{"id":%d,"name":"%s %s","email":"%s@%s.com","score":%d.%d,"active":%s,"tags":["%s","%s"]}\n'):format(
+                id, word(), word(), word(), word(), rnd.int(100), rnd.int(100),
+                rnd.int(2) == 0 and "true" or "false", word(), word())
+        end
+    end
+
+    function generators.random(rnd)
+        return function()
+            return ("<I4<I4<I4<I4"):pack(rnd.bits32(), rnd.bits32(), rnd.bits32(), rnd.bits32())
+        end
+    end
+
+    local CORPUS = {"text", "log", "records", "random"}
+
+    -- bench.corpus([size]) returns the synthetic corpus
+    -- (a list of {name=name, data=data}, size bytes per item, default: 1 MB)
+    function bench.corpus(size)
+        size = size or MB
+        local corpus = {}
+        for i, name in ipairs(CORPUS) do
+            local next_chunk = generators[name](prng(i))
+            local chunks = {}
+            local len = 0
+            while len < size do
+                local chunk = next_chunk()
+                chunks[#chunks+1] = chunk
+                len = len + #chunk
+            end
+            corpus[i] = {name=name, data=table.concat(chunks):sub(1, size)}
+        end
+        return corpus
+    end
+
+    -- Memory
+    -- The peak memory is the peak resident set size (VmHWM) minus the resident set size
+    -- before the measure (Linux only: the peak is reset through /proc/self/clear_refs).
+
+    local function status()
+        local f = io.open("/proc/self/status")
+        if not f then return nil end
+        local s = f:read("a")
+        f:close()
+        local rss, hwm = s:match "VmRSS:%s*(%d+)", s:match "VmHWM:%s*(%d+)"
+        if not rss or not hwm then return nil end
+        return tonumber(rss)*1024, tonumber(hwm)*1024
+    end
+
+    local function reset_peak()
+        local f = io.open("/proc/self/clear_refs", "w")
+        if not f then return false end
+        f:write("5")
+        return f:close() and true or false
+    end
+
+    -- Timing
+
+    local function measure(f, time, calls)
+        local times = {}
+        local total = 0.0
+        repeat
+            local t = clock()
+            f()
+            t = clock() - t
+            times[#times+1] = t
+            total = total + t
+        until #times >= calls and total >= time
+        table.sort(times)
+        local function percentile(p) return times[math.max(1, math.ceil(#times*p/100))] end
+        return {
+            calls = #times, total = total,
+            min = times[1], p50 = percentile(50), p90 = percentile(90), p99 = percentile(99), max = times[#times],
+        }
+    end
+
+    local function run(codec, input, options)
+        local result = {codec=codec.name, input=input.name, size=#input.data}
+        local src = z.buffer(input.data)
+        local compressed, decompressed = z.buffer(), z.buffer()
+        local copts = {into=compressed}
+        for k, v in pairs(codec.options) do copts[k] = v end
+        local dopts = {into=decompressed}
+        collectgarbage()
+        local rss0 = status()
+        local peak = rss0 and reset_peak()
+        local ok, err = codec.compress(src, copts)
+        if not ok then result.error = "compress: "..tostring(err); return result end
+        result.compressed_size = #compressed
+        result.ratio = #compressed > 0 and #src / #compressed or 0
+        result.compress = measure(function() codec.compress(src, copts) end, options.time, options.calls)
+        ok, err = codec.decompress(compressed, dopts)
+        if not ok then result.error = "decompress: "..tostring(err); return result end
+        if #decompressed ~= #src or tostring(decompressed) ~= input.data then result.error = "decompress: corrupted data"; return result end
+        result.decompress = measure(function() codec.decompress(compressed, dopts) end, options.time, options.calls)
+        result.compress_speed = result.size * result.compress.calls / result.compress.total / MB
+        result.decompress_speed = result.size * result.decompress.calls / result.decompress.total / MB
+        if peak then
+            local _, hwm = status()
+            result.peak_memory = math.max(0, hwm - rss0)
+        end
+        return result
+    end
+
+    -- bench.z([options]) runs the benchmark and returns a report
+    --      options.files: list of files (default: synthetic corpus)
+    --      options.size: size of the items of the synthetic corpus (default: 1 MB)
+    --      options.codecs: list of codec names (default: all)
+    --      options.time: minimal time of a measure in seconds (default: 0.5)
+    --      options.calls: minimal number of calls per measure (default: 3)
+    function bench.z(options)
+        options = options or {}
+        local opts = {time = options.time or 0.5, calls = options.calls or 3}
+        local inputs
+        if options.files then
+            inputs = {}
+            for i, name in ipairs(options.files) do
+                local f = assert(io.open(name, "rb"))
+                inputs[i] = {name=name, data=f:read("a")}
+                f:close()
+            end
+        else
+            inputs = bench.corpus(options.size)
+        end
+        local report = {
+            bonaluna = _BL_VERSION, lua = _VERSION, platform = sys and sys.platform,
+            date = os.date("!%Y-%m-%dT%H:%M:%SZ"),
+            time = opts.time, calls = opts.calls,
+            inputs = {}, results = {},
+        }
+        for i, input in ipairs(inputs) do report.inputs[i] = {name=input.name, size=#input.data} end
+        for _, input in ipairs(inputs) do
+            for _, codec in ipairs(codecs()) do
+                if selected(codec, options.codecs) then
+                    report.results[#report.results+1] = run(codec, input, opts)
+                end
+            end
+        end
+        return report
+    end
+
+    -- bench.table(report) formats a report as a text table (one table per input)
+    function bench.table(report)
+        local out = {}
+        local function ms(t) return ("%.3f"):format(t*1000) end
+        out[#out+1] = ("%s (%s, %s), %s, %g s per measure"):format(
+            report.bonaluna or "BonaLuna", report.lua or "?", report.platform or "?", report.date, report.time)
+        for _, input in ipairs(report.inputs) do
+            out[#out+1] = ""
+            out[#out+1] = ("%s (%d bytes)"):format(input.name, input.size)
+            out[#out+1] = ("%-12s %7s %10s %10s %9s  %-26s %s"):format(
+                "codec", "ratio", "comp MB/s", "dec MB/s", "peak MB", "comp ms p50/p90/p99", "dec ms p50/p90/p99")
+            for _, r in ipairs(report.results) do
+                if r.input == input.name then
+                    if r.error then
+                        out[#out+1] = ("%-12s %s"):format(r.codec, r.error)
+                    else
+                        out[#out+1] = ("%-12s %7.3f %10.1f %10.1f %9s  %-26s %s"):format(
+                            r.codec, r.ratio, r.compress_speed, r.decompress_speed,
+                            r.peak_memory and ("%.1f"):format(r.peak_memory/MB) or "-",
+                            ms(r.compress.p50).."/"..ms(r.compress.p90).."/"..ms(r.compress.p99),
+                            ms(r.decompress.p50).."/"..ms(r.decompress.p90).."/"..ms(r.decompress.p99))
+                    end
+                end
+            end
+        end
+        return table.concat(out, "\n").."\n"
+    end
+
+    -- bench.json(report) formats a report in JSON (keys are sorted to ease comparisons)
+    function bench.json(report)
+        local out = {}
+        local escapes = {['"']='\\"', ['\\']='\\\\', ['\n']='\\n', ['\t']='\\t'}
+        local function str(s)
+            return '"'..s:gsub('[%c"\\]', function(c) return escapes[c] or ("\\u%04x"):format(c:byte()) end)..'"'
+        end
+        local function encode(x, indent)
+            local t = type(x)
+            if t == "table" then
+                local inner = indent.."  "
+                if #x > 0 or next(x) == nil then
+                    out[#out+1] = "["
+                    for i, v in ipairs(x) do
+                        out[#out+1] = (i > 1 and ",\n" or "\n")..inner
+                        encode(v, inner)
+                    end
+                    out[#out+1] = #x > 0 and "\n"..indent.."]" or "]"
+                else
+                    local keys = {}
+                    for k in pairs(x) do keys[#keys+1] = k end
+                    table.sort(keys)
+                    out[#out+1] = "{"
+                    for i, k in ipairs(keys) do
+                        out[#out+1] = (i > 1 and ",\n" or "\n")..inner..str(k)..": "
+                        encode(x[k], inner)
+                    end
+                    out[#out+1] = "\n"..indent.."}"
+                end
+            elseif t == "string" then
+                out[#out+1] = str(x)
+            elseif math.type(x) == "integer" then
+                out[#out+1] = ("%d"):format(x)
+            elseif t == "number" then
+                out[#out+1] = x == x and x ~= math.huge and x ~= -math.huge and ("%.6g"):format(x) or "null"
+            elseif t == "boolean" then
+                out[#out+1] = tostring(x)
+            else
+                out[#out+1] = "null"
+            end
+        end
+        encode(report, "")
+        return table.concat(out).."\n"
+    end
+
+    local usage = [[
+usage: bl bench z [options] [files]
+
+Runs the compression benchmark on files (default: synthetic corpus).
+
+    -json           print the report in JSON instead of a table
+    -o file.json    also write the report in JSON to file.json
+    -t seconds      minimal time of a measure (default: 0.5)
+    -n calls        minimal number of calls per measure (default: 3)
+    -s size         size of the items of the synthetic corpus (default: 1048576)
+    -c codecs       comma separated list of codecs (e.g. lz4,zlib,z:fast, z for all the z modes)
+]]
+
+    -- bench.main(args) implements "bl bench z [options] [files]"
+    -- (args does not contain "bench") and returns the exit status
+    function bench.main(args)
+        if args[1] ~= "z" then
+            io.stderr:write(usage)
+            return 1
+        end
+        local options = {}
+        local json, output
+        local i = 2
+        local function param()
+            i = i + 1
+            if args[i] == nil then error("bl bench: missing parameter after "..args[i-1], 0) end
+            return args[i]
+        end
+        while args[i] do
+            local a = args[i]
+            if a == "-json" then json = true
+            elseif a == "-o" then output = param()
+            elseif a == "-t" then options.time = tonumber(param())
+            elseif a == "-n" then options.calls = math.tointeger(tonumber(param()))
+            elseif a == "-s" then options.size = math.tointeger(tonumber(param()))
+            elseif a == "-c" then options.codecs = param():split ","
+            elseif a:match "^%-" then io.stderr:write("bl bench: unknown option "..a.."\n", usage); return 1
+            else options.files = options.files or {}; table.insert(options.files, a)
+            end
+            i = i + 1
+        end
+        local report = bench.z(options)
+        io.write(json and bench.json(report) or bench.table(report))
+        if output then
+            local f = assert(io.open(output, "w"))
+            f:write(bench.json(report))
+            f:close()
+        end
+        for _, r in ipairs(report.results) do
+            if r.error then return 1 end
+        end
+        return 0
+    end
+
+end
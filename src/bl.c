@@ -110,6 +110,7 @@ Freely available under the terms of the MIT license.
 
 /* BonaLuna "glue" */
 static int glue(lua_State *L, char **argv, int argc, int script);
+static int bl_command(lua_State *L, char **argv, int script);
 
 /* lua */
 #include "lua.c"
@@ -12,7 +12,7 @@ Freely available under the terms of the MIT license.
 
 -- Inspired by BigNum (http://oss.digirati.com.br/luabignum/)
 
-bn = {}
+bn = bn or {} -- may be a lazy stub (see package.lazy)
 
 do
 
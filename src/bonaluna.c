@@ -19,6 +19,7 @@ Freely available under the terms of the MIT license.
 #include "utime.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <math.h>
 #include <fcntl.h>
 
 #ifdef __MINGW32__
@@ -31,6 +32,23 @@ Freely available under the terms of the MIT license.
 #include "sys/select.h"
 #endif
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef BL_THREADS
+#include <pthread.h>
+#endif
+
 #ifdef USE_ZLIB
 #include "zlib.h"
 #endif
@@ -42,6 +60,7 @@ Freely available under the terms of the MIT license.
 #ifdef USE_LZ4
 #include "lz4.h"
 #include "lz4hc.h"
+#include "lz4frame.h"
 #endif
 
 #ifdef USE_LZO
@@ -52,6 +71,11 @@ Freely available under the terms of the MIT license.
 #include "lzma.h"
 #endif
 
+#ifdef USE_ZSTD
+#include "zstd.h"
+#include "zstd_errors.h"
+#endif
+
 #define BL_PATHSIZE 1024
 #define BL_BUFSIZE  (64*1024)
 
@@ -93,6 +117,354 @@ static int bl_pusherror2(lua_State *L, const char *msg, const char *arg1, int ar
     return 2;
 }
 
+#ifdef BL_THREADS
+/* number of online CPUs (used to size thread pools) */
+static int bl_cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+#endif
+
+/* bl_hash computes the 128-bit MurmurHash3 (x64 variant) of buf
+ * as a hexadecimal string. It is fast but not cryptographic
+ * (it is meant to identify contents, e.g. in a cache).
+ * bl_hash128 returns the hash as two 64-bit integers.
+ */
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void bl_hash128(const void *buf, size_t len, uint64_t h[2])
+{
+    const uint8_t *data = (const uint8_t *)buf;
+    const size_t nblocks = len / 16;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const uint8_t *tail = data + nblocks*16;
+    uint64_t h1 = 0, h2 = 0;
+    uint64_t k1, k2;
+    size_t i;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        memcpy(&k1, data + i*16, 8);
+        memcpy(&k2, data + i*16 + 8, 8);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    k1 = 0;
+    k2 = 0;
+    switch (len & 15)
+    {
+        case 15: k2 ^= (uint64_t)tail[14] << 48;
+        case 14: k2 ^= (uint64_t)tail[13] << 40;
+        case 13: k2 ^= (uint64_t)tail[12] << 32;
+        case 12: k2 ^= (uint64_t)tail[11] << 24;
+        case 11: k2 ^= (uint64_t)tail[10] << 16;
+        case 10: k2 ^= (uint64_t)tail[ 9] << 8;
+        case  9: k2 ^= (uint64_t)tail[ 8];
+                 k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        case  8: k1 ^= (uint64_t)tail[ 7] << 56;
+        case  7: k1 ^= (uint64_t)tail[ 6] << 48;
+        case  6: k1 ^= (uint64_t)tail[ 5] << 40;
+        case  5: k1 ^= (uint64_t)tail[ 4] << 32;
+        case  4: k1 ^= (uint64_t)tail[ 3] << 24;
+        case  3: k1 ^= (uint64_t)tail[ 2] << 16;
+        case  2: k1 ^= (uint64_t)tail[ 1] << 8;
+        case  1: k1 ^= (uint64_t)tail[ 0];
+                 k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+
+    h[0] = h1;
+    h[1] = h2;
+}
+
+static void bl_hash(const void *buf, size_t len, char hex[33])
+{
+    uint64_t h[2];
+    bl_hash128(buf, len, h);
+    snprintf(hex, 33, "%016llx%016llx", (unsigned long long)h[0], (unsigned long long)h[1]);
+}
+
+/* bl_parallel calls job(ctx, i) for i in [0, n[ on a pool of threads
+ * (the calling thread included) and returns when all the jobs are done.
+ * The jobs must not use any Lua state.
+ * bl_parallel_threads limits the pool to nb_threads threads (0: one per CPU).
+ */
+typedef void (*t_bl_job)(void *ctx, int i);
+
+#ifdef BL_THREADS
+
+typedef struct
+{
+    t_bl_job job;
+    void *ctx;
+    int n;
+    int next;
+    pthread_mutex_t mutex;
+} t_bl_parallel;
+
+static void *bl_parallel_worker(void *arg)
+{
+    t_bl_parallel *p = (t_bl_parallel*)arg;
+    for (;;)
+    {
+        int i;
+        pthread_mutex_lock(&p->mutex);
+        i = p->next++;
+        pthread_mutex_unlock(&p->mutex);
+        if (i >= p->n) return NULL;
+        p->job(p->ctx, i);
+    }
+}
+
+#endif
+
+static void bl_parallel_threads(int nb_threads, int n, t_bl_job job, void *ctx)
+{
+    int i;
+#ifdef BL_THREADS
+    nb_threads = (nb_threads > 0 ? nb_threads : bl_cpu_count()) - 1;
+    if (nb_threads > n - 1) nb_threads = n - 1;
+    if (nb_threads > 0)
+    {
+        t_bl_parallel p;
+        pthread_t *threads = (pthread_t*)malloc(nb_threads * sizeof(pthread_t));
+        int started = 0;
+        p.job = job;
+        p.ctx = ctx;
+        p.n = n;
+        p.next = 0;
+        pthread_mutex_init(&p.mutex, NULL);
+        for (i = 0; i < nb_threads; i++)
+            if (pthread_create(&threads[started], NULL, bl_parallel_worker, &p) == 0)
+                started++;
+        bl_parallel_worker(&p);
+        for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+        pthread_mutex_destroy(&p.mutex);
+        free(threads);
+        return;
+    }
+#endif
+    (void)nb_threads;
+    for (i = 0; i < n; i++) job(ctx, i);
+}
+
+static void bl_parallel(int n, t_bl_job job, void *ctx)
+{
+    bl_parallel_threads(0, n, job, ctx);
+}
+
+/*******************************************************************/
+/* startup tracing                                                 */
+/*******************************************************************/
+
+/* BL_TRACE_STARTUP=file records the time spent in the initialization
+ * of the libraries and in each block of the glue.
+ * The file is a Chrome trace (chrome://tracing) if its name ends with ".json",
+ * otherwise it is a text report.
+ */
+
+typedef struct
+{
+    const char *cat;
+    char *name;
+    char *detail;
+    double start;           /* µs since the initialization of the tracer */
+    double dur;             /* µs */
+    int tid;
+} t_trace_event;
+
+static struct
+{
+    char *file;
+    double origin;
+    t_trace_event *events;
+    int nb_events;
+    int max_events;
+#ifdef BL_THREADS
+    pthread_mutex_t mutex;
+    int nb_threads;
+#endif
+} bl_tracer;
+
+#ifdef BL_THREADS
+static __thread int bl_trace_tid;
+#endif
+
+static double bl_trace_now(void)
+{
+#ifdef __MINGW32__
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart * 1e6 / (double)freq.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1e6 + t.tv_nsec/1e3;
+#endif
+}
+
+static void bl_trace_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(f, "\\u%04x", (unsigned char)*s);
+        else fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static int bl_trace_cmp(const void *a, const void *b)
+{
+    double d = ((const t_trace_event*)a)->start - ((const t_trace_event*)b)->start;
+    return d < 0 ? -1 : d > 0 ? 1 : 0;
+}
+
+static void bl_trace_write(void)
+{
+    FILE *f;
+    int i, j;
+    size_t n;
+    double total = bl_trace_now() - bl_tracer.origin;
+#ifdef BL_THREADS
+    pthread_mutex_lock(&bl_tracer.mutex);
+#endif
+    f = fopen(bl_tracer.file, "w");
+    if (f == NULL) goto end;
+    qsort(bl_tracer.events, bl_tracer.nb_events, sizeof(t_trace_event), bl_trace_cmp);
+    n = strlen(bl_tracer.file);
+    if (n >= 5 && strcmp(bl_tracer.file+n-5, ".json") == 0)
+    {
+        /* Chrome trace event format */
+        fprintf(f, "{\"traceEvents\":[\n");
+        for (i = 0; i < bl_tracer.nb_events; i++)
+        {
+            t_trace_event *e = &bl_tracer.events[i];
+            fprintf(f, "%s{\"name\":", i > 0 ? ",\n" : "");
+            bl_trace_json_string(f, e->name);
+            fprintf(f, ",\"cat\":");
+            bl_trace_json_string(f, e->cat);
+            fprintf(f, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d", e->start, e->dur, e->tid);
+            if (e->detail)
+            {
+                fprintf(f, ",\"args\":{\"detail\":");
+                bl_trace_json_string(f, e->detail);
+                fprintf(f, "}");
+            }
+            fprintf(f, "}");
+        }
+        fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    }
+    else
+    {
+        /* text report */
+        fprintf(f, "%10s %10s %6s  %-10s %s\n", "start(ms)", "time(ms)", "thread", "category", "name");
+        for (i = 0; i < bl_tracer.nb_events; i++)
+        {
+            t_trace_event *e = &bl_tracer.events[i];
+            fprintf(f, "%10.3f %10.3f %6d  %-10s %s%s%s%s\n",
+                    e->start/1e3, e->dur/1e3, e->tid, e->cat, e->name,
+                    e->detail ? " (" : "", e->detail ? e->detail : "", e->detail ? ")" : "");
+        }
+        fprintf(f, "\n%-10s %10s\n", "category", "time(ms)");
+        for (i = 0; i < bl_tracer.nb_events; i++)
+        {
+            double sum = 0.0;
+            for (j = 0; j < i; j++)
+                if (strcmp(bl_tracer.events[j].cat, bl_tracer.events[i].cat) == 0) break;
+            if (j < i) continue; /* already summed */
+            for (j = i; j < bl_tracer.nb_events; j++)
+                if (strcmp(bl_tracer.events[j].cat, bl_tracer.events[i].cat) == 0) sum += bl_tracer.events[j].dur;
+            fprintf(f, "%-10s %10.3f\n", bl_tracer.events[i].cat, sum/1e3);
+        }
+        fprintf(f, "%-10s %10.3f\n", "total", total/1e3);
+    }
+    fclose(f);
+end:
+#ifdef BL_THREADS
+    pthread_mutex_unlock(&bl_tracer.mutex);
+#endif
+    return;
+}
+
+void bl_trace_init(void)
+{
+    const char *file = getenv("BL_TRACE_STARTUP");
+    if (file == NULL || *file == '\0' || bl_tracer.file != NULL) return;
+    bl_tracer.file = strdup(file);
+    bl_tracer.origin = bl_trace_now();
+#ifdef BL_THREADS
+    pthread_mutex_init(&bl_tracer.mutex, NULL);
+#endif
+    atexit(bl_trace_write);
+}
+
+int bl_tracing(void)
+{
+    return bl_tracer.file != NULL;
+}
+
+/* bl_trace_clock returns the start time of an event (0 if tracing is off) */
+double bl_trace_clock(void)
+{
+    return bl_tracer.file ? bl_trace_now() : 0.0;
+}
+
+/* bl_trace records an event started at start (given by bl_trace_clock) */
+void bl_trace(const char *cat, const char *name, const char *detail, double start)
+{
+    t_trace_event *e;
+    double end;
+    if (bl_tracer.file == NULL) return;
+    end = bl_trace_now();
+#ifdef BL_THREADS
+    pthread_mutex_lock(&bl_tracer.mutex);
+#endif
+    if (bl_tracer.nb_events == bl_tracer.max_events)
+    {
+        bl_tracer.max_events = bl_tracer.max_events ? 2*bl_tracer.max_events : 256;
+        bl_tracer.events = (t_trace_event*)realloc(bl_tracer.events, bl_tracer.max_events*sizeof(t_trace_event));
+    }
+    e = &bl_tracer.events[bl_tracer.nb_events++];
+    e->cat = cat;
+    e->name = strdup(name ? name : "");
+    e->detail = detail ? strdup(detail) : NULL;
+    e->start = start - bl_tracer.origin;
+    e->dur = end - start;
+#ifdef BL_THREADS
+    if (bl_trace_tid == 0) bl_trace_tid = ++bl_tracer.nb_threads;
+    e->tid = bl_trace_tid;
+    pthread_mutex_unlock(&bl_tracer.mutex);
+#else
+    e->tid = 1;
+#endif
+}
+
 /*******************************************************************/
 /* fs: File System                                                 */
 /*******************************************************************/
@@ -191,6 +563,332 @@ static int fs_glob(lua_State *L)
 
 #endif
 
+#ifdef __linux__
+
+/* fs.walk reads the directories with getdents64 and uses the type of the
+ * entries given by the kernel (d_type): only symbolic links (and the entries
+ * of file systems without d_type) are stat'ed, relatively to the directory (fstatat).
+ * The order is the order of the Lua version of fs.walk (stdlib.lua):
+ * each directory is followed by its files and its subdirectories are walked
+ * last (in reverse order). Entries are read lazily, one directory at a time.
+ */
+
+#define BL_WALK             "bl.fs.walk"
+#define BL_WALK_GETDENTS    (64*1024)
+
+struct bl_dirent64
+{
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+enum { BL_WALK_FILE, BL_WALK_DIR, BL_WALK_LINK, BL_WALK_OTHER };
+static const char *const bl_walk_types[] = {"file", "directory", "link", "unknown"};
+
+typedef struct
+{
+    char *path;
+    int depth;
+    int node;                   /* node of the parent directory (-1 for the root) */
+} t_walk_dir;
+
+/* followed links to an ancestor directory are not walked again */
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    int parent;
+} t_walk_node;
+
+typedef struct
+{
+    size_t offset;              /* offset of the name in names (while reading the directory) */
+    const char *name;
+    int type;
+} t_walk_entry;
+
+typedef struct
+{
+    int max_depth;              /* -1: no limit */
+    int follow;                 /* follow symbolic links to directories */
+    int sort;
+    t_walk_dir *dirs;           /* stack of directories to walk */
+    size_t nb_dirs, max_dirs;
+    t_walk_node *nodes;
+    size_t nb_nodes, max_nodes;
+    char *dir;                  /* current directory */
+    t_walk_entry *entries;      /* files of the current directory (or all its entries while reading it) */
+    size_t nb_entries, max_entries, next;
+    char *names;
+    size_t names_len, names_size;
+    char *buf;                  /* getdents64 buffer */
+} t_walk;
+
+/* bl_walk_grow makes room for n items of size bytes in *p (0 if there is not enough memory) */
+static int bl_walk_grow(void **p, size_t *max, size_t n, size_t size)
+{
+    if (n > *max)
+    {
+        size_t new_max = *max ? 2*(*max) : 64;
+        void *q;
+        while (new_max < n) new_max *= 2;
+        q = realloc(*p, new_max*size);
+        if (!q) return 0;
+        *p = q;
+        *max = new_max;
+    }
+    return 1;
+}
+
+static int bl_walk_loop(t_walk *w, int node, const struct stat *st)
+{
+    for (; node >= 0; node = w->nodes[node].parent)
+        if (w->nodes[node].dev == st->st_dev && w->nodes[node].ino == st->st_ino) return 1;
+    return 0;
+}
+
+/* bl_walk_type returns the type of an entry (-1 for broken links, ignored as fs.stat fails on them) */
+static int bl_walk_type(t_walk *w, int fd, int node, const char *name, unsigned char d_type)
+{
+    struct stat st;
+    switch (d_type)
+    {
+        case DT_DIR:    return BL_WALK_DIR;
+        case DT_REG:    return BL_WALK_FILE;
+        case DT_LNK:    if (!w->follow) return BL_WALK_LINK; break;
+        case DT_UNKNOWN:
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+            if (S_ISDIR(st.st_mode)) return BL_WALK_DIR;
+            if (S_ISREG(st.st_mode)) return BL_WALK_FILE;
+            if (!S_ISLNK(st.st_mode)) return BL_WALK_OTHER;
+            if (!w->follow) return BL_WALK_LINK;
+            break;
+        default:        return BL_WALK_OTHER;
+    }
+    /* followed link */
+    if (fstatat(fd, name, &st, 0) != 0) return -1;
+    if (S_ISREG(st.st_mode)) return BL_WALK_FILE;
+    if (!S_ISDIR(st.st_mode)) return BL_WALK_OTHER;
+    return bl_walk_loop(w, node, &st) ? BL_WALK_LINK : BL_WALK_DIR;
+}
+
+static int bl_walk_cmp(const void *a, const void *b)
+{
+    return strcmp(((const t_walk_entry *)a)->name, ((const t_walk_entry *)b)->name);
+}
+
+/* bl_walk_read reads the directory d: its files are stored in w->entries
+ * and its subdirectories are pushed on w->dirs.
+ * It returns 1 (directory read), 0 (directory not readable) or -1 (not enough memory).
+ */
+static int bl_walk_read(t_walk *w, const t_walk_dir *d)
+{
+    int fd = openat(AT_FDCWD, d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (w->follow || d->depth == 0 ? 0 : O_NOFOLLOW));
+    int node = d->node;
+    size_t i, nb_files, dir_len;
+    if (fd < 0) return 0;
+    w->nb_entries = w->next = 0;
+    w->names_len = 0;
+    if (w->max_depth >= 0 && d->depth >= w->max_depth)
+    {
+        close(fd);
+        return 1;
+    }
+    if (w->follow)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+        {
+            if (!bl_walk_grow((void**)&w->nodes, &w->max_nodes, w->nb_nodes+1, sizeof(t_walk_node))) goto nomem;
+            w->nodes[w->nb_nodes].dev = st.st_dev;
+            w->nodes[w->nb_nodes].ino = st.st_ino;
+            w->nodes[w->nb_nodes].parent = d->node;
+            node = (int)w->nb_nodes++;
+        }
+    }
+    for (;;)
+    {
+        long n = syscall(SYS_getdents64, fd, w->buf, BL_WALK_GETDENTS);
+        long pos;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (pos = 0; pos < n; )
+        {
+            struct bl_dirent64 *e = (struct bl_dirent64 *)(w->buf + pos);
+            size_t len;
+            int type;
+            pos += e->d_reclen;
+            if (e->d_name[0] == '.' && (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0'))) continue;
+            type = bl_walk_type(w, fd, node, e->d_name, e->d_type);
+            if (type < 0) continue;
+            len = strlen(e->d_name) + 1;
+            if (!bl_walk_grow((void**)&w->entries, &w->max_entries, w->nb_entries+1, sizeof(t_walk_entry))) goto nomem;
+            if (!bl_walk_grow((void**)&w->names, &w->names_size, w->names_len+len, 1)) goto nomem;
+            memcpy(w->names + w->names_len, e->d_name, len);
+            w->entries[w->nb_entries].offset = w->names_len;
+            w->entries[w->nb_entries].type = type;
+            w->nb_entries++;
+            w->names_len += len;
+        }
+    }
+    close(fd);
+    for (i = 0; i < w->nb_entries; i++) w->entries[i].name = w->names + w->entries[i].offset;
+    if (w->sort) qsort(w->entries, w->nb_entries, sizeof(t_walk_entry), bl_walk_cmp);
+    /* the subdirectories are pushed in order and the files are kept in order */
+    dir_len = strlen(d->path);
+    nb_files = 0;
+    for (i = 0; i < w->nb_entries; i++)
+    {
+        t_walk_entry *e = &w->entries[i];
+        if (e->type == BL_WALK_DIR)
+        {
+            const char *name = e->name;
+            size_t len = strlen(name);
+            char *path = (char*)malloc(dir_len + 1 + len + 1);
+            if (!path || !bl_walk_grow((void**)&w->dirs, &w->max_dirs, w->nb_dirs+1, sizeof(t_walk_dir)))
+            {
+                free(path);
+                return -1;
+            }
+            memcpy(path, d->path, dir_len);
+            path[dir_len] = '/';
+            memcpy(path + dir_len + 1, name, len + 1);
+            w->dirs[w->nb_dirs].path = path;
+            w->dirs[w->nb_dirs].depth = d->depth + 1;
+            w->dirs[w->nb_dirs].node = node;
+            w->nb_dirs++;
+        }
+        else
+        {
+            w->entries[nb_files++] = *e;
+        }
+    }
+    w->nb_entries = nb_files;
+    return 1;
+nomem:
+    close(fd);
+    return -1;
+}
+
+static int fs_walk_next(lua_State *L)
+{
+    t_walk *w = (t_walk*)luaL_checkudata(L, lua_upvalueindex(1), BL_WALK);
+    t_walk_entry *e;
+    while (w->next >= w->nb_entries)
+    {
+        t_walk_dir d;
+        int r;
+        if (w->nb_dirs == 0) return 0;
+        d = w->dirs[w->nb_dirs-1];
+        if (d.depth > 0 && !lua_isnil(L, lua_upvalueindex(2)))
+        {
+            /* the directory stays on the stack (and is freed by the gc) if prune fails */
+            int pruned;
+            lua_pushvalue(L, lua_upvalueindex(2));
+            lua_pushstring(L, d.path);
+            lua_call(L, 1, 1);
+            pruned = lua_toboolean(L, -1);
+            lua_pop(L, 1);
+            if (pruned)
+            {
+                free(d.path);
+                w->nb_dirs--;
+                continue;
+            }
+        }
+        w->nb_dirs--;
+        free(w->dir);
+        w->dir = d.path;
+        w->nb_entries = w->next = 0;
+        r = bl_walk_read(w, &d);
+        if (r < 0) return luaL_error(L, "fs.walk: not enough memory");
+        if (r > 0)
+        {
+            lua_pushstring(L, w->dir);
+            lua_pushstring(L, bl_walk_types[BL_WALK_DIR]);
+            return 2;
+        }
+    }
+    e = &w->entries[w->next++];
+    lua_pushfstring(L, "%s/%s", w->dir, e->name);
+    lua_pushstring(L, bl_walk_types[e->type]);
+    return 2;
+}
+
+static int fs_walk_gc(lua_State *L)
+{
+    t_walk *w = (t_walk*)luaL_checkudata(L, 1, BL_WALK);
+    while (w->nb_dirs > 0) free(w->dirs[--w->nb_dirs].path);
+    free(w->dirs);
+    free(w->nodes);
+    free(w->dir);
+    free(w->entries);
+    free(w->names);
+    free(w->buf);
+    memset(w, 0, sizeof(t_walk));
+    return 0;
+}
+
+/* fs.walk([path [, options]]) returns an iterator over the directories and files
+ * of path (with their types). options:
+ *      depth: maximal depth (0: path only, 1: entries of path, ...)
+ *      follow: follow the symbolic links to directories (default: true)
+ *      sort: sort the entries of the directories (default: true)
+ *      prune: function called with the path of each subdirectory, the directory is skipped if it returns true
+ */
+static int fs_walk(lua_State *L)
+{
+    const char *path = luaL_optstring(L, 1, ".");
+    t_walk *w;
+    int max_depth = -1, follow = 1, sort = 1;
+    lua_settop(L, 2);
+    if (!lua_isnil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "depth");
+        if (!lua_isnil(L, -1))
+        {
+            lua_Integer n = luaL_checkinteger(L, -1);
+            if (n < 0) return luaL_argerror(L, 2, "invalid depth");
+            max_depth = n > INT_MAX ? INT_MAX : (int)n;
+        }
+        lua_getfield(L, 2, "follow");
+        if (!lua_isnil(L, -1)) follow = lua_toboolean(L, -1);
+        lua_getfield(L, 2, "sort");
+        if (!lua_isnil(L, -1)) sort = lua_toboolean(L, -1);
+        lua_getfield(L, 2, "prune");
+        if (!lua_isnil(L, -1)) luaL_checktype(L, -1, LUA_TFUNCTION);
+        lua_replace(L, 2);
+        lua_settop(L, 2);
+    }
+    w = (t_walk*)lua_newuserdata(L, sizeof(t_walk));
+    memset(w, 0, sizeof(t_walk));
+    if (luaL_newmetatable(L, BL_WALK))
+    {
+        lua_pushcfunction(L, fs_walk_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    w->max_depth = max_depth;
+    w->follow = follow;
+    w->sort = sort;
+    w->buf = (char*)malloc(BL_WALK_GETDENTS);
+    w->dirs = (t_walk_dir*)malloc(sizeof(t_walk_dir));
+    if (w->dirs) w->max_dirs = 1;
+    if (!w->buf || !w->dirs || !(w->dirs[0].path = strdup(path))) return luaL_error(L, "fs.walk: not enough memory");
+    w->dirs[0].depth = 0;
+    w->dirs[0].node = -1;
+    w->nb_dirs = 1;
+    lua_pushvalue(L, 2);        /* prune */
+    lua_pushcclosure(L, fs_walk_next, 2);
+    return 1;
+}
+
+#endif
+
 static int fs_remove(lua_State *L)
 {
     const char *filename = luaL_checkstring(L, 1);
@@ -212,59 +910,150 @@ static int fs_rename(lua_State *L)
     return bl_pushresult(L, rename(fromname, toname) == 0, fromname);
 }
 
+#define BL_COPY_BUFSIZE (1024*1024)     /* buffer used when the kernel can not copy the file */
+
+#ifdef __linux__
+/* errors of FICLONE, copy_file_range and sendfile meaning that the next method shall be tried */
+#define BL_COPY_UNSUPPORTED(e) ((e) == ENOSYS || (e) == EXDEV || (e) == EINVAL || (e) == EOPNOTSUPP || (e) == ENOTTY || (e) == EBADF)
+#endif
+
+/* bl_copy_fd copies the file from (size bytes expected) to the file to.
+ * On Linux the data is not copied through user space:
+ *      - FICLONE shares the blocks of the file (reflink on btrfs, XFS, ...)
+ *      - copy_file_range copies in the kernel (or on the server for NFS and SMB)
+ *      - sendfile copies between file systems not supported by copy_file_range
+ * What the kernel does not copy (everything on Windows, files of /proc
+ * which size is unknown, ...) is copied through a large buffer.
+ * It returns 0 or -1 (errno is set).
+ */
+static int bl_copy_fd(int from, int to, off_t size)
+{
+    char *buffer;
+    ssize_t n;
+#ifdef __linux__
+    off_t done = 0;
+    if (size > 0 && ioctl(to, FICLONE, from) == 0) return 0;
+#ifdef SYS_copy_file_range
+    while (done < size)
+    {
+        n = syscall(SYS_copy_file_range, from, NULL, to, NULL, (size_t)(size - done), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && !BL_COPY_UNSUPPORTED(errno)) return -1;
+        if (n <= 0) break;
+        done += n;
+    }
+#endif
+    while (done < size)
+    {
+        n = sendfile(to, from, NULL, (size_t)(size - done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && !BL_COPY_UNSUPPORTED(errno)) return -1;
+        if (n <= 0) break;
+        done += n;
+    }
+    if (size > 0 && done == size) return 0;
+    posix_fadvise(from, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#ifdef __MINGW32__
+    buffer = (char*)malloc(BL_COPY_BUFSIZE);
+#else
+    if (posix_memalign((void**)&buffer, 4096, BL_COPY_BUFSIZE) != 0) buffer = NULL;
+#endif
+    if (!buffer)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    while ((n = read(from, buffer, BL_COPY_BUFSIZE)) != 0)
+    {
+        char *p = buffer;
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            free(buffer);
+            return -1;
+        }
+        while (n > 0)
+        {
+            ssize_t written = write(to, p, n);
+            if (written < 0)
+            {
+                if (errno == EINTR) continue;
+                free(buffer);
+                return -1;
+            }
+            p += written;
+            n -= written;
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
 static int fs_copy(lua_State *L)
 {
     const char *fromname = luaL_checkstring(L, 1);
     const char *toname = luaL_checkstring(L, 2);
     int _en;
-    FILE *from, *to;
-    int n;
-    char buffer[BL_BUFSIZE];
+    int from, to;
     struct stat st;
-    struct utimbuf t;
-    from = fopen(fromname, "rb");
-    if (!from) return bl_pushresult(L, 0, fromname);
-    to = fopen(toname, "wb");
-    if (!to)
+#ifndef __MINGW32__
+    struct timespec times[2];
+#endif
+    from = open(fromname, O_RDONLY | O_BINARY);
+    if (from < 0) return bl_pushresult(L, 0, fromname);
+    if (fstat(from, &st) != 0)
     {
         _en = errno;
-        fclose(from);
+        close(from);
         errno = _en;
-        return bl_pushresult(L, 0, toname);
+        return bl_pushresult(L, 0, fromname);
     }
-    while (n = fread(buffer, sizeof(char), BL_BUFSIZE, from))
+#ifndef __MINGW32__
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+#endif
+    to = open(toname, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (to < 0)
     {
-        if (fwrite(buffer, sizeof(char), n, to) != n)
-        {
-            _en = errno;
-            fclose(from);
-            fclose(to);
-            remove(toname);
-            errno = _en;
-            return bl_pushresult(L, 0, toname);
-        }
+        _en = errno;
+        close(from);
+        errno = _en;
+        return bl_pushresult(L, 0, toname);
     }
-    if (ferror(from))
+    if (bl_copy_fd(from, to, st.st_size) != 0
+#ifndef __MINGW32__
+        /* the attributes and times (in nanoseconds) are set on the open file */
+        || fchmod(to, st.st_mode & 07777) != 0
+        || futimens(to, times) != 0
+#endif
+        )
     {
         _en = errno;
-        fclose(from);
-        fclose(to);
+        close(from);
+        close(to);
         remove(toname);
         errno = _en;
         return bl_pushresult(L, 0, toname);
     }
-    fclose(from);
-    fclose(to);
-    if (stat(fromname, &st) != 0) return bl_pushresult(L, 0, fromname);
-    t.actime = st.st_atime;
-    t.modtime = st.st_mtime;
-    return bl_pushresult(L, 
-        utime(toname, &t) == 0 && chmod(toname, st.st_mode) == 0,
-        toname);
-}
-
-static int fs_mkdir(lua_State *L)
-{
+    close(from);
+    if (close(to) != 0) return bl_pushresult(L, 0, toname);
+#ifdef __MINGW32__
+    {
+        struct utimbuf t;
+        t.actime = st.st_atime;
+        t.modtime = st.st_mtime;
+        return bl_pushresult(L,
+            utime(toname, &t) == 0 && chmod(toname, st.st_mode) == 0,
+            toname);
+    }
+#else
+    return bl_pushresult(L, 1, toname);
+#endif
+}
+
+static int fs_mkdir(lua_State *L)
+{
     const char *path = luaL_checkstring(L, 1);
 #ifdef __MINGW32__
     return bl_pushresult(L, mkdir(path) == 0, path);
@@ -273,12 +1062,25 @@ static int fs_mkdir(lua_State *L)
 #endif
 }
 
-static int fs_stat(lua_State *L)
+/* fs_pushstat reads the attributes of a file (follow = 0 to read the symbolic links themselves) */
+static int fs_pushstat(lua_State *L, int follow)
 {
     const char *path = luaL_checkstring(L, 1);
     struct stat buf;
-    if (stat(path, &buf)==0)
+    int r;
+#ifdef __MINGW32__
+    /* no lstat function */
+    (void)follow;
+    r = stat(path, &buf);
+#else
+    r = follow ? stat(path, &buf) : lstat(path, &buf);
+#endif
+    if (r==0)
     {
+        const char *type = S_ISDIR(buf.st_mode) ? "directory" : S_ISREG(buf.st_mode) ? "file" : "unknown";
+#ifndef __MINGW32__
+        if (S_ISLNK(buf.st_mode)) type = "link";
+#endif
 #define STRING(VAL, ATTR) lua_pushstring(L, VAL); lua_setfield(L, -2, ATTR)
 #define INTEGER(VAL, ATTR) lua_pushinteger(L, VAL); lua_setfield(L, -2, ATTR)
         lua_newtable(L); /* stat */
@@ -287,7 +1089,7 @@ static int fs_stat(lua_State *L)
         INTEGER(buf.st_mtime, "mtime");
         INTEGER(buf.st_atime, "atime");
         INTEGER(buf.st_ctime, "ctime");
-        STRING(S_ISDIR(buf.st_mode)?"directory":S_ISREG(buf.st_mode)?"file":"unknown", "type");
+        STRING(type, "type");
         INTEGER(buf.st_mode, "mode");
 #define PERMISSION(MASK, ATTR) lua_pushboolean(L, buf.st_mode & MASK); lua_setfield(L, -2, ATTR);
         PERMISSION(S_IRUSR, "uR");
@@ -312,6 +1114,16 @@ static int fs_stat(lua_State *L)
     }
 }
 
+static int fs_stat(lua_State *L)
+{
+    return fs_pushstat(L, 1);
+}
+
+static int fs_lstat(lua_State *L)
+{
+    return fs_pushstat(L, 0);
+}
+
 #ifdef __MINGW32__
 
 /* "inode" number for MS-Windows (http://gnuwin32.sourceforge.net/compile.html) */
@@ -502,10 +1314,14 @@ static const luaL_Reg fslib[] =
     {"rename",      fs_rename},
     {"mkdir",       fs_mkdir},
     {"stat",        fs_stat},
+    {"lstat",       fs_lstat},
     {"inode",       fs_inode},
     {"chmod",       fs_chmod},
     {"touch",       fs_touch},
     {"copy",        fs_copy},
+#ifdef __linux__
+    {"walk",        fs_walk},
+#endif
     {NULL, NULL}
 };
 
@@ -560,9 +1376,19 @@ static int ps_sleep(lua_State *L)
     return 0;
 }
 
+/* ps.clock() returns the time in seconds given by a monotonic clock
+ * (unlike os.clock, it is not the CPU time of the process)
+ */
+static int ps_clock(lua_State *L)
+{
+    lua_pushnumber(L, bl_trace_now() / 1e6);
+    return 1;
+}
+
 static const luaL_Reg pslib[] =
 {
     {"sleep",       ps_sleep},
+    {"clock",       ps_clock},
     {NULL, NULL}
 };
 
@@ -637,7 +1463,7 @@ LUAMOD_API int luaopen_sys (lua_State *L)
 }
 
 /*******************************************************************/
-/* z, minilzo, lzo, qlz, lz4, zlib, ucl, lzma: compression libraries */
+/* z, minilzo, lzo, qlz, lz4, zlib, ucl, lzma, zstd: compression libraries */
 /*******************************************************************/
 
 #ifdef USE_Z
@@ -649,6 +1475,13 @@ LUAMOD_API int luaopen_sys (lua_State *L)
 #define LZF_SIG  0x00465A4C
 #define ZLIB_SIG 0x42494C5A
 #define LZMA_SIG 0x414D5A4C
+#define ZSTD_SIG 0x4454535A
+#define STORE_SIG 0x524F5453
+#define FRAME_SIG 0x4D52465A
+#define ZLIB_DICT_SIG 0x004C5A44
+#define LZ4_DICT_SIG  0x00345A44
+#define LZMA_DICT_SIG 0x004D5A44
+#define ZSTD_DICT_SIG 0x00535A44
 
 typedef struct
 {
@@ -656,604 +1489,3441 @@ typedef struct
     uint32_t  len;
 } t_z_header;
 
-#define COMPRESSOR(LIB)                                                         \
-                                                                                \
-static int bl_##LIB##_compress(lua_State *L)                                    \
-{                                                                               \
-    const char *src = luaL_checkstring(L, 1);                                   \
-    size_t src_len = lua_rawlen(L, 1);                                          \
-    char *dst;                                                                  \
-    size_t dst_len;                                                             \
-    int n = bl_##LIB##_compress_core(L, src, src_len, &dst, &dst_len);          \
-    if (n > 0) return n; /* error messages pushed by bl_##LIB##_compress_core */    \
-    lua_pop(L, 1);                                                              \
-    lua_pushlstring(L, dst, (size_t)(dst_len));                                 \
-    free(dst);                                                                  \
-    return 1;                                                                   \
-}                                                                               \
-                                                                                \
-static int bl_##LIB##_decompress(lua_State *L)                                  \
-{                                                                               \
-    const char *src = luaL_checkstring(L, 1);                                   \
-    size_t src_len = lua_rawlen(L, 1);                                          \
-    char *dst;                                                                  \
-    size_t dst_len;                                                             \
-    int n = bl_##LIB##_decompress_core(L, src, src_len, &dst, &dst_len);        \
-    if (n > 0) return n; /* error messages pushed by bl_##LIB##_decompress_core */  \
-    if (n < 0)           /* string not compressed by LIB */                     \
-    {                                                                           \
-        lua_pushnil(L);                                                         \
-        lua_pushstring(L, #LIB ": not a compressed string");                    \
-        return 2;                                                               \
-    }                                                                           \
-    lua_pop(L, 1);                                                              \
-    lua_pushlstring(L, dst, (size_t)(dst_len));                                 \
-    free(dst);                                                                  \
-    return 1;                                                                   \
-}                                                                               \
-                                                                                \
-static const luaL_Reg LIB##lib[] =                                              \
-{                                                                               \
-    {"compress", bl_##LIB##_compress},                                          \
-    {"decompress", bl_##LIB##_decompress},                                      \
-    {NULL, NULL}                                                                \
-};                                                                              \
+/* The compression cores can be called without any Lua state (L == NULL),
+ * e.g. by the threads that decompress the glue at startup.
+ * Errors are then only reported by the return value.
+ */
+#define bl_z_error(L, ...) ((L) ? (lua_pushnil(L), lua_pushfstring(L, __VA_ARGS__), 2) : 2)
 
-#ifdef USE_MINILZO
+typedef int (*t_z_compressor)(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len);
 
-int bl_minilzo_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+/* bl_z_codec returns the name of the compressor of src (or NULL) */
+static const char *bl_z_codec(const char *src, size_t src_len)
 {
-#define HEAP_ALLOC(var,size) \
-    lzo_align_t __LZO_MMODEL var [ ((size) + (sizeof(lzo_align_t) - 1)) / sizeof(lzo_align_t) ]
-    HEAP_ALLOC(wrkmem, LZO1X_1_MEM_COMPRESS);
-    lzo_uint lzo_dst_len = src_len + src_len/16 + 64 + 3 + sizeof(t_z_header);
-    lzo_bytep lzo_dst = (lzo_bytep)malloc(sizeof(lzo_byte)*lzo_dst_len);
-    int r = lzo1x_1_compress(src, src_len, lzo_dst+sizeof(t_z_header), &lzo_dst_len, wrkmem);
-    if (r != LZO_E_OK)
+    if (src_len < sizeof(t_z_header)) return NULL;
+    switch (((t_z_header*)src)->sig)
     {
-        free(lzo_dst);
-        lua_pushnil(L);
-        lua_pushfstring(L, "minilzo: lzo1x_1_compress failed (error: %d)", r);
-        return 2;
+        case LZO_SIG:   return "lzo";
+        case UCL_SIG:   return "ucl";
+        case QLZ_SIG:   return "qlz";
+        case LZ4_SIG:   return "lz4";
+        case LZF_SIG:   return "lzf";
+        case ZLIB_SIG:  return "zlib";
+        case LZMA_SIG:  return "lzma";
+        case ZSTD_SIG:  return "zstd";
+        case STORE_SIG: return "store";
+        case FRAME_SIG: return "frame";
+        case ZLIB_DICT_SIG: return "zlib+dict";
+        case LZ4_DICT_SIG:  return "lz4+dict";
+        case LZMA_DICT_SIG: return "lzma+dict";
+        case ZSTD_DICT_SIG: return "zstd+dict";
+        default:        return NULL;
     }
-    ((t_z_header*)lzo_dst)->sig = LZO_SIG;
-    ((t_z_header*)lzo_dst)->len = src_len;
-    *dst = lzo_dst;
-    *dst_len = lzo_dst_len;
-    *dst_len += sizeof(t_z_header);
-    return 0;
 }
 
-int bl_minilzo_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+/* Frames store large strings in independently compressed chunks:
+ *
+ *      t_z_frame_header
+ *      uint64_t offsets[nb_chunks]     (if BL_Z_FRAME_SEEK, from the beginning of the frame)
+ *      nb_chunks * (t_z_chunk_header, compressed chunk)
+ *
+ * All the chunks except the last one contain chunk_size bytes.
+ * The checksum of a chunk is the lowest 32 bits of the hash of the uncompressed chunk.
+ * Strings larger than BL_Z_BLOCK_MAX are always compressed in frames
+ * (the length of the compressed strings is limited to 32 bits).
+ */
+
+#define BL_Z_BLOCK_MAX      (1U<<30)
+#define BL_Z_FRAME_CHUNK    (1024*1024)
+#define BL_Z_FRAME_SEEK     1
+
+typedef struct
 {
-    if (((t_z_header*)src)->sig == LZO_SIG)
-    {
-        lzo_uint lzo_dst_len = ((t_z_header*)src)->len;
-        *dst = (lzo_bytep)malloc(sizeof(lzo_byte)*lzo_dst_len);
-        int r = lzo1x_decompress_safe(src+sizeof(t_z_header), src_len-sizeof(t_z_header), *dst, &lzo_dst_len, NULL);
-        if (r != LZO_E_OK)
-        {
-            free(*dst);
-            lua_pushnil(L);
-            lua_pushfstring(L, "minilzo: lzo1x_decompress failed (error: %d)", r);
-            return 2;
-        }
-        *dst_len = lzo_dst_len;
-        return 0;
-    }
-    return -1;
-}
+    uint32_t  sig;
+    uint32_t  chunk_size;
+    uint64_t  len;
+    uint32_t  nb_chunks;
+    uint32_t  flags;
+} t_z_frame_header;
 
-COMPRESSOR(minilzo)
+typedef struct
+{
+    uint32_t  size;
+    uint32_t  check;
+} t_z_chunk_header;
 
-LUAMOD_API int luaopen_minilzo (lua_State *L)
+typedef struct
 {
-    if (lzo_init() != LZO_E_OK)
-    {
-        luaL_error(L, "minilzo: lzo_init() failed !!!");
-    }
-    luaL_newlib(L, minilzolib);
-    return 1;
+    t_z_frame_header h;
+    const char *src;
+    size_t src_len;
+    size_t first;               /* offset of the first chunk */
+} t_z_frame;
+
+static uint32_t bl_z_checksum(const char *buf, size_t len)
+{
+    uint64_t h[2];
+    bl_hash128(buf, len, h);
+    return (uint32_t)h[0];
 }
 
-#endif
+/* The chunks are compressed and decompressed in parallel.
+ * The chunk codecs get a context (e.g. the options of a compressor)
+ * instead of a Lua state.
+ */
 
-#ifdef USE_LZO
+typedef int (*t_z_chunk_codec)(void *ctx, const char *src, size_t src_len, char **dst, size_t *dst_len);
 
-int bl_lzo_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+/* bl_z_chunk_core runs the compression core pointed by ctx */
+static int bl_z_chunk_core(void *ctx, const char *src, size_t src_len, char **dst, size_t *dst_len)
 {
-#define HEAP_ALLOC(var,size) \
-    lzo_align_t __LZO_MMODEL var [ ((size) + (sizeof(lzo_align_t) - 1)) / sizeof(lzo_align_t) ]
-    HEAP_ALLOC(wrkmem, LZO1X_999_MEM_COMPRESS);
-    lzo_uint lzo_dst_len = src_len + src_len/16 + 64 + 3 + sizeof(t_z_header);
-    lzo_bytep lzo_dst = (lzo_bytep)malloc(sizeof(lzo_byte)*lzo_dst_len);
-    int r = lzo1x_999_compress(src, src_len, lzo_dst+sizeof(t_z_header), &lzo_dst_len, wrkmem);
-    if (r != LZO_E_OK)
+    return (*(t_z_compressor*)ctx)(NULL, src, src_len, dst, dst_len);
+}
+
+typedef struct
+{
+    const char *src;
+    size_t src_len;
+    size_t chunk_size;
+    t_z_chunk_codec compress;
+    void *ctx;
+    char **chunks;
+    size_t *chunk_lens;
+    uint32_t *checks;
+    int *status;
+} t_z_frame_cjob;
+
+static void bl_z_frame_compress_job(void *ctx, int i)
+{
+    t_z_frame_cjob *job = (t_z_frame_cjob*)ctx;
+    const char *chunk = job->src + (size_t)i*job->chunk_size;
+    size_t len = job->src_len - (size_t)i*job->chunk_size;
+    if (len > job->chunk_size) len = job->chunk_size;
+    job->status[i] = job->compress(job->ctx, chunk, len, &job->chunks[i], &job->chunk_lens[i]);
+    if (job->status[i] == 0 && job->chunk_lens[i] > UINT32_MAX)
     {
-        free(lzo_dst);
-        lua_pushnil(L);
-        lua_pushfstring(L, "lzo: lzo1x_999_compress failed (error: %d)", r);
-        return 2;
+        free(job->chunks[i]);
+        job->status[i] = 1;
     }
-    ((t_z_header*)lzo_dst)->sig = LZO_SIG;
-    ((t_z_header*)lzo_dst)->len = src_len;
-    *dst = lzo_dst;
-    *dst_len = lzo_dst_len;
-    *dst_len += sizeof(t_z_header);
-    return 0;
+    job->checks[i] = bl_z_checksum(chunk, len);
 }
 
-int bl_lzo_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+static int bl_z_frame_compress_with(lua_State *L, const char *src, size_t src_len, size_t chunk_size, int seek, int threads, t_z_chunk_codec compress, void *ctx, char **dst, size_t *dst_len)
 {
-    if (((t_z_header*)src)->sig == LZO_SIG)
+    size_t nb_chunks;
+    size_t i, size, offset;
+    t_z_frame_cjob job;
+    t_z_frame_header *h;
+    int failed = 0;
+    char *frame;
+
+    if (chunk_size == 0 || chunk_size > BL_Z_BLOCK_MAX) return bl_z_error(L, "z: bad chunk size");
+    nb_chunks = (src_len + chunk_size - 1) / chunk_size;
+    if (nb_chunks > INT_MAX) return bl_z_error(L, "z: too many chunks");
+    job.src = src;
+    job.src_len = src_len;
+    job.chunk_size = chunk_size;
+    job.compress = compress;
+    job.ctx = ctx;
+    job.chunks = (char**)calloc(nb_chunks+1, sizeof(char*));
+    job.chunk_lens = (size_t*)calloc(nb_chunks+1, sizeof(size_t));
+    job.checks = (uint32_t*)calloc(nb_chunks+1, sizeof(uint32_t));
+    job.status = (int*)calloc(nb_chunks+1, sizeof(int));
+    if (!job.chunks || !job.chunk_lens || !job.checks || !job.status)
     {
-        lzo_uint lzo_dst_len = ((t_z_header*)src)->len;
-        *dst = (lzo_bytep)malloc(sizeof(lzo_byte)*lzo_dst_len);
-        int r = lzo1x_decompress_safe(src+sizeof(t_z_header), src_len-sizeof(t_z_header), *dst, &lzo_dst_len, NULL);
-        if (r != LZO_E_OK)
+        free(job.chunks);
+        free(job.chunk_lens);
+        free(job.checks);
+        free(job.status);
+        return bl_z_error(L, "z: not enough memory");
+    }
+    bl_parallel_threads(threads, nb_chunks, bl_z_frame_compress_job, &job);
+
+    size = sizeof(t_z_frame_header) + (seek ? nb_chunks*sizeof(uint64_t) : 0);
+    for (i = 0; i < nb_chunks; i++)
+    {
+        if (job.status[i] != 0) failed = 1;
+        else size += sizeof(t_z_chunk_header) + job.chunk_lens[i];
+    }
+    frame = failed ? NULL : (char*)malloc(size);
+    if (frame)
+    {
+        h = (t_z_frame_header*)frame;
+        h->sig = FRAME_SIG;
+        h->chunk_size = chunk_size;
+        h->len = src_len;
+        h->nb_chunks = nb_chunks;
+        h->flags = seek ? BL_Z_FRAME_SEEK : 0;
+        offset = sizeof(t_z_frame_header) + (seek ? nb_chunks*sizeof(uint64_t) : 0);
+        for (i = 0; i < nb_chunks; i++)
         {
-            free(*dst);
-            lua_pushnil(L);
-            lua_pushfstring(L, "lzo: lzo1x_decompress failed (error: %d)", r);
-            return 2;
+            t_z_chunk_header ch;
+            if (seek)
+            {
+                uint64_t o = offset;
+                memcpy(frame + sizeof(t_z_frame_header) + i*sizeof(uint64_t), &o, sizeof(o));
+            }
+            ch.size = job.chunk_lens[i];
+            ch.check = job.checks[i];
+            memcpy(frame + offset, &ch, sizeof(ch));
+            memcpy(frame + offset + sizeof(ch), job.chunks[i], job.chunk_lens[i]);
+            offset += sizeof(ch) + job.chunk_lens[i];
         }
-        *dst_len = lzo_dst_len;
-        return 0;
     }
-    return -1;
+    for (i = 0; i < nb_chunks; i++) if (job.status[i] == 0) free(job.chunks[i]);
+    free(job.chunks);
+    free(job.chunk_lens);
+    free(job.checks);
+    free(job.status);
+    if (!frame) return bl_z_error(L, "z: can not compress");
+    *dst = frame;
+    *dst_len = size;
+    return 0;
 }
 
-COMPRESSOR(lzo)
-
-LUAMOD_API int luaopen_lzo (lua_State *L)
+static int bl_z_frame_compress(lua_State *L, const char *src, size_t src_len, size_t chunk_size, int seek, int threads, t_z_compressor compress, char **dst, size_t *dst_len)
 {
-    if (lzo_init() != LZO_E_OK)
-    {
-        luaL_error(L, "lzo: lzo_init() failed !!!");
-    }
-    luaL_newlib(L, lzolib);
-    return 1;
+    return bl_z_frame_compress_with(L, src, src_len, chunk_size, seek, threads, bl_z_chunk_core, &compress, dst, dst_len);
 }
 
-#endif
-
-#ifdef USE_UCL
-
-int bl_ucl_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+/* bl_z_frame_open returns -1 if src is not a frame, 1 if it is corrupted and 0 if it is valid */
+static int bl_z_frame_open(t_z_frame *f, const char *src, size_t src_len)
 {
-    ucl_uint ucl_dst_len = src_len + src_len/8 + 256 + sizeof(t_z_header);
-    ucl_bytep ucl_dst = (ucl_bytep)malloc(sizeof(ucl_byte)*ucl_dst_len);
-    int r = ucl_nrv2e_99_compress(src, src_len, ucl_dst+sizeof(t_z_header), &ucl_dst_len, NULL, UCL_LEVEL, NULL, NULL);
-    if (r != UCL_E_OK)
+    if (src_len < sizeof(uint32_t) || ((t_z_header*)src)->sig != FRAME_SIG) return -1;
+    if (src_len < sizeof(t_z_frame_header)) return 1;
+    memcpy(&f->h, src, sizeof(t_z_frame_header));
+    f->src = src;
+    f->src_len = src_len;
+    if (f->h.chunk_size == 0) return 1;
+    if ((f->h.len + f->h.chunk_size - 1) / f->h.chunk_size != f->h.nb_chunks) return 1;
+    if (f->h.nb_chunks > INT_MAX) return 1;
+    f->first = sizeof(t_z_frame_header);
+    if (f->h.flags & BL_Z_FRAME_SEEK)
     {
-        free(ucl_dst);
-        lua_pushnil(L);
-        lua_pushfstring(L, "ucl: ucl_nrv2e_99_compress failed (error: %d)", r);
-        return 2;
+        if ((src_len - f->first) / sizeof(uint64_t) < f->h.nb_chunks) return 1;
+        f->first += f->h.nb_chunks * sizeof(uint64_t);
     }
-    ((t_z_header*)ucl_dst)->sig = UCL_SIG;
-    ((t_z_header*)ucl_dst)->len = src_len;
-    *dst = ucl_dst;
-    *dst_len = ucl_dst_len;
-    *dst_len += sizeof(t_z_header);
     return 0;
 }
 
-int bl_ucl_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+/* bl_z_frame_locate computes the offsets of the chunks [first, last]
+ * (read in the seek table or found by walking through the chunk headers).
+ */
+static const char *bl_z_frame_locate(t_z_frame *f, uint32_t first, uint32_t last, size_t *offsets)
 {
-    if (((t_z_header*)src)->sig == UCL_SIG)
+    uint32_t i;
+    if (f->h.flags & BL_Z_FRAME_SEEK)
     {
-        ucl_uint ucl_dst_len = ((t_z_header*)src)->len;
-        *dst = (ucl_bytep)malloc(sizeof(ucl_byte)*ucl_dst_len+65000);
-        int r = ucl_nrv2e_decompress_safe_8(src+sizeof(t_z_header), src_len-sizeof(t_z_header), *dst, &ucl_dst_len, NULL);
-        if (r != UCL_E_OK)
+        for (i = first; i <= last; i++)
         {
-            free(*dst);
-            lua_pushnil(L);
-            lua_pushfstring(L, "ucl: ucl_nrv2e_decompress_safe_8 failed (error: %d)", r);
-            return 2;
+            uint64_t o;
+            memcpy(&o, f->src + sizeof(t_z_frame_header) + i*sizeof(uint64_t), sizeof(o));
+            if (o < f->first || o > f->src_len) return "corrupted frame";
+            offsets[i-first] = o;
         }
-        *dst_len = ucl_dst_len;
-        return 0;
     }
-    return -1;
-}
-
-COMPRESSOR(ucl)
-
-LUAMOD_API int luaopen_ucl (lua_State *L)
-{
-    if (ucl_init() != UCL_E_OK)
+    else
     {
-        luaL_error(L, "ucl: ucl_init() failed !!!");
+        size_t offset = f->first;
+        for (i = 0; i <= last; i++)
+        {
+            t_z_chunk_header ch;
+            if (f->src_len - offset < sizeof(ch)) return "corrupted frame";
+            memcpy(&ch, f->src + offset, sizeof(ch));
+            if (i >= first) offsets[i-first] = offset;
+            offset += sizeof(ch) + ch.size;
+            if (offset > f->src_len) return "corrupted frame";
+        }
     }
-    luaL_newlib(L, ucllib);
-    return 1;
+    return NULL;
 }
 
-#endif
-
-#ifdef USE_QLZ
-
-int bl_qlz_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+typedef struct
 {
-    char *qlz_dst;
-    size_t qlz_dst_len;
-    if (src_len == 0)
+    t_z_frame *f;
+    t_z_chunk_codec decompress;
+    void *ctx;
+    uint32_t first;             /* first chunk of the range */
+    size_t *offsets;            /* offsets of the chunks of the range */
+    uint64_t offset;            /* range to decompress */
+    uint64_t len;
+    char *dst;
+    const char **errors;
+} t_z_frame_djob;
+
+/* bl_z_frame_decompress_job decompresses the chunk first+k of a frame
+ * and copies the part of the range it contains.
+ */
+static void bl_z_frame_decompress_job(void *ctx, int k)
+{
+    t_z_frame_djob *job = (t_z_frame_djob*)ctx;
+    t_z_frame *f = job->f;
+    uint32_t i = job->first + k;
+    uint64_t chunk_start = (uint64_t)i*f->h.chunk_size;
+    size_t len = i < f->h.nb_chunks-1 ? f->h.chunk_size : f->h.len - chunk_start;
+    size_t offset = job->offsets[k];
+    uint64_t start, end;
+    t_z_chunk_header ch;
+    char *chunk;
+    size_t chunk_len;
+    int r;
+    if (f->src_len - offset < sizeof(ch))
     {
-        /* specific case for the empty string (the decompressor crashes on empty strings) */
-        qlz_dst = (char*)malloc(sizeof(t_z_header));
-        qlz_dst_len = 0;
+        job->errors[k] = "corrupted frame";
+        return;
     }
-    else
+    memcpy(&ch, f->src + offset, sizeof(ch));
+    if (f->src_len - offset - sizeof(ch) < ch.size || ch.size < sizeof(t_z_header)
+        || ((t_z_header*)(f->src + offset + sizeof(ch)))->len > f->h.chunk_size)
     {
-        qlz_state_compress *state_compress = (qlz_state_compress *)malloc(sizeof(qlz_state_compress));
-        qlz_dst = (char*)malloc(src_len + 400 + sizeof(t_z_header));
-        qlz_dst_len = qlz_compress(src, qlz_dst+sizeof(t_z_header), src_len, state_compress);
-        free(state_compress);
+        job->errors[k] = "corrupted frame";
+        return;
     }
-
-    ((t_z_header*)qlz_dst)->sig = QLZ_SIG;
-    ((t_z_header*)qlz_dst)->len = src_len;
-    *dst = qlz_dst;
-    *dst_len = qlz_dst_len;
-    *dst_len += sizeof(t_z_header);
-    return 0;
+    r = job->decompress(job->ctx, f->src + offset + sizeof(ch), ch.size, &chunk, &chunk_len);
+    if (r != 0)
+    {
+        job->errors[k] = r < 0 ? "unknown compressor in frame" : "corrupted chunk";
+        return;
+    }
+    if (chunk_len != len || bl_z_checksum(chunk, len) != ch.check)
+    {
+        free(chunk);
+        job->errors[k] = "bad chunk checksum";
+        return;
+    }
+    start = job->offset > chunk_start ? job->offset : chunk_start;
+    end = job->offset + job->len < chunk_start + len ? job->offset + job->len : chunk_start + len;
+    memcpy(job->dst + (start - job->offset), chunk + (start - chunk_start), end - start);
+    free(chunk);
 }
 
-int bl_qlz_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+/* bl_z_frame_range decompresses len bytes of a frame starting at offset */
+static int bl_z_frame_range_with(lua_State *L, t_z_frame *f, t_z_chunk_codec decompress, void *ctx, uint64_t offset, uint64_t len, char **dst, size_t *dst_len)
 {
-    if (((t_z_header*)src)->sig == QLZ_SIG)
+    t_z_frame_djob job;
+    const char *err = NULL;
+    uint32_t last, k;
+    if (offset > f->h.len) offset = f->h.len;
+    if (len > f->h.len - offset) len = f->h.len - offset;
+    if (len > SIZE_MAX - 1) return bl_z_error(L, "z: frame too large");
+    job.f = f;
+    job.decompress = decompress;
+    job.ctx = ctx;
+    job.offset = offset;
+    job.len = len;
+    job.dst = (char*)malloc(len + 1);
+    if (!job.dst) return bl_z_error(L, "z: not enough memory");
+    if (len == 0)
     {
-        if (((t_z_header*)src)->len == 0)
-        {
-            /* specific case for the empty string (the decompressor crashes on empty strings) */
-            *dst_len = 0;
-            *dst = NULL;
-        }
-        else
-        {
-            qlz_state_decompress *state_decompress = (qlz_state_decompress *)malloc(sizeof(qlz_state_decompress));
-            *dst_len = ((t_z_header*)src)->len;
-            *dst = (char*)malloc(*dst_len);
-            *dst_len = qlz_decompress(src+sizeof(t_z_header), *dst, state_decompress);
-            free(state_decompress);
-        }
+        *dst = job.dst;
+        *dst_len = 0;
         return 0;
     }
-    return -1;
+    job.first = offset / f->h.chunk_size;
+    last = (offset + len - 1) / f->h.chunk_size;
+    job.offsets = (size_t*)malloc((last - job.first + 1) * sizeof(size_t));
+    job.errors = (const char **)calloc(last - job.first + 1, sizeof(const char *));
+    if (!job.offsets || !job.errors) err = "not enough memory";
+    else err = bl_z_frame_locate(f, job.first, last, job.offsets);
+    if (!err)
+    {
+        bl_parallel(last - job.first + 1, bl_z_frame_decompress_job, &job);
+        for (k = 0; k <= last - job.first && !err; k++) err = job.errors[k];
+    }
+    free(job.offsets);
+    free(job.errors);
+    if (err)
+    {
+        free(job.dst);
+        return bl_z_error(L, "z: %s", err);
+    }
+    *dst = job.dst;
+    *dst_len = len;
+    return 0;
 }
 
-COMPRESSOR(qlz)
+static int bl_z_frame_range(lua_State *L, t_z_frame *f, t_z_compressor decompress, uint64_t offset, uint64_t len, char **dst, size_t *dst_len)
+{
+    return bl_z_frame_range_with(L, f, bl_z_chunk_core, &decompress, offset, len, dst, dst_len);
+}
 
-LUAMOD_API int luaopen_qlz (lua_State *L)
+/* bl_z_frame_decompress decompresses a whole frame (-1 if src is not a frame) */
+static int bl_z_frame_decompress_with(lua_State *L, const char *src, size_t src_len, t_z_chunk_codec decompress, void *ctx, char **dst, size_t *dst_len)
 {
-    luaL_newlib(L, qlzlib);
-    return 1;
+    t_z_frame f;
+    int r = bl_z_frame_open(&f, src, src_len);
+    if (r < 0) return r;
+    if (r > 0) return bl_z_error(L, "z: corrupted frame");
+    return bl_z_frame_range_with(L, &f, decompress, ctx, 0, f.h.len, dst, dst_len);
+}
+
+static int bl_z_frame_decompress(lua_State *L, const char *src, size_t src_len, t_z_compressor decompress, char **dst, size_t *dst_len)
+{
+    return bl_z_frame_decompress_with(L, src, src_len, bl_z_chunk_core, &decompress, dst, dst_len);
+}
+
+/* bl_z_threads returns the number of threads given by options.threads
+ * (0 if not given, one thread per CPU if true)
+ */
+static int bl_z_threads(lua_State *L, int options)
+{
+    int threads = 0;
+    if (lua_isnoneornil(L, options)) return 0;
+    luaL_checktype(L, options, LUA_TTABLE);
+    lua_getfield(L, options, "threads");
+    if (lua_isboolean(L, -1))
+    {
+#ifdef BL_THREADS
+        threads = lua_toboolean(L, -1) ? bl_cpu_count() : 0;
+#else
+        threads = lua_toboolean(L, -1);
+#endif
+    }
+    else if (!lua_isnil(L, -1))
+    {
+        lua_Integer n = luaL_checkinteger(L, -1);
+        if (n < 0 || n > 1024) return luaL_argerror(L, options, "invalid number of threads");
+        threads = n;
+    }
+    lua_pop(L, 1);
+    return threads;
+}
+
+/* Buffers are mutable byte strings (z.buffer([data])) accepted
+ * everywhere a string is compressed or decompressed.
+ * A buffer given as options.into receives the result of a codec
+ * instead of a new Lua string: the buffer takes the block allocated
+ * by the codec (no copy) and frees its previous content.
+ * Contexts exchange their work buffer with the destination
+ * so that the same blocks are reused from one call to another.
+ */
+
+#define BL_Z_BUFFER "bl.z.buffer"
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t size;                /* allocated size (at least len) */
+} t_z_buffer;
+
+static void bl_z_buffer_set(t_z_buffer *b, char *data, size_t len, size_t size)
+{
+    if (b->data != data) free(b->data);
+    b->data = data;
+    b->len = len;
+    b->size = size;
+}
+
+/* z.buffer([data]) returns a new buffer (initialized with a copy of data) */
+static int bl_z_buffer(lua_State *L)
+{
+    size_t len = 0;
+    const char *data = NULL;
+    t_z_buffer *b;
+    if (!lua_isnoneornil(L, 1))
+    {
+        t_z_buffer *src = (t_z_buffer*)luaL_testudata(L, 1, BL_Z_BUFFER);
+        if (src) { data = src->data; len = src->len; }
+        else data = luaL_checklstring(L, 1, &len);
+    }
+    b = (t_z_buffer*)lua_newuserdata(L, sizeof(t_z_buffer));
+    memset(b, 0, sizeof(t_z_buffer));
+    luaL_setmetatable(L, BL_Z_BUFFER);
+    if (len > 0)
+    {
+        b->data = (char*)malloc(len);
+        if (!b->data) return luaL_error(L, "z: not enough memory");
+        memcpy(b->data, data, len);
+        b->len = b->size = len;
+    }
+    return 1;
+}
+
+static int bl_z_buffer_gc(lua_State *L)
+{
+    t_z_buffer *b = (t_z_buffer*)luaL_checkudata(L, 1, BL_Z_BUFFER);
+    bl_z_buffer_set(b, NULL, 0, 0);
+    return 0;
+}
+
+static int bl_z_buffer_len(lua_State *L)
+{
+    t_z_buffer *b = (t_z_buffer*)luaL_checkudata(L, 1, BL_Z_BUFFER);
+    lua_pushinteger(L, b->len);
+    return 1;
+}
+
+static int bl_z_buffer_tostring(lua_State *L)
+{
+    t_z_buffer *b = (t_z_buffer*)luaL_checkudata(L, 1, BL_Z_BUFFER);
+    lua_pushlstring(L, b->data ? b->data : "", b->len);
+    return 1;
+}
+
+/* buffer:sub(i [, j]) works as string.sub */
+static int bl_z_buffer_sub(lua_State *L)
+{
+    t_z_buffer *b = (t_z_buffer*)luaL_checkudata(L, 1, BL_Z_BUFFER);
+    lua_Integer len = b->len;
+    lua_Integer i = luaL_checkinteger(L, 2);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+    if (i < 0) i = i < -len ? 1 : len + i + 1;
+    else if (i == 0) i = 1;
+    if (j < 0) j = j < -len ? 0 : len + j + 1;
+    else if (j > len) j = len;
+    if (i > j) lua_pushliteral(L, "");
+    else lua_pushlstring(L, b->data + i - 1, (size_t)(j - i + 1));
+    return 1;
+}
+
+static FILE *bl_z_buffer_file(lua_State *L, int idx)
+{
+    luaL_Stream *p = (luaL_Stream*)luaL_checkudata(L, idx, LUA_FILEHANDLE);
+    if (p->closef == NULL) luaL_error(L, "attempt to use a closed file");
+    return p->f;
+}
+
+/* buffer:read(file [, n]) replaces the content of the buffer with
+ * n bytes (or the end) of file.
+ * It returns the buffer or nil at the end of the file.
+ */
+static int bl_z_buffer_read(lua_State *L)
+{
+    t_z_buffer *b = (t_z_buffer*)luaL_checkudata(L, 1, BL_Z_BUFFER);
+    FILE *f = bl_z_buffer_file(L, 2);
+    int all = lua_isnoneornil(L, 3);
+    lua_Integer count = all ? 65536 : luaL_checkinteger(L, 3);
+    size_t n, len = 0;
+    luaL_argcheck(L, count >= 0, 3, "negative size");
+    n = (size_t)count;
+    for (;;)
+    {
+        size_t r;
+        if (len + n > b->size)
+        {
+            char *data = (char*)realloc(b->data, len + n);
+            if (!data) return luaL_error(L, "z: not enough memory");
+            b->data = data;
+            b->size = len + n;
+        }
+        r = fread(b->data + len, 1, n, f);
+        len += r;
+        if (!all || r < n) break;
+        n = len;                /* doubles the size of the buffer */
+    }
+    b->len = len;
+    if (ferror(f)) return luaL_fileresult(L, 0, NULL);
+    lua_settop(L, 1);
+    if (!all && len == 0 && n > 0) lua_pushnil(L); /* end of file */
+    return 1;
+}
+
+/* buffer:write(file) writes the content of the buffer to file */
+static int bl_z_buffer_write(lua_State *L)
+{
+    t_z_buffer *b = (t_z_buffer*)luaL_checkudata(L, 1, BL_Z_BUFFER);
+    FILE *f = bl_z_buffer_file(L, 2);
+    if (b->len > 0 && fwrite(b->data, 1, b->len, f) != b->len) return luaL_fileresult(L, 0, NULL);
+    lua_settop(L, 2);
+    return 1;
+}
+
+static const luaL_Reg bl_z_buffer_methods[] =
+{
+    {"sub", bl_z_buffer_sub},
+    {"read", bl_z_buffer_read},
+    {"write", bl_z_buffer_write},
+    {"__len", bl_z_buffer_len},
+    {"__tostring", bl_z_buffer_tostring},
+    {"__gc", bl_z_buffer_gc},
+    {NULL, NULL}
+};
+
+/* bl_z_checkdata returns the content of the string or buffer at index idx */
+static const char *bl_z_checkdata(lua_State *L, int idx, size_t *len)
+{
+    t_z_buffer *b = (t_z_buffer*)luaL_testudata(L, idx, BL_Z_BUFFER);
+    if (b)
+    {
+        *len = b->len;
+        return b->data ? b->data : "";
+    }
+    return luaL_checklstring(L, idx, len);
+}
+
+/* bl_z_optbuffer returns idx if the value at idx is a buffer (0 if nil) */
+static int bl_z_optbuffer(lua_State *L, int idx)
+{
+    if (lua_isnoneornil(L, idx)) return 0;
+    luaL_checkudata(L, idx, BL_Z_BUFFER);
+    return lua_absindex(L, idx);
+}
+
+/* bl_z_into pushes options.into and returns its index (0 and nothing pushed if not given) */
+static int bl_z_into(lua_State *L, int options)
+{
+    if (!lua_istable(L, options)) return 0;
+    lua_getfield(L, options, "into");
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        return 0;
+    }
+    if (!luaL_testudata(L, -1, BL_Z_BUFFER)) luaL_argerror(L, options, "into: z.buffer expected");
+    return lua_gettop(L);
+}
+
+/* bl_z_result pushes the result of a compression core
+ * (in the buffer at index into if into is not 0)
+ */
+static int bl_z_result(lua_State *L, int into, int n, char *dst, size_t dst_len)
+{
+    if (n > 0) return n; /* error messages pushed by the core */
+    if (into)
+    {
+        bl_z_buffer_set((t_z_buffer*)lua_touserdata(L, into), dst, dst_len, dst_len);
+        lua_pushvalue(L, into);
+        return 1;
+    }
+    lua_pushlstring(L, dst, dst_len);
+    free(dst);
+    return 1;
+}
+
+/* Dictionaries help compressing small strings (e.g. records of a few hundred bytes).
+ * The strings compressed with a dictionary have a larger header containing
+ * the id of the dictionary (the checksum of its content) and the compressed
+ * data has no container (raw deflate, LZ4 block, raw LZMA2).
+ * Dictionaries are given as strings or as z.dictionary objects
+ * (which cache the id and the state of the compressors).
+ */
+
+#define BL_Z_DICT "bl.z.dictionary"
+
+typedef struct
+{
+    uint32_t  sig;
+    uint32_t  len;
+    uint32_t  dict_id;
+} t_z_dict_header;
+
+typedef struct
+{
+    const char *data;
+    size_t len;
+    uint32_t id;
+    int owned;                  /* z.dictionary objects own their data and cache the compressor states */
+#ifdef USE_LZ4
+    LZ4_stream_t *lz4;
+#endif
+} t_z_dict;
+
+#define IS_DICT_SIG(sig) ((sig) == ZLIB_DICT_SIG || (sig) == LZ4_DICT_SIG || (sig) == LZMA_DICT_SIG || (sig) == ZSTD_DICT_SIG)
+
+static void bl_z_dict_init(t_z_dict *d, const char *data, size_t len)
+{
+    memset(d, 0, sizeof(t_z_dict));
+    d->data = data;
+    d->len = len;
+    d->id = bl_z_checksum(data, len);
+}
+
+/* z.dictionary(data) returns a dictionary object */
+static int bl_z_dictionary(lua_State *L)
+{
+    size_t len;
+    const char *data = luaL_checklstring(L, 1, &len);
+    t_z_dict *d = (t_z_dict*)lua_newuserdata(L, sizeof(t_z_dict));
+    char *copy = (char*)malloc(len + 1);
+    if (!copy) return luaL_error(L, "z: not enough memory");
+    memcpy(copy, data, len);
+    bl_z_dict_init(d, copy, len);
+    d->owned = 1;
+    luaL_setmetatable(L, BL_Z_DICT);
+    return 1;
+}
+
+static int bl_z_dictionary_gc(lua_State *L)
+{
+    t_z_dict *d = (t_z_dict*)luaL_checkudata(L, 1, BL_Z_DICT);
+    if (d->owned)
+    {
+        free((char*)d->data);
+#ifdef USE_LZ4
+        if (d->lz4) LZ4_freeStream(d->lz4);
+#endif
+        d->owned = 0;
+    }
+    return 0;
+}
+
+static int bl_z_dictionary_index(lua_State *L)
+{
+    t_z_dict *d = (t_z_dict*)luaL_checkudata(L, 1, BL_Z_DICT);
+    const char *field = luaL_checkstring(L, 2);
+    if (strcmp(field, "id") == 0) lua_pushinteger(L, d->id);
+    else if (strcmp(field, "data") == 0) lua_pushlstring(L, d->data, d->len);
+    else lua_pushnil(L);
+    return 1;
+}
+
+static const luaL_Reg bl_z_dictionary_methods[] =
+{
+    {"__gc", bl_z_dictionary_gc},
+    {"__index", bl_z_dictionary_index},
+    {NULL, NULL}
+};
+
+/* bl_z_todict returns the dictionary at index idx (NULL if nil).
+ * Strings are converted in tmp.
+ */
+static t_z_dict *bl_z_todict(lua_State *L, int idx, t_z_dict *tmp)
+{
+    t_z_dict *d;
+    size_t len;
+    const char *data;
+    if (lua_isnoneornil(L, idx)) return NULL;
+    d = (t_z_dict*)luaL_testudata(L, idx, BL_Z_DICT);
+    if (d) return d;
+    data = lua_tolstring(L, idx, &len);
+    if (!data) luaL_error(L, "z: bad dictionary (string or z.dictionary expected)");
+    bl_z_dict_init(tmp, data, len);
+    return tmp;
+}
+
+/* bl_z_dict_option returns options.dict (the string stays referenced by options) */
+static t_z_dict *bl_z_dict_option(lua_State *L, int options, t_z_dict *tmp)
+{
+    t_z_dict *d;
+    if (lua_isnoneornil(L, options)) return NULL;
+    luaL_checktype(L, options, LUA_TTABLE);
+    lua_getfield(L, options, "dict");
+    d = bl_z_todict(L, -1, tmp);
+    lua_pop(L, 1);
+    return d;
+}
+
+static int bl_z_dict_decompress(lua_State *L, const char *src, size_t src_len, t_z_dict *d, char **dst, size_t *dst_len);
+
+/* The chunks of a frame may be compressed with a dictionary (see bl_zstd_compress_opt) */
+typedef struct
+{
+    t_z_compressor decompress;
+    t_z_dict *dict;
+} t_z_dict_chunk;
+
+static int bl_z_dict_chunk_decompress(void *ctx, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    t_z_dict_chunk *c = (t_z_dict_chunk*)ctx;
+    if (src_len >= sizeof(t_z_dict_header) && IS_DICT_SIG(((t_z_header*)src)->sig))
+        return bl_z_dict_decompress(NULL, src, src_len, c->dict, dst, dst_len);
+    return c->decompress(NULL, src, src_len, dst, dst_len);
+}
+
+/* bl_z_decompress_with implements lib.decompress(data [, dict])
+ * and lib.decompress(data, {dict=dict, into=buffer}).
+ * dict_sig is the signature of the strings compressed by lib with a dictionary
+ * (0 for z that accepts all the signatures).
+ */
+static int bl_z_decompress_with(lua_State *L, const char *name, t_z_compressor decompress, uint32_t dict_sig)
+{
+    size_t src_len;
+    const char *src = bl_z_checkdata(L, 1, &src_len);
+    t_z_dict tmp;
+    t_z_dict *d = lua_istable(L, 2) ? bl_z_dict_option(L, 2, &tmp) : bl_z_todict(L, 2, &tmp);
+    int into = bl_z_into(L, 2);
+    uint32_t sig = src_len >= sizeof(t_z_dict_header) ? ((t_z_header*)src)->sig : 0;
+    char *dst;
+    size_t dst_len;
+    int n;
+    if (IS_DICT_SIG(sig) && (dict_sig == 0 || sig == dict_sig))
+    {
+        if (!d) return bl_z_error(L, "%s: dictionary required (id: %I)", name, (lua_Integer)((t_z_dict_header*)src)->dict_id);
+        n = bl_z_dict_decompress(L, src, src_len, d, &dst, &dst_len);
+    }
+    else
+    {
+        t_z_dict_chunk chunk;
+        chunk.decompress = decompress;
+        chunk.dict = d;
+        n = d ? bl_z_frame_decompress_with(L, src, src_len, bl_z_dict_chunk_decompress, &chunk, &dst, &dst_len)
+              : bl_z_frame_decompress(L, src, src_len, decompress, &dst, &dst_len);
+        if (n < 0) n = decompress(L, src, src_len, &dst, &dst_len);
+        if (n < 0) return bl_z_error(L, "%s: not a compressed string", name);
+    }
+    return bl_z_result(L, into, n, dst, dst_len);
+}
+
+#define COMPRESSOR(LIB)                                                         \
+                                                                                \
+static int bl_##LIB##_compress(lua_State *L)                                    \
+{                                                                               \
+    size_t src_len;                                                             \
+    const char *src = bl_z_checkdata(L, 1, &src_len);                           \
+    int into = bl_z_into(L, 2);                                                 \
+    char *dst;                                                                  \
+    size_t dst_len;                                                             \
+    int n = src_len > BL_Z_BLOCK_MAX                                            \
+        ? bl_z_frame_compress(L, src, src_len, BL_Z_FRAME_CHUNK, 1, 0, bl_##LIB##_compress_core, &dst, &dst_len) \
+        : bl_##LIB##_compress_core(L, src, src_len, &dst, &dst_len);            \
+    return bl_z_result(L, into, n, dst, dst_len); /* error messages pushed by bl_##LIB##_compress_core */ \
+}                                                                               \
+                                                                                \
+static int bl_##LIB##_decompress(lua_State *L)                                  \
+{                                                                               \
+    size_t src_len;                                                             \
+    const char *src = bl_z_checkdata(L, 1, &src_len);                           \
+    int into = bl_z_into(L, 2);                                                 \
+    char *dst;                                                                  \
+    size_t dst_len;                                                             \
+    int n = bl_z_frame_decompress(L, src, src_len, bl_##LIB##_decompress_core, &dst, &dst_len); \
+    if (n < 0) n = bl_##LIB##_decompress_core(L, src, src_len, &dst, &dst_len); \
+    if (n < 0)           /* string not compressed by LIB */                     \
+    {                                                                           \
+        lua_pushnil(L);                                                         \
+        lua_pushstring(L, #LIB ": not a compressed string");                    \
+        return 2;                                                               \
+    }                                                                           \
+    return bl_z_result(L, into, n, dst, dst_len); /* error messages pushed by bl_##LIB##_decompress_core */ \
+}                                                                               \
+                                                                                \
+static const luaL_Reg LIB##lib[] =                                              \
+{                                                                               \
+    {"compress", bl_##LIB##_compress},                                          \
+    {"decompress", bl_##LIB##_decompress},                                      \
+    {"stream", bl_##LIB##_stream},                                              \
+    {NULL, NULL}                                                                \
+};                                                                              \
+
+/* Streams compress or decompress data given chunk by chunk
+ * (lib.stream([direction]), direction is "compress" (default) or "decompress").
+ * stream:update(chunk) returns the data produced so far
+ * and stream:finish([chunk]) returns the end of the data.
+ * Only the state of the codec and at most one block are kept in memory.
+ *
+ * zlib, lzma, lz4 and lz4hc use their native stream formats
+ * (zlib or gzip, xz and LZ4 frames).
+ * The other libraries write blocks of BL_Z_STREAM_BLOCK bytes,
+ * each block being preceded by its compressed size (uint32_t)
+ * and the last block being followed by a null size.
+ */
+
+#define BL_Z_STREAM         "bl.z.stream"
+#define BL_Z_STREAM_BLOCK   (256*1024)
+#define BL_Z_STREAM_OUT     (64*1024)   /* output buffer given to the codecs */
+
+typedef struct t_z_stream t_z_stream;
+
+/* code feeds the codec with src and adds the output to out.
+ * It returns NULL or an error message.
+ */
+typedef const char *(*t_z_stream_code)(t_z_stream *s, const char *src, size_t src_len, int finish, luaL_Buffer *out);
+typedef const char *(*t_z_stream_flush)(t_z_stream *s, luaL_Buffer *out);
+typedef void (*t_z_stream_end)(t_z_stream *s);
+
+struct t_z_stream
+{
+    const char *name;
+    int compress;
+    int closed;
+    int eos;                    /* end of the compressed stream reached */
+    t_z_stream_code code;
+    t_z_stream_flush flush;     /* outputs the data kept by the compressor */
+    t_z_stream_end end;
+    char error[128];
+    /* block streams */
+    t_z_compressor block_compress;
+    t_z_compressor block_decompress;
+    char *buf;
+    size_t buf_len;
+    union
+    {
+#ifdef USE_ZLIB
+        z_stream zlib;
+#endif
+#ifdef USE_LZMA
+        lzma_stream lzma;
+#endif
+#ifdef USE_LZ4
+        struct
+        {
+            LZ4F_compressionContext_t cctx;
+            LZ4F_decompressionContext_t dctx;
+            LZ4F_preferences_t prefs;
+            int begun;
+        } lz4;
+#endif
+#ifdef USE_ZSTD
+        struct
+        {
+            ZSTD_CCtx *cctx;
+            ZSTD_DCtx *dctx;
+        } zstd;
+#endif
+        int none;
+    } u;
+};
+
+static const char *bl_z_stream_error(t_z_stream *s, const char *msg, int code)
+{
+    snprintf(s->error, sizeof(s->error), "%s (error: %d)", msg, code);
+    return s->error;
+}
+
+static void bl_z_stream_close(t_z_stream *s)
+{
+    if (!s->closed)
+    {
+        if (s->end) s->end(s);
+        if (s->buf) free(s->buf);
+        s->buf = NULL;
+        s->closed = 1;
+    }
+}
+
+static int bl_z_stream_gc(lua_State *L)
+{
+    bl_z_stream_close((t_z_stream*)luaL_checkudata(L, 1, BL_Z_STREAM));
+    return 0;
+}
+
+enum { BL_Z_UPDATE, BL_Z_FLUSH, BL_Z_FINISH };
+
+static int bl_z_stream_code(lua_State *L, int action)
+{
+    t_z_stream *s = (t_z_stream*)luaL_checkudata(L, 1, BL_Z_STREAM);
+    size_t src_len = 0;
+    const char *src = lua_isnoneornil(L, 2) ? "" : bl_z_checkdata(L, 2, &src_len);
+    const char *err;
+    int finish = action == BL_Z_FINISH;
+    luaL_Buffer out;
+    if (s->closed) return bl_z_error(L, "%s: stream already finished", s->name);
+    luaL_buffinit(L, &out);
+    err = s->code(s, src, src_len, finish, &out);
+    if (!err && action == BL_Z_FLUSH && s->compress && s->flush) err = s->flush(s, &out);
+    luaL_pushresult(&out);
+    if (err)
+    {
+        lua_pop(L, 1);
+        bl_z_stream_close(s);
+        return bl_z_error(L, "%s: %s", s->name, err);
+    }
+    if (finish) bl_z_stream_close(s);
+    return 1;
+}
+
+static int bl_z_stream_update(lua_State *L) { return bl_z_stream_code(L, BL_Z_UPDATE); }
+static int bl_z_stream_flush(lua_State *L) { return bl_z_stream_code(L, BL_Z_FLUSH); }
+static int bl_z_stream_finish(lua_State *L) { return bl_z_stream_code(L, BL_Z_FINISH); }
+
+static const luaL_Reg bl_z_stream_methods[] =
+{
+    {"update", bl_z_stream_update},
+    {"flush", bl_z_stream_flush},
+    {"finish", bl_z_stream_finish},
+    {"__gc", bl_z_stream_gc},
+    {NULL, NULL}
+};
+
+/* bl_z_stream_new pushes a new stream (not initialized yet) */
+static t_z_stream *bl_z_stream_new(lua_State *L, const char *name)
+{
+    static const char *const directions[] = {"compress", "decompress", NULL};
+    int compress = luaL_checkoption(L, 1, "compress", directions) == 0;
+    t_z_stream *s = (t_z_stream*)lua_newuserdata(L, sizeof(t_z_stream));
+    memset(s, 0, sizeof(t_z_stream));
+    s->name = name;
+    s->compress = compress;
+    s->closed = 1;              /* until the codec is initialized */
+    if (luaL_newmetatable(L, BL_Z_STREAM))
+    {
+        luaL_setfuncs(L, bl_z_stream_methods, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    return s;
+}
+
+/* Block streams */
+
+static const char *bl_z_block_flush(t_z_stream *s, luaL_Buffer *out)
+{
+    char *dst;
+    size_t dst_len;
+    uint32_t size;
+    if (s->block_compress(NULL, s->buf, s->buf_len, &dst, &dst_len) != 0) return "can not compress";
+    size = dst_len;
+    luaL_addlstring(out, (const char *)&size, sizeof(size));
+    luaL_addlstring(out, dst, dst_len);
+    free(dst);
+    s->buf_len = 0;
+    return NULL;
+}
+
+static const char *bl_z_block_code(t_z_stream *s, const char *src, size_t src_len, int finish, luaL_Buffer *out)
+{
+    const char *err;
+    uint32_t size;
+    if (s->compress)
+    {
+        while (src_len > 0)
+        {
+            size_t n = BL_Z_STREAM_BLOCK - s->buf_len;
+            if (n > src_len) n = src_len;
+            memcpy(s->buf + s->buf_len, src, n);
+            s->buf_len += n;
+            src += n;
+            src_len -= n;
+            if (s->buf_len == BL_Z_STREAM_BLOCK && (err = bl_z_block_flush(s, out))) return err;
+        }
+        if (finish)
+        {
+            if (s->buf_len > 0 && (err = bl_z_block_flush(s, out))) return err;
+            size = 0;
+            luaL_addlstring(out, (const char *)&size, sizeof(size));
+        }
+        return NULL;
+    }
+    /* s->buf contains the size and the beginning of the current block */
+    while (src_len > 0)
+    {
+        size_t need = sizeof(size);
+        size_t n;
+        if (s->eos) return "data after the end of the stream";
+        if (s->buf_len >= sizeof(size))
+        {
+            memcpy(&size, s->buf, sizeof(size));
+            need += size;
+        }
+        n = need - s->buf_len;
+        if (n > src_len) n = src_len;
+        memcpy(s->buf + s->buf_len, src, n);
+        s->buf_len += n;
+        src += n;
+        src_len -= n;
+        if (s->buf_len == sizeof(size))
+        {
+            memcpy(&size, s->buf, sizeof(size));
+            if (size == 0)
+            {
+                s->eos = 1;
+                s->buf_len = 0;
+            }
+            else if (size < sizeof(t_z_header) || size > 2*BL_Z_STREAM_BLOCK)
+            {
+                return "corrupted stream";
+            }
+        }
+        else if (s->buf_len == need)
+        {
+            char *dst;
+            size_t dst_len;
+            int r;
+            if (((t_z_header*)(s->buf+sizeof(size)))->len > BL_Z_STREAM_BLOCK) return "corrupted stream";
+            r = s->block_decompress(NULL, s->buf+sizeof(size), size, &dst, &dst_len);
+            if (r < 0) return "not a compressed stream";
+            if (r > 0) return "corrupted stream";
+            luaL_addlstring(out, dst, dst_len);
+            free(dst);
+            s->buf_len = 0;
+        }
+    }
+    if (finish && !s->eos) return "truncated stream";
+    return NULL;
+}
+
+static const char *bl_z_block_stream_flush(t_z_stream *s, luaL_Buffer *out)
+{
+    return s->buf_len > 0 ? bl_z_block_flush(s, out) : NULL;
+}
+
+static int bl_z_block_stream(lua_State *L, const char *name, t_z_compressor compress, t_z_compressor decompress)
+{
+    t_z_stream *s = bl_z_stream_new(L, name);
+    s->code = bl_z_block_code;
+    s->flush = bl_z_block_stream_flush;
+    s->block_compress = compress;
+    s->block_decompress = decompress;
+    s->buf = (char*)malloc(s->compress ? BL_Z_STREAM_BLOCK : sizeof(uint32_t) + 2*BL_Z_STREAM_BLOCK);
+    if (!s->buf) return bl_z_error(L, "%s: not enough memory", name);
+    s->closed = 0;
+    return 1;
+}
+
+#define BLOCK_STREAM(LIB)                                                       \
+                                                                                \
+static int bl_##LIB##_stream(lua_State *L)                                      \
+{                                                                               \
+    return bl_z_block_stream(L, #LIB, bl_##LIB##_compress_core, bl_##LIB##_decompress_core); \
+}                                                                               \
+
+/* Contexts keep the state of a codec, its work memory and its output buffer
+ * between calls (lib.context([options]), options.level and options.dict).
+ * context:compress(data) and context:decompress(data) produce and read
+ * the same strings as lib.compress and lib.decompress
+ * but the codec is only reset (not reinitialized) between calls.
+ */
+
+#define BL_Z_CONTEXT            "bl.z.context"
+#define BL_Z_CONTEXT_BUF_MAX    (16*1024*1024)  /* larger output buffers are not kept */
+
+typedef struct t_z_context t_z_context;
+
+/* code compresses or decompresses src in c->buf.
+ * It returns 0 (dst_len bytes in c->buf), -1 (src not compressed by the codec)
+ * or the number of values pushed by bl_z_error.
+ */
+typedef int (*t_z_context_code)(lua_State *L, t_z_context *c, const char *src, size_t src_len, size_t *dst_len);
+typedef void (*t_z_context_end)(t_z_context *c);
+
+struct t_z_context
+{
+    const char *name;
+    int level;
+    uint32_t dict_sig;          /* signature of the strings compressed with a dictionary */
+    t_z_dict *dict;             /* NULL or dictionary referenced by the user value of the context */
+    t_z_dict dict_string;       /* dictionary given as a string */
+    char *buf;
+    size_t buf_size;
+    t_z_compressor compress_core;       /* frames (strings larger than BL_Z_BLOCK_MAX) */
+    t_z_compressor decompress_core;
+    t_z_context_code compress;
+    t_z_context_code decompress;
+    t_z_context_end end;
+    union
+    {
+#ifdef USE_ZLIB
+        struct
+        {
+            z_stream deflate;
+            z_stream inflate;
+            int deflate_ready;
+            int inflate_ready;
+        } zlib;
+#endif
+#ifdef USE_LZMA
+        struct
+        {
+            lzma_stream encoder;
+            lzma_stream decoder;
+        } lzma;
+#endif
+#ifdef USE_LZ4
+        struct
+        {
+            LZ4_stream_t *stream;
+            LZ4_stream_t *dict;         /* stream with the dictionary loaded */
+        } lz4;
+        struct
+        {
+            LZ4_streamHC_t *stream;
+            LZ4_streamHC_t *dict;
+        } lz4hc;
+#endif
+#ifdef USE_ZSTD
+        struct
+        {
+            ZSTD_CCtx *cctx;
+            ZSTD_DCtx *dctx;
+        } zstd;
+#endif
+        int none;
+    } u;
+};
+
+static char *bl_z_context_reserve(t_z_context *c, size_t size)
+{
+    if (size > c->buf_size)
+    {
+        free(c->buf);
+        c->buf = (char*)malloc(size);
+        c->buf_size = c->buf ? size : 0;
+    }
+    return c->buf;
+}
+
+/* bl_z_context_result pushes the result of a context
+ * (the work buffer and the buffer at index into are exchanged if into is not 0)
+ */
+static int bl_z_context_result(lua_State *L, t_z_context *c, int into, int n, size_t dst_len)
+{
+    if (n > 0) return n; /* error messages pushed by the codec */
+    if (into)
+    {
+        t_z_buffer *b = (t_z_buffer*)lua_touserdata(L, into);
+        char *buf = b->data;
+        size_t buf_size = b->size;
+        b->data = c->buf;
+        b->len = dst_len;
+        b->size = c->buf_size;
+        c->buf = buf;
+        c->buf_size = buf_size;
+        lua_pushvalue(L, into);
+    }
+    else
+        lua_pushlstring(L, c->buf, dst_len);
+    if (c->buf_size > BL_Z_CONTEXT_BUF_MAX)
+    {
+        free(c->buf);
+        c->buf = NULL;
+        c->buf_size = 0;
+    }
+    return 1;
+}
+
+static int bl_z_context_compress(lua_State *L)
+{
+    t_z_context *c = (t_z_context*)luaL_checkudata(L, 1, BL_Z_CONTEXT);
+    size_t src_len;
+    const char *src = bl_z_checkdata(L, 2, &src_len);
+    int into = bl_z_optbuffer(L, 3);
+    size_t dst_len;
+    int n;
+    if (src_len > BL_Z_BLOCK_MAX)
+    {
+        char *dst;
+        n = bl_z_frame_compress(L, src, src_len, BL_Z_FRAME_CHUNK, 1, 0, c->compress_core, &dst, &dst_len);
+        return bl_z_result(L, into, n, dst, dst_len);
+    }
+    n = c->compress(L, c, src, src_len, &dst_len);
+    return bl_z_context_result(L, c, into, n, dst_len);
+}
+
+static int bl_z_context_decompress(lua_State *L)
+{
+    t_z_context *c = (t_z_context*)luaL_checkudata(L, 1, BL_Z_CONTEXT);
+    size_t src_len;
+    const char *src = bl_z_checkdata(L, 2, &src_len);
+    int into = bl_z_optbuffer(L, 3);
+    uint32_t sig = src_len >= sizeof(t_z_header) ? ((t_z_header*)src)->sig : 0;
+    size_t dst_len;
+    int n = -1;
+    if (sig == c->dict_sig)
+    {
+        const t_z_dict_header *h = (const t_z_dict_header*)src;
+        if (src_len < sizeof(t_z_dict_header)) return bl_z_error(L, "%s: not a compressed string", c->name);
+        if (!c->dict) return bl_z_error(L, "%s: dictionary required (id: %I)", c->name, (lua_Integer)h->dict_id);
+        if (h->dict_id != c->dict->id) return bl_z_error(L, "%s: wrong dictionary (id: %I instead of %I)", c->name, (lua_Integer)c->dict->id, (lua_Integer)h->dict_id);
+    }
+    if (sig != FRAME_SIG && src_len >= sizeof(t_z_header)) n = c->decompress(L, c, src, src_len, &dst_len);
+    if (n < 0)
+    {
+        char *dst;
+        n = bl_z_frame_decompress(L, src, src_len, c->decompress_core, &dst, &dst_len);
+        if (n < 0) return bl_z_error(L, "%s: not a compressed string", c->name);
+        return bl_z_result(L, into, n, dst, dst_len);
+    }
+    return bl_z_context_result(L, c, into, n, dst_len);
+}
+
+static int bl_z_context_gc(lua_State *L)
+{
+    t_z_context *c = (t_z_context*)luaL_checkudata(L, 1, BL_Z_CONTEXT);
+    if (c->end) c->end(c);
+    c->end = NULL;
+    free(c->buf);
+    c->buf = NULL;
+    c->buf_size = 0;
+    return 0;
+}
+
+static const luaL_Reg bl_z_context_methods[] =
+{
+    {"compress", bl_z_context_compress},
+    {"decompress", bl_z_context_decompress},
+    {"__gc", bl_z_context_gc},
+    {NULL, NULL}
+};
+
+/* bl_z_context_new pushes a new context (the codec state is initialized by the caller).
+ * options.level is checked against [min_level, max_level].
+ */
+static t_z_context *bl_z_context_new(lua_State *L, const char *name, uint32_t dict_sig, int level, int min_level, int max_level,
+                                     t_z_compressor compress_core, t_z_compressor decompress_core)
+{
+    t_z_context *c;
+    lua_settop(L, 1);
+    if (!lua_isnil(L, 1))
+    {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_getfield(L, 1, "level");
+        if (!lua_isnil(L, -1))
+        {
+            lua_Integer n = luaL_checkinteger(L, -1);
+            if (n < min_level || n > max_level) luaL_argerror(L, 1, "invalid level");
+            level = (int)n;
+        }
+        lua_pop(L, 1);
+    }
+    c = (t_z_context*)lua_newuserdata(L, sizeof(t_z_context));
+    memset(c, 0, sizeof(t_z_context));
+    c->name = name;
+    c->dict_sig = dict_sig;
+    c->level = level;
+    c->compress_core = compress_core;
+    c->decompress_core = decompress_core;
+    c->dict = bl_z_dict_option(L, 1, &c->dict_string);
+    if (c->dict)
+    {
+        /* the context keeps a reference to the dictionary */
+        lua_getfield(L, 1, "dict");
+        lua_setuservalue(L, -2);
+    }
+    if (luaL_newmetatable(L, BL_Z_CONTEXT))
+    {
+        luaL_setfuncs(L, bl_z_context_methods, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    return c;
+}
+
+#ifdef USE_MINILZO
+
+int bl_minilzo_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+#define HEAP_ALLOC(var,size) \
+    lzo_align_t __LZO_MMODEL var [ ((size) + (sizeof(lzo_align_t) - 1)) / sizeof(lzo_align_t) ]
+    HEAP_ALLOC(wrkmem, LZO1X_1_MEM_COMPRESS);
+    lzo_uint lzo_dst_len = src_len + src_len/16 + 64 + 3 + sizeof(t_z_header);
+    lzo_bytep lzo_dst = (lzo_bytep)malloc(sizeof(lzo_byte)*lzo_dst_len);
+    int r = lzo1x_1_compress(src, src_len, lzo_dst+sizeof(t_z_header), &lzo_dst_len, wrkmem);
+    if (r != LZO_E_OK)
+    {
+        free(lzo_dst);
+        return bl_z_error(L, "minilzo: lzo1x_1_compress failed (error: %d)", r);
+    }
+    ((t_z_header*)lzo_dst)->sig = LZO_SIG;
+    ((t_z_header*)lzo_dst)->len = src_len;
+    *dst = lzo_dst;
+    *dst_len = lzo_dst_len;
+    *dst_len += sizeof(t_z_header);
+    return 0;
+}
+
+int bl_minilzo_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    if (((t_z_header*)src)->sig == LZO_SIG)
+    {
+        lzo_uint lzo_dst_len = ((t_z_header*)src)->len;
+        *dst = (lzo_bytep)malloc(sizeof(lzo_byte)*lzo_dst_len);
+        int r = lzo1x_decompress_safe(src+sizeof(t_z_header), src_len-sizeof(t_z_header), *dst, &lzo_dst_len, NULL);
+        if (r != LZO_E_OK)
+        {
+            free(*dst);
+            return bl_z_error(L, "minilzo: lzo1x_decompress failed (error: %d)", r);
+        }
+        *dst_len = lzo_dst_len;
+        return 0;
+    }
+    return -1;
+}
+
+BLOCK_STREAM(minilzo)
+COMPRESSOR(minilzo)
+
+LUAMOD_API int luaopen_minilzo (lua_State *L)
+{
+    if (lzo_init() != LZO_E_OK)
+    {
+        luaL_error(L, "minilzo: lzo_init() failed !!!");
+    }
+    luaL_newlib(L, minilzolib);
+    return 1;
+}
+
+#endif
+
+#ifdef USE_LZO
+
+int bl_lzo_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+#define HEAP_ALLOC(var,size) \
+    lzo_align_t __LZO_MMODEL var [ ((size) + (sizeof(lzo_align_t) - 1)) / sizeof(lzo_align_t) ]
+    HEAP_ALLOC(wrkmem, LZO1X_999_MEM_COMPRESS);
+    lzo_uint lzo_dst_len = src_len + src_len/16 + 64 + 3 + sizeof(t_z_header);
+    lzo_bytep lzo_dst = (lzo_bytep)malloc(sizeof(lzo_byte)*lzo_dst_len);
+    int r = lzo1x_999_compress(src, src_len, lzo_dst+sizeof(t_z_header), &lzo_dst_len, wrkmem);
+    if (r != LZO_E_OK)
+    {
+        free(lzo_dst);
+        return bl_z_error(L, "lzo: lzo1x_999_compress failed (error: %d)", r);
+    }
+    ((t_z_header*)lzo_dst)->sig = LZO_SIG;
+    ((t_z_header*)lzo_dst)->len = src_len;
+    *dst = lzo_dst;
+    *dst_len = lzo_dst_len;
+    *dst_len += sizeof(t_z_header);
+    return 0;
+}
+
+int bl_lzo_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    if (((t_z_header*)src)->sig == LZO_SIG)
+    {
+        lzo_uint lzo_dst_len = ((t_z_header*)src)->len;
+        *dst = (lzo_bytep)malloc(sizeof(lzo_byte)*lzo_dst_len);
+        int r = lzo1x_decompress_safe(src+sizeof(t_z_header), src_len-sizeof(t_z_header), *dst, &lzo_dst_len, NULL);
+        if (r != LZO_E_OK)
+        {
+            free(*dst);
+            return bl_z_error(L, "lzo: lzo1x_decompress failed (error: %d)", r);
+        }
+        *dst_len = lzo_dst_len;
+        return 0;
+    }
+    return -1;
+}
+
+BLOCK_STREAM(lzo)
+COMPRESSOR(lzo)
+
+LUAMOD_API int luaopen_lzo (lua_State *L)
+{
+    if (lzo_init() != LZO_E_OK)
+    {
+        luaL_error(L, "lzo: lzo_init() failed !!!");
+    }
+    luaL_newlib(L, lzolib);
+    return 1;
+}
+
+#endif
+
+#ifdef USE_UCL
+
+int bl_ucl_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    ucl_uint ucl_dst_len = src_len + src_len/8 + 256 + sizeof(t_z_header);
+    ucl_bytep ucl_dst = (ucl_bytep)malloc(sizeof(ucl_byte)*ucl_dst_len);
+    int r = ucl_nrv2e_99_compress(src, src_len, ucl_dst+sizeof(t_z_header), &ucl_dst_len, NULL, UCL_LEVEL, NULL, NULL);
+    if (r != UCL_E_OK)
+    {
+        free(ucl_dst);
+        return bl_z_error(L, "ucl: ucl_nrv2e_99_compress failed (error: %d)", r);
+    }
+    ((t_z_header*)ucl_dst)->sig = UCL_SIG;
+    ((t_z_header*)ucl_dst)->len = src_len;
+    *dst = ucl_dst;
+    *dst_len = ucl_dst_len;
+    *dst_len += sizeof(t_z_header);
+    return 0;
+}
+
+int bl_ucl_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    if (((t_z_header*)src)->sig == UCL_SIG)
+    {
+        ucl_uint ucl_dst_len = ((t_z_header*)src)->len;
+        *dst = (ucl_bytep)malloc(sizeof(ucl_byte)*ucl_dst_len+65000);
+        int r = ucl_nrv2e_decompress_safe_8(src+sizeof(t_z_header), src_len-sizeof(t_z_header), *dst, &ucl_dst_len, NULL);
+        if (r != UCL_E_OK)
+        {
+            free(*dst);
+            return bl_z_error(L, "ucl: ucl_nrv2e_decompress_safe_8 failed (error: %d)", r);
+        }
+        *dst_len = ucl_dst_len;
+        return 0;
+    }
+    return -1;
+}
+
+BLOCK_STREAM(ucl)
+COMPRESSOR(ucl)
+
+LUAMOD_API int luaopen_ucl (lua_State *L)
+{
+    if (ucl_init() != UCL_E_OK)
+    {
+        luaL_error(L, "ucl: ucl_init() failed !!!");
+    }
+    luaL_newlib(L, ucllib);
+    return 1;
+}
+
+#endif
+
+#ifdef USE_QLZ
+
+int bl_qlz_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    char *qlz_dst;
+    size_t qlz_dst_len;
+    if (src_len == 0)
+    {
+        /* specific case for the empty string (the decompressor crashes on empty strings) */
+        qlz_dst = (char*)malloc(sizeof(t_z_header));
+        qlz_dst_len = 0;
+    }
+    else
+    {
+        qlz_state_compress *state_compress = (qlz_state_compress *)malloc(sizeof(qlz_state_compress));
+        qlz_dst = (char*)malloc(src_len + 400 + sizeof(t_z_header));
+        qlz_dst_len = qlz_compress(src, qlz_dst+sizeof(t_z_header), src_len, state_compress);
+        free(state_compress);
+    }
+
+    ((t_z_header*)qlz_dst)->sig = QLZ_SIG;
+    ((t_z_header*)qlz_dst)->len = src_len;
+    *dst = qlz_dst;
+    *dst_len = qlz_dst_len;
+    *dst_len += sizeof(t_z_header);
+    return 0;
+}
+
+int bl_qlz_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    if (((t_z_header*)src)->sig == QLZ_SIG)
+    {
+        if (((t_z_header*)src)->len == 0)
+        {
+            /* specific case for the empty string (the decompressor crashes on empty strings) */
+            *dst_len = 0;
+            *dst = NULL;
+        }
+        else
+        {
+            qlz_state_decompress *state_decompress = (qlz_state_decompress *)malloc(sizeof(qlz_state_decompress));
+            *dst_len = ((t_z_header*)src)->len;
+            *dst = (char*)malloc(*dst_len);
+            *dst_len = qlz_decompress(src+sizeof(t_z_header), *dst, state_decompress);
+            free(state_decompress);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+BLOCK_STREAM(qlz)
+COMPRESSOR(qlz)
+
+LUAMOD_API int luaopen_qlz (lua_State *L)
+{
+    luaL_newlib(L, qlzlib);
+    return 1;
+}
+
+#endif
+
+#ifdef USE_LZ4
+
+int bl_lz4_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    int lz4_max_dst_len = LZ4_COMPRESSBOUND(src_len);
+    char *lz4_dst = (char*)malloc(lz4_max_dst_len + sizeof(t_z_header));
+    int lz4_dst_len = LZ4_compress_default((char*)src, lz4_dst+sizeof(t_z_header), src_len, lz4_max_dst_len);
+    ((t_z_header*)lz4_dst)->sig = LZ4_SIG;
+    ((t_z_header*)lz4_dst)->len = src_len;
+    *dst = lz4_dst;
+    *dst_len = lz4_dst_len;
+    *dst_len += sizeof(t_z_header);
+    return 0;
+}
+
+int bl_lz4hc_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    int lz4_max_dst_len = LZ4_COMPRESSBOUND(src_len);
+    char *lz4_dst = (char*)malloc(lz4_max_dst_len + sizeof(t_z_header));
+    int lz4_dst_len = LZ4_compress_HC((char*)src, lz4_dst+sizeof(t_z_header), src_len, lz4_max_dst_len, 9);
+    ((t_z_header*)lz4_dst)->sig = LZ4_SIG;
+    ((t_z_header*)lz4_dst)->len = src_len;
+    *dst = lz4_dst;
+    *dst_len = lz4_dst_len;
+    *dst_len += sizeof(t_z_header);
+    return 0;
+}
+
+int bl_lz4_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    if (((t_z_header*)src)->sig == LZ4_SIG)
+    {
+        *dst_len = ((t_z_header*)src)->len + 3;
+        *dst = (char*)malloc(*dst_len);
+        int r = LZ4_decompress_safe((char*)(src+sizeof(t_z_header)), *dst, src_len-sizeof(t_z_header), *dst_len);
+        if (r < 0)
+        {
+            free(*dst);
+            return bl_z_error(L, "lz4: LZ4_decompress_safe (error: %d)", r);
+        }
+        *dst_len = r;
+        return 0;
+    }
+    return -1;
+}
+
+#define bl_lz4hc_decompress_core bl_lz4_decompress_core
+
+#define BL_LZ4F_HEADER_SIZE 32  /* LZ4 frame header max size (19) */
+
+static const char *bl_lz4_stream_code(t_z_stream *s, const char *src, size_t src_len, int finish, luaL_Buffer *out)
+{
+    size_t r;
+    if (s->compress)
+    {
+        if (!s->u.lz4.begun)
+        {
+            r = LZ4F_compressBegin(s->u.lz4.cctx, luaL_prepbuffsize(out, BL_LZ4F_HEADER_SIZE), BL_LZ4F_HEADER_SIZE, &s->u.lz4.prefs);
+            if (LZ4F_isError(r)) return LZ4F_getErrorName(r);
+            luaL_addsize(out, r);
+            s->u.lz4.begun = 1;
+        }
+        while (src_len > 0)
+        {
+            size_t n = src_len < BL_Z_STREAM_OUT ? src_len : BL_Z_STREAM_OUT;
+            size_t bound = LZ4F_compressBound(n, &s->u.lz4.prefs);
+            r = LZ4F_compressUpdate(s->u.lz4.cctx, luaL_prepbuffsize(out, bound), bound, src, n, NULL);
+            if (LZ4F_isError(r)) return LZ4F_getErrorName(r);
+            luaL_addsize(out, r);
+            src += n;
+            src_len -= n;
+        }
+        if (finish)
+        {
+            size_t bound = LZ4F_compressBound(0, &s->u.lz4.prefs);
+            r = LZ4F_compressEnd(s->u.lz4.cctx, luaL_prepbuffsize(out, bound), bound, NULL);
+            if (LZ4F_isError(r)) return LZ4F_getErrorName(r);
+            luaL_addsize(out, r);
+        }
+        return NULL;
+    }
+    for (;;)
+    {
+        size_t in = src_len;
+        size_t n = BL_Z_STREAM_OUT;
+        r = LZ4F_decompress(s->u.lz4.dctx, luaL_prepbuffsize(out, n), &n, src, &in, NULL);
+        if (LZ4F_isError(r)) return LZ4F_getErrorName(r);
+        luaL_addsize(out, n);
+        src += in;
+        src_len -= in;
+        if (in > 0 || n > 0) s->eos = r == 0;
+        if (src_len == 0 && n < BL_Z_STREAM_OUT) break;
+    }
+    if (finish && !s->eos) return "truncated stream";
+    return NULL;
+}
+
+static const char *bl_lz4_stream_flush(t_z_stream *s, luaL_Buffer *out)
+{
+    size_t bound = LZ4F_compressBound(0, &s->u.lz4.prefs);
+    size_t r = LZ4F_flush(s->u.lz4.cctx, luaL_prepbuffsize(out, bound), bound, NULL);
+    if (LZ4F_isError(r)) return LZ4F_getErrorName(r);
+    luaL_addsize(out, r);
+    return NULL;
+}
+
+static void bl_lz4_stream_end(t_z_stream *s)
+{
+    if (s->u.lz4.cctx) LZ4F_freeCompressionContext(s->u.lz4.cctx);
+    if (s->u.lz4.dctx) LZ4F_freeDecompressionContext(s->u.lz4.dctx);
+}
+
+static int bl_lz4_stream_level(lua_State *L, const char *name, int level)
+{
+    t_z_stream *s = bl_z_stream_new(L, name);
+    LZ4F_errorCode_t r;
+    if (s->compress)
+    {
+        r = LZ4F_createCompressionContext(&s->u.lz4.cctx, LZ4F_VERSION);
+        s->u.lz4.prefs.compressionLevel = level;
+        s->u.lz4.prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    }
+    else
+    {
+        r = LZ4F_createDecompressionContext(&s->u.lz4.dctx, LZ4F_VERSION);
+    }
+    s->code = bl_lz4_stream_code;
+    s->flush = bl_lz4_stream_flush;
+    s->end = bl_lz4_stream_end;
+    s->closed = 0;
+    if (LZ4F_isError(r))
+    {
+        bl_z_stream_close(s);
+        return bl_z_error(L, "%s: %s", name, LZ4F_getErrorName(r));
+    }
+    return 1;
+}
+
+static int bl_lz4_stream(lua_State *L) { return bl_lz4_stream_level(L, "lz4", 0); }
+static int bl_lz4hc_stream(lua_State *L) { return bl_lz4_stream_level(L, "lz4hc", 9); }
+
+COMPRESSOR(lz4)
+COMPRESSOR(lz4hc)
+
+/* With a dictionary, lz4 and lz4hc write an LZ4 block
+ * referencing the end of the dictionary (64 KB).
+ * The LZ4 state of z.dictionary objects is computed only once.
+ */
+
+static int bl_lz4_compress_dict(lua_State *L, const char *src, size_t src_len, t_z_dict *d, int level, char **dst, size_t *dst_len)
+{
+    int lz4_max_dst_len = LZ4_COMPRESSBOUND(src_len);
+    char *lz4_dst = (char*)malloc(lz4_max_dst_len + sizeof(t_z_dict_header));
+    int lz4_dst_len;
+    if (level > 0)
+    {
+        LZ4_streamHC_t *stream = LZ4_createStreamHC();
+        LZ4_resetStreamHC(stream, level);
+        LZ4_loadDictHC(stream, d->data, d->len);
+        lz4_dst_len = LZ4_compress_HC_continue(stream, src, lz4_dst+sizeof(t_z_dict_header), src_len, lz4_max_dst_len);
+        LZ4_freeStreamHC(stream);
+    }
+    else
+    {
+        LZ4_stream_t stream;
+        if (d->owned && !d->lz4)
+        {
+            d->lz4 = LZ4_createStream();
+            LZ4_loadDict(d->lz4, d->data, d->len);
+        }
+        if (d->lz4) memcpy(&stream, d->lz4, sizeof(stream));
+        else
+        {
+            LZ4_resetStream(&stream);
+            LZ4_loadDict(&stream, d->data, d->len);
+        }
+        lz4_dst_len = LZ4_compress_fast_continue(&stream, src, lz4_dst+sizeof(t_z_dict_header), src_len, lz4_max_dst_len, 1);
+    }
+    if (lz4_dst_len <= 0 && src_len > 0)
+    {
+        free(lz4_dst);
+        return bl_z_error(L, "lz4: can not compress");
+    }
+    ((t_z_dict_header*)lz4_dst)->sig = LZ4_DICT_SIG;
+    ((t_z_dict_header*)lz4_dst)->len = src_len;
+    ((t_z_dict_header*)lz4_dst)->dict_id = d->id;
+    *dst = lz4_dst;
+    *dst_len = sizeof(t_z_dict_header) + lz4_dst_len;
+    return 0;
+}
+
+static int bl_lz4_decompress_dict(lua_State *L, const char *src, size_t src_len, t_z_dict *d, char **dst, size_t *dst_len)
+{
+    size_t len = ((t_z_dict_header*)src)->len;
+    size_t dict_len = d->len < 64*1024 ? d->len : 64*1024;
+    int r;
+    *dst = (char*)malloc(len + 1);
+    r = LZ4_decompress_safe_usingDict(src+sizeof(t_z_dict_header), *dst, src_len-sizeof(t_z_dict_header), len,
+                                      d->data + d->len - dict_len, dict_len);
+    if (r < 0 || (size_t)r != len)
+    {
+        free(*dst);
+        return bl_z_error(L, "lz4: LZ4_decompress_safe_usingDict (error: %d)", r);
+    }
+    *dst_len = len;
+    return 0;
+}
+
+static int bl_lz4_compress_opt(lua_State *L)
+{
+    size_t src_len;
+    const char *src = bl_z_checkdata(L, 1, &src_len);
+    t_z_dict tmp;
+    t_z_dict *d = bl_z_dict_option(L, 2, &tmp);
+    int into = bl_z_into(L, 2);
+    char *dst;
+    size_t dst_len;
+    int n;
+    if (d && src_len <= BL_Z_BLOCK_MAX)
+        n = bl_lz4_compress_dict(L, src, src_len, d, 0, &dst, &dst_len);
+    else if (src_len > BL_Z_BLOCK_MAX)
+        n = bl_z_frame_compress(L, src, src_len, BL_Z_FRAME_CHUNK, 1, 0, bl_lz4_compress_core, &dst, &dst_len);
+    else
+        n = bl_lz4_compress_core(L, src, src_len, &dst, &dst_len);
+    return bl_z_result(L, into, n, dst, dst_len);
+}
+
+static int bl_lz4_decompress_opt(lua_State *L)
+{
+    return bl_z_decompress_with(L, "lz4", bl_lz4_decompress_core, LZ4_DICT_SIG);
+}
+
+static int bl_lz4hc_decompress_opt(lua_State *L)
+{
+    return bl_z_decompress_with(L, "lz4hc", bl_lz4hc_decompress_core, LZ4_DICT_SIG);
+}
+
+/* lz4 and lz4hc contexts keep their LZ4 stream and a copy of the stream
+ * with the dictionary loaded (copied to the stream before each compression).
+ * Without dictionary, the streams are reset with LZ4_resetStream_fast
+ * and LZ4_resetStreamHC_fast which do not clear the hash tables.
+ */
+
+static int bl_lz4_context_compress(lua_State *L, t_z_context *c, const char *src, size_t src_len, size_t *dst_len)
+{
+    size_t header = c->dict ? sizeof(t_z_dict_header) : sizeof(t_z_header);
+    int lz4_max_dst_len = LZ4_COMPRESSBOUND(src_len);
+    char *lz4_dst = bl_z_context_reserve(c, header + lz4_max_dst_len);
+    int lz4_dst_len;
+    if (!lz4_dst) return bl_z_error(L, "%s: not enough memory", c->name);
+    if (c->level > 0)
+    {
+        if (c->dict) memcpy(c->u.lz4hc.stream, c->u.lz4hc.dict, sizeof(LZ4_streamHC_t));
+        else LZ4_resetStreamHC_fast(c->u.lz4hc.stream, c->level);
+        lz4_dst_len = LZ4_compress_HC_continue(c->u.lz4hc.stream, src, lz4_dst+header, src_len, lz4_max_dst_len);
+    }
+    else
+    {
+        if (c->dict) memcpy(c->u.lz4.stream, c->u.lz4.dict, sizeof(LZ4_stream_t));
+        else LZ4_resetStream_fast(c->u.lz4.stream);
+        lz4_dst_len = LZ4_compress_fast_continue(c->u.lz4.stream, src, lz4_dst+header, src_len, lz4_max_dst_len, 1);
+    }
+    if (lz4_dst_len <= 0 && src_len > 0) return bl_z_error(L, "%s: can not compress", c->name);
+    if (c->dict)
+    {
+        ((t_z_dict_header*)lz4_dst)->sig = LZ4_DICT_SIG;
+        ((t_z_dict_header*)lz4_dst)->dict_id = c->dict->id;
+    }
+    else
+        ((t_z_header*)lz4_dst)->sig = LZ4_SIG;
+    ((t_z_header*)lz4_dst)->len = src_len;
+    *dst_len = header + lz4_dst_len;
+    return 0;
+}
+
+static int bl_lz4_context_decompress(lua_State *L, t_z_context *c, const char *src, size_t src_len, size_t *dst_len)
+{
+    uint32_t sig = ((t_z_header*)src)->sig;
+    size_t len = ((t_z_header*)src)->len;
+    char *lz4_dst;
+    int r;
+    if (sig == LZ4_SIG)
+    {
+        lz4_dst = bl_z_context_reserve(c, len + 1);
+        if (!lz4_dst) return bl_z_error(L, "%s: not enough memory", c->name);
+        r = LZ4_decompress_safe(src+sizeof(t_z_header), lz4_dst, src_len-sizeof(t_z_header), len);
+    }
+    else if (sig == LZ4_DICT_SIG)
+    {
+        size_t dict_len = c->dict->len < 64*1024 ? c->dict->len : 64*1024;
+        lz4_dst = bl_z_context_reserve(c, len + 1);
+        if (!lz4_dst) return bl_z_error(L, "%s: not enough memory", c->name);
+        r = LZ4_decompress_safe_usingDict(src+sizeof(t_z_dict_header), lz4_dst, src_len-sizeof(t_z_dict_header), len,
+                                          c->dict->data + c->dict->len - dict_len, dict_len);
+    }
+    else
+        return -1;
+    if (r < 0 || (size_t)r != len) return bl_z_error(L, "%s: LZ4_decompress_safe (error: %d)", c->name, r);
+    *dst_len = len;
+    return 0;
+}
+
+static void bl_lz4_context_end(t_z_context *c)
+{
+    if (c->level > 0)
+    {
+        if (c->u.lz4hc.stream) LZ4_freeStreamHC(c->u.lz4hc.stream);
+        if (c->u.lz4hc.dict) LZ4_freeStreamHC(c->u.lz4hc.dict);
+    }
+    else
+    {
+        if (c->u.lz4.stream) LZ4_freeStream(c->u.lz4.stream);
+        if (c->u.lz4.dict) LZ4_freeStream(c->u.lz4.dict);
+    }
+}
+
+static int bl_lz4_context_level(lua_State *L, const char *name, int level, int min_level, int max_level)
+{
+    t_z_context *c = bl_z_context_new(L, name, LZ4_DICT_SIG, level, min_level, max_level,
+                                      level > 0 ? bl_lz4hc_compress_core : bl_lz4_compress_core, bl_lz4_decompress_core);
+    c->compress = bl_lz4_context_compress;
+    c->decompress = bl_lz4_context_decompress;
+    c->end = bl_lz4_context_end;
+    if (c->level > 0)
+    {
+        c->u.lz4hc.stream = LZ4_createStreamHC();
+        if (c->dict)
+        {
+            c->u.lz4hc.dict = LZ4_createStreamHC();
+            LZ4_resetStreamHC(c->u.lz4hc.dict, c->level);
+            LZ4_loadDictHC(c->u.lz4hc.dict, c->dict->data, c->dict->len);
+        }
+    }
+    else
+    {
+        c->u.lz4.stream = LZ4_createStream();
+        if (c->dict)
+        {
+            c->u.lz4.dict = LZ4_createStream();
+            LZ4_loadDict(c->u.lz4.dict, c->dict->data, c->dict->len);
+        }
+    }
+    return 1;
+}
+
+static int bl_lz4_context(lua_State *L) { return bl_lz4_context_level(L, "lz4", 0, 0, 0); }
+static int bl_lz4hc_context(lua_State *L) { return bl_lz4_context_level(L, "lz4hc", 9, 1, 12); }
+
+static const luaL_Reg lz4lib_ext[] =
+{
+    {"compress", bl_lz4_compress_opt},
+    {"decompress", bl_lz4_decompress_opt},
+    {"context", bl_lz4_context},
+    {NULL, NULL}
+};
+
+LUAMOD_API int luaopen_lz4 (lua_State *L)
+{
+    luaL_newlib(L, lz4lib);
+    luaL_setfuncs(L, lz4lib_ext, 0);
+    return 1;
+}
+
+/* lz4hc.compress(data, {threads=n}) compresses chunks in parallel in a frame
+ * (the LZ4 blocks of the strings can not be split)
+ */
+static int bl_lz4hc_compress_opt(lua_State *L)
+{
+    size_t src_len;
+    const char *src = bl_z_checkdata(L, 1, &src_len);
+    int threads = bl_z_threads(L, 2);
+    t_z_dict tmp;
+    t_z_dict *d = bl_z_dict_option(L, 2, &tmp);
+    int into = bl_z_into(L, 2);
+    char *dst;
+    size_t dst_len;
+    int n;
+    if (d && src_len <= BL_Z_BLOCK_MAX)
+        n = bl_lz4_compress_dict(L, src, src_len, d, 9, &dst, &dst_len);
+    else if (src_len > BL_Z_BLOCK_MAX || (threads > 0 && src_len > BL_Z_FRAME_CHUNK))
+        n = bl_z_frame_compress(L, src, src_len, BL_Z_FRAME_CHUNK, 1, threads, bl_lz4hc_compress_core, &dst, &dst_len);
+    else
+        n = bl_lz4hc_compress_core(L, src, src_len, &dst, &dst_len);
+    return bl_z_result(L, into, n, dst, dst_len);
+}
+
+static const luaL_Reg lz4hclib_ext[] =
+{
+    {"compress", bl_lz4hc_compress_opt},
+    {"decompress", bl_lz4hc_decompress_opt},
+    {"context", bl_lz4hc_context},
+    {NULL, NULL}
+};
+
+LUAMOD_API int luaopen_lz4hc (lua_State *L)
+{
+    luaL_newlib(L, lz4hclib);
+    luaL_setfuncs(L, lz4hclib_ext, 0);
+    return 1;
+}
+
+#endif
+
+#ifdef USE_LZF
+
+int bl_lzf_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    char *lzf_dst;
+    unsigned int lzf_dst_len;
+    if (src_len == 0)
+    {
+        /* specific case for the empty string (the decompressor crashes on empty strings) */
+        lzf_dst = (char*)malloc(sizeof(t_z_header));
+        lzf_dst_len = 0;
+    }
+    else
+    {
+        lzf_dst = (char*)malloc(src_len+src_len/16+16 + sizeof(t_z_header));
+        lzf_dst_len = lzf_compress((char*)src, src_len, lzf_dst+sizeof(t_z_header), src_len+src_len/16+16);
+    }
+    ((t_z_header*)lzf_dst)->sig = LZF_SIG;
+    ((t_z_header*)lzf_dst)->len = src_len;
+    *dst = lzf_dst;
+    *dst_len = lzf_dst_len;
+    *dst_len += sizeof(t_z_header);
+    return 0;
+}
+
+int bl_lzf_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    if (((t_z_header*)src)->sig == LZF_SIG)
+    {
+        if (((t_z_header*)src)->len == 0)
+        {
+            /* specific case for the empty string (the decompressor crashes on empty strings) */
+            *dst_len = 0;
+            *dst = NULL;
+        }
+        else
+        {
+            *dst_len = ((t_z_header*)src)->len+16;
+            *dst = (char*)malloc(*dst_len);
+            unsigned int r = lzf_decompress((char*)(src+sizeof(t_z_header)), src_len-sizeof(t_z_header), *dst, *dst_len);
+            if (r == 0)
+            {
+                free(*dst);
+                return bl_z_error(L, "lzf: lzf_decompress");
+            }
+            *dst_len = r;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+BLOCK_STREAM(lzf)
+COMPRESSOR(lzf)
+
+LUAMOD_API int luaopen_lzf (lua_State *L)
+{
+    luaL_newlib(L, lzflib);
+    return 1;
+}
+
+#endif
+
+#ifdef USE_ZLIB
+
+int bl_zlib_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    uLongf zlib_dst_len = src_len + src_len/10 + 12;
+    Bytef *zlib_dst = (char*)malloc(zlib_dst_len + sizeof(t_z_header));
+    int r = compress2(zlib_dst+sizeof(t_z_header), &zlib_dst_len, src, src_len, ZLIB_LEVEL);
+    if (r != Z_OK)
+    {
+        free(zlib_dst);
+        return bl_z_error(L, "zlib: compress2 failed (error: %d)", r);
+    }
+    ((t_z_header*)zlib_dst)->sig = ZLIB_SIG;
+    ((t_z_header*)zlib_dst)->len = src_len;
+    *dst = zlib_dst;
+    *dst_len = zlib_dst_len;
+    *dst_len += sizeof(t_z_header);
+    return 0;
+}
+
+int bl_zlib_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    if (((t_z_header*)src)->sig == ZLIB_SIG)
+    {
+        *dst_len = ((t_z_header*)src)->len;
+        *dst = (char*)malloc(*dst_len);
+        int r = uncompress(*dst, (uLongf *)dst_len, (char*)(src+sizeof(t_z_header)), src_len-sizeof(t_z_header));
+        if (r != Z_OK)
+        {
+            free(*dst);
+            return bl_z_error(L, "z: uncompress failed (error: %d)", r);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* gzip files can contain several members (e.g. concatenated gzip files) */
+#define BL_GZIP_MEMBER(s, buf, len) (!(s)->compress && (len) > 0 && ((const unsigned char*)(buf))[0] == 0x1F)
+
+static const char *bl_zlib_stream_code(t_z_stream *s, const char *src, size_t src_len, int finish, luaL_Buffer *out)
+{
+    z_stream *z = &s->u.zlib;
+    int r;
+    if (s->eos && src_len > 0)
+    {
+        if (!BL_GZIP_MEMBER(s, src, src_len)) return "data after the end of the stream";
+        inflateReset(z);
+        s->eos = 0;
+    }
+    z->next_in = (Bytef*)src;
+    z->avail_in = src_len;
+    for (;;)
+    {
+        z->next_out = (Bytef*)luaL_prepbuffsize(out, BL_Z_STREAM_OUT);
+        z->avail_out = BL_Z_STREAM_OUT;
+        r = s->compress ? deflate(z, finish ? Z_FINISH : Z_NO_FLUSH) : inflate(z, Z_NO_FLUSH);
+        luaL_addsize(out, BL_Z_STREAM_OUT - z->avail_out);
+        if (r == Z_STREAM_END)
+        {
+            s->eos = 1;
+            if (BL_GZIP_MEMBER(s, z->next_in, z->avail_in))
+            {
+                inflateReset(z);
+                s->eos = 0;
+                continue;
+            }
+            if (z->avail_in > 0) return "data after the end of the stream";
+            break;
+        }
+        if (r != Z_OK && r != Z_BUF_ERROR) return bl_z_stream_error(s, s->compress ? "deflate failed" : "inflate failed", r);
+        if (z->avail_in == 0 && z->avail_out > 0 && !(s->compress && finish)) break;
+    }
+    if (finish && !s->eos) return "truncated stream";
+    return NULL;
+}
+
+static const char *bl_zlib_stream_flush(t_z_stream *s, luaL_Buffer *out)
+{
+    z_stream *z = &s->u.zlib;
+    int r;
+    z->next_in = (Bytef*)"";
+    z->avail_in = 0;
+    do
+    {
+        z->next_out = (Bytef*)luaL_prepbuffsize(out, BL_Z_STREAM_OUT);
+        z->avail_out = BL_Z_STREAM_OUT;
+        r = deflate(z, Z_SYNC_FLUSH);
+        luaL_addsize(out, BL_Z_STREAM_OUT - z->avail_out);
+        if (r != Z_OK && r != Z_BUF_ERROR) return bl_z_stream_error(s, "deflate failed", r);
+    } while (z->avail_out == 0);
+    return NULL;
+}
+
+static void bl_zlib_stream_end(t_z_stream *s)
+{
+    if (s->compress) deflateEnd(&s->u.zlib);
+    else inflateEnd(&s->u.zlib);
+}
+
+/* zlib.stream(direction, {gzip=true}) writes a gzip stream instead of a zlib stream */
+static int bl_zlib_stream(lua_State *L)
+{
+    int gzip = 0;
+    t_z_stream *s;
+    int r;
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "gzip");
+        gzip = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    s = bl_z_stream_new(L, "zlib");
+    /* zlib and gzip streams are accepted by the decompressor */
+    r = s->compress ? deflateInit2(&s->u.zlib, ZLIB_LEVEL, Z_DEFLATED, gzip ? 15+16 : 15, 8, Z_DEFAULT_STRATEGY)
+                    : inflateInit2(&s->u.zlib, 15+32);
+    if (r != Z_OK) return bl_z_error(L, "zlib: stream initialization failed (error: %d)", r);
+    s->code = bl_zlib_stream_code;
+    s->flush = bl_zlib_stream_flush;
+    s->end = bl_zlib_stream_end;
+    s->closed = 0;
+    return 1;
+}
+
+COMPRESSOR(zlib)
+
+/* zlib.compress(data, {threads=n}) compresses blocks in parallel (as pigz does).
+ * Each block is a raw deflate stream ended by a sync flush and using
+ * the end of the previous block as a dictionary.
+ * The blocks are concatenated in a single zlib stream.
+ */
+
+#define BL_ZLIB_BLOCK   (128*1024)
+#define BL_ZLIB_DICT    (32*1024)
+
+typedef struct
+{
+    const char *src;
+    size_t src_len;
+    size_t nb_blocks;
+    char **blocks;
+    size_t *block_lens;
+    uLong *adlers;
+    int *status;
+} t_zlib_parallel;
+
+static void bl_zlib_block_job(void *ctx, int i)
+{
+    t_zlib_parallel *p = (t_zlib_parallel*)ctx;
+    const char *block = p->src + (size_t)i*BL_ZLIB_BLOCK;
+    size_t len = p->src_len - (size_t)i*BL_ZLIB_BLOCK;
+    int last = (size_t)i == p->nb_blocks-1;
+    z_stream z;
+    uLong bound;
+    int r;
+    if (len > BL_ZLIB_BLOCK) len = BL_ZLIB_BLOCK;
+    p->adlers[i] = adler32(adler32(0L, Z_NULL, 0), (const Bytef*)block, len);
+    p->status[i] = 1;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, ZLIB_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return;
+    if (i > 0) deflateSetDictionary(&z, (const Bytef*)block - BL_ZLIB_DICT, BL_ZLIB_DICT);
+    bound = deflateBound(&z, len) + 16;
+    p->blocks[i] = (char*)malloc(bound);
+    z.next_in = (Bytef*)block;
+    z.avail_in = len;
+    z.next_out = (Bytef*)p->blocks[i];
+    z.avail_out = bound;
+    r = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (z.avail_in == 0 && r == (last ? Z_STREAM_END : Z_OK))
+    {
+        p->block_lens[i] = bound - z.avail_out;
+        p->status[i] = 0;
+    }
+    else
+    {
+        free(p->blocks[i]);
+    }
+    deflateEnd(&z);
+}
+
+static int bl_zlib_compress_parallel(lua_State *L, const char *src, size_t src_len, int threads, char **dst, size_t *dst_len)
+{
+    t_zlib_parallel p;
+    size_t i, size;
+    int failed = 0;
+    int level = ZLIB_LEVEL < 0 ? 6 : ZLIB_LEVEL;
+    unsigned int header = (0x78 << 8) | ((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6);
+    uLong adler;
+    char *zlib_dst;
+    p.src = src;
+    p.src_len = src_len;
+    p.nb_blocks = (src_len + BL_ZLIB_BLOCK - 1) / BL_ZLIB_BLOCK;
+    p.blocks = (char**)calloc(p.nb_blocks, sizeof(char*));
+    p.block_lens = (size_t*)calloc(p.nb_blocks, sizeof(size_t));
+    p.adlers = (uLong*)calloc(p.nb_blocks, sizeof(uLong));
+    p.status = (int*)calloc(p.nb_blocks, sizeof(int));
+    if (!p.blocks || !p.block_lens || !p.adlers || !p.status)
+    {
+        free(p.blocks);
+        free(p.block_lens);
+        free(p.adlers);
+        free(p.status);
+        return bl_z_error(L, "zlib: not enough memory");
+    }
+    bl_parallel_threads(threads, p.nb_blocks, bl_zlib_block_job, &p);
+
+    size = sizeof(t_z_header) + 2 + 4;
+    for (i = 0; i < p.nb_blocks; i++)
+    {
+        if (p.status[i] != 0) failed = 1;
+        size += p.block_lens[i];
+    }
+    zlib_dst = failed ? NULL : (char*)malloc(size);
+    if (zlib_dst)
+    {
+        unsigned char *q = (unsigned char *)zlib_dst + sizeof(t_z_header);
+        ((t_z_header*)zlib_dst)->sig = ZLIB_SIG;
+        ((t_z_header*)zlib_dst)->len = src_len;
+        header += 31 - header % 31;
+        *q++ = header >> 8;
+        *q++ = header & 0xFF;
+        adler = p.adlers[0];
+        for (i = 0; i < p.nb_blocks; i++)
+        {
+            memcpy(q, p.blocks[i], p.block_lens[i]);
+            q += p.block_lens[i];
+            if (i > 0) adler = adler32_combine(adler, p.adlers[i], i < p.nb_blocks-1 ? BL_ZLIB_BLOCK : src_len - i*BL_ZLIB_BLOCK);
+        }
+        *q++ = adler >> 24;
+        *q++ = adler >> 16;
+        *q++ = adler >> 8;
+        *q++ = adler;
+    }
+    for (i = 0; i < p.nb_blocks; i++) if (p.status[i] == 0) free(p.blocks[i]);
+    free(p.blocks);
+    free(p.block_lens);
+    free(p.adlers);
+    free(p.status);
+    if (!zlib_dst) return bl_z_error(L, "zlib: can not compress");
+    *dst = zlib_dst;
+    *dst_len = size;
+    return 0;
+}
+
+/* With a dictionary, zlib writes a raw deflate stream
+ * (the dictionary is the end of the preset dictionary of deflate).
+ */
+
+static int bl_zlib_compress_dict(lua_State *L, const char *src, size_t src_len, t_z_dict *d, char **dst, size_t *dst_len)
+{
+    size_t dict_len = d->len < BL_ZLIB_DICT ? d->len : BL_ZLIB_DICT;
+    z_stream z;
+    uLong bound;
+    char *zlib_dst;
+    int r;
+    memset(&z, 0, sizeof(z));
+    r = deflateInit2(&z, ZLIB_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    if (r != Z_OK) return bl_z_error(L, "zlib: deflateInit2 failed (error: %d)", r);
+    deflateSetDictionary(&z, (const Bytef*)d->data + d->len - dict_len, dict_len);
+    bound = deflateBound(&z, src_len);
+    zlib_dst = (char*)malloc(bound + sizeof(t_z_dict_header));
+    z.next_in = (Bytef*)src;
+    z.avail_in = src_len;
+    z.next_out = (Bytef*)zlib_dst + sizeof(t_z_dict_header);
+    z.avail_out = bound;
+    r = deflate(&z, Z_FINISH);
+    deflateEnd(&z);
+    if (r != Z_STREAM_END)
+    {
+        free(zlib_dst);
+        return bl_z_error(L, "zlib: deflate failed (error: %d)", r);
+    }
+    ((t_z_dict_header*)zlib_dst)->sig = ZLIB_DICT_SIG;
+    ((t_z_dict_header*)zlib_dst)->len = src_len;
+    ((t_z_dict_header*)zlib_dst)->dict_id = d->id;
+    *dst = zlib_dst;
+    *dst_len = sizeof(t_z_dict_header) + bound - z.avail_out;
+    return 0;
+}
+
+static int bl_zlib_decompress_dict(lua_State *L, const char *src, size_t src_len, t_z_dict *d, char **dst, size_t *dst_len)
+{
+    size_t dict_len = d->len < BL_ZLIB_DICT ? d->len : BL_ZLIB_DICT;
+    size_t len = ((t_z_dict_header*)src)->len;
+    z_stream z;
+    int r;
+    memset(&z, 0, sizeof(z));
+    r = inflateInit2(&z, -15);
+    if (r != Z_OK) return bl_z_error(L, "zlib: inflateInit2 failed (error: %d)", r);
+    inflateSetDictionary(&z, (const Bytef*)d->data + d->len - dict_len, dict_len);
+    *dst = (char*)malloc(len + 1);
+    z.next_in = (Bytef*)src + sizeof(t_z_dict_header);
+    z.avail_in = src_len - sizeof(t_z_dict_header);
+    z.next_out = (Bytef*)*dst;
+    z.avail_out = len + 1;
+    r = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    if (r != Z_STREAM_END || z.total_out != len)
+    {
+        free(*dst);
+        return bl_z_error(L, "zlib: inflate failed (error: %d)", r);
+    }
+    *dst_len = len;
+    return 0;
+}
+
+static int bl_zlib_compress_opt(lua_State *L)
+{
+    size_t src_len;
+    const char *src = bl_z_checkdata(L, 1, &src_len);
+    int threads = bl_z_threads(L, 2);
+    t_z_dict tmp;
+    t_z_dict *d = bl_z_dict_option(L, 2, &tmp);
+    int into = bl_z_into(L, 2);
+    char *dst;
+    size_t dst_len;
+    int n;
+    if (d && src_len <= BL_Z_BLOCK_MAX)
+        n = bl_zlib_compress_dict(L, src, src_len, d, &dst, &dst_len);
+    else if (src_len > BL_Z_BLOCK_MAX)
+        n = bl_z_frame_compress(L, src, src_len, BL_Z_FRAME_CHUNK, 1, threads, bl_zlib_compress_core, &dst, &dst_len);
+    else if (threads > 0 && src_len > BL_ZLIB_BLOCK)
+        n = bl_zlib_compress_parallel(L, src, src_len, threads, &dst, &dst_len);
+    else
+        n = bl_zlib_compress_core(L, src, src_len, &dst, &dst_len);
+    return bl_z_result(L, into, n, dst, dst_len);
+}
+
+static int bl_zlib_decompress_opt(lua_State *L)
+{
+    return bl_z_decompress_with(L, "zlib", bl_zlib_decompress_core, ZLIB_DICT_SIG);
+}
+
+/* zlib contexts reset their deflate and inflate streams between calls
+ * (the dictionary is set again after each reset).
+ */
+
+static int bl_zlib_context_compress(lua_State *L, t_z_context *c, const char *src, size_t src_len, size_t *dst_len)
+{
+    z_stream *z = &c->u.zlib.deflate;
+    size_t header = c->dict ? sizeof(t_z_dict_header) : sizeof(t_z_header);
+    uLong bound;
+    char *zlib_dst;
+    int r;
+    if (c->u.zlib.deflate_ready) r = deflateReset(z);
+    else
+    {
+        r = deflateInit2(z, c->level, Z_DEFLATED, c->dict ? -15 : 15, 8, Z_DEFAULT_STRATEGY);
+        c->u.zlib.deflate_ready = r == Z_OK;
+    }
+    if (r != Z_OK) return bl_z_error(L, "zlib: deflateInit2 failed (error: %d)", r);
+    if (c->dict)
+    {
+        size_t dict_len = c->dict->len < BL_ZLIB_DICT ? c->dict->len : BL_ZLIB_DICT;
+        deflateSetDictionary(z, (const Bytef*)c->dict->data + c->dict->len - dict_len, dict_len);
+    }
+    bound = deflateBound(z, src_len);
+    zlib_dst = bl_z_context_reserve(c, header + bound);
+    if (!zlib_dst) return bl_z_error(L, "%s: not enough memory", c->name);
+    z->next_in = (Bytef*)src;
+    z->avail_in = src_len;
+    z->next_out = (Bytef*)zlib_dst + header;
+    z->avail_out = bound;
+    r = deflate(z, Z_FINISH);
+    if (r != Z_STREAM_END) return bl_z_error(L, "zlib: deflate failed (error: %d)", r);
+    if (c->dict)
+    {
+        ((t_z_dict_header*)zlib_dst)->sig = ZLIB_DICT_SIG;
+        ((t_z_dict_header*)zlib_dst)->dict_id = c->dict->id;
+    }
+    else
+        ((t_z_header*)zlib_dst)->sig = ZLIB_SIG;
+    ((t_z_header*)zlib_dst)->len = src_len;
+    *dst_len = header + bound - z->avail_out;
+    return 0;
+}
+
+static int bl_zlib_context_decompress(lua_State *L, t_z_context *c, const char *src, size_t src_len, size_t *dst_len)
+{
+    z_stream *z = &c->u.zlib.inflate;
+    int raw = ((t_z_header*)src)->sig == ZLIB_DICT_SIG;
+    size_t header = raw ? sizeof(t_z_dict_header) : sizeof(t_z_header);
+    size_t len = ((t_z_header*)src)->len;
+    int r;
+    if (!raw && ((t_z_header*)src)->sig != ZLIB_SIG) return -1;
+    if (c->u.zlib.inflate_ready) r = inflateReset2(z, raw ? -15 : 15);
+    else
+    {
+        r = inflateInit2(z, raw ? -15 : 15);
+        c->u.zlib.inflate_ready = r == Z_OK;
+    }
+    if (r != Z_OK) return bl_z_error(L, "zlib: inflateInit2 failed (error: %d)", r);
+    if (raw)
+    {
+        size_t dict_len = c->dict->len < BL_ZLIB_DICT ? c->dict->len : BL_ZLIB_DICT;
+        inflateSetDictionary(z, (const Bytef*)c->dict->data + c->dict->len - dict_len, dict_len);
+    }
+    z->next_in = (Bytef*)src + header;
+    z->avail_in = src_len - header;
+    z->next_out = (Bytef*)bl_z_context_reserve(c, len + 1);
+    if (!z->next_out) return bl_z_error(L, "%s: not enough memory", c->name);
+    z->avail_out = len + 1;
+    r = inflate(z, Z_FINISH);
+    if (r != Z_STREAM_END || z->total_out != len) return bl_z_error(L, "zlib: inflate failed (error: %d)", r);
+    *dst_len = len;
+    return 0;
+}
+
+static void bl_zlib_context_end(t_z_context *c)
+{
+    if (c->u.zlib.deflate_ready) deflateEnd(&c->u.zlib.deflate);
+    if (c->u.zlib.inflate_ready) inflateEnd(&c->u.zlib.inflate);
+}
+
+static int bl_zlib_context(lua_State *L)
+{
+    t_z_context *c = bl_z_context_new(L, "zlib", ZLIB_DICT_SIG, ZLIB_LEVEL < 0 ? 6 : ZLIB_LEVEL, 0, 9, bl_zlib_compress_core, bl_zlib_decompress_core);
+    c->compress = bl_zlib_context_compress;
+    c->decompress = bl_zlib_context_decompress;
+    c->end = bl_zlib_context_end;
+    return 1;
+}
+
+static const luaL_Reg zliblib_ext[] =
+{
+    {"compress", bl_zlib_compress_opt},
+    {"decompress", bl_zlib_decompress_opt},
+    {"context", bl_zlib_context},
+    {NULL, NULL}
+};
+
+LUAMOD_API int luaopen_zlib (lua_State *L)
+{
+    luaL_newlib(L, zliblib);
+    luaL_setfuncs(L, zliblib_ext, 0);
+    return 1;
 }
 
 #endif
 
-#ifdef USE_LZ4
+#ifdef USE_LZMA
+
+#define LZMA_EXTREME 0
+#define LZMA_CHECK LZMA_CHECK_CRC64
+
+int bl_lzma_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    uint32_t preset = LZMA_LEVEL | (LZMA_EXTREME ? LZMA_PRESET_EXTREME : 0);
+    lzma_check check = LZMA_CHECK;
+    lzma_stream strm = LZMA_STREAM_INIT;
+    size_t lzma_dst_len = src_len + src_len/8 + 256;
+    uint8_t *lzma_dst = (uint8_t*)malloc(lzma_dst_len + sizeof(t_z_header));
+    int out_finished = 0;
+    lzma_action action;
+    lzma_ret ret;
+    ret = lzma_easy_encoder(&strm, preset, check);
+    if (ret != LZMA_OK)
+    {
+        free(lzma_dst);
+        return bl_z_error(L, "lzma: lzma_easy_encoder failed (error: %d)", ret);
+    }
+    strm.next_in = src;
+    strm.avail_in = src_len;
+    action = LZMA_FINISH;
+    strm.next_out = lzma_dst + sizeof(t_z_header);
+    strm.avail_out = lzma_dst_len;
+    ret = lzma_code(&strm, action);
+    if (ret != LZMA_STREAM_END)
+    {
+        free(lzma_dst);
+        return bl_z_error(L, "lzma: lzma_code failed (error: %d)", ret);
+    }
+    lzma_dst_len -= strm.avail_out;
+    ((t_z_header*)lzma_dst)->sig = LZMA_SIG;
+    ((t_z_header*)lzma_dst)->len = src_len;
+    *dst = lzma_dst;
+    *dst_len = lzma_dst_len;
+    *dst_len += sizeof(t_z_header);
+    lzma_end(&strm);
+    return 0;
+}
+
+/* lzma.compress(data, {threads=n}) uses the multithreaded encoder of XZ Utils.
+ * The data is split in blocks (at least BL_LZMA_BLOCK_MIN bytes per block)
+ * so that each thread compresses at least one block.
+ * The blocks listed in the index of an XZ stream are decompressed in parallel.
+ */
+
+#define BL_LZMA_BLOCK_MIN   (1024*1024)
+
+static int bl_lzma_compress_mt(lua_State *L, const char *src, size_t src_len, int threads, char **dst, size_t *dst_len)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_mt mt;
+    size_t lzma_dst_len = lzma_stream_buffer_bound(src_len);
+    uint8_t *lzma_dst;
+    lzma_ret ret;
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = threads;
+    mt.block_size = src_len / threads + 1;
+    if (mt.block_size < BL_LZMA_BLOCK_MIN) mt.block_size = BL_LZMA_BLOCK_MIN;
+    mt.preset = LZMA_LEVEL | (LZMA_EXTREME ? LZMA_PRESET_EXTREME : 0);
+    mt.check = LZMA_CHECK;
+    ret = lzma_stream_encoder_mt(&strm, &mt);
+    if (ret != LZMA_OK) return bl_lzma_compress_core(L, src, src_len, dst, dst_len);
+    lzma_dst = (uint8_t*)malloc(lzma_dst_len + sizeof(t_z_header));
+    strm.next_in = (const uint8_t*)src;
+    strm.avail_in = src_len;
+    strm.next_out = lzma_dst + sizeof(t_z_header);
+    strm.avail_out = lzma_dst_len;
+    do ret = lzma_code(&strm, LZMA_FINISH); while (ret == LZMA_OK);
+    lzma_end(&strm);
+    if (ret != LZMA_STREAM_END)
+    {
+        free(lzma_dst);
+        return bl_z_error(L, "lzma: lzma_code failed (error: %d)", ret);
+    }
+    lzma_dst_len -= strm.avail_out;
+    ((t_z_header*)lzma_dst)->sig = LZMA_SIG;
+    ((t_z_header*)lzma_dst)->len = src_len;
+    *dst = (char*)lzma_dst;
+    *dst_len = lzma_dst_len + sizeof(t_z_header);
+    return 0;
+}
+
+typedef struct
+{
+    const uint8_t *in;
+    size_t in_size;
+    uint8_t *out;
+    lzma_check check;
+    lzma_index_iter *blocks;
+    int *status;
+} t_lzma_parallel;
+
+static void bl_lzma_block_job(void *ctx, int i)
+{
+    t_lzma_parallel *p = (t_lzma_parallel*)ctx;
+    lzma_index_iter *it = &p->blocks[i];
+    size_t offset = it->block.compressed_file_offset;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+    size_t in_pos, out_pos = 0;
+    int j;
+    p->status[i] = 1;
+    if (offset >= p->in_size) return;
+    memset(&block, 0, sizeof(block));
+    block.version = 0;
+    block.check = p->check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(p->in[offset]);
+    if (offset + block.header_size > p->in_size) return;
+    if (lzma_block_header_decode(&block, NULL, p->in + offset) != LZMA_OK) return;
+    in_pos = offset + block.header_size;
+    if (lzma_block_compressed_size(&block, it->block.unpadded_size) == LZMA_OK
+        && lzma_block_buffer_decode(&block, NULL, p->in, &in_pos, p->in_size,
+                                    p->out + it->block.uncompressed_file_offset, &out_pos, it->block.uncompressed_size) == LZMA_OK
+        && out_pos == it->block.uncompressed_size)
+    {
+        p->status[i] = 0;
+    }
+    for (j = 0; filters[j].id != LZMA_VLI_UNKNOWN; j++) free(filters[j].options);
+}
+
+/* bl_lzma_decompress_parallel decompresses the blocks of a single XZ stream in parallel.
+ * It returns -1 if the stream can not be decompressed this way
+ * (e.g. only one block), 1 on errors, 2 if there is not enough memory and 0 on success.
+ */
+static int bl_lzma_decompress_parallel(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size)
+{
+    lzma_stream_flags header_flags, footer_flags;
+    lzma_index *index = NULL;
+    uint64_t memlimit = UINT64_MAX;
+    lzma_index_iter it;
+    t_lzma_parallel p;
+    size_t pos, n, i;
+    int r = 0;
+    if (in_size < 2*LZMA_STREAM_HEADER_SIZE) return -1;
+    if (lzma_stream_header_decode(&header_flags, in) != LZMA_OK) return -1;
+    if (lzma_stream_footer_decode(&footer_flags, in + in_size - LZMA_STREAM_HEADER_SIZE) != LZMA_OK) return -1;
+    if (lzma_stream_flags_compare(&header_flags, &footer_flags) != LZMA_OK) return -1;
+    if (footer_flags.backward_size > in_size - 2*LZMA_STREAM_HEADER_SIZE) return -1;
+    pos = in_size - LZMA_STREAM_HEADER_SIZE - footer_flags.backward_size;
+    if (lzma_index_buffer_decode(&index, &memlimit, NULL, in, &pos, in_size - LZMA_STREAM_HEADER_SIZE) != LZMA_OK) return -1;
+    n = lzma_index_block_count(index);
+    if (n < 2 || lzma_index_stream_size(index) != in_size || lzma_index_uncompressed_size(index) != out_size)
+    {
+        lzma_index_end(index, NULL);
+        return -1;
+    }
+    p.in = in;
+    p.in_size = in_size;
+    p.out = out;
+    p.check = footer_flags.check;
+    p.blocks = (lzma_index_iter*)malloc(n * sizeof(lzma_index_iter));
+    p.status = (int*)calloc(n, sizeof(int));
+    if (!p.blocks || !p.status)
+    {
+        free(p.blocks);
+        free(p.status);
+        lzma_index_end(index, NULL);
+        return 2;
+    }
+    lzma_index_iter_init(&it, index);
+    for (i = 0; i < n && !lzma_index_iter_next(&it, LZMA_INDEX_ITER_BLOCK); i++) p.blocks[i] = it;
+    if (i == n)
+    {
+        bl_parallel(n, bl_lzma_block_job, &p);
+        for (i = 0; i < n; i++) if (p.status[i] != 0) r = 1;
+    }
+    else
+    {
+        r = 1;
+    }
+    free(p.blocks);
+    free(p.status);
+    lzma_index_end(index, NULL);
+    return r;
+}
+
+int bl_lzma_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    if (((t_z_header*)src)->sig == LZMA_SIG)
+    {
+        lzma_stream strm = LZMA_STREAM_INIT;
+        const uint32_t flags = LZMA_TELL_UNSUPPORTED_CHECK | LZMA_CONCATENATED;
+        const uint64_t memory_limit = UINT64_MAX;
+        *dst_len = ((t_z_header*)src)->len;
+        *dst = (uint8_t*)malloc(*dst_len);
+        lzma_action action;
+        lzma_ret ret;
+        if (!*dst) return bl_z_error(L, "lzma: not enough memory");
+        switch (bl_lzma_decompress_parallel((const uint8_t*)src + sizeof(t_z_header), src_len - sizeof(t_z_header), (uint8_t*)*dst, *dst_len))
+        {
+            case 0: return 0;
+            case 1:
+                free(*dst);
+                return bl_z_error(L, "lzma: corrupted block");
+            case 2:
+                free(*dst);
+                return bl_z_error(L, "lzma: not enough memory");
+        }
+        ret = lzma_stream_decoder(&strm, memory_limit, flags);
+        if (ret != LZMA_OK)
+        {
+            free(*dst);
+            return bl_z_error(L, "lzma: lzma_stream_decoder failed (error: %d)", ret);
+        }
+        strm.next_in = src + sizeof(t_z_header);
+        strm.avail_in = src_len - sizeof(t_z_header);
+        action = LZMA_FINISH;
+        strm.next_out = *dst;
+        strm.avail_out = *dst_len;
+        ret = lzma_code(&strm, action);
+        if (ret != LZMA_STREAM_END)
+        {
+            free(*dst);
+            return bl_z_error(L, "lzma: lzma_code failed (error: %d)", ret);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static const char *bl_lzma_stream_code(t_z_stream *s, const char *src, size_t src_len, int finish, luaL_Buffer *out)
+{
+    lzma_stream *strm = &s->u.lzma;
+    lzma_action action = finish ? LZMA_FINISH : LZMA_RUN;
+    lzma_ret r;
+    if (s->eos && src_len > 0) return "data after the end of the stream";
+    strm->next_in = (const uint8_t*)src;
+    strm->avail_in = src_len;
+    for (;;)
+    {
+        strm->next_out = (uint8_t*)luaL_prepbuffsize(out, BL_Z_STREAM_OUT);
+        strm->avail_out = BL_Z_STREAM_OUT;
+        r = lzma_code(strm, action);
+        luaL_addsize(out, BL_Z_STREAM_OUT - strm->avail_out);
+        if (r == LZMA_STREAM_END)
+        {
+            s->eos = 1;
+            break;
+        }
+        if (r == LZMA_BUF_ERROR && finish) return "truncated stream";
+        if (r != LZMA_OK) return bl_z_stream_error(s, "lzma_code failed", r);
+        if (strm->avail_in == 0 && strm->avail_out > 0 && action == LZMA_RUN) break;
+    }
+    if (finish && !s->eos) return "truncated stream";
+    return NULL;
+}
+
+static const char *bl_lzma_stream_flush(t_z_stream *s, luaL_Buffer *out)
+{
+    lzma_stream *strm = &s->u.lzma;
+    lzma_ret r;
+    strm->next_in = NULL;
+    strm->avail_in = 0;
+    do
+    {
+        strm->next_out = (uint8_t*)luaL_prepbuffsize(out, BL_Z_STREAM_OUT);
+        strm->avail_out = BL_Z_STREAM_OUT;
+        r = lzma_code(strm, LZMA_SYNC_FLUSH);
+        luaL_addsize(out, BL_Z_STREAM_OUT - strm->avail_out);
+        if (r != LZMA_OK && r != LZMA_STREAM_END) return bl_z_stream_error(s, "lzma_code failed", r);
+    } while (r != LZMA_STREAM_END);
+    return NULL;
+}
+
+static void bl_lzma_stream_end(t_z_stream *s)
+{
+    lzma_end(&s->u.lzma);
+}
+
+static int bl_lzma_stream(lua_State *L)
+{
+    t_z_stream *s = bl_z_stream_new(L, "lzma");
+    lzma_stream init = LZMA_STREAM_INIT;
+    lzma_ret r;
+    s->u.lzma = init;
+    if (s->compress)
+        r = lzma_easy_encoder(&s->u.lzma, LZMA_LEVEL | (LZMA_EXTREME ? LZMA_PRESET_EXTREME : 0), LZMA_CHECK);
+    else
+        r = lzma_stream_decoder(&s->u.lzma, UINT64_MAX, LZMA_TELL_UNSUPPORTED_CHECK | LZMA_CONCATENATED);
+    if (r != LZMA_OK) return bl_z_error(L, "lzma: stream initialization failed (error: %d)", r);
+    s->code = bl_lzma_stream_code;
+    s->flush = bl_lzma_stream_flush;
+    s->end = bl_lzma_stream_end;
+    s->closed = 0;
+    return 1;
+}
+
+COMPRESSOR(lzma)
+
+/* With a dictionary, lzma writes a raw LZMA2 stream using the dictionary
+ * as a preset dictionary. The size of the dictionary of LZMA2 is computed
+ * from the sizes of the preset dictionary and of the data
+ * (a smaller dictionary makes the encoder faster on small strings).
+ */
+
+static void bl_lzma_dict_filters(t_z_dict *d, size_t len, uint32_t preset, lzma_options_lzma *options, lzma_filter filters[2])
+{
+    lzma_lzma_preset(options, preset | (LZMA_EXTREME ? LZMA_PRESET_EXTREME : 0));
+    options->preset_dict = (const uint8_t*)d->data;
+    options->preset_dict_size = d->len;
+    if (d->len + len < options->dict_size)
+        options->dict_size = d->len + len < LZMA_DICT_SIZE_MIN ? LZMA_DICT_SIZE_MIN : d->len + len;
+    filters[0].id = LZMA_FILTER_LZMA2;
+    filters[0].options = options;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+    filters[1].options = NULL;
+}
+
+static int bl_lzma_compress_dict(lua_State *L, const char *src, size_t src_len, t_z_dict *d, char **dst, size_t *dst_len)
+{
+    lzma_options_lzma options;
+    lzma_filter filters[2];
+    size_t lzma_dst_len = src_len + src_len/8 + 256;
+    size_t pos = sizeof(t_z_dict_header);
+    char *lzma_dst = (char*)malloc(lzma_dst_len + sizeof(t_z_dict_header));
+    lzma_ret ret;
+    bl_lzma_dict_filters(d, src_len, LZMA_LEVEL, &options, filters);
+    ret = lzma_raw_buffer_encode(filters, NULL, (const uint8_t*)src, src_len, (uint8_t*)lzma_dst, &pos, lzma_dst_len + sizeof(t_z_dict_header));
+    if (ret != LZMA_OK)
+    {
+        free(lzma_dst);
+        return bl_z_error(L, "lzma: lzma_raw_buffer_encode failed (error: %d)", ret);
+    }
+    ((t_z_dict_header*)lzma_dst)->sig = LZMA_DICT_SIG;
+    ((t_z_dict_header*)lzma_dst)->len = src_len;
+    ((t_z_dict_header*)lzma_dst)->dict_id = d->id;
+    *dst = lzma_dst;
+    *dst_len = pos;
+    return 0;
+}
+
+static int bl_lzma_decompress_dict(lua_State *L, const char *src, size_t src_len, t_z_dict *d, char **dst, size_t *dst_len)
+{
+    size_t len = ((t_z_dict_header*)src)->len;
+    lzma_options_lzma options;
+    lzma_filter filters[2];
+    size_t in_pos = sizeof(t_z_dict_header);
+    size_t out_pos = 0;
+    lzma_ret ret;
+    bl_lzma_dict_filters(d, len, 9, &options, filters);  /* large enough for all the levels */
+    *dst = (char*)malloc(len + 1);
+    ret = lzma_raw_buffer_decode(filters, NULL, (const uint8_t*)src, &in_pos, src_len, (uint8_t*)*dst, &out_pos, len);
+    if (ret != LZMA_OK || out_pos != len)
+    {
+        free(*dst);
+        return bl_z_error(L, "lzma: lzma_raw_buffer_decode failed (error: %d)", ret);
+    }
+    *dst_len = len;
+    return 0;
+}
+
+static int bl_lzma_compress_opt(lua_State *L)
+{
+    size_t src_len;
+    const char *src = bl_z_checkdata(L, 1, &src_len);
+    int threads = bl_z_threads(L, 2);
+    t_z_dict tmp;
+    t_z_dict *d = bl_z_dict_option(L, 2, &tmp);
+    int into = bl_z_into(L, 2);
+    char *dst;
+    size_t dst_len;
+    int n;
+    if (d && src_len <= BL_Z_BLOCK_MAX)
+        n = bl_lzma_compress_dict(L, src, src_len, d, &dst, &dst_len);
+    else if (src_len > BL_Z_BLOCK_MAX)
+        n = bl_z_frame_compress(L, src, src_len, BL_Z_FRAME_CHUNK, 1, threads, bl_lzma_compress_core, &dst, &dst_len);
+    else if (threads > 0)
+        n = bl_lzma_compress_mt(L, src, src_len, threads, &dst, &dst_len);
+    else
+        n = bl_lzma_compress_core(L, src, src_len, &dst, &dst_len);
+    return bl_z_result(L, into, n, dst, dst_len);
+}
+
+static int bl_lzma_decompress_opt(lua_State *L)
+{
+    return bl_z_decompress_with(L, "lzma", bl_lzma_decompress_core, LZMA_DICT_SIG);
+}
+
+/* lzma contexts reinitialize their encoder and decoder on the same lzma_stream,
+ * XZ Utils then keeps the buffers and only clears the match finder tables.
+ * The size of the LZMA2 dictionary is the size of the data (and of the dictionary)
+ * rounded up to a power of two: the tables to clear are smaller for small strings
+ * and are kept for strings of similar sizes.
+ */
+
+#define BL_LZMA_CONTEXT_ROOM    (4*1024)
+
+static int bl_lzma_context_compress(lua_State *L, t_z_context *c, const char *src, size_t src_len, size_t *dst_len)
+{
+    lzma_stream *strm = &c->u.lzma.encoder;
+    size_t header = c->dict ? sizeof(t_z_dict_header) : sizeof(t_z_header);
+    size_t bound = src_len + src_len/8 + 256;
+    char *lzma_dst = bl_z_context_reserve(c, header + bound);
+    lzma_ret ret;
+    if (!lzma_dst) return bl_z_error(L, "%s: not enough memory", c->name);
+    if (c->dict)
+    {
+        lzma_options_lzma options;
+        lzma_filter filters[2];
+        size_t room = BL_LZMA_CONTEXT_ROOM;
+        while (room < src_len) room *= 2;
+        bl_lzma_dict_filters(c->dict, room, c->level, &options, filters);
+        ret = lzma_raw_encoder(strm, filters);
+    }
+    else
+    {
+        lzma_options_lzma options;
+        lzma_filter filters[2];
+        lzma_lzma_preset(&options, c->level | (LZMA_EXTREME ? LZMA_PRESET_EXTREME : 0));
+        if (src_len < options.dict_size)
+        {
+            uint32_t dict_size = BL_LZMA_CONTEXT_ROOM;
+            while (dict_size < src_len) dict_size *= 2;
+            if (dict_size < options.dict_size) options.dict_size = dict_size;
+        }
+        filters[0].id = LZMA_FILTER_LZMA2;
+        filters[0].options = &options;
+        filters[1].id = LZMA_VLI_UNKNOWN;
+        filters[1].options = NULL;
+        ret = lzma_stream_encoder(strm, filters, LZMA_CHECK);
+    }
+    if (ret != LZMA_OK) return bl_z_error(L, "lzma: encoder initialization failed (error: %d)", ret);
+    strm->next_in = (const uint8_t*)src;
+    strm->avail_in = src_len;
+    strm->next_out = (uint8_t*)lzma_dst + header;
+    strm->avail_out = bound;
+    ret = lzma_code(strm, LZMA_FINISH);
+    if (ret != LZMA_STREAM_END) return bl_z_error(L, "lzma: lzma_code failed (error: %d)", ret);
+    if (c->dict)
+    {
+        ((t_z_dict_header*)lzma_dst)->sig = LZMA_DICT_SIG;
+        ((t_z_dict_header*)lzma_dst)->dict_id = c->dict->id;
+    }
+    else
+        ((t_z_header*)lzma_dst)->sig = LZMA_SIG;
+    ((t_z_header*)lzma_dst)->len = src_len;
+    *dst_len = header + bound - strm->avail_out;
+    return 0;
+}
+
+static int bl_lzma_context_decompress(lua_State *L, t_z_context *c, const char *src, size_t src_len, size_t *dst_len)
+{
+    lzma_stream *strm = &c->u.lzma.decoder;
+    uint32_t sig = ((t_z_header*)src)->sig;
+    size_t len = ((t_z_header*)src)->len;
+    size_t header;
+    lzma_ret ret;
+    if (sig == LZMA_SIG)
+    {
+        header = sizeof(t_z_header);
+        ret = lzma_stream_decoder(strm, UINT64_MAX, LZMA_TELL_UNSUPPORTED_CHECK | LZMA_CONCATENATED);
+    }
+    else if (sig == LZMA_DICT_SIG)
+    {
+        lzma_options_lzma options;
+        lzma_filter filters[2];
+        header = sizeof(t_z_dict_header);
+        bl_lzma_dict_filters(c->dict, len, 9, &options, filters);
+        ret = lzma_raw_decoder(strm, filters);
+    }
+    else
+        return -1;
+    if (ret != LZMA_OK) return bl_z_error(L, "lzma: decoder initialization failed (error: %d)", ret);
+    strm->next_in = (const uint8_t*)src + header;
+    strm->avail_in = src_len - header;
+    strm->next_out = (uint8_t*)bl_z_context_reserve(c, len + 1);
+    if (!strm->next_out) return bl_z_error(L, "%s: not enough memory", c->name);
+    strm->avail_out = len;
+    ret = lzma_code(strm, LZMA_FINISH);
+    if (ret != LZMA_STREAM_END || strm->total_out != len) return bl_z_error(L, "lzma: lzma_code failed (error: %d)", ret);
+    *dst_len = len;
+    return 0;
+}
+
+static void bl_lzma_context_end(t_z_context *c)
+{
+    lzma_end(&c->u.lzma.encoder);
+    lzma_end(&c->u.lzma.decoder);
+}
+
+static int bl_lzma_context(lua_State *L)
+{
+    t_z_context *c = bl_z_context_new(L, "lzma", LZMA_DICT_SIG, LZMA_LEVEL, 0, 9, bl_lzma_compress_core, bl_lzma_decompress_core);
+    lzma_stream init = LZMA_STREAM_INIT;
+    c->u.lzma.encoder = init;
+    c->u.lzma.decoder = init;
+    c->compress = bl_lzma_context_compress;
+    c->decompress = bl_lzma_context_decompress;
+    c->end = bl_lzma_context_end;
+    return 1;
+}
 
-int bl_lz4_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+static const luaL_Reg lzmalib_ext[] =
 {
-    int lz4_max_dst_len = LZ4_COMPRESSBOUND(src_len);
-    char *lz4_dst = (char*)malloc(lz4_max_dst_len + sizeof(t_z_header));
-    int lz4_dst_len = LZ4_compress_default((char*)src, lz4_dst+sizeof(t_z_header), src_len, lz4_max_dst_len);
-    ((t_z_header*)lz4_dst)->sig = LZ4_SIG;
-    ((t_z_header*)lz4_dst)->len = src_len;
-    *dst = lz4_dst;
-    *dst_len = lz4_dst_len;
-    *dst_len += sizeof(t_z_header);
-    return 0;
+    {"compress", bl_lzma_compress_opt},
+    {"decompress", bl_lzma_decompress_opt},
+    {"context", bl_lzma_context},
+    {NULL, NULL}
+};
+
+LUAMOD_API int luaopen_lzma(lua_State *L)
+{
+    luaL_newlib(L, lzmalib);
+    luaL_setfuncs(L, lzmalib_ext, 0);
+    return 1;
 }
+#endif
 
-int bl_lz4hc_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+#ifdef USE_ZSTD
+
+/* zstd strings are a t_z_header (or a t_z_dict_header) followed by a zstd frame.
+ * The parameters are given by the options of zstd.compress, zstd.stream and zstd.context:
+ *      level: compression level (negative levels are faster, default: ZSTD_LEVEL)
+ *      long: long distance matching (window of 2^ZSTD_LONG_WINDOW bytes)
+ *      threads: number of worker threads of libzstd (ignored if libzstd is not multithreaded)
+ * Dictionaries are raw content prefixes (ZSTD_CCtx_refPrefix), the frames
+ * can be decompressed by any zstd decoder given the same prefix.
+ */
+
+#define ZSTD_LONG_WINDOW 27     /* largest window accepted by the decoders without option */
+
+typedef struct
 {
-    int lz4_max_dst_len = LZ4_COMPRESSBOUND(src_len);
-    char *lz4_dst = (char*)malloc(lz4_max_dst_len + sizeof(t_z_header));
-    int lz4_dst_len = LZ4_compress_HC((char*)src, lz4_dst+sizeof(t_z_header), src_len, lz4_max_dst_len, 9);
-    ((t_z_header*)lz4_dst)->sig = LZ4_SIG;
-    ((t_z_header*)lz4_dst)->len = src_len;
-    *dst = lz4_dst;
-    *dst_len = lz4_dst_len;
-    *dst_len += sizeof(t_z_header);
-    return 0;
+    int level;
+    int long_mode;
+    int threads;
+} t_zstd_params;
+
+static void bl_zstd_options(lua_State *L, int options, t_zstd_params *p)
+{
+    p->level = ZSTD_LEVEL;
+    p->long_mode = 0;
+    p->threads = bl_z_threads(L, options);
+    if (lua_isnoneornil(L, options)) return;
+    lua_getfield(L, options, "level");
+    if (!lua_isnil(L, -1))
+    {
+        lua_Integer n = luaL_checkinteger(L, -1);
+        if (n < ZSTD_minCLevel() || n > ZSTD_maxCLevel()) luaL_argerror(L, options, "invalid level");
+        p->level = (int)n;
+    }
+    lua_getfield(L, options, "long");
+    p->long_mode = lua_toboolean(L, -1);
+    lua_pop(L, 2);
 }
 
-int bl_lz4_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+static size_t bl_zstd_params(ZSTD_CCtx *cctx, const t_zstd_params *p)
 {
-    if (((t_z_header*)src)->sig == LZ4_SIG)
+    size_t r = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, p->level);
+    if (!ZSTD_isError(r) && p->long_mode)
     {
-        *dst_len = ((t_z_header*)src)->len + 3;
-        *dst = (char*)malloc(*dst_len);
-        int r = LZ4_decompress_safe((char*)(src+sizeof(t_z_header)), *dst, src_len-sizeof(t_z_header), *dst_len);
-        if (r < 0)
-        {
-            free(dst);
-            lua_pushnil(L);
-            lua_pushfstring(L, "lz4: LZ4_decompress_safe (error: %d)", *dst_len);
-            return 2;
-        }
-        *dst_len = r;
-        return 0;
+        r = ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+        if (!ZSTD_isError(r)) r = ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, ZSTD_LONG_WINDOW);
     }
-    return -1;
+    /* a single threaded libzstd rejects nbWorkers and compresses in the calling thread */
+    if (!ZSTD_isError(r) && p->threads > 0) ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, p->threads);
+    return r;
 }
 
-#define bl_lz4hc_decompress_core bl_lz4_decompress_core
+static void bl_zstd_header(char *zstd_dst, const t_z_dict *d, size_t len)
+{
+    if (d)
+    {
+        ((t_z_dict_header*)zstd_dst)->sig = ZSTD_DICT_SIG;
+        ((t_z_dict_header*)zstd_dst)->dict_id = d->id;
+    }
+    else
+        ((t_z_header*)zstd_dst)->sig = ZSTD_SIG;
+    ((t_z_header*)zstd_dst)->len = len;
+}
 
-COMPRESSOR(lz4)
-COMPRESSOR(lz4hc)
+/* bl_zstd_compress_frame compresses src after a header in dst (bound bytes after the header) */
+static size_t bl_zstd_compress_frame(ZSTD_CCtx *cctx, const t_z_dict *d, const char *src, size_t src_len, char *zstd_dst, size_t bound)
+{
+    size_t header = d ? sizeof(t_z_dict_header) : sizeof(t_z_header);
+    size_t r = d ? ZSTD_CCtx_refPrefix(cctx, d->data, d->len) : 0;
+    if (!ZSTD_isError(r)) r = ZSTD_compress2(cctx, zstd_dst + header, bound, src, src_len);
+    if (!ZSTD_isError(r)) bl_zstd_header(zstd_dst, d, src_len);
+    return r;
+}
 
-LUAMOD_API int luaopen_lz4 (lua_State *L)
+static int bl_zstd_compress_with(lua_State *L, const t_zstd_params *p, const t_z_dict *d, const char *src, size_t src_len, char **dst, size_t *dst_len)
 {
-    luaL_newlib(L, lz4lib);
-    return 1;
+    size_t header = d ? sizeof(t_z_dict_header) : sizeof(t_z_header);
+    size_t bound = ZSTD_compressBound(src_len);
+    char *zstd_dst = (char*)malloc(header + bound);
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    size_t r;
+    if (!zstd_dst || !cctx)
+    {
+        free(zstd_dst);
+        ZSTD_freeCCtx(cctx);
+        return bl_z_error(L, "zstd: not enough memory");
+    }
+    r = bl_zstd_params(cctx, p);
+    if (!ZSTD_isError(r)) r = bl_zstd_compress_frame(cctx, d, src, src_len, zstd_dst, bound);
+    ZSTD_freeCCtx(cctx);
+    if (ZSTD_isError(r))
+    {
+        free(zstd_dst);
+        return bl_z_error(L, "zstd: compression failed (%s)", ZSTD_getErrorName(r));
+    }
+    *dst = zstd_dst;
+    *dst_len = header + r;
+    return 0;
 }
 
-LUAMOD_API int luaopen_lz4hc (lua_State *L)
+int bl_zstd_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
 {
-    luaL_newlib(L, lz4hclib);
-    return 1;
+    t_zstd_params p = {ZSTD_LEVEL, 0, 0};
+    return bl_zstd_compress_with(L, &p, NULL, src, src_len, dst, dst_len);
 }
 
-#endif
+/* the default level of zstd is a z candidate of the balanced mode:
+ * it is much faster than ZSTD_LEVEL and close to zlib in ratio
+ */
+static int bl_zstd_fast_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    t_zstd_params p = {ZSTD_CLEVEL_DEFAULT, 0, 0};
+    return bl_zstd_compress_with(L, &p, NULL, src, src_len, dst, dst_len);
+}
 
-#ifdef USE_LZF
+/* bl_zstd_decompress_frame decompresses the frame after the header of src in len bytes of dst */
+static int bl_zstd_decompress_frame(lua_State *L, ZSTD_DCtx *dctx, const t_z_dict *d, const char *src, size_t src_len, char *zstd_dst, size_t len)
+{
+    size_t header = d ? sizeof(t_z_dict_header) : sizeof(t_z_header);
+    size_t r;
+    if (src_len < header) return bl_z_error(L, "zstd: corrupted string");
+    r = d ? ZSTD_DCtx_refPrefix(dctx, d->data, d->len) : 0;
+    /* the window of long distance matching frames is accepted */
+    if (!ZSTD_isError(r)) r = ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, ZSTD_LONG_WINDOW);
+    if (!ZSTD_isError(r)) r = ZSTD_decompressDCtx(dctx, zstd_dst, len, src + header, src_len - header);
+    if (ZSTD_isError(r)) return bl_z_error(L, "zstd: decompression failed (%s)", ZSTD_getErrorName(r));
+    if (r != len) return bl_z_error(L, "zstd: bad decompressed length");
+    return 0;
+}
 
-int bl_lzf_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+static int bl_zstd_decompress_with(lua_State *L, const t_z_dict *d, const char *src, size_t src_len, char **dst, size_t *dst_len)
 {
-    char *lzf_dst;
-    unsigned int lzf_dst_len;
-    if (src_len == 0)
+    size_t len = ((t_z_header*)src)->len;
+    char *zstd_dst = (char*)malloc(len + 1);
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    int n;
+    if (!zstd_dst || !dctx)
     {
-        /* specific case for the empty string (the decompressor crashes on empty strings) */
-        lzf_dst = (char*)malloc(sizeof(t_z_header));
-        lzf_dst_len = 0;
+        free(zstd_dst);
+        ZSTD_freeDCtx(dctx);
+        return bl_z_error(L, "zstd: not enough memory");
     }
-    else
+    n = bl_zstd_decompress_frame(L, dctx, d, src, src_len, zstd_dst, len);
+    ZSTD_freeDCtx(dctx);
+    if (n)
     {
-        lzf_dst = (char*)malloc(src_len+src_len/16+16 + sizeof(t_z_header));
-        lzf_dst_len = lzf_compress((char*)src, src_len, lzf_dst+sizeof(t_z_header), src_len+src_len/16+16);
+        free(zstd_dst);
+        return n;
     }
-    ((t_z_header*)lzf_dst)->sig = LZF_SIG;
-    ((t_z_header*)lzf_dst)->len = src_len;
-    *dst = lzf_dst;
-    *dst_len = lzf_dst_len;
-    *dst_len += sizeof(t_z_header);
+    *dst = zstd_dst;
+    *dst_len = len;
     return 0;
 }
 
-int bl_lzf_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+int bl_zstd_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
 {
-    if (((t_z_header*)src)->sig == LZF_SIG)
+    if (src_len < sizeof(t_z_header) || ((t_z_header*)src)->sig != ZSTD_SIG) return -1;
+    return bl_zstd_decompress_with(L, NULL, src, src_len, dst, dst_len);
+}
+
+static int bl_zstd_compress_dict(lua_State *L, const char *src, size_t src_len, t_z_dict *d, char **dst, size_t *dst_len)
+{
+    t_zstd_params p = {ZSTD_LEVEL, 0, 0};
+    return bl_zstd_compress_with(L, &p, d, src, src_len, dst, dst_len);
+}
+
+static int bl_zstd_decompress_dict(lua_State *L, const char *src, size_t src_len, t_z_dict *d, char **dst, size_t *dst_len)
+{
+    return bl_zstd_decompress_with(L, d, src, src_len, dst, dst_len);
+}
+
+/* zstd streams produce and accept standard zstd frames (as the zstd command line tool).
+ * Concatenated frames are decompressed as a single stream.
+ */
+static const char *bl_zstd_stream_code(t_z_stream *s, const char *src, size_t src_len, int finish, luaL_Buffer *out)
+{
+    ZSTD_inBuffer in;
+    in.src = src;
+    in.size = src_len;
+    in.pos = 0;
+    for (;;)
     {
-        if (((t_z_header*)src)->len == 0)
+        ZSTD_outBuffer o;
+        size_t r;
+        o.dst = luaL_prepbuffsize(out, BL_Z_STREAM_OUT);
+        o.size = BL_Z_STREAM_OUT;
+        o.pos = 0;
+        if (s->compress)
         {
-            /* specific case for the empty string (the decompressor crashes on empty strings) */
-            *dst_len = 0;
-            *dst = NULL;
+            r = ZSTD_compressStream2(s->u.zstd.cctx, &o, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+            luaL_addsize(out, o.pos);
+            if (ZSTD_isError(r)) return bl_z_stream_error(s, "ZSTD_compressStream2 failed", (int)ZSTD_getErrorCode(r));
+            if (finish && r == 0)
+            {
+                s->eos = 1;
+                break;
+            }
         }
         else
         {
-            *dst_len = ((t_z_header*)src)->len+16;
-            *dst = (char*)malloc(*dst_len);
-            unsigned int r = lzf_decompress((char*)(src+sizeof(t_z_header)), src_len-sizeof(t_z_header), *dst, *dst_len);
+            if (s->eos)
+            {
+                if (in.pos == in.size) break;
+                s->eos = 0;     /* next frame */
+            }
+            r = ZSTD_decompressStream(s->u.zstd.dctx, &o, &in);
+            luaL_addsize(out, o.pos);
+            if (ZSTD_isError(r)) return bl_z_stream_error(s, "ZSTD_decompressStream failed", (int)ZSTD_getErrorCode(r));
             if (r == 0)
             {
-                free(dst);
-                lua_pushnil(L);
-                lua_pushfstring(L, "lzf: lzf_decompress");
-                return 2;
+                s->eos = 1;     /* end of a frame */
+                continue;
             }
-            *dst_len = r;
         }
-        return 0;
+        if (!finish && in.pos == in.size && o.pos < o.size) break;
+        if (finish && !s->compress && in.pos == in.size && o.pos < o.size) return "truncated stream";
     }
-    return -1;
+    return NULL;
 }
 
-COMPRESSOR(lzf)
+static const char *bl_zstd_stream_flush(t_z_stream *s, luaL_Buffer *out)
+{
+    ZSTD_inBuffer in;
+    size_t r;
+    in.src = "";
+    in.size = 0;
+    in.pos = 0;
+    do
+    {
+        ZSTD_outBuffer o;
+        o.dst = luaL_prepbuffsize(out, BL_Z_STREAM_OUT);
+        o.size = BL_Z_STREAM_OUT;
+        o.pos = 0;
+        r = ZSTD_compressStream2(s->u.zstd.cctx, &o, &in, ZSTD_e_flush);
+        luaL_addsize(out, o.pos);
+        if (ZSTD_isError(r)) return bl_z_stream_error(s, "ZSTD_compressStream2 failed", (int)ZSTD_getErrorCode(r));
+    } while (r != 0);
+    return NULL;
+}
 
-LUAMOD_API int luaopen_lzf (lua_State *L)
+static void bl_zstd_stream_end(t_z_stream *s)
 {
-    luaL_newlib(L, lzflib);
+    ZSTD_freeCCtx(s->u.zstd.cctx);
+    ZSTD_freeDCtx(s->u.zstd.dctx);
+}
+
+static int bl_zstd_stream(lua_State *L)
+{
+    t_zstd_params p;
+    t_z_stream *s;
+    size_t r;
+    bl_zstd_options(L, 2, &p);
+    s = bl_z_stream_new(L, "zstd");
+    if (s->compress)
+    {
+        s->u.zstd.cctx = ZSTD_createCCtx();
+        r = s->u.zstd.cctx ? bl_zstd_params(s->u.zstd.cctx, &p) : (size_t)-ZSTD_error_memory_allocation;
+    }
+    else
+    {
+        s->u.zstd.dctx = ZSTD_createDCtx();
+        r = s->u.zstd.dctx ? ZSTD_DCtx_setParameter(s->u.zstd.dctx, ZSTD_d_windowLogMax, ZSTD_LONG_WINDOW) : (size_t)-ZSTD_error_memory_allocation;
+    }
+    if (ZSTD_isError(r))
+    {
+        bl_zstd_stream_end(s);
+        return bl_z_error(L, "zstd: stream initialization failed (%s)", ZSTD_getErrorName(r));
+    }
+    s->code = bl_zstd_stream_code;
+    s->flush = bl_zstd_stream_flush;
+    s->end = bl_zstd_stream_end;
+    s->closed = 0;
     return 1;
 }
 
-#endif
+COMPRESSOR(zstd)
 
-#ifdef USE_ZLIB
+/* frame chunks compressed with the options of zstd.compress */
+typedef struct
+{
+    t_zstd_params p;
+    const t_z_dict *d;
+} t_zstd_chunk;
 
-int bl_zlib_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+static int bl_zstd_compress_chunk(void *ctx, const char *src, size_t src_len, char **dst, size_t *dst_len)
 {
-    uLongf zlib_dst_len = src_len + src_len/10 + 12;
-    Bytef *zlib_dst = (char*)malloc(zlib_dst_len + sizeof(t_z_header));
-    int r = compress2(zlib_dst+sizeof(t_z_header), &zlib_dst_len, src, src_len, ZLIB_LEVEL);
-    if (r != Z_OK)
+    t_zstd_chunk *c = (t_zstd_chunk*)ctx;
+    return bl_zstd_compress_with(NULL, &c->p, c->d, src, src_len, dst, dst_len);
+}
+
+static int bl_zstd_compress_opt(lua_State *L)
+{
+    size_t src_len;
+    const char *src = bl_z_checkdata(L, 1, &src_len);
+    t_zstd_params p;
+    t_z_dict tmp;
+    t_z_dict *d = bl_z_dict_option(L, 2, &tmp);
+    int into = bl_z_into(L, 2);
+    char *dst;
+    size_t dst_len;
+    int n;
+    bl_zstd_options(L, 2, &p);
+    if (src_len > BL_Z_BLOCK_MAX)
     {
-        free(zlib_dst);
-        lua_pushnil(L);
-        lua_pushfstring(L, "zlib: compress2 failed (error: %d)", r);
-        return 2;
+        /* the chunks are compressed in parallel with the same options */
+        t_zstd_chunk chunk;
+        chunk.p = p;
+        chunk.p.threads = 0;
+        chunk.d = d;
+        n = bl_z_frame_compress_with(L, src, src_len, BL_Z_FRAME_CHUNK, 1, p.threads, bl_zstd_compress_chunk, &chunk, &dst, &dst_len);
     }
-    ((t_z_header*)zlib_dst)->sig = ZLIB_SIG;
-    ((t_z_header*)zlib_dst)->len = src_len;
-    *dst = zlib_dst;
-    *dst_len = zlib_dst_len;
-    *dst_len += sizeof(t_z_header);
+    else
+        n = bl_zstd_compress_with(L, &p, d, src, src_len, &dst, &dst_len);
+    return bl_z_result(L, into, n, dst, dst_len);
+}
+
+static int bl_zstd_decompress_opt(lua_State *L)
+{
+    return bl_z_decompress_with(L, "zstd", bl_zstd_decompress_core, ZSTD_DICT_SIG);
+}
+
+/* zstd contexts keep a ZSTD_CCtx and a ZSTD_DCtx: their parameters are set once
+ * and libzstd reuses their tables and buffers from one string to the next.
+ */
+
+static int bl_zstd_context_compress(lua_State *L, t_z_context *c, const char *src, size_t src_len, size_t *dst_len)
+{
+    size_t header = c->dict ? sizeof(t_z_dict_header) : sizeof(t_z_header);
+    size_t bound = ZSTD_compressBound(src_len);
+    char *zstd_dst = bl_z_context_reserve(c, header + bound);
+    size_t r;
+    if (!zstd_dst) return bl_z_error(L, "%s: not enough memory", c->name);
+    r = bl_zstd_compress_frame(c->u.zstd.cctx, c->dict, src, src_len, zstd_dst, bound);
+    if (ZSTD_isError(r)) return bl_z_error(L, "zstd: compression failed (%s)", ZSTD_getErrorName(r));
+    *dst_len = header + r;
     return 0;
 }
 
-int bl_zlib_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+static int bl_zstd_context_decompress(lua_State *L, t_z_context *c, const char *src, size_t src_len, size_t *dst_len)
 {
-    if (((t_z_header*)src)->sig == ZLIB_SIG)
-    {
-        *dst_len = ((t_z_header*)src)->len;
-        *dst = (char*)malloc(*dst_len);
-        int r = uncompress(*dst, (uLongf *)dst_len, (char*)(src+sizeof(t_z_header)), src_len-sizeof(t_z_header));
-        if (r != Z_OK)
-        {
-            free(*dst);
-            lua_pushnil(L);
-            lua_pushfstring(L, "z: uncompress failed (error: %d)", r);
-            return 2;
-        }
-        return 0;
-    }
-    return -1;
+    uint32_t sig = ((t_z_header*)src)->sig;
+    size_t len = ((t_z_header*)src)->len;
+    char *zstd_dst;
+    int n;
+    if (sig != ZSTD_SIG && sig != ZSTD_DICT_SIG) return -1;
+    zstd_dst = bl_z_context_reserve(c, len + 1);
+    if (!zstd_dst) return bl_z_error(L, "%s: not enough memory", c->name);
+    n = bl_zstd_decompress_frame(L, c->u.zstd.dctx, sig == ZSTD_DICT_SIG ? c->dict : NULL,
+                                 src, src_len, zstd_dst, len);
+    if (n) return n;
+    *dst_len = len;
+    return 0;
 }
 
-COMPRESSOR(zlib)
+static void bl_zstd_context_end(t_z_context *c)
+{
+    ZSTD_freeCCtx(c->u.zstd.cctx);
+    ZSTD_freeDCtx(c->u.zstd.dctx);
+}
 
-LUAMOD_API int luaopen_zlib (lua_State *L)
+static int bl_zstd_context(lua_State *L)
 {
-    luaL_newlib(L, zliblib);
+    t_zstd_params p;
+    t_z_context *c;
+    size_t r;
+    bl_zstd_options(L, 1, &p);
+    c = bl_z_context_new(L, "zstd", ZSTD_DICT_SIG, ZSTD_LEVEL, ZSTD_minCLevel(), ZSTD_maxCLevel(), bl_zstd_compress_core, bl_zstd_decompress_core);
+    c->u.zstd.cctx = ZSTD_createCCtx();
+    c->u.zstd.dctx = ZSTD_createDCtx();
+    c->end = bl_zstd_context_end;
+    if (!c->u.zstd.cctx || !c->u.zstd.dctx) return bl_z_error(L, "zstd: not enough memory");
+    r = bl_zstd_params(c->u.zstd.cctx, &p);
+    if (ZSTD_isError(r)) return bl_z_error(L, "zstd: context initialization failed (%s)", ZSTD_getErrorName(r));
+    c->compress = bl_zstd_context_compress;
+    c->decompress = bl_zstd_context_decompress;
     return 1;
 }
 
-#endif
+static const luaL_Reg zstdlib_ext[] =
+{
+    {"compress", bl_zstd_compress_opt},
+    {"decompress", bl_zstd_decompress_opt},
+    {"context", bl_zstd_context},
+    {NULL, NULL}
+};
 
-#ifdef USE_LZMA
+LUAMOD_API int luaopen_zstd(lua_State *L)
+{
+    luaL_newlib(L, zstdlib);
+    luaL_setfuncs(L, zstdlib_ext, 0);
+    return 1;
+}
+#endif
 
-#define LZMA_EXTREME 0
-#define LZMA_CHECK LZMA_CHECK_CRC64
+/* Data that can not be compressed (e.g. already compressed data)
+ * is stored as is after a header so that z.decompress accepts it.
+ */
 
-int bl_lzma_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+int bl_store_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
 {
-    uint32_t preset = LZMA_LEVEL | (LZMA_EXTREME ? LZMA_PRESET_EXTREME : 0);
-    lzma_check check = LZMA_CHECK;
-    lzma_stream strm = LZMA_STREAM_INIT;
-    size_t lzma_dst_len = src_len + src_len/8 + 256;
-    uint8_t *lzma_dst = (uint8_t*)malloc(lzma_dst_len + sizeof(t_z_header));
-    int out_finished = 0;
-    lzma_action action;
-    lzma_ret ret;
-    ret = lzma_easy_encoder(&strm, preset, check);
-    if (ret != LZMA_OK)
-    {
-        free(lzma_dst);
-        lua_pushnil(L);
-        lua_pushfstring(L, "lzma: lzma_easy_encoder failed (error: %d)", ret);
-        return 2;
-    }
-    strm.next_in = src;
-    strm.avail_in = src_len;
-    action = LZMA_FINISH;
-    strm.next_out = lzma_dst + sizeof(t_z_header);
-    strm.avail_out = lzma_dst_len;
-    ret = lzma_code(&strm, action);
-    if (ret != LZMA_STREAM_END)
-    {
-        free(lzma_dst);
-        lua_pushnil(L);
-        lua_pushfstring(L, "lzma: lzma_code failed (error: %d)", ret);
-        return 2;
-    }
-    lzma_dst_len -= strm.avail_out;
-    ((t_z_header*)lzma_dst)->sig = LZMA_SIG;
-    ((t_z_header*)lzma_dst)->len = src_len;
-    *dst = lzma_dst;
-    *dst_len = lzma_dst_len;
-    *dst_len += sizeof(t_z_header);
-    lzma_end(&strm);
+    char *store_dst = (char*)malloc(src_len + sizeof(t_z_header));
+    ((t_z_header*)store_dst)->sig = STORE_SIG;
+    ((t_z_header*)store_dst)->len = src_len;
+    memcpy(store_dst+sizeof(t_z_header), src, src_len);
+    *dst = store_dst;
+    *dst_len = src_len + sizeof(t_z_header);
     return 0;
 }
 
-int bl_lzma_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+int bl_store_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
 {
-    if (((t_z_header*)src)->sig == LZMA_SIG)
+    if (src_len >= sizeof(t_z_header) && ((t_z_header*)src)->sig == STORE_SIG)
     {
-        lzma_stream strm = LZMA_STREAM_INIT;
-        const uint32_t flags = LZMA_TELL_UNSUPPORTED_CHECK | LZMA_CONCATENATED;
-        const uint64_t memory_limit = UINT64_MAX;
-        *dst_len = ((t_z_header*)src)->len;
-        *dst = (uint8_t*)malloc(*dst_len);
-        lzma_action action;
-        lzma_ret ret;
-        ret = lzma_stream_decoder(&strm, memory_limit, flags);
-        if (ret != LZMA_OK)
-        {
-            free(*dst);
-            lua_pushnil(L);
-            lua_pushfstring(L, "lzma: lzma_stream_decoder failed (error: %d)", ret);
-            return 2;
-        }
-        strm.next_in = src + sizeof(t_z_header);
-        strm.avail_in = src_len - sizeof(t_z_header);
-        action = LZMA_FINISH;
-        strm.next_out = *dst;
-        strm.avail_out = *dst_len;
-        ret = lzma_code(&strm, action);
-        if (ret != LZMA_STREAM_END)
+        if (((t_z_header*)src)->len != src_len - sizeof(t_z_header))
         {
-            free(*dst);
-            lua_pushnil(L);
-            lua_pushfstring(L, "lzma: lzma_code failed (error: %d)", ret);
-            return 2;
+            return bl_z_error(L, "z: bad stored string length");
         }
+        *dst_len = src_len - sizeof(t_z_header);
+        *dst = (char*)malloc(*dst_len + 1);
+        memcpy(*dst, src+sizeof(t_z_header), *dst_len);
         return 0;
     }
     return -1;
 }
 
-COMPRESSOR(lzma)
-
-LUAMOD_API int luaopen_lzma(lua_State *L)
+typedef struct
 {
-    luaL_newlib(L, lzmalib);
-    return 1;
-}
-#endif
+    const char *name;
+    t_z_compressor compress;
+    int fast;                   /* compressor tried by the fast mode */
+} t_z_codec;
 
-int bl_z_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+/* candidate compressors of z.compress */
+static const t_z_codec bl_z_codecs[] =
 {
-    char *smallest = NULL;
-    size_t smallest_len = (size_t)-1;
-    char *compressed;
-    size_t compressed_len;
-
-#define COMPRESS(LIB)                                                                   \
-{                                                                                       \
-    int r = bl_##LIB##_compress_core(L, src, src_len, &compressed, &compressed_len);    \
-    if (r > 0) return r;                                                                \
-    if (compressed_len < smallest_len)                                                  \
-    {                                                                                   \
-        if (smallest) free(smallest);                                                   \
-        smallest = compressed;                                                          \
-        smallest_len = compressed_len;                                                  \
-    }                                                                                   \
-}
-
 #ifdef USE_MINILZO
-    COMPRESS(minilzo)
+    {"minilzo", bl_minilzo_compress_core, 1},
 #endif
 #ifdef USE_LZO
-    COMPRESS(lzo)
+    {"lzo", bl_lzo_compress_core, 1},
 #endif
 #ifdef USE_QLZ
-    COMPRESS(qlz)
+    {"qlz", bl_qlz_compress_core, 1},
 #endif
 #ifdef USE_LZ4
-    COMPRESS(lz4)
-    COMPRESS(lz4hc)
+    {"lz4", bl_lz4_compress_core, 1},
+    {"lz4hc", bl_lz4hc_compress_core, 0},
 #endif
 #ifdef USE_LZF
-    COMPRESS(lzf)
+    {"lzf", bl_lzf_compress_core, 1},
 #endif
 #ifdef USE_ZLIB
-    COMPRESS(zlib)
+    {"zlib", bl_zlib_compress_core, 0},
 #endif
 #ifdef USE_UCL
-    COMPRESS(ucl)
+    {"ucl", bl_ucl_compress_core, 0},
 #endif
 #ifdef USE_LZMA
-    COMPRESS(lzma)
+    {"lzma", bl_lzma_compress_core, 0},
 #endif
+#ifdef USE_ZSTD
+    {"zstd", bl_zstd_compress_core, 0},
+    {"zstd:3", bl_zstd_fast_compress_core, 0},
+#endif
+    /* store is the last one (it is only useful for incompressible data) */
+    {"store", bl_store_compress_core, 1},
+    {NULL, NULL, 0}
+};
+
+#define BL_Z_NB_COMPRESSORS (sizeof(bl_z_codecs)/sizeof(t_z_codec) - 1)
+#define BL_Z_STORE          (BL_Z_NB_COMPRESSORS - 1)
+
+/* bl_z_compress_core runs all the compressors one after another
+ * and keeps the smallest result (see bl_z_compress_race for a parallel version)
+ */
+int bl_z_compress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    char *smallest = NULL;
+    size_t smallest_len = (size_t)-1;
+    char *compressed;
+    size_t compressed_len;
+    size_t i;
 
-#undef COMPRESS
+    for (i = 0; i < BL_Z_NB_COMPRESSORS; i++)
+    {
+        int r = bl_z_codecs[i].compress(L, src, src_len, &compressed, &compressed_len);
+        if (r > 0) return r;
+        if (compressed_len < smallest_len)
+        {
+            if (smallest) free(smallest);
+            smallest = compressed;
+            smallest_len = compressed_len;
+        }
+        else
+        {
+            free(compressed);
+        }
+    }
 
     if (smallest)
     {
@@ -1262,15 +4932,15 @@ int bl_z_compress_core(lua_State *L, const char *src, size_t src_len, char **dst
     }
     else
     {
-        lua_pushnil(L);
-        lua_pushstring(L, "z: can not compress");
-        return 2;
+        return bl_z_error(L, "z: can not compress");
     }
     return 0;
 }
 
 int bl_z_decompress_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
 {
+    int n = bl_z_frame_decompress(L, src, src_len, bl_z_decompress_core, dst, dst_len);
+    if (n >= 0) return n;
 
 #define DECOMPRESS(LIB)                                                 \
 {                                                                       \
@@ -1305,16 +4975,749 @@ int bl_z_decompress_core(lua_State *L, const char *src, size_t src_len, char **d
 #ifdef USE_LZMA
     DECOMPRESS(lzma)
 #endif
+#ifdef USE_ZSTD
+    DECOMPRESS(zstd)
+#endif
+    DECOMPRESS(store)
 
     return -1;
 #undef DECOMPRESS
 }
 
+BLOCK_STREAM(z)
 COMPRESSOR(z)
 
+#ifdef BL_THREADS
+
+/* bl_z_compress_race runs the compressors of z.compress concurrently
+ * (one thread per CPU) and keeps the smallest result.
+ * If budget > 0, the compressors still running after budget seconds
+ * are dropped (the first result is always waited for). Their threads
+ * are detached and the last one frees the race.
+ * The threads of all the races are limited to one per CPU: a new race
+ * waits for the threads of the previous races to finish their compressor.
+ */
+
+static pthread_mutex_t bl_z_race_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bl_z_race_free = PTHREAD_COND_INITIALIZER;
+static int bl_z_race_workers = 0;   /* running threads of all the races */
+
+static void bl_z_race_unreserve(int nb)
+{
+    pthread_mutex_lock(&bl_z_race_lock);
+    bl_z_race_workers -= nb;
+    pthread_cond_broadcast(&bl_z_race_free);
+    pthread_mutex_unlock(&bl_z_race_lock);
+}
+
+typedef struct
+{
+    const char *src;
+    size_t src_len;
+    char *src_copy;             /* copy of src when the race can be abandoned */
+    int next;                   /* next compressor to run */
+    int nb_done;
+    int nb_ok;
+    int refs;                   /* threads and caller using the race */
+    int abandoned;              /* the caller does not wait anymore */
+    char *dst[BL_Z_NB_COMPRESSORS+1];
+    size_t dst_len[BL_Z_NB_COMPRESSORS+1];
+    int status[BL_Z_NB_COMPRESSORS+1];
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+} t_z_race;
+
+static void bl_z_race_release(t_z_race *race)
+{
+    int last;
+    size_t i;
+    pthread_mutex_lock(&race->mutex);
+    last = --race->refs == 0;
+    pthread_mutex_unlock(&race->mutex);
+    if (!last) return;
+    for (i = 0; i < BL_Z_NB_COMPRESSORS; i++)
+        if (race->dst[i]) free(race->dst[i]);
+    if (race->src_copy) free(race->src_copy);
+    pthread_mutex_destroy(&race->mutex);
+    pthread_cond_destroy(&race->done);
+    free(race);
+}
+
+static void *bl_z_race_worker(void *arg)
+{
+    t_z_race *race = (t_z_race*)arg;
+    for (;;)
+    {
+        size_t i;
+        char *dst = NULL;
+        size_t dst_len = 0;
+        int status;
+        pthread_mutex_lock(&race->mutex);
+        i = race->abandoned ? BL_Z_NB_COMPRESSORS : (size_t)race->next++;
+        pthread_mutex_unlock(&race->mutex);
+        if (i >= BL_Z_NB_COMPRESSORS) break;
+        status = bl_z_codecs[i].compress(NULL, race->src, race->src_len, &dst, &dst_len);
+        pthread_mutex_lock(&race->mutex);
+        race->status[i] = status;
+        if (status == 0)
+        {
+            race->dst[i] = dst;
+            race->dst_len[i] = dst_len;
+            race->nb_ok++;
+        }
+        race->nb_done++;
+        pthread_cond_broadcast(&race->done);
+        pthread_mutex_unlock(&race->mutex);
+    }
+    bl_z_race_release(race);
+    bl_z_race_unreserve(1);
+    return NULL;
+}
+
+static int bl_z_compress_race(lua_State *L, const char *src, size_t src_len, double budget, char **dst, size_t *dst_len)
+{
+    t_z_race *race;
+    int nb_threads = bl_cpu_count();
+    int max_threads = nb_threads;
+    int started = 0;
+    int t;
+    size_t i, best;
+    struct timespec deadline;
+
+    if (nb_threads > (int)BL_Z_NB_COMPRESSORS) nb_threads = BL_Z_NB_COMPRESSORS;
+    if (budget <= 0 && nb_threads <= 1) return bl_z_compress_core(L, src, src_len, dst, dst_len);
+
+    /* wait for the threads abandoned by the previous races */
+    pthread_mutex_lock(&bl_z_race_lock);
+    while (bl_z_race_workers >= max_threads)
+        pthread_cond_wait(&bl_z_race_free, &bl_z_race_lock);
+    if (nb_threads > max_threads - bl_z_race_workers) nb_threads = max_threads - bl_z_race_workers;
+    bl_z_race_workers += nb_threads;
+    pthread_mutex_unlock(&bl_z_race_lock);
+
+    race = (t_z_race*)calloc(1, sizeof(t_z_race));
+    race->src = src;
+    race->src_len = src_len;
+    if (budget > 0)
+    {
+        /* the threads may run after src has been collected */
+        race->src_copy = (char*)malloc(src_len+1);
+        memcpy(race->src_copy, src, src_len);
+        race->src = race->src_copy;
+    }
+    race->refs = 1;
+    pthread_mutex_init(&race->mutex, NULL);
+    pthread_cond_init(&race->done, NULL);
+    for (t = 0; t < nb_threads; t++)
+    {
+        pthread_t thread;
+        pthread_mutex_lock(&race->mutex);
+        race->refs++;
+        pthread_mutex_unlock(&race->mutex);
+        if (pthread_create(&thread, NULL, bl_z_race_worker, race) != 0)
+        {
+            pthread_mutex_lock(&race->mutex);
+            race->refs--;
+            pthread_mutex_unlock(&race->mutex);
+            break;
+        }
+        pthread_detach(thread);
+        started++;
+    }
+    if (started < nb_threads) bl_z_race_unreserve(nb_threads - started);
+    if (started == 0)
+    {
+        bl_z_race_release(race);
+        return bl_z_compress_core(L, src, src_len, dst, dst_len);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)budget;
+    deadline.tv_nsec += (long)((budget - (double)(time_t)budget) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&race->mutex);
+    while (race->nb_done < (int)BL_Z_NB_COMPRESSORS)
+    {
+        if (budget > 0 && race->nb_ok > 0)
+        {
+            if (pthread_cond_timedwait(&race->done, &race->mutex, &deadline) == ETIMEDOUT) break;
+        }
+        else
+        {
+            pthread_cond_wait(&race->done, &race->mutex);
+        }
+    }
+    best = BL_Z_NB_COMPRESSORS;
+    for (i = 0; i < BL_Z_NB_COMPRESSORS; i++)
+        if (race->dst[i] && (best == BL_Z_NB_COMPRESSORS || race->dst_len[i] < race->dst_len[best]))
+            best = i;
+    if (best < BL_Z_NB_COMPRESSORS)
+    {
+        *dst = race->dst[best];
+        *dst_len = race->dst_len[best];
+        race->dst[best] = NULL;
+    }
+    race->abandoned = 1;
+    pthread_mutex_unlock(&race->mutex);
+    bl_z_race_release(race);
+
+    if (best == BL_Z_NB_COMPRESSORS) return bl_z_error(L, "z: can not compress");
+    return 0;
+}
+
+#else
+
+static int bl_z_compress_race(lua_State *L, const char *src, size_t src_len, double budget, char **dst, size_t *dst_len)
+{
+    (void)budget;
+    return bl_z_compress_core(L, src, src_len, dst, dst_len);
+}
+
+#endif
+
+/* The fast and balanced modes of z.compress only compress the data once
+ * with a compressor chosen on a sample of the data:
+ *      - data with a high entropy (already compressed) is stored
+ *      - the fast mode chooses the fast compressor giving the smallest sample
+ *      - the balanced mode chooses the fastest compressor giving a sample
+ *        less than 15% larger than the smallest one
+ * The sample is made of BL_Z_SAMPLES slices spread over the data.
+ */
+
+enum { BL_Z_MAX, BL_Z_BALANCED, BL_Z_FAST };
+
+#define BL_Z_SAMPLES        4
+#define BL_Z_SAMPLE_SIZE    (16*1024)
+#define BL_Z_MAX_ENTROPY    7.9     /* bits per byte */
+#define BL_Z_MIN_GAIN       0.98    /* samples must be at least 2% smaller */
+#define BL_Z_TOLERANCE      0.15    /* balanced mode: size tolerance */
+
+/* bl_z_entropy returns the Shannon entropy of buf (in bits per byte) */
+static double bl_z_entropy(const unsigned char *buf, size_t len)
+{
+    size_t count[256] = {0};
+    double h = 0.0;
+    size_t i;
+    if (len == 0) return 0.0;
+    for (i = 0; i < len; i++) count[buf[i]]++;
+    for (i = 0; i < 256; i++)
+    {
+        if (count[i])
+        {
+            double p = (double)count[i] / (double)len;
+            h -= p * log2(p);
+        }
+    }
+    return h;
+}
+
+static int bl_z_compress_sampled(lua_State *L, const char *src, size_t src_len, int mode, char **dst, size_t *dst_len)
+{
+    const char *sample = src;
+    size_t sample_len = src_len;
+    char *buffer = NULL;
+    char *trial[BL_Z_NB_COMPRESSORS+1] = {NULL};
+    size_t trial_len[BL_Z_NB_COMPRESSORS+1];
+    double trial_time[BL_Z_NB_COMPRESSORS+1];
+    size_t i, best = BL_Z_STORE, smallest = BL_Z_STORE;
+    int whole, r;
+
+    if (src_len > BL_Z_SAMPLES*BL_Z_SAMPLE_SIZE)
+    {
+        size_t step = (src_len - BL_Z_SAMPLE_SIZE) / (BL_Z_SAMPLES - 1);
+        buffer = (char*)malloc(BL_Z_SAMPLES*BL_Z_SAMPLE_SIZE);
+        for (i = 0; i < BL_Z_SAMPLES; i++)
+            memcpy(buffer + i*BL_Z_SAMPLE_SIZE, src + i*step, BL_Z_SAMPLE_SIZE);
+        sample = buffer;
+        sample_len = BL_Z_SAMPLES*BL_Z_SAMPLE_SIZE;
+    }
+    whole = sample == src;
+
+    if (bl_z_entropy((const unsigned char *)sample, sample_len) < BL_Z_MAX_ENTROPY)
+    {
+        int nb_fast = 0;
+        for (i = 0; i < BL_Z_STORE; i++) nb_fast += bl_z_codecs[i].fast;
+        for (i = 0; i < BL_Z_STORE; i++)
+        {
+            double t;
+            /* the fast mode tries all the compressors if none is fast */
+            if (mode == BL_Z_FAST && nb_fast > 0 && !bl_z_codecs[i].fast) continue;
+            t = bl_trace_now();
+            if (bl_z_codecs[i].compress(NULL, sample, sample_len, &trial[i], &trial_len[i]) != 0)
+            {
+                trial[i] = NULL;
+                continue;
+            }
+            trial_time[i] = bl_trace_now() - t;
+            if (smallest == BL_Z_STORE || trial_len[i] < trial_len[smallest]) smallest = i;
+        }
+        best = smallest;
+        if (mode == BL_Z_BALANCED && smallest != BL_Z_STORE)
+        {
+            for (i = 0; i < BL_Z_STORE; i++)
+                if (trial[i] && trial_len[i] <= (1.0+BL_Z_TOLERANCE)*trial_len[smallest] && trial_time[i] < trial_time[best])
+                    best = i;
+        }
+        if (best != BL_Z_STORE && trial_len[best] >= BL_Z_MIN_GAIN*sample_len) best = BL_Z_STORE;
+    }
+
+    if (whole && best != BL_Z_STORE)
+    {
+        /* the sample is the data */
+        *dst = trial[best];
+        *dst_len = trial_len[best];
+        trial[best] = NULL;
+        r = 0;
+    }
+    else
+    {
+        r = bl_z_codecs[best].compress(NULL, src, src_len, dst, dst_len);
+        if (r == 0 && best != BL_Z_STORE && *dst_len >= src_len + sizeof(t_z_header))
+        {
+            /* the sample was not representative */
+            free(*dst);
+            r = 1;
+        }
+        if (r != 0) r = bl_store_compress_core(NULL, src, src_len, dst, dst_len);
+    }
+    for (i = 0; i < BL_Z_STORE; i++) if (trial[i]) free(trial[i]);
+    if (buffer) free(buffer);
+    if (r != 0) return bl_z_error(L, "z: can not compress");
+    return 0;
+}
+
+/* Compression with dictionaries (see t_z_dict) */
+
+static int bl_z_dict_decompress(lua_State *L, const char *src, size_t src_len, t_z_dict *d, char **dst, size_t *dst_len)
+{
+    const t_z_dict_header *h = (const t_z_dict_header*)src;
+    if (h->dict_id != d->id) return bl_z_error(L, "z: wrong dictionary (id: %I instead of %I)", (lua_Integer)d->id, (lua_Integer)h->dict_id);
+    switch (h->sig)
+    {
+#ifdef USE_ZLIB
+        case ZLIB_DICT_SIG: return bl_zlib_decompress_dict(L, src, src_len, d, dst, dst_len);
+#endif
+#ifdef USE_LZ4
+        case LZ4_DICT_SIG:  return bl_lz4_decompress_dict(L, src, src_len, d, dst, dst_len);
+#endif
+#ifdef USE_LZMA
+        case LZMA_DICT_SIG: return bl_lzma_decompress_dict(L, src, src_len, d, dst, dst_len);
+#endif
+#ifdef USE_ZSTD
+        case ZSTD_DICT_SIG: return bl_zstd_decompress_dict(L, src, src_len, d, dst, dst_len);
+#endif
+    }
+    return bl_z_error(L, "z: compressor not available");
+}
+
+/* bl_z_compress_dict compresses src with the compressors supporting dictionaries
+ * (fast mode: LZ4, balanced mode: ZLIB and ZSTD, max mode: all of them).
+ */
+static int bl_z_compress_dict(lua_State *L, const char *src, size_t src_len, t_z_dict *d, int mode, char **dst, size_t *dst_len)
+{
+    char *best = NULL;
+    size_t best_len = 0;
+    int i;
+    for (i = 0; i < 5; i++)
+    {
+        char *compressed = NULL;
+        size_t compressed_len;
+        int r = -1;
+        switch (i)
+        {
+#ifdef USE_LZ4
+            case 0: if (mode != BL_Z_BALANCED) r = bl_lz4_compress_dict(NULL, src, src_len, d, 0, &compressed, &compressed_len); break;
+            case 1: if (mode == BL_Z_MAX) r = bl_lz4_compress_dict(NULL, src, src_len, d, 9, &compressed, &compressed_len); break;
+#endif
+#ifdef USE_ZLIB
+            case 2: if (mode != BL_Z_FAST || !best) r = bl_zlib_compress_dict(NULL, src, src_len, d, &compressed, &compressed_len); break;
+#endif
+#ifdef USE_LZMA
+            case 3: if (mode == BL_Z_MAX || !best) r = bl_lzma_compress_dict(NULL, src, src_len, d, &compressed, &compressed_len); break;
+#endif
+#ifdef USE_ZSTD
+            case 4: if (mode != BL_Z_FAST || !best) r = bl_zstd_compress_dict(NULL, src, src_len, d, &compressed, &compressed_len); break;
+#endif
+        }
+        if (r != 0) continue;
+        if (!best || compressed_len < best_len)
+        {
+            if (best) free(best);
+            best = compressed;
+            best_len = compressed_len;
+        }
+        else
+        {
+            free(compressed);
+        }
+    }
+    if (!best) return bl_z_error(L, "z: no compressor supports dictionaries");
+    *dst = best;
+    *dst_len = best_len;
+    return 0;
+}
+
+/* z.train_dictionary(samples [, size]) builds a dictionary (default size: 32 KB)
+ * made of the most frequent segments of the samples (as the COVER algorithm of zstd):
+ *      - the frequencies of the d-grams (8 bytes) of the samples are counted
+ *      - the samples are split in epochs (one per segment of the dictionary)
+ *      - the segment (k bytes) of each epoch containing the most frequent d-grams
+ *        is added to the dictionary and its d-grams are not counted anymore
+ * The best segments are at the end of the dictionary (closer to the data).
+ */
+
+#define BL_Z_DICT_SIZE      (32*1024)
+#define BL_Z_DICT_D         8
+#define BL_Z_DICT_K         256
+#define BL_Z_DICT_HASH_BITS 20
+
+typedef struct
+{
+    size_t offset;
+    uint64_t score;
+} t_z_segment;
+
+static uint32_t bl_z_dgram(const unsigned char *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return (uint32_t)((x * 0x9E3779B185EBCA87ULL) >> (64 - BL_Z_DICT_HASH_BITS));
+}
+
+static int bl_z_segment_cmp(const void *a, const void *b)
+{
+    const t_z_segment *sa = (const t_z_segment*)a;
+    const t_z_segment *sb = (const t_z_segment*)b;
+    if (sa->score != sb->score) return sa->score < sb->score ? -1 : 1;
+    return sa->offset < sb->offset ? -1 : sa->offset > sb->offset;
+}
+
+static int bl_z_train_dictionary(lua_State *L)
+{
+    size_t size, total = 0, i, nb_epochs, epoch_size, nb_segments = 0, dict_len = 0;
+    lua_Integer dict_size;
+    int n, k;
+    unsigned char *samples;
+    uint32_t *freqs;
+    t_z_segment *segments;
+    luaL_Buffer b;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    dict_size = luaL_optinteger(L, 2, BL_Z_DICT_SIZE);
+    luaL_argcheck(L, dict_size >= BL_Z_DICT_K, 2, "dictionary too small");
+    luaL_argcheck(L, dict_size <= BL_Z_BLOCK_MAX, 2, "dictionary too large");
+    size = (size_t)dict_size;
+    n = lua_rawlen(L, 1);
+    for (k = 1; k <= n; k++)
+    {
+        lua_rawgeti(L, 1, k);
+        size_t len;
+        if (!lua_isstring(L, -1)) return luaL_error(L, "z: bad sample #%d (string expected)", k);
+        lua_tolstring(L, -1, &len); /* numbers are copied as strings */
+        total += len;
+        lua_pop(L, 1);
+    }
+    if (total <= size)
+    {
+        /* the samples are the dictionary */
+        luaL_buffinit(L, &b);
+        for (k = 1; k <= n; k++)
+        {
+            lua_rawgeti(L, 1, k);
+            luaL_addvalue(&b);
+        }
+        luaL_pushresult(&b);
+        return 1;
+    }
+
+    /* the d-grams do not overlap two samples */
+    samples = (unsigned char *)malloc(total + BL_Z_DICT_D);
+    freqs = (uint32_t*)calloc(1 << BL_Z_DICT_HASH_BITS, sizeof(uint32_t));
+    if (!samples || !freqs)
+    {
+        free(samples);
+        free(freqs);
+        return luaL_error(L, "z: not enough memory");
+    }
+    total = 0;
+    for (k = 1; k <= n; k++)
+    {
+        size_t len;
+        const char *sample;
+        lua_rawgeti(L, 1, k);
+        sample = lua_tolstring(L, -1, &len);
+        memcpy(samples + total, sample, len);
+        for (i = 0; i + BL_Z_DICT_D <= len; i++) freqs[bl_z_dgram(samples + total + i)]++;
+        total += len;
+        lua_pop(L, 1);
+    }
+    memset(samples + total, 0, BL_Z_DICT_D);
+
+    nb_epochs = size / BL_Z_DICT_K;
+    epoch_size = total / nb_epochs;
+    if (epoch_size < BL_Z_DICT_K)
+    {
+        epoch_size = BL_Z_DICT_K;
+        nb_epochs = total / epoch_size;
+    }
+    segments = (t_z_segment*)malloc(nb_epochs * sizeof(t_z_segment));
+    if (!segments)
+    {
+        free(samples);
+        free(freqs);
+        return luaL_error(L, "z: not enough memory");
+    }
+    for (i = 0; i < nb_epochs; i++)
+    {
+        size_t start = i * epoch_size;
+        size_t end = start + epoch_size - BL_Z_DICT_K;
+        size_t j, best = start;
+        uint64_t score = 0, best_score = 0;
+        /* sliding window over the d-grams of the segments of the epoch */
+        for (j = start; j < start + BL_Z_DICT_K - BL_Z_DICT_D + 1; j++) score += freqs[bl_z_dgram(samples + j)];
+        best_score = score;
+        for (j = start + 1; j <= end; j++)
+        {
+            score -= freqs[bl_z_dgram(samples + j - 1)];
+            score += freqs[bl_z_dgram(samples + j + BL_Z_DICT_K - BL_Z_DICT_D)];
+            if (score > best_score)
+            {
+                best_score = score;
+                best = j;
+            }
+        }
+        if (best_score == 0) continue;
+        for (j = best; j < best + BL_Z_DICT_K - BL_Z_DICT_D + 1; j++) freqs[bl_z_dgram(samples + j)] = 0;
+        segments[nb_segments].offset = best;
+        segments[nb_segments].score = best_score;
+        nb_segments++;
+    }
+    qsort(segments, nb_segments, sizeof(t_z_segment), bl_z_segment_cmp);
+
+    luaL_buffinit(L, &b);
+    for (i = 0; i < nb_segments && dict_len + BL_Z_DICT_K <= size; i++)
+    {
+        luaL_addlstring(&b, (const char *)samples + segments[i].offset, BL_Z_DICT_K);
+        dict_len += BL_Z_DICT_K;
+    }
+    free(samples);
+    free(freqs);
+    free(segments);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int bl_z_compress_balanced_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    return bl_z_compress_sampled(L, src, src_len, BL_Z_BALANCED, dst, dst_len);
+}
+
+static int bl_z_compress_fast_core(lua_State *L, const char *src, size_t src_len, char **dst, size_t *dst_len)
+{
+    return bl_z_compress_sampled(L, src, src_len, BL_Z_FAST, dst, dst_len);
+}
+
+/* z.compress(data [, options]) compresses data.
+ * options.mode is "max" (default: all the compressors run in parallel),
+ * "balanced" or "fast" (a single compressor chosen on a sample).
+ * options.budget is the maximal time (in seconds) given to the compressors
+ * in the max mode.
+ * options.chunk is the chunk size of a frame (see bl_z_frame_compress)
+ * and options.seek adds a seek table to the frame (default: true).
+ * options.dict is a dictionary (see t_z_dict).
+ */
+static int bl_z_compress_opt(lua_State *L)
+{
+    static const char *const modes[] = {"max", "balanced", "fast", NULL};
+    size_t src_len;
+    const char *src = bl_z_checkdata(L, 1, &src_len);
+    double budget = 0.0;
+    int mode = BL_Z_MAX;
+    lua_Integer chunk = src_len > BL_Z_BLOCK_MAX ? BL_Z_FRAME_CHUNK : 0;
+    int seek = 1;
+    t_z_dict tmp;
+    t_z_dict *d = bl_z_dict_option(L, 2, &tmp);
+    int into = bl_z_into(L, 2);
+    char *dst;
+    size_t dst_len;
+    int n;
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "budget");
+        budget = luaL_optnumber(L, -1, 0.0);
+        lua_pop(L, 1);
+        lua_getfield(L, 2, "mode");
+        if (!lua_isnil(L, -1))
+        {
+            const char *name = luaL_checkstring(L, -1);
+            for (mode = 0; modes[mode] && strcmp(modes[mode], name) != 0; mode++) ;
+            if (modes[mode] == NULL) return luaL_argerror(L, 2, lua_pushfstring(L, "invalid mode '%s'", name));
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, 2, "chunk");
+        chunk = luaL_optinteger(L, -1, chunk);
+        lua_pop(L, 1);
+        lua_getfield(L, 2, "seek");
+        if (!lua_isnil(L, -1)) seek = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (chunk < 0 || chunk > BL_Z_BLOCK_MAX) return luaL_argerror(L, 2, "invalid chunk size");
+    }
+    if (d && chunk == 0)
+        n = bl_z_compress_dict(L, src, src_len, d, mode, &dst, &dst_len);
+    else if (chunk > 0)
+    {
+        static const t_z_compressor compressors[] = {bl_z_compress_core, bl_z_compress_balanced_core, bl_z_compress_fast_core};
+        n = bl_z_frame_compress(L, src, src_len, chunk, seek, 0, compressors[mode], &dst, &dst_len);
+    }
+    else if (mode == BL_Z_MAX)
+        n = bl_z_compress_race(L, src, src_len, budget, &dst, &dst_len);
+    else
+        n = bl_z_compress_sampled(L, src, src_len, mode, &dst, &dst_len);
+    return bl_z_result(L, into, n, dst, dst_len); /* error messages pushed by the compressors */
+}
+
+/* z.decompress_range(data, offset, len) returns len bytes of the
+ * decompressed data starting at offset (0 is the first byte).
+ * Only the chunks containing the range are decompressed in frames.
+ */
+static int bl_z_decompress_range(lua_State *L)
+{
+    size_t src_len;
+    const char *src = bl_z_checkdata(L, 1, &src_len);
+    lua_Integer offset = luaL_checkinteger(L, 2);
+    lua_Integer len = luaL_checkinteger(L, 3);
+    char *dst;
+    size_t dst_len;
+    t_z_frame f;
+    int n;
+    luaL_argcheck(L, offset >= 0, 2, "negative offset");
+    luaL_argcheck(L, len >= 0, 3, "negative length");
+    n = bl_z_frame_open(&f, src, src_len);
+    if (n > 0) return bl_z_error(L, "z: corrupted frame");
+    if (n == 0)
+    {
+        n = bl_z_frame_range(L, &f, bl_z_decompress_core, offset, len, &dst, &dst_len);
+        if (n > 0) return n;
+        lua_pushlstring(L, dst, dst_len);
+        free(dst);
+        return 1;
+    }
+    /* single block strings are decompressed entirely */
+    n = bl_z_decompress_core(L, src, src_len, &dst, &dst_len);
+    if (n > 0) return n;
+    if (n < 0)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, "z: not a compressed string");
+        return 2;
+    }
+    if ((size_t)offset > dst_len) offset = dst_len;
+    if ((size_t)len > dst_len - offset) len = dst_len - offset;
+    lua_pushlstring(L, dst + offset, len);
+    free(dst);
+    return 1;
+}
+
+typedef struct
+{
+    const char *src;
+    size_t src_len;
+    char *dst;
+    size_t dst_len;
+    int status;
+} t_z_job;
+
+static void bl_z_compress_job(void *ctx, int i)
+{
+    t_z_job *job = &((t_z_job*)ctx)[i];
+    if (job->src_len > BL_Z_BLOCK_MAX) return; /* framed later on all the CPUs */
+    job->status = bl_z_compress_core(NULL, job->src, job->src_len, &job->dst, &job->dst_len);
+}
+
+/* z.compress_list(list) compresses all the strings of list in parallel.
+ * It returns a list of compressed strings (false if a string can not be compressed).
+ */
+static int bl_z_compress_list(lua_State *L)
+{
+    int i, n;
+    t_z_job *jobs;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    n = lua_rawlen(L, 1);
+    jobs = (t_z_job*)malloc((n+1) * sizeof(t_z_job));
+    if (!jobs) return luaL_error(L, "z: not enough memory");
+    /* the strings (and the numbers converted to strings) are kept alive by a copy of the list */
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++)
+    {
+        lua_rawgeti(L, 1, i+1);
+        if (!lua_isstring(L, -1))
+        {
+            free(jobs);
+            return luaL_error(L, "z: bad item #%d in compress_list (string expected)", i+1);
+        }
+        jobs[i].src = lua_tolstring(L, -1, &jobs[i].src_len);
+        lua_rawseti(L, 2, i+1);
+    }
+    bl_parallel(n, bl_z_compress_job, jobs);
+    for (i = 0; i < n; i++)
+    {
+        /* same frames as z.compress */
+        if (jobs[i].src_len > BL_Z_BLOCK_MAX)
+            jobs[i].status = bl_z_frame_compress(NULL, jobs[i].src, jobs[i].src_len, BL_Z_FRAME_CHUNK, 1, 0, bl_z_compress_core, &jobs[i].dst, &jobs[i].dst_len);
+    }
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++)
+    {
+        if (jobs[i].status == 0)
+        {
+            lua_pushlstring(L, jobs[i].dst, jobs[i].dst_len);
+            free(jobs[i].dst);
+        }
+        else
+        {
+            lua_pushboolean(L, 0);
+        }
+        lua_rawseti(L, -2, i+1);
+    }
+    free(jobs);
+    return 1;
+}
+
+static int bl_z_decompress_opt(lua_State *L)
+{
+    return bl_z_decompress_with(L, "z", bl_z_decompress_core, 0);
+}
+
+static const luaL_Reg zlib_ext[] =
+{
+    {"compress", bl_z_compress_opt},
+    {"decompress", bl_z_decompress_opt},
+    {"compress_list", bl_z_compress_list},
+    {"decompress_range", bl_z_decompress_range},
+    {"train_dictionary", bl_z_train_dictionary},
+    {"dictionary", bl_z_dictionary},
+    {"buffer", bl_z_buffer},
+    {NULL, NULL}
+};
+
 LUAMOD_API int luaopen_z (lua_State *L)
 {
     luaL_newlib(L, zlib);
+    luaL_setfuncs(L, zlib_ext, 0);
+    luaL_newmetatable(L, BL_Z_DICT);
+    luaL_setfuncs(L, bl_z_dictionary_methods, 0);
+    lua_pop(L, 1);
+    luaL_newmetatable(L, BL_Z_BUFFER);
+    luaL_setfuncs(L, bl_z_buffer_methods, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
     return 1;
 }
 
@@ -1390,9 +5793,21 @@ static int crypt_btea_decrypt(lua_State *L)
     return crypt_btea(L, -1);
 }
 
+/* crypt.hash(s) returns the hash of s computed by bl_hash */
+static int crypt_hash(lua_State *L)
+{
+    size_t len;
+    const char *data = luaL_checklstring(L, 1, &len);
+    char hex[33];
+    bl_hash(data, len, hex);
+    lua_pushstring(L, hex);
+    return 1;
+}
+
 static const luaL_Reg cryptlib[] =
 {
     {"rnd", crypt_rnd},
+    {"hash", crypt_hash},
     {"btea_encrypt", crypt_btea_encrypt},
     {"btea_decrypt", crypt_btea_decrypt},
     {NULL, NULL}
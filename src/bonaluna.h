@@ -17,10 +17,20 @@ Freely available under the terms of the MIT license.
 #define BONALUNA_COPYRIGHT  BONALUNA_VERSION " Copyright (C) 2010-2017 cdelord.fr, Christophe Delord"
 #define BONALUNA_AUTHORS    "Christophe Delord"
 
-#if defined(USE_MINILZO) || defined(USE_LZO) || defined(USE_QLZ) || defined(USE_LZ4) || defined(USE_LZF) || defined(USE_ZLIB) || defined(USE_UCL) || defined(USE_LZMA)
+#if defined(USE_MINILZO) || defined(USE_LZO) || defined(USE_QLZ) || defined(USE_LZ4) || defined(USE_LZF) || defined(USE_ZLIB) || defined(USE_UCL) || defined(USE_LZMA) || defined(USE_ZSTD)
     #define USE_Z
 #endif
 
+#ifndef __MINGW32__
+    #define BL_THREADS
+#endif
+
+/* startup tracing (BL_TRACE_STARTUP=file) */
+void bl_trace_init(void);
+int bl_tracing(void);
+double bl_trace_clock(void);
+void bl_trace(const char *cat, const char *name, const char *detail, double start);
+
 LUALIB_API int luaopen_mathx(lua_State *L);
 
 #define LUA_FSLIBNAME "fs"
@@ -62,6 +72,9 @@ LUAMOD_API int (luaopen_ucl) (lua_State *L);
 #define LUA_LZMALIBNAME "lzma"
 LUAMOD_API int (luaopen_lzma) (lua_State *L);
 
+#define LUA_ZSTDLIBNAME "zstd"
+LUAMOD_API int (luaopen_zstd) (lua_State *L);
+
 #define LUA_ZLIBNAME "z"
 LUAMOD_API int (luaopen_z) (lua_State *L);
 
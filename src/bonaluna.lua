@@ -309,6 +309,42 @@ Example:
 [^1]: See [Object Orientation Closure Approach](http://lua-users.org/wiki/ObjectOrientationClosureApproach).
 ]]
 
+doc [[
+Lazy loading
+------------
+
+The Lua parts of the `bc`, `m`, `bn`, `crypt`, `curl` and `FTP` packages
+are not loaded when BonaLuna starts.
+They are loaded the first time one of their fields is used
+(`FTP` is loaded the first time it is called).
+
+**package.lazy(modname, name1, ..., namen)** defines the global variables
+`name1`, ..., `namen` as stubs that load `modname` with `require`
+the first time one of them is used.
+A name ending with `()` is a function, other names are tables.
+]]
+
+do
+    assert(package.loaded["bl.crypt"] == nil)
+    lazy_t = {c = 1}
+    package.lazy("lazy_test", "lazy_t", "lazy_t2", "lazy_f()")
+    package.preload.lazy_test = function()
+        lazy_loaded = (lazy_loaded or 0) + 1
+        assert(lazy_t.c == 1)
+        lazy_t.answer = 42
+        lazy_t2 = lazy_t2 or {}
+        lazy_t2.x = 1
+        function lazy_f(x) return x + 1 end
+    end
+    assert(lazy_loaded == nil)
+    assert(lazy_t.answer == 42 and lazy_t.c == 1)
+    assert(lazy_loaded == 1)
+    assert(getmetatable(lazy_t) == nil and getmetatable(lazy_t2) == nil)
+    assert(lazy_f(41) == 42 and lazy_t2.x == 1)
+    assert(lazy_loaded == 1)
+    lazy_t, lazy_t2, lazy_f, lazy_loaded = nil, nil, nil, nil
+end
+
 doc [[
 bc, m: arbitrary precision library for Lua based on GNU bc
 ----------------------------------------------------------
@@ -730,6 +766,8 @@ BTEA encrypts 32-bit words so the length of data should be a multiple of 4
 
 **crypt.random(bits)** returns a string with `bits` random bits.
 
+**crypt.hash(data)** computes a fast non cryptographic hash of `data` (128-bit MurmurHash3).
+
 ]]
 
 if crypt then
@@ -747,6 +785,9 @@ if crypt then
     -- sha224, sha256
     assert(crypt.sha224(data) == "730e109bd7a8a32b1cb9d9a09aa2325d2430587ddbc0c38bad911525")
     assert(crypt.sha256(data) == "d7a8fbb307d7809469ca9abcb0082e4f8d5651e46d3cdb762d02d0bf37c9e592")
+
+    assert(crypt.hash(data) == "e34bbc7bbc071b6c7a433ca9c49a9347")
+    assert(crypt.hash("") == "00000000000000000000000000000000")
     -- aes
     local keylen = {128, 192, 256}
     local method = {"ecb", "cbc"}
@@ -886,8 +927,23 @@ doc [[
 **fs.dir([path])** returns an iterator listing files and directories in
 `path` (the default path is the current directory).
 
-**fs.walk([path])** returns an iterator listing directory and file names
-in `path` and its subdirectories (the default path is the current directory).
+**fs.walk([path] [, options])** returns an iterator listing directory and file names
+in `path` and its subdirectories (the default path is the current directory)
+with their types (`"directory"`, `"file"`, `"link"` or `"unknown"`).
+Each directory is followed by its files and its subdirectories are walked after.
+
+- `options.depth` is the maximal depth (0: `path` only, 1: the entries of `path`, ...)
+- `options.sort` (default: `true`) sorts the entries of each directory,
+  `false` keeps the order of the file system (faster on large directories)
+- `options.prune(dir)` is called for each subdirectory,
+  the subdirectory and its content are skipped when it returns `true`
+- `options.follow` (default: `true`) follows the symbolic links to directories,
+  `false` lists them as links (links to a parent directory are never walked again)
+
+On Linux, `fs.walk` reads the directories with `getdents64` and only calls `stat`
+on symbolic links. On Windows and in executables containing virtual files,
+`fs.walk` is based on `fs.listdir`, `fs.lstat` and `fs.inode`
+(symbolic links are not seen by `fs.lstat` on Windows and are always followed).
 
 **fs.mkdir(path)** creates a new directory `path`.
 
@@ -934,10 +990,12 @@ do
                 "foo/bar/file3.lua"
     }
     local i = 0
-    for name in fs.walk "foo" do
+    for name, type in fs.walk "foo" do
         i = i + 1
         assert(name == names[i]:gsub("/", fs.sep))
+        assert(type == (name:match "%.%w+$" and "file" or "directory"))
     end
+    assert(i == #names)
     assert(fs.remove("foo/file1.c"))
     assert(fs.rename("foo/bar", "foo/bar2"))
     check_foo2(fs.listdir("foo"))
@@ -956,9 +1014,52 @@ do
     rm_rf "foo"
 end
 
+do
+    rm_rf "foo"
+    assert(fs.mkdir("foo"))
+    assert(fs.mkdir("foo/b"))
+    assert(fs.mkdir("foo/b/d"))
+    assert(fs.mkdir("foo/z"))
+    for name in iter{"foo/a.txt", "foo/b/c.txt", "foo/b/d/e.txt"} do io.open(name, "w"):close() end
+    local function walk(options)
+        local names = {}
+        for name, type in fs.walk("foo", options) do names[#names+1] = name:gsub("[/\\]", "/").." "..type end
+        return table.concat(names, ",")
+    end
+    assert(walk() == "foo directory,foo/a.txt file,foo/z directory,foo/b directory,foo/b/c.txt file,foo/b/d directory,foo/b/d/e.txt file")
+    assert(walk{depth=0} == "foo directory")
+    assert(walk{depth=1} == "foo directory,foo/a.txt file,foo/z directory,foo/b directory")
+    local pruned = {}
+    assert(walk{prune=function(dir) pruned[#pruned+1] = dir; return dir:match "b$" end} == "foo directory,foo/a.txt file,foo/z directory")
+    assert(#pruned == 2)
+    local unsorted = {}
+    for name in walk{sort=false}:gmatch "[^,]+" do unsorted[#unsorted+1] = name end
+    table.sort(unsorted)
+    local sorted = {}
+    for name in walk():gmatch "[^,]+" do sorted[#sorted+1] = name end
+    table.sort(sorted)
+    assert(table.concat(unsorted, ",") == table.concat(sorted, ","))
+    assert(fs.walk("foo/none")() == nil)
+    if sys.platform == "Linux" then
+        assert(os.execute("ln -s b foo/lb && ln -s .. foo/b/up"))
+        assert(fs.lstat("foo/lb").type == "link" and fs.stat("foo/lb").type == "directory")
+        assert(fs.lstat("foo/b").type == "directory" and fs.lstat("foo/none") == nil)
+        assert(walk() == "foo directory,foo/a.txt file,foo/z directory,"..
+                         "foo/lb directory,foo/lb/c.txt file,foo/lb/up link,foo/lb/d directory,foo/lb/d/e.txt file,"..
+                         "foo/b directory,foo/b/c.txt file,foo/b/up link,foo/b/d directory,foo/b/d/e.txt file")
+        assert(walk{follow=false} == "foo directory,foo/a.txt file,foo/lb link,foo/z directory,"..
+                                     "foo/b directory,foo/b/c.txt file,foo/b/up link,foo/b/d directory,foo/b/d/e.txt file")
+        os.remove("foo/lb")
+        os.remove("foo/b/up")
+    end
+    rm_rf "foo"
+end
+
 doc [[
 **fs.copy(source_name, target_name)** copies file `source_name` to `target_name`.
-The attributes and times are preserved.
+The attributes and times are preserved (with a nanosecond resolution, except on Windows).
+On Linux the file is cloned when the file system supports it (btrfs, XFS, ...)
+or copied by the kernel (`copy_file_range`, `sendfile`), without going through BonaLuna.
 ]]
 
 do
@@ -982,6 +1083,32 @@ do
     end
     fs.remove("answer")
     fs.remove("answer-2")
+    local big = string.rep(content, 5)
+    f = assert(io.open("answer", "wb"))
+    f:write(big)
+    f:close()
+    assert(fs.copy("answer", "answer-2"))
+    f = assert(io.open("answer-2", "rb"))
+    assert(f:read("a") == big)
+    f:close()
+    if sys.platform == "Linux" then
+        -- nanosecond times
+        assert(os.execute("touch -d '2001-02-03 04:05:06.123456789' answer"))
+        assert(fs.copy("answer", "answer-2"))
+        local p = io.popen("stat -c %y answer answer-2")
+        local t1, t2 = p:read("l", "l")
+        p:close()
+        assert(t1 == t2 and t1:match "%.123456789")
+        -- files of unknown size
+        assert(fs.copy("/proc/self/status", "answer-2"))
+        f = assert(io.open("answer-2", "rb"))
+        assert(f:read("a"):match "^Name:")
+        f:close()
+    end
+    assert(fs.copy("answer", "answer-3/answer") == nil)
+    assert(fs.copy("answer-3", "answer-2") == nil)
+    fs.remove("answer")
+    fs.remove("answer-2")
 end
 
 doc [[
@@ -996,6 +1123,9 @@ doc [[
 - `gR`, `gW`, `gX`: group Read/Write/eXecute permissions
 - `oR`, `oW`, `oX`: other Read/Write/eXecute permissions
 
+**fs.lstat(name)** reads the same attributes as `fs.stat` without following symbolic links
+(the type of a link is "link"). On Windows, `fs.lstat` is `fs.stat`.
+
 **fs.inode(name)** reads device and inode attributes of the file `name`.
 Attributes are:
 
@@ -1158,8 +1288,8 @@ The documentation of these modules are available on Lpeg web site:
 ]]
 
 doc [[
-z, lzo, qlz, lz4, zlib, ucl, lzma: compression libraries
---------------------------------------------------------
+z, lzo, qlz, lz4, zlib, ucl, lzma, zstd: compression libraries
+--------------------------------------------------------------
 
 Compression libraries are based on:
 
@@ -1170,6 +1300,7 @@ Compression libraries are based on:
 - [ZLIB](http://www.zlib.net/)
 - [UCL](http://www.oberhumer.com/opensource/ucl/)
 - [XZ Utils](http://tukaani.org/xz/)
+- [Zstandard](https://facebook.github.io/zstd/)
 
 It's inspired by the [Lua Lzo module](http://lua-users.org/wiki/LuaModuleLzo).
 
@@ -1180,10 +1311,74 @@ but you can change it in `setup`.
 ]]
 
 doc [[
-**z.compress(data)** compresses `data` using the best compressor and returns the compressed string.
+**z.compress(data [, options])** compresses `data` using the best compressor and returns the compressed string.
+The compressors run in parallel (one thread per CPU, except on Windows).
+`options.budget` is the maximal time (in seconds) given to the compressors:
+the compressors still running after this time are dropped
+(the first compressed string is always waited for).
+The dropped compressors finish in the background but do not start new threads:
+the next calls wait for them when all the CPUs are busy.
+`options.mode` selects the compression strategy:
+
+- `"max"` (default): all the compressors are run and the smallest result is kept
+- `"balanced"`: the fastest compressor giving a result less than 15% larger than the best one
+- `"fast"`: the fast compressors only (LZO, QLZ, LZ4, LZF)
+
+In the balanced and fast modes the compressor is chosen on a small sample of `data`
+and `data` is compressed only once.
+Data that can not be compressed (e.g. already compressed data, detected by its entropy)
+is stored as is with a small header.
+`options.budget` only applies to the max mode.
+`options.chunk` compresses `data` in a frame made of independently compressed chunks of `options.chunk` bytes
+(strings larger than 1 GB are always compressed in frames of 1 MB chunks).
+Frames have 64-bit sizes, a checksum per chunk and a seek table (unless `options.seek` is `false`).
+
+On C and Lua sources, the balanced mode is about twice as fast as the max mode
+(ZLIB instead of XZ, 15% larger) and the fast mode is more than 100 times faster
+(LZ4, 85% larger).
 
 **z.decompress(data)** decompresses `data` and returns the decompressed string.
 
+**z.decompress_range(data, offset, len)** returns `len` bytes of the decompressed string starting at `offset`
+(0 is the first byte). Only the chunks containing the range are decompressed in frames
+(strings that are not frames are entirely decompressed).
+
+**z.compress_list(list)** compresses all the strings of `list` in parallel (one thread per CPU, except on Windows)
+and returns the list of the compressed strings (`false` when a string can not be compressed).
+Strings larger than 1 GB are compressed in frames, as with `z.compress`.
+
+**lib.stream([direction])** returns a stream object that compresses (`direction` is `"compress"`, the default)
+or decompresses (`direction` is `"decompress"`) data given chunk by chunk
+(`lib` is `z` or any of the compression libraries below).
+Only the state of the compressor is kept in memory, so large files can be processed with a bounded memory.
+
+- **stream:update(chunk)** returns the data produced by `chunk` (possibly an empty string)
+- **stream:flush([chunk])** returns the data produced by `chunk` and the data kept by the compressor,
+  so that everything given so far can be decompressed (the stream stays open)
+- **stream:finish([chunk])** returns the end of the data and closes the stream
+
+`zlib`, `lzma`, `lz4`, `lz4hc` and `zstd` streams use the native formats of these libraries
+(zlib, xz, LZ4 frame and zstd formats, the zlib decompressor also accepts gzip streams)
+and can be read by the usual command line tools.
+`zlib.stream("compress", {gzip=true})` writes a gzip stream.
+The other streams are sequences of blocks compressed by the library (256 KB of data per block),
+each block being preceded by its size (32 bits) and the last block being followed by a null size.
+
+**z.open(path [, mode] [, options])** opens a compressed file and returns an object
+that behaves like a Lua file (`read`, `lines`, `write`, `flush`, `seek` and `close`).
+`mode` is `"r"` (default) or `"w"`.
+The file is compressed or decompressed chunk by chunk by a stream,
+so large files are processed without being loaded in memory.
+
+- when reading, gzip, xz, LZ4 frame and zstd files are recognized by their first bytes
+  and the other files are read as is
+- when writing, the codec depends on the extension of `path`
+  (`.gz`: gzip (default), `.xz`: xz, `.lz4`: LZ4 frame, `.zst`: zstd)
+- `options.codec` forces the codec (`"gzip"`, `"xz"` or the name of a compression library)
+- `seek` can return the current position, move forward or go back to the beginning of a file being read
+  (going back decompresses the file again)
+- `flush` writes all the data given so far to the file (the compressed file can be read before being closed)
+
 **minilzo.compress(data)** compresses `data` with miniLZO and returns the compressed string.
 
 **minilzo.decompress(data)** decompresses `data` with miniLZO and returns the decompressed string.
@@ -1219,13 +1414,136 @@ doc [[
 **lzma.compress(data)** compresses `data` with XZ Utils and returns the compressed string.
 
 **lzma.decompress(data)** decompresses `data` with XZ Utils and returns the decompressed string.
+
+**zstd.compress(data [, options])** compresses `data` with Zstandard and returns the compressed string.
+`options.level` is the compression level (1 to 22, negative levels are faster, default: 19),
+`options.long` enables the long distance matching of Zstandard (128 MB window, for large data
+with distant repetitions) and `options.threads` the worker threads of Zstandard
+(one thread per CPU if `true`).
+These options are also accepted by `zstd.stream` and `zstd.context`.
+Strings larger than 1 GB are compressed in frames of chunks compressed with the same options.
+
+**zstd.decompress(data)** decompresses `data` with Zstandard and returns the decompressed string.
+
+`z.compress` also tries Zstandard (levels 19 and 3) in the max and balanced modes.
+
+**zlib.compress(data, {threads=n})**, **lzma.compress(data, {threads=n})** and **lz4hc.compress(data, {threads=n})**
+split `data` in blocks compressed by `n` threads (one thread per CPU if `n` is `true`):
+
+- ZLIB blocks (128 KB) use the end of the previous block as a dictionary
+  and are concatenated in a single ZLIB stream (as pigz does)
+- XZ blocks (at least 1 MB) are compressed by the multithreaded encoder of XZ Utils
+- LZ4HC blocks (1 MB) are compressed in a frame (see `z.compress`)
+
+The blocks of XZ streams and frames are also decompressed in parallel.
+
+Small strings (e.g. records, messages) compress much better with a dictionary
+built from typical samples:
+
+**z.train_dictionary(samples [, size])** returns a dictionary (default size: 32 KB)
+made of the most frequent segments of the strings of the list `samples`
+(the most frequent segments are at the end of the dictionary).
+
+**z.dictionary(data)** returns a dictionary object made of the string `data`
+(`dictionary.id` is the identifier of the dictionary and `dictionary.data` its content).
+Dictionary objects are faster than strings when used several times.
+
+**lib.compress(data, {dict=dictionary})** compresses `data` with a dictionary
+(`lib` is `z`, `zlib`, `lzma`, `lz4`, `lz4hc` or `zstd`, `dictionary` is a string or a dictionary object).
+The identifier of the dictionary is stored in the compressed string.
+`z.compress` uses LZ4 in fast mode, ZLIB and Zstandard in balanced mode and keeps the smallest result in max mode.
+
+**lib.decompress(data, dictionary)** decompresses `data` compressed with `dictionary`.
+Without the right dictionary, `lib.decompress` returns `nil` and an error message.
+
+**lib.context([options])** returns a context that keeps the state of the compressor,
+its work memory and its output buffer between calls
+(`lib` is `zlib`, `lzma`, `lz4`, `lz4hc` or `zstd`).
+Contexts are faster than `lib.compress` and `lib.decompress` on many small strings.
+`options.level` is the compression level (0 to 9 for `zlib` and `lzma`, 1 to 12 for `lz4hc`, up to 22 for `zstd`)
+and `options.dict` the dictionary used by the context.
+
+- **context:compress(data)** compresses `data` and returns the compressed string
+- **context:decompress(data)** decompresses `data` and returns the decompressed string
+
+The strings compressed by a context can be decompressed by `lib.decompress` and `z.decompress`
+(with the same dictionary) and conversely.
+
+Large strings are cheaper to process in buffers than in Lua strings:
+
+**z.buffer([data])** returns a mutable buffer (initialized with a copy of `data`).
+Buffers are accepted by all the compression functions in place of strings.
+
+- **#buffer** is the size of the content of the buffer
+- **tostring(buffer)** and **buffer:sub(i [, j])** return the content of the buffer as a string (as `string.sub`)
+- **buffer:read(file [, n])** replaces the content of the buffer with `n` bytes (or the end) of `file`
+  and returns the buffer (`nil` at the end of the file)
+- **buffer:write(file)** writes the content of the buffer to `file`
+
+**lib.compress(data, {into=buffer})** and **lib.decompress(data, {into=buffer})**
+store the result in `buffer` and return `buffer` (`lib` is `z` or any of the compression libraries,
+`lib.decompress(data, {dict=dictionary, into=buffer})` uses a dictionary).
+**context:compress(data, buffer)** and **context:decompress(data, buffer)** do the same with a context.
+The result is not copied in a new string: the buffer takes the memory allocated by the compressor
+(contexts reuse the previous memory of the buffer), which halves the memory and time needed
+to decompress large strings.
 ]]
 
+doc [[
+**bench.z([options])** measures the compression libraries compiled in BonaLuna
+(and the three modes of `z`) and returns a report.
+Each library compresses and decompresses each input several times
+(at least `options.calls` calls (default: 3) during at least `options.time` seconds (default: 0.5)).
+The inputs are the files listed in `options.files`
+or a synthetic corpus (text, log, JSON records and random data, `options.size` bytes each (default: 1 MB))
+that is the same on all platforms.
+`options.codecs` restricts the benchmark to some libraries (e.g. `{"lz4", "zlib", "z:fast"}`, `"z"` for the three modes).
+The report gives, for each library and input, the compression ratio, the compression and decompression
+speeds (MB/s), the peak memory (Linux only) and the latencies of the calls (min, p50, p90, p99 and max, in seconds).
+
+**bench.table(report)** and **bench.json(report)** format a report as a text table or in JSON
+(e.g. to compare BonaLuna builds).
+
+**bench.corpus([size])** returns the synthetic corpus (a list of `{name=name, data=data}`).
+
+**bl bench z [-json] [-o file.json] [-t seconds] [-n calls] [-s size] [-c codecs] [files]**
+runs `bench.z` from the command line and prints the report as a table (or in JSON with `-json`).
+`-o` also writes the JSON report to a file.
+`bench` is a command of the BonaLuna interpreter: a script named `bench` in the current directory is run instead.
+]]
+
+if z then
+    local report = bench.z{size=16*1024, time=0, calls=2, codecs={"lz4", "zlib", "z:fast"}}
+    local n = 1
+    if lz4 then n = n + 1 end
+    if zlib then n = n + 1 end
+    assert(#report.inputs == 4 and #report.results == 4*n)
+    for _, r in ipairs(report.results) do
+        assert(not r.error and r.size == 16*1024 and r.ratio > 0, r.error)
+        assert(r.compress.calls >= 2 and r.compress.min <= r.compress.p50 and r.compress.p50 <= r.compress.p99)
+        assert(r.decompress.calls >= 2 and r.decompress_speed > 0)
+        assert(r.peak_memory == nil or r.peak_memory >= 0)
+    end
+    assert(bench.table(report):match "\nrecords %(16384 bytes%)\n" and bench.table(report):match "\nz:fast ")
+    assert(bench.json(report):match '\n  "results": %[\n    {\n      "codec": "')
+    assert(bench.corpus(1000)[4].data == bench.corpus(1000)[4].data)
+    if sys.platform == 'Linux' and arg[-1] then
+        local p = io.popen(arg[-1].." bench z -json -s 4096 -t 0 -n 1 -c z:fast")
+        local json = p:read("a")
+        assert(p:close() and json:match '"codec": "z:fast"')
+        assert(os.execute(arg[-1].." bench z -c z:fast -s 4096 -t 0 -unknown 2> /dev/null") == nil)
+        local f = io.open("bench", "w"); f:write('io.write("script ", ...)'); f:close()
+        p = io.popen(arg[-1].." bench z")
+        assert(p:read("a") == "script z" and p:close())
+        fs.remove("bench")
+    end
+end
+
 if z then
     local a = "This is a test string..."
     local b = "And this is another test string!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!"
     local big = string.rep("a lot of bytes; ", 100000)
-    local libs = {"z", "minilzo", "lzo", "qlz", "lz4", "lz4hc", "lzf", "zlib", "ucl", "lzma"}
+    local libs = {"z", "minilzo", "lzo", "qlz", "lz4", "lz4hc", "lzf", "zlib", "ucl", "lzma", "zstd"}
     for name in iter(libs) do
         local lib = _G[name]
         if lib then
@@ -1236,8 +1554,248 @@ if z then
             assert(#lib.compress(big) < #big)
             local ok, err = lib.decompress("not a compressed string")
             assert(ok == nil and err == name..": not a compressed string")
+            local input = {a, "", b, big, a}
+            local c = lib.stream()
+            local compressed = {}
+            for chunk in iter(input) do compressed[#compressed+1] = c:update(chunk) end
+            compressed[#compressed+1] = c:finish()
+            compressed = table.concat(compressed)
+            assert(#compressed < #big)
+            assert(c:update(a) == nil)
+            local d = lib.stream("decompress")
+            local decompressed = {}
+            for i = 1, #compressed, 1000 do decompressed[#decompressed+1] = d:update(compressed:sub(i, i+999)) end
+            decompressed[#decompressed+1] = d:finish()
+            assert(table.concat(decompressed) == table.concat(input))
+            assert(lib.stream("decompress"):finish(lib.stream():finish()) == "")
+            ok, err = lib.stream("decompress"):finish(compressed:sub(1, #compressed//2))
+            assert(ok == nil and err == name..": truncated stream")
+            c, d = lib.stream(), lib.stream("decompress")
+            assert(d:update(c:flush(a)) == a and d:update(c:flush()) == "")
+            assert(d:update(c:update(b)..c:flush()) == b and d:finish(c:finish(a)) == a)
+        end
+    end
+    for _ = 1, 10 do
+        assert(z.decompress(z.compress(big, {budget=0.001})) == big)
+    end
+    assert(z.compress(big, {budget=1000}) == z.compress(big))
+    for mode in iter{"max", "balanced", "fast"} do
+        assert(z.decompress(z.compress("", {mode=mode})) == "")
+        assert(z.decompress(z.compress(a, {mode=mode})) == a)
+        assert(z.decompress(z.compress(big, {mode=mode})) == big)
+        assert(#z.compress(big, {mode=mode}) < #big)
+        local twice = z.compress(z.compress(big), {mode=mode})
+        assert(z.decompress(z.decompress(twice)) == big)
+    end
+    assert(#z.compress(big, {mode="max"}) <= #z.compress(big, {mode="fast"}))
+    if crypt then
+        local r = crypt.random(8*100000)
+        for mode in iter{"balanced", "fast"} do
+            local stored = z.compress(r, {mode=mode})
+            assert(#stored == #r + 8)
+            assert(z.decompress(stored) == r)
+        end
+    end
+    assert(not pcall(z.compress, a, {mode="slow"}))
+    for seek in iter{true, false} do
+        local frame = z.compress(big, {chunk=10000, seek=seek, mode="fast"})
+        assert(frame:sub(1, 4) == "ZFRM")
+        assert(z.decompress(frame) == big)
+        assert(z.decompress_range(frame, 0, 20) == big:sub(1, 20))
+        assert(z.decompress_range(frame, 9990, 30) == big:sub(9991, 10020))
+        assert(z.decompress_range(frame, #big-5, 100) == big:sub(-5))
+        assert(z.decompress_range(frame, #big+5, 100) == "")
+        local broken = frame:sub(1, 1000)..frame:sub(1002)
+        assert(z.decompress(broken) == nil)
+    end
+    local huge = string.pack("<I4I4I8I4I4", 0x4D52465A, 0xFFFFFFFF, 1<<62, ((1<<62) + 0xFFFFFFFE) // 0xFFFFFFFF, 0)
+    assert(z.decompress_range(huge, 0, 1<<62) == nil)
+    assert(z.decompress(z.compress("", {chunk=10})) == "")
+    local large = string.rep(a..b..big, 3)
+    for name in iter{"zlib", "lzma", "lz4hc", "zstd"} do
+        local lib = _G[name]
+        if lib then
+            for threads in iter{true, 1, 3} do
+                local compressed = lib.compress(large, {threads=threads})
+                assert(lib.decompress(compressed) == large)
+                assert(z.decompress(compressed) == large)
+                assert(#compressed < #large)
+            end
+            assert(lib.decompress(lib.compress(a, {threads=true})) == a)
         end
     end
+    assert(z.decompress_range(z.compress(b), 10, 7) == b:sub(11, 17))
+    local records = {}
+    for i = 1, 500 do
+        records[i] = ('{"id":%d,"name":"user%d","email":"user%d@example.com","active":%s,"tags":["alpha","beta"]}'):format(i, i*7, i*7, i%2==0 and "true" or "false")
+    end
+    local dict = z.train_dictionary(records, 4096)
+    assert(#dict <= 4096 and #dict > 0)
+    assert(z.train_dictionary({a, b}) == a..b)
+    assert(not pcall(z.train_dictionary, records, -1))
+    assert(not pcall(z.train_dictionary, records, 1<<40))
+    local samples = {}
+    for i = 1, 2000 do samples[i] = i % 2 == 0 and ("sample %d"):format(i) or 1000000000 + i end
+    assert(#z.train_dictionary(samples, 1024) <= 1024)
+    local dictionary = z.dictionary(dict)
+    assert(dictionary.data == dict and type(dictionary.id) == "number")
+    local record = records[42]
+    for name in iter{"z", "zlib", "lzma", "lz4", "lz4hc", "zstd"} do
+        local lib = _G[name]
+        if lib then
+            for d in iter{dict, dictionary} do
+                local compressed = lib.compress(record, {dict=d})
+                assert(#compressed < #lib.compress(record))
+                assert(lib.decompress(compressed, d) == record)
+                assert(z.decompress(compressed, d) == record)
+                assert(lib.decompress(lib.compress("", {dict=d}), d) == "")
+                assert(lib.decompress(lib.compress(big, {dict=d}), d) == big)
+                local ok, err = lib.decompress(compressed)
+                assert(ok == nil and err:match("dictionary required"))
+                assert(lib.decompress(compressed, a) == nil)
+            end
+        end
+    end
+    for mode in iter{"max", "balanced", "fast"} do
+        assert(z.decompress(z.compress(record, {dict=dictionary, mode=mode}), dictionary) == record)
+    end
+    for name in iter{"zlib", "lzma", "lz4", "lz4hc", "zstd"} do
+        local lib = _G[name]
+        if lib then
+            local level = name ~= "lz4" and 2 or nil
+            for options in iter{{}, {level=level}, {dict=dict}, {dict=dictionary, level=level}} do
+                local c = lib.context(options)
+                for s in iter{a, "", record, b, big, record} do
+                    local compressed = c:compress(s)
+                    assert(c:decompress(compressed) == s)
+                    assert(lib.decompress(compressed, options.dict) == s)
+                    assert(c:decompress(lib.compress(s, {dict=options.dict})) == s)
+                end
+                local ok, err = c:decompress("not a compressed string")
+                assert(ok == nil and err == name..": not a compressed string")
+                if name:match "lz4" then assert(c:decompress(lz4hc.compress(large, {threads=2})) == large) end
+                if options.dict then
+                    assert(lib.context():decompress(c:compress(record)) == nil)
+                    assert(lib.context{dict=a}:decompress(c:compress(record)) == nil)
+                end
+            end
+            assert(lib.context():decompress(lib.context():compress(big)) == big)
+            assert(not pcall(lib.context, {level=100}))
+        end
+    end
+    if zstd then
+        for options in iter{{level=1}, {level=-5}, {level=22}, {long=true}, {threads=2, level=3}, {long=true, threads=true}} do
+            local compressed = zstd.compress(large, options)
+            assert(zstd.decompress(compressed) == large and z.decompress(compressed) == large)
+            local c = zstd.stream("compress", options)
+            compressed = c:update(large)..c:finish()
+            assert(compressed:sub(1, 4) == "\x28\xB5\x2F\xFD")
+            assert(zstd.stream("decompress"):finish(compressed) == large)
+            local ctx = zstd.context(options)
+            assert(ctx:decompress(ctx:compress(large)) == large)
+        end
+        assert(#zstd.compress(large, {level=19}) < #zstd.compress(large, {level=1}))
+        assert(not pcall(zstd.compress, a, {level=23}))
+        local frames = zstd.stream():finish(a)..zstd.stream():finish(b)
+        assert(zstd.stream("decompress"):finish(frames) == a..b)
+        local huge = string.rep(record, (1<<30)//#record + 1) -- larger than 1 GB
+        local compressed = zstd.compress(huge, {level=1, dict=dict})
+        assert(compressed:sub(1, 4) == "ZFRM" and zstd.decompress(compressed, dict) == huge)
+        assert(zstd.decompress(compressed) == nil)
+        huge, compressed = nil, nil
+    end
+    if z.open then
+        local lines = {}
+        for i = 1, 20000 do lines[i] = ("line %d: %s"):format(i, ("x"):rep(i % 50)) end
+        local text = table.concat(lines, "\n").."\n"
+        local files = {["z-test.gz"]=false, ["z-test.xz"]=false, ["z-test.lz4"]=false, ["z-test.z"]="z", ["z-test.txt"]=false}
+        if zstd then files["z-test.zst"] = false end
+        for name, codec in pairs(files) do
+            local f = codec == false and name:match "txt$" and assert(io.open(name, "w")) or assert(z.open(name, "w", {codec=codec}))
+            for i = 1, #lines do
+                f:write(lines[i], "\n")
+                if i == 100 then
+                    -- the flushed file can be read before being closed
+                    assert(f:flush())
+                    local raw = io.open(name, "rb"):read("a")
+                    local lib = _G[({gz="zlib", xz="lzma", lz4="lz4", zst="zstd", z="z"})[name:match "%w+$"]]
+                    assert((lib and lib.stream("decompress"):update(raw) or raw) == table.concat(lines, "\n", 1, 100).."\n")
+                end
+            end
+            f:close()
+            local g = assert(z.open(name, "r", {codec=codec}))
+            local n = 0
+            for line in g:lines() do n = n + 1; assert(line == lines[n]) end
+            assert(n == #lines)
+            assert(g:read("a") == "" and g:read("l") == nil and g:read(0) == nil)
+            assert(g:seek("set", 10) == 10)
+            assert(g:read(5) == text:sub(11, 15))
+            assert(g:seek() == 15)
+            assert(g:seek("cur", 100000) == 100015)
+            assert(g:read("L") == text:match("[^\n]*\n", 100016))
+            assert(g:read(0) == "")
+            g:close()
+            assert(not pcall(g.read, g))
+            assert(z.open(name):read("a") == (codec and io.open(name, "rb"):read("a") or text))
+            fs.remove(name)
+        end
+        local f = z.open("z-test.gz", "w"); f:write("1 2.5 0x10\n", 42, "\n"); f:close()
+        local data = io.open("z-test.gz", "rb"):read("a")
+        f = io.open("z-test.gz", "wb"); f:write(data, data); f:close()
+        f = z.open("z-test.gz")
+        local x, y, h, n = f:read("n", "n", "n", "n")
+        assert(x == 1 and y == 2.5 and h == 16 and n == 42)
+        assert(f:read("a") == "\n1 2.5 0x10\n42\n")
+        f:close()
+        fs.remove("z-test.gz")
+        assert(z.open("z-test.none") == nil)
+        assert(not pcall(z.open, "z-test.gz", "a"))
+    end
+    local buf = z.buffer("hello world")
+    assert(#buf == 11 and tostring(buf) == "hello world")
+    assert(buf:sub(1, 5) == "hello" and buf:sub(-5) == "world" and buf:sub(3, 2) == "" and buf:sub(0, 100) == "hello world")
+    assert(#z.buffer() == 0 and tostring(z.buffer(buf)) == "hello world")
+    local out = z.buffer()
+    for _, lib in ipairs{z, minilzo, lzo, qlz, lz4, lz4hc, lzf, zlib, ucl, lzma, zstd} do
+        if lib then
+            local c = lib.compress(big)
+            assert(lib.decompress(c, {into=out}) == out and #out == #big and tostring(out) == big)
+            assert(lib.compress(out, {into=buf}) == buf)
+            assert(lib.decompress(buf) == big)
+            assert(lib.decompress(buf, {into=buf}) == buf and tostring(buf) == big)
+            if lib.context then
+                local ctx = lib.context()
+                for i = 1, 3 do
+                    assert(ctx:compress(big, buf) == buf)
+                    assert(ctx:decompress(buf, out) == out and tostring(out) == big)
+                end
+                assert(lib.decompress(ctx:compress(out, buf)) == big)
+            end
+        end
+    end
+    assert(not pcall(z.compress, big, {into="string"}))
+    buf = z.buffer(big)
+    local f = io.open("z-test.bin", "wb"); buf:write(f); buf:write(f); f:close()
+    f = io.open("z-test.bin", "rb")
+    assert(buf:read(f, 10) == buf and tostring(buf) == big:sub(1, 10))
+    assert(buf:read(f) == buf and tostring(buf) == big:sub(11)..big)
+    assert(buf:read(f, 10) == nil and #buf == 0)
+    f:close()
+    fs.remove("z-test.bin")
+    local list = {a, b, big, "", big}
+    local compressed = z.compress_list(list)
+    assert(#compressed == #list)
+    for i = 1, #list do
+        assert(compressed[i] == z.compress(list[i]))
+        assert(z.decompress(compressed[i]) == list[i])
+    end
+    compressed = z.compress_list({42, big, 3.5})
+    assert(z.decompress(compressed[1]) == "42" and z.decompress(compressed[3]) == "3.5")
+    local huge = string.rep("bonaluna ", (1<<30)//9 + 1) -- larger than 1 GB
+    compressed = z.compress_list({"bonaluna", huge})
+    assert(compressed[2]:sub(1, 4) == "ZFRM" and z.decompress(compressed[2]) == huge)
+    huge, compressed = nil, nil
+    collectgarbage()
 end
 
 doc [[
@@ -1245,6 +1803,9 @@ ps: Processes
 -------------
 
 **ps.sleep(n)** sleeps for `n` seconds.
+
+**ps.clock()** returns the time in seconds given by a monotonic clock
+(unlike `os.clock` it is not the CPU time of the process, its origin is unspecified).
 ]]
 
 do
@@ -1257,6 +1818,9 @@ do
     --check(2, 1)
     --check(0.1, 50)
     --check(0.01, 500)
+    local t0 = ps.clock()
+    ps.sleep(0.02)
+    assert(ps.clock() - t0 >= 0.015)
 end
 
 doc [[
@@ -1450,52 +2014,120 @@ This feature is inspired by
 `pegar.lua` parameters (command line interface)
 -----------------------------------------------
 
-**compile:on|off|min** turns compilation on, off or on when chunks are smaller than sources (`min` is the default value)
+**compile:on|off|min|opt** turns compilation on, off or on when chunks are smaller than sources (`min` is the default value).
+`opt` is like `min` but strips debug information of the next scripts
+(scripts using the `debug` library shall be added with another mode).
 
 **compress:on|off|min** turns compression on, off or on when chunks are smaller than sources (`min` is the default value)
 
+**extract:on|off** turns extraction of the next files and directories on or off (`off` is the default value)
+
+**merge:on|off** turns merging of the next consecutive scripts into a single chunk on or off (`off` is the default value).
+Identical merged scripts are only stored once.
+Merged scripts keep their own chunk names (in error messages and tracebacks) and compile modes.
+
+**solid:on|off** turns the solid mode on or off for the next compressed blocks (`off` is the default value).
+In solid mode, the blocks are concatenated and compressed by chunks of 256 KB
+to take advantage of the redundancy between small scripts and files.
+A block only requires the decompression of the chunks it is stored in.
+
+**cache:directory** keeps the compressed blocks in a cache directory.
+The next builds only compress the blocks that have changed.
+
 **read:original_interpretor** reads the initial interpretor
 
 **lua:script.lua** adds a script to be executed at runtime
 
 **lua:script.lua=realname.lua** as above but stored under a different name
 
+**mod:path/module.lua** adds a module loaded by `require` (the module name is `path.module`)
+
+**mod:name=realname.lua** as above but the module name is `name`
+
 **str:name=value** creates a global variable holding a string
 
 **str:name=@filename** as above but the string is the content of a file
 
-**file:name** adds a file to be created at runtime (the file is not overwritten if it already exists)
+**file:name** adds a file to be read at runtime (or created when extraction is on, the file is not overwritten if it already exists)
 
 **file:name=realname** as above but stored under a different name
 
-**dir:name** creates a directory at runtime
+**dir:name** adds a directory (or creates it at runtime when extraction is on)
+
+**tree:name** adds a directory tree extracted at runtime (with the permissions and dates of its files)
+
+**tree:name=realname** as above but extracted under a different name
 
 **write:new_executable** write a new executable containing the original interpretor and all the added items
 
 When a path starts with `:`, it is relative to the executable path otherwise
 it is relative to the current working directory.
 
+Blocks are compressed in parallel (one thread per CPU, except on Windows)
+when the executable is written or when enough data have been added.
+Identical contents (e.g. the same file added under several names) are stored
+and decompressed only once.
+
+Scripts are executed when the executable starts, in the order they were added.
+Compressed scripts, strings and files are decompressed in parallel
+(one thread per CPU, except on Windows) while the previous blocks are executed.
+Modules are indexed at the end of the glue and are only loaded
+when they are required (`require` first searches modules in the glue).
+
+Trees are extracted in parallel. The files that already exist with the same size
+and date are not extracted again, nor the files with the same size and content
+(their date and permissions are restored).
+
+Files and directories are not extracted unless extraction is on.
+They are served from memory by `io.open`, `io.lines`, `loadfile`, `fs.stat`
+and `fs.listdir` (and the functions based on them like `fs.dir` and `fs.walk`).
+These files are read only: opening them for writing creates real files.
+Compressed files are decompressed when they are read for the first time.
+
+Startup tracing
+---------------
+
+When the environment variable `BL_TRACE_STARTUP` contains a file name,
+the time spent in the initialization of the libraries (`luaopen_*` functions)
+and in each block of the glue (decompression, loading and execution)
+is recorded in this file when the executable exits.
+The file is a [Chrome trace](https://www.chromium.org/developers/how-tos/trace-event-profiling-tool)
+(that can be loaded in `chrome://tracing`) if its name ends with `.json`,
+otherwise it is a text report.
+
 `Pegar` class (useable in BonaLuna scripts)
 -------------------------------------------
 
 The class `Pegar` defines methods to build an executable.
 The methods have the same name as the command line parameters:
 
-**compile(mode)** turns compilation on, off or on
+**compile(mode)** turns compilation on, off, on or opt
 
 **compress(mode)** turns compression on, off or on
 
+**extract(mode)** turns extraction on or off
+
+**merge(mode)** turns merging of scripts on or off
+
+**solid(mode)** turns the solid mode on or off
+
+**cache(directory)** keeps the compressed blocks in a cache directory
+
 **read(original_interpretor)** reads the initial interpretor (if different from the running interpretor)
 
 **lua(script[, realname])** adds a script to be executed at runtime
 
+**mod(name[, realname])** adds a module loaded by `require`
+
 **str(name, value)** creates a global variable holding a string
 
 **strf(name, filename)** as above but the string is the content of a file
 
-**file(name[, realname])** adds a file to be created at runtime
+**file(name[, realname])** adds a file to be read (or created) at runtime
+
+**dir(name)** adds a directory (or creates it at runtime)
 
-**dir(name)** creates a directory at runtime
+**tree(name[, realname])** adds a directory tree extracted at runtime
 
 **write(new_executable)** write a new executable containing the original interpretor and all the added items
 
@@ -1507,7 +2139,7 @@ do
     local big_file = string.rep("what a big file", 10000)
     local big_str = string.rep("what a big string", 10000)
     for compress in iter{'on', 'off', 'min'} do
-    for compile in iter{'on', 'off', 'min'} do
+    for compile in iter{'on', 'off', 'min', 'opt'} do
     for interface in Pegar and iter{'cli', 'script'} or iter{"cli"} do
         rm_rf "tmp"
         assert(fs.mkdir "tmp")
@@ -1515,62 +2147,173 @@ do
         f:write [[#! the shebang that loadstring doesn't like
             assert(fs.basename(arg[-1]) == "hello.exe")
             assert(arg[0] == "hello.lua")
+            local source = debug.getinfo(1, "S").source
+            assert(source == "hello.lua" or source == "=?")
             assert(arg[1] == "a")
             assert(arg[2] == "b")
             assert(arg[3] == "c")
             assert(big_str == string.rep("what a big string", 10000))
+            assert(hello_mod_loaded == nil)
+            assert(require("hello.mod").answer == 42)
+            assert(hello_mod_loaded == true)
+            local vfs = fs.dirname(arg[-1])..fs.sep
+            assert(io.open(vfs.."hello.vflag"):read("*a") == " hi ")
+            for l in io.lines(vfs.."hello.vflag") do assert(l == " hi ") end
+            assert(loadfile(vfs.."hello_vfs.lua")(20) == 21)
+            assert(fs.stat(vfs.."hello.vflag").type == "file")
+            assert(fs.stat(vfs.."hello.vflag").size == 4)
+            assert(io.open(vfs.."hello.vempty"):read("a") == "")
+            assert(io.open(vfs.."hello.big_copy"):read("a") == string.rep("what a big file", 10000))
+            assert(fs.stat(vfs.."hello.vdir").type == "directory")
+            local names = {}
+            for name in fs.dir(vfs) do names[name] = true end
+            assert(names["hello.vflag"] and names["hello.vdir"] and names["hello.exe"])
             print(my_constant*14)
         ]]
         f:write("\n--"..string.rep("a big compressible and useless comment...", 10000).."\n")
         f:write("z = [["..string.rep("a big compressible and useless string...", 10000).."]]\n")
         f:close()
+        f = io.open("tmp/hello_mod.lua", "w")
+        f:write [[
+            hello_mod_loaded = true
+            return {answer = 42}
+        ]]
+        f:close()
+        f = io.open("tmp/hello_vfs.lua", "w")
+        f:write [[ return ... + 1 ]]
+        f:close()
         f = io.open("tmp/exit.lua", "w")
         f:write [[ os.exit() ]]
         f:close()
         f = io.open("tmp/hello.flag", "w")
         f:write [[ hi ]]
         f:close()
+        io.open("tmp/hello.empty", "w"):close()
         f = io.open("tmp/hello.big_file", "w")
         f:write(big_file)
         f:close()
         f = io.open("tmp/hello.big_str", "w")
         f:write(big_str)
         f:close()
+        assert(fs.mkdir "tmp/hello.tree")
+        assert(fs.mkdir "tmp/hello.tree/sub")
+        f = io.open("tmp/hello.tree/sub/big", "w")
+        f:write(big_file)
+        f:close()
+        f = io.open("tmp/hello.tree/small", "w")
+        f:write [[ hi ]]
+        f:close()
+        assert(fs.touch("tmp/hello.tree/small", 42))
         if interface == 'cli' then
             os.execute(stub.." ../tools/pegar.lua -q"..
+                " cache:tmp/cache"..
                 " compile:"..compile..
+                " merge:"..((compile == 'opt' or compile == 'min') and 'on' or 'off')..
+                " solid:"..(compile == 'on' and 'on' or 'off')..
                 " compress:"..compress..
                 " read:"..stub..
+                " extract:on"..
                 " file::/hello.flag2=tmp/hello.flag"..
+                " file::/hello.empty2=tmp/hello.empty"..
                 " file::/hello.big_file2=tmp/hello.big_file"..
                 " str:big_str=@tmp/hello.big_str"..
                 " dir:tmp/hello.dir"..
+                " tree:tmp/hello.tree2=tmp/hello.tree"..
+                " extract:off"..
+                " file::/hello.vflag=tmp/hello.flag"..
+                " file::/hello.vempty=tmp/hello.empty"..
+                " file::/hello.big_copy=tmp/hello.big_file"..
+                " file::/hello_vfs.lua=tmp/hello_vfs.lua"..
+                " dir::/hello.vdir"..
                 " str:my_constant=3"..
+                " mod:hello.mod=tmp/hello_mod.lua"..
                 " lua:hello.lua=tmp/hello.lua"..
                 " lua:exit.lua=tmp/exit.lua"..
                 " write:tmp/hello.exe")
         else
             Pegar().quiet().
                 compile(compile).
+                merge((compile == 'opt' or compile == 'min') and 'on' or 'off').
+                solid(compile == 'on' and 'on' or 'off').
                 compress(compress).
+                extract("on").
                 file(":/hello.flag2", "tmp/hello.flag").
+                file(":/hello.empty2", "tmp/hello.empty").
                 file(":/hello.big_file2", "tmp/hello.big_file").
                 strf("big_str", "tmp/hello.big_str").
                 dir("tmp/hello.dir").
+                tree("tmp/hello.tree2", "tmp/hello.tree").
+                extract("off").
+                file(":/hello.vflag", "tmp/hello.flag").
+                file(":/hello.vempty", "tmp/hello.empty").
+                file(":/hello.big_copy", "tmp/hello.big_file").
+                file(":/hello_vfs.lua", "tmp/hello_vfs.lua").
+                dir(":/hello.vdir").
                 str("my_constant", "3").
+                mod("hello.mod", "tmp/hello_mod.lua").
                 lua("hello.lua", "tmp/hello.lua").
                 lua("exit.lua", "tmp/exit.lua").
                 write("tmp/hello.exe")
         end
         assert(fs.stat("tmp/hello.exe"))
+        if interface == 'cli' then
+            -- the cache does not change the executable
+            assert(#fs.listdir("tmp/cache") > 0)
+            os.execute(stub.." ../tools/pegar.lua -q"..
+                " compile:"..compile..
+                " compress:"..compress..
+                " read:"..stub..
+                " cache:tmp/cache"..
+                " str:big_str=@tmp/hello.big_str"..
+                " lua:hello.lua=tmp/hello.lua"..
+                " write:tmp/hello_cached.exe")
+            os.execute(stub.." ../tools/pegar.lua -q"..
+                " compile:"..compile..
+                " compress:"..compress..
+                " read:"..stub..
+                " str:big_str=@tmp/hello.big_str"..
+                " lua:hello.lua=tmp/hello.lua"..
+                " write:tmp/hello_uncached.exe")
+            local f1 = io.open("tmp/hello_cached.exe", "rb")
+            local f2 = io.open("tmp/hello_uncached.exe", "rb")
+            assert(f1:read("*a") == f2:read("*a"))
+            f1:close()
+            f2:close()
+        end
         assert(tonumber(io.popen("tmp"..fs.sep.."hello.exe a b c"):read("*a")) == 42)
         f = io.open("tmp/hello.flag2", "rb")
         assert(f:read("*a") == [[ hi ]])
         f:close()
+        assert(fs.stat("tmp/hello.empty2").size == 0)
         f = io.open("tmp/hello.big_file", "rb")
         assert(f:read("*a") == big_file)
         f:close()
         assert(fs.stat("tmp/hello.dir").type == "directory")
+        f = io.open("tmp/hello.tree2/sub/big", "rb")
+        assert(f:read("*a") == big_file)
+        f:close()
+        f = io.open("tmp/hello.tree2/small", "rb")
+        assert(f:read("*a") == [[ hi ]])
+        f:close()
+        assert(fs.stat("tmp/hello.tree2/small").mtime == 42)
+        -- modified files are extracted again
+        f = io.open("tmp/hello.tree2/small", "w")
+        f:write "modified"
+        f:close()
+        assert(tonumber(io.popen("tmp"..fs.sep.."hello.exe a b c"):read("*a")) == 42)
+        f = io.open("tmp/hello.tree2/small", "rb")
+        assert(f:read("*a") == [[ hi ]])
+        f:close()
+        assert(fs.stat("tmp/hello.vflag") == nil)
+        assert(fs.stat("tmp/hello.vdir") == nil)
+        if sys.platform == 'Linux' then
+            os.execute("BL_TRACE_STARTUP=tmp/trace.json tmp/hello.exe a b c > /dev/null")
+            local trace = io.open("tmp/trace.json"):read("*a")
+            assert(trace:match('^{"traceEvents":%['))
+            assert(trace:match('"name":"luaL_openlibs"'))
+            assert(trace:match('"cat":"luaopen"'))
+            assert(trace:match('"name":"hello.lua","cat":"load"') or trace:match('"name":"startup","cat":"load"'))
+        end
     end
     end
     end
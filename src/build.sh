@@ -17,7 +17,7 @@ LZO_SRC=lzo-2.10
 LZO_URL=http://www.oberhumer.com/opensource/lzo/download/$LZO_SRC.tar.gz
 QLZ_SRC=quicklz
 QLZ_URL=http://www.quicklz.com/
-LZ4_REV=1.8.2
+LZ4_REV=1.9.4
 LZ4_SRC=lz4-$LZ4_REV
 LZ4_URL=https://github.com/lz4/lz4/archive/v$LZ4_REV.tar.gz
 LZF_SRC=liblzf-3.6
@@ -28,6 +28,9 @@ UCL_SRC=ucl-1.03
 UCL_URL=http://www.oberhumer.com/opensource/ucl/download/$UCL_SRC.tar.gz
 LZMA_SRC=xz-5.2.4
 LZMA_URL=http://tukaani.org/xz/$LZMA_SRC.tar.gz
+ZSTD_REV=1.5.6
+ZSTD_SRC=zstd-$ZSTD_REV
+ZSTD_URL=https://github.com/facebook/zstd/releases/download/v$ZSTD_REV/$ZSTD_SRC.tar.gz
 CURL_SRC=curl-7.53.1
 CURL_URL=http://curl.haxx.se/download/$CURL_SRC.tar.gz
 SOCKET_SRC=luasocket-2.0.2
@@ -81,20 +84,25 @@ mkdir -p $BUILD
 # Check configuration
 #####################
 
-for lib in PEGAR LZO MINILZO UCL QLZ LZ4 LZF LZMA ZLIB CRYPT CURL SOCKET BN BC LPEG
+for lib in PEGAR LZO MINILZO UCL QLZ LZ4 LZF LZMA ZSTD ZLIB CRYPT CURL SOCKET BN BC LPEG
 do
     eval USE_$lib=false
 done
 PEGAR_CONF+=" lua:stdlib.lua"
+PEGAR_CONF+=" mod:bl.bench=bench.lua"; LAZY_LIBS+=" bl.bench=bench"
 for lib in $LIBRARIES
 do
     case "$lib" in
         PEGAR)              export PEGAR_CONF+=" lua:pegar.lua"; eval USE_$lib=true;;
         LZO|MINILZO|UCL)    export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true;;
-        QLZ|LZ4|ZLIB|LZMA)  export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true;;
+        QLZ|LZ4|ZLIB|LZMA|ZSTD) export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true;;
         LZF)                export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true;;
-        CRYPT)              export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true; export PEGAR_CONF+=" lua:crypt.lua";;
-        CURL)               export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true; export PEGAR_CONF+=" lua:curl.lua";;
+        CRYPT)              export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true
+                            export PEGAR_CONF+=" mod:bl.crypt=$TARGET/crypt.lua"; LAZY_LIBS+=" bl.crypt=crypt"
+                            ;;
+        CURL)               export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true
+                            export PEGAR_CONF+=" mod:bl.curl=curl.lua"; LAZY_LIBS+=" bl.curl=curl"
+                            ;;
         SOCKET)             export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true;
                             export PEGAR_CONF+=" lua:$SOCKET_SRC/ltn12.lua=$TARGET/ltn12.lua"
                             export PEGAR_CONF+=" lua:$SOCKET_SRC/mime.lua=$TARGET/mime.lua"
@@ -104,11 +112,11 @@ do
                             export PEGAR_CONF+=" lua:$SOCKET_SRC/smtp.lua=$TARGET/smtp.lua"
                             export PEGAR_CONF+=" lua:$SOCKET_SRC/ftp.lua=$TARGET/ftp.lua"
                             export PEGAR_CONF+=" lua:$SOCKET_SRC/http.lua=$TARGET/http.lua"
-                            export PEGAR_CONF+=" lua:ftp.lua"
+                            export PEGAR_CONF+=" mod:bl.ftp=ftp.lua"; LAZY_LIBS+=" bl.ftp=FTP()"
                             ;;
-        BN)                 export PEGAR_CONF+=" lua:bn.lua"; eval USE_$lib=true;;
+        BN)                 export PEGAR_CONF+=" mod:bl.bn=bn.lua"; eval USE_$lib=true; LAZY_LIBS+=" bl.bn=bn";;
         BC)                 export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true
-                            export PEGAR_CONF+=" lua:bc.lua"
+                            export PEGAR_CONF+=" mod:bl.bc=bc.lua"; LAZY_LIBS+=" bl.bc=bc,m"
                             ;;
         LPEG)               export LUA_CONF+=" -DUSE_$lib"; eval USE_$lib=true
                             export PEGAR_CONF+=" lua:lpeg.lua=$TARGET/lpeg.lua"
@@ -116,6 +124,8 @@ do
         *)                  echo "Unknown library: $lib"; exit 1;;
     esac
 done
+# libraries loaded on demand are registered after the other scripts
+PEGAR_CONF+=" lua:lazy.lua=$TARGET/lazy.lua"
 
 $USE_LZO && $USE_MINILZO && {
     echo "Can not use both LZO and miniLZO"
@@ -144,7 +154,7 @@ esac
 
 case "$PLATFORM" in
     Linux)      LUA_CONF+=" -DLUA_USE_LINUX"
-                CC_LIBS2+=" -ldl -lreadline -lrt"
+                CC_LIBS2+=" -ldl -lreadline -lrt -lpthread"
                 HOST=""
                 ;;
     Windows)    #LUA_CONF+=" -DLUA_USE_LONGLONG"
@@ -196,6 +206,11 @@ $USE_LZMA && (
     [ -e $LZMA_SRC ] || tar xzf $(basename $LZMA_URL)
 )
 
+$USE_ZSTD && (
+    [ -e $(basename $ZSTD_URL) ] || wget $ZSTD_URL
+    [ -e $ZSTD_SRC ] || tar xzf $(basename $ZSTD_URL)
+)
+
 $USE_ZLIB && (
     [ -e $(basename $ZLIB_URL) ] || wget $ZLIB_URL
     [ -e $ZLIB_SRC ] || tar xzf $(basename $ZLIB_URL)
@@ -241,11 +256,18 @@ $USE_LZF && cp -f "$LZF_SRC"/{lzf_c.c,lzf_d.c,lzf.h,lzfP.h} $TARGET/
 $USE_ZLIB && ! [ -e $TARGET/$ZLIB_SRC ] && cp -rf $ZLIB_SRC $TARGET/
 $USE_UCL && ! [ -e $TARGET/$UCL_SRC ] && cp -rf $UCL_SRC $TARGET/
 $USE_LZMA && ! [ -e $TARGET/$LZMA_SRC ] && cp -rf $LZMA_SRC $TARGET/
+$USE_ZSTD && ! [ -e $TARGET/$ZSTD_SRC ] && cp -rf $ZSTD_SRC $TARGET/
 $USE_CURL && ! [ -e $TARGET/$CURL_SRC ] && cp -rf $CURL_SRC $TARGET/
 $USE_SOCKET && cp -f $SOCKET_SRC/src/*.{c,h,lua} $TARGET/
 $USE_BC && cp -f $BC_SRC/*.{c,h} $TARGET/
 $USE_LPEG && cp -rf $LPEG_SRC $TARGET/
 
+# lazy.lua registers the libraries loaded on demand (see package.lazy in stdlib.lua)
+for lib in $LAZY_LIBS
+do
+    echo "package.lazy(\"${lib%%=*}\", \"$(echo ${lib#*=} | sed 's/,/", "/g')\")"
+done > $TARGET/lazy.lua
+
 case "$PLATFORM" in
     Linux)      ;;
     Windows)    ;;
@@ -265,6 +287,18 @@ awk '
         print
         next
     }
+    /if \(script < argc &&/ {
+        print "  if (script < argc && bl_command(L, argv, script)) return 0;"
+        print
+        next
+    }
+    /luaL_openlibs\(L\)/ {
+        print "  bl_trace_init();"
+        print "  double bl_t0 = bl_trace_clock();"
+        print
+        print "  bl_trace(\"init\", \"luaL_openlibs\", NULL, bl_t0);"
+        next
+    }
     {print}
 ' $LUA_SRC/src/lua.c > $TARGET/lua.c
 
@@ -321,6 +355,9 @@ awk '
         print "#if defined(USE_LZMA)"
         print "  {LUA_LZMALIBNAME, luaopen_lzma},"
         print "#endif"
+        print "#if defined(USE_ZSTD)"
+        print "  {LUA_ZSTDLIBNAME, luaopen_zstd},"
+        print "#endif"
         print "#if defined(USE_CURL)"
         print "  {LUA_CURLLIBNAME, luaopen_cURL},"
         print "#endif"
@@ -341,6 +378,12 @@ awk '
         print "  {LUA_MATHLIBNAME\"x\", luaopen_mathx},"
         next
         }
+    /luaL_requiref\(L, lib->name, lib->func, 1\)/ {
+        print "    double bl_t0 = bl_trace_clock();"
+        print
+        print "    bl_trace(\"luaopen\", lib->name, NULL, bl_t0);"
+        next
+    }
     {print}
 ' $LUA_SRC/src/linit.c > $TARGET/linit.c
 
@@ -702,6 +745,24 @@ $USE_LZMA && cp -f $TARGET/$LZMA_SRC/src/liblzma/api/lzma/*.h $INCLUDE_PATH/lzma
 $USE_LZMA && CC_LIBS2+=" $LIBRARY_PATH/liblzma.a"
 $USE_LZMA && LUA_CONF+=" -DLZMA_LEVEL=6"
 
+# ZSTD configuration
+####################
+
+# the static library is multithreaded (ZSTD_MULTITHREAD) for the threads option of zstd
+LIB_ZSTD=$TARGET/$ZSTD_SRC/lib/libzstd.a
+$USE_ZSTD && ! [ -e $LIB_ZSTD ] && (
+    cd $TARGET/$ZSTD_SRC/lib
+    # zstd has no configure script, the toolchain is given to make
+    case $PLATFORM in
+        Linux)      make CC="$CC" AR="$AR" RANLIB="$RANLIB" libzstd.a-mt ;;
+        Windows)    make CC="$CC" AR="$AR" RANLIB="$RANLIB" TARGET_SYSTEM=Windows_NT libzstd.a-mt ;;
+    esac
+)
+$USE_ZSTD && cp -f $LIB_ZSTD $LIBRARY_PATH/
+$USE_ZSTD && cp -f $TARGET/$ZSTD_SRC/lib/{zstd.h,zstd_errors.h} $INCLUDE_PATH/
+$USE_ZSTD && CC_LIBS2+=" $LIBRARY_PATH/libzstd.a"
+$USE_ZSTD && LUA_CONF+=" -DZSTD_LEVEL=19"
+
 # cURL configuration
 ####################
 
@@ -827,6 +888,12 @@ echo "$CC $CC_OPTS $LUA_CONF $BONALUNA_CONF $CC_INC bl.c -o $TARGET/$BL $CC_LIBS
 $CC -g $CC_OPTS $LUA_CONF $BONALUNA_CONF $CC_INC bl.c -o $TARGET/$BL $CC_LIBS $CC_LIBS2 || error "Compilation error"
 $STRIP $TARGET/$BL
 [ -n "$COMPRESS" ] && $COMPRESS $TARGET/$BL && chmod +x $TARGET/$BL
+if $USE_CRYPT
+then
+    # AES tables are precomputed instead of being computed when crypt is loaded
+    $WINE $TARGET/$BL crypt.lua --tables > $TARGET/crypt_tables.lua || error "Crypt tables computation error"
+    sed -e "/@CRYPT_TABLES@/r $TARGET/crypt_tables.lua" -e "/@CRYPT_TABLES@/d" crypt.lua > $TARGET/crypt.lua
+fi
 $WINE $TARGET/$BL ../tools/pegar.lua read:$TARGET/$BL $PEGAR_CONF write:$BL
 #cp $TARGET/$BL .
 
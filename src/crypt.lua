@@ -10,6 +10,9 @@ Freely available under the terms of the MIT license.
 
 --]]
 
+-- "crypt.lua --tables" prints the AES tables precomputed by build.sh
+local dump_tables = ... == "--tables"
+
 local strlen  = string.len
 local strchar = string.char
 local strbyte = string.byte
@@ -673,8 +676,6 @@ do
         end
     end
 
-    initMulTable()
-
     -- Implementation of AES with pure lua
     --
     -- AES with lua is slow, really slow :-)
@@ -1079,10 +1080,48 @@ do
         return intsToBytes(state, output, outputOffset)
     end
 
-    -- calculate all tables when loading this file
-    calcSBox()
-    calcRoundTables()
-    calcInvRoundTables()
+    -- tables precomputed by build.sh
+    local tables = nil
+    -- @CRYPT_TABLES@
+
+    if tables then
+        exp, log = tables.exp, tables.log
+        SBox, iSBox = tables.SBox, tables.iSBox
+        table0, table1, table2, table3 = tables.table0, tables.table1, tables.table2, tables.table3
+        tableInv0, tableInv1, tableInv2, tableInv3 = tables.tableInv0, tables.tableInv1, tables.tableInv2, tables.tableInv3
+    else
+        -- calculate all tables when loading this file
+        initMulTable()
+        calcSBox()
+        calcRoundTables()
+        calcInvRoundTables()
+    end
+
+    if dump_tables then
+        local function dump(name, t)
+            local first = t[0] and 0 or 1
+            local items = {}
+            for i = first, 255 do
+                if t[i] == nil then break end
+                items[#items+1] = t[i]
+            end
+            io.write(("        %s = {%s%s},\n"):format(name, first == 0 and "[0]=" or "", concat(items, ",")))
+        end
+        io.write("    tables = {\n")
+        dump("exp", exp)
+        dump("log", log)
+        dump("SBox", SBox)
+        dump("iSBox", iSBox)
+        dump("table0", table0)
+        dump("table1", table1)
+        dump("table2", table2)
+        dump("table3", table3)
+        dump("tableInv0", tableInv0)
+        dump("tableInv1", tableInv1)
+        dump("tableInv2", tableInv2)
+        dump("tableInv3", tableInv3)
+        io.write("    }\n")
+    end
 
     -- Encrypt strings
     -- key - byte array with key
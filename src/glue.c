@@ -11,277 +11,1850 @@ Freely available under the terms of the MIT license.
 
 /* Inspired by srlua */
 
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+
+typedef enum
+{
+    START_SIG       = 0x45554C47,
+    END_SIG         = 0x444E4523,
+} t_block_sig;
+
 typedef enum
 {
-    START_SIG       = 0x45554C47,
-    END_SIG         = 0x444E4523,
-} t_block_sig;
+    LUA_BLOCK       = 0x41554C23,
+    STRING_BLOCK    = 0x52545323,
+    FILE_BLOCK      = 0x53455223,
+    DIR_BLOCK       = 0x52494423,
+    MODULE_BLOCK    = 0x444F4D23,
+    TOC_BLOCK       = 0x434F5423,
+    VFILE_BLOCK     = 0x53465623,
+    VDIR_BLOCK      = 0x52445623,
+    SOLID_BLOCK     = 0x444C5323,
+    TREE_BLOCK      = 0x45525423,
+    TREE_FILE_BLOCK = 0x46525423,
+} t_block_type;
+
+/* A TREE_BLOCK is a directory tree extracted at runtime.
+ * Its name is the root of the tree and its data is the manifest of the tree:
+ *      - the number of entries (unsigned int)
+ *      - for each entry (directories before their contents):
+ *          - the kind of the entry (unsigned int, 0: directory, 1: file)
+ *          - the permissions (unsigned int)
+ *          - the modification time (64-bit integer)
+ *          - the size of the file (unsigned int)
+ *          - the hash of the file (null terminated string, see bl_hash, may be empty)
+ *          - the path relative to the root (null terminated string, '/' separators)
+ * The payloads of the files are in the TREE_FILE_BLOCKs that follow
+ * the TREE_BLOCK (in the same order as in the manifest).
+ */
+
+/* In solid mode, the payloads of the blocks are concatenated in a stream
+ * stored in SOLID_BLOCKs. The stream is cut in chunks of fixed size
+ * that are compressed independently. The data of a SOLID_BLOCK contains:
+ *      - the size of the chunks (unsigned int)
+ *      - the size of the whole stream (unsigned int)
+ *      - the number of chunks (unsigned int)
+ *      - the size of each compressed chunk (unsigned int)
+ *      - the compressed chunks
+ * The type of a block stored in a solid block starts with '@' instead of '#'
+ * and its data is a reference to the stream:
+ *      - the index of the solid block in the glue (unsigned int)
+ *      - the offset of the payload in the stream (unsigned int)
+ *      - the size of the payload (unsigned int)
+ */
+
+/* Identical payloads are stored once. The type of a block whose payload
+ * is stored by a previous block starts with '=' instead of '#'
+ * and its data is the offset of this block from the start block (unsigned int).
+ */
+
+#define SOLID_REF(type)     ((t_block_type)(((type) & ~0xFFu) | '@'))
+#define IS_SOLID_REF(type)  (((type) & 0xFF) == '@')
+#define DEDUP_REF(type)     ((t_block_type)(((type) & ~0xFFu) | '='))
+#define IS_DEDUP_REF(type)  (((type) & 0xFF) == '=')
+#define BASE_TYPE(type)     ((t_block_type)(((type) & ~0xFFu) | '#'))
+
+typedef struct
+{
+    t_block_sig sig;
+} t_start_block;
+
+typedef struct
+{
+    t_block_type type;
+    unsigned int name_len;
+    unsigned int data_len;
+} t_block;
+
+typedef struct
+{
+    t_block_sig sig;
+    unsigned int size;
+} t_end_block;
+
+/* The TOC block is the last block of the glue (just before the end block).
+ * Its data contains:
+ *      - the number of modules (unsigned int)
+ *      - for each module: the offset of the module block from the start block
+ *        (unsigned int) and the name of the module (null terminated string)
+ *      - the size of the whole TOC block (unsigned int) so that it can be found
+ *        from the end block
+ */
+
+static int docall (lua_State *L, int narg, int nres);
+static int report (lua_State *L, int status);
+
+#define cant(x, name) luaL_error(L, "cannot %s %s: %s", x, name, strerror(errno))
+
+static void glue_setarg(lua_State *L, char **argv, int argc, int script, char *exename)
+{
+    int i;
+    lua_newtable(L);
+    lua_pushinteger(L, -1);
+    lua_pushstring(L, exename);
+    lua_rawset(L, -3);
+    for (i=1; argv[i]; i++)
+    {
+        lua_pushinteger(L, i);
+        lua_pushstring(L, argv[i]);
+        lua_rawset(L, -3);
+    }
+    lua_setglobal(L, "arg");
+}
+
+static void glue_setarg0(lua_State *L, const char *arg0)
+{
+    lua_getglobal(L, "arg");
+    lua_pushinteger(L, 0);
+    lua_pushstring(L, arg0);
+    lua_rawset(L, -3);
+    lua_remove(L, 0);
+}
+
+#ifdef __MINGW32__
+/* GetModuleFileName defined in windows.h */
+#else
+static int GetModuleFileName(void *null, char *exename, size_t bufsize)
+{
+    char link[32];
+    ssize_t n;
+    sprintf(link, "/proc/%d/exe", getpid());
+    n = readlink(link, exename, bufsize);
+    if (n<0) return 0;
+    exename[n] = '\0';
+    return 1;
+}
+#endif
+
+/* The glue is read from a memory image of the executable.
+ * The executable is mapped in memory when possible so that blocks are
+ * given to Lua without any copy.
+ * Otherwise the glue is read in a single buffer.
+ */
+
+typedef enum
+{
+    CHUNK_TODO,             /* compressed chunk */
+    CHUNK_RUNNING,          /* chunk being decompressed */
+    CHUNK_DONE,             /* decompressed chunk */
+    CHUNK_BAD,              /* corrupted chunk */
+} t_chunk_state;
+
+typedef struct
+{
+    unsigned int chunk_size;    /* size of the chunks (the last one may be smaller) */
+    unsigned int size;          /* size of the whole stream */
+    unsigned int nb_chunks;
+    const char **chunks;        /* chunks (in the image or decompressed) */
+    unsigned int *chunk_lens;   /* size of the chunks in the image */
+    char **uncompressed;        /* decompressed chunks to be freed */
+    t_chunk_state *state;
+#ifdef BL_THREADS
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+#endif
+} t_glue_solid;
+
+typedef struct
+{
+    char *map;              /* memory mapped executable (NULL if not mapped) */
+    size_t map_size;        /* size of the mapped executable */
+    char *buffer;           /* glue read with fread when mmap is not available */
+    const char *start;      /* start block */
+    const char *end;        /* end block */
+    const char *toc;        /* module index (NULL if the glue has no TOC block) */
+    const char *toc_end;    /* end of the module index */
+    t_glue_solid *solids;   /* solid blocks (decompressed on demand) */
+    int nb_solids;
+} t_glue_image;
+
+/* The image is kept in memory as long as modules can be loaded from it */
+static t_glue_image glue_image;
+
+static void glue_map(FILE *f, t_glue_image *image)
+{
+    struct stat st;
+    image->map = NULL;
+    image->map_size = 0;
+    if (fstat(fileno(f), &st) != 0 || st.st_size < (off_t)sizeof(t_end_block)) return;
+#ifdef __MINGW32__
+    {
+        HANDLE hFile = (HANDLE)_get_osfhandle(fileno(f));
+        HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMap == NULL) return;
+        image->map = (char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMap);
+        if (image->map == NULL) return;
+    }
+#else
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (map == MAP_FAILED) return;
+        image->map = (char*)map;
+    }
+#endif
+    image->map_size = st.st_size;
+}
+
+static void glue_solid_free(t_glue_image *image)
+{
+    int i;
+    unsigned int j;
+    for (i = 0; i < image->nb_solids; i++)
+    {
+        t_glue_solid *s = &image->solids[i];
+        for (j = 0; j < s->nb_chunks; j++)
+            if (s->uncompressed[j]) free(s->uncompressed[j]);
+        free(s->chunks);
+        free(s->chunk_lens);
+        free(s->uncompressed);
+        free(s->state);
+#ifdef BL_THREADS
+        pthread_mutex_destroy(&s->mutex);
+        pthread_cond_destroy(&s->done);
+#endif
+    }
+    if (image->solids) free(image->solids);
+    image->solids = NULL;
+    image->nb_solids = 0;
+}
+
+static void glue_unmap(t_glue_image *image)
+{
+    glue_solid_free(image);
+    if (image->map)
+    {
+#ifdef __MINGW32__
+        UnmapViewOfFile(image->map);
+#else
+        munmap(image->map, image->map_size);
+#endif
+        image->map = NULL;
+    }
+    if (image->buffer)
+    {
+        free(image->buffer);
+        image->buffer = NULL;
+    }
+    image->toc = NULL;
+    image->toc_end = NULL;
+}
+
+/* glue_open reads the glue of the executable f.
+ * Returns 1 if the executable contains a glue, 0 otherwise.
+ */
+static int glue_open(lua_State *L, FILE *f, const char *exename, t_glue_image *image)
+{
+    t_end_block end_block;
+    t_start_block start_block;
+
+    image->buffer = NULL;
+    image->solids = NULL;
+    image->nb_solids = 0;
+    glue_map(f, image);
+
+    if (image->map)
+    {
+        /* search for the start block in the mapped executable */
+        memcpy(&end_block, image->map + image->map_size - sizeof(t_end_block), sizeof(t_end_block));
+        if (end_block.sig != END_SIG || end_block.size > image->map_size)
+        {
+            /* Nothing to load */
+            glue_unmap(image);
+            return 0;
+        }
+        image->start = image->map + image->map_size - end_block.size;
+    }
+    else
+    {
+        /* search for the start block with fread */
+        if (fseek(f, -(ssize_t)sizeof(t_end_block), SEEK_END) != 0) cant("seek", exename);
+        if (fread(&end_block, sizeof(t_end_block), 1, f) != 1) cant("read", exename);
+        if (end_block.sig != END_SIG)
+        {
+            /* Nothing to load */
+            return 0;
+        }
+        if (fseek(f, -(long int)end_block.size, SEEK_END) != 0) cant("seek", exename);
+        image->buffer = (char*)malloc(end_block.size);
+        if (image->buffer == NULL) luaL_error(L, "not enough memory to load %s", exename);
+        if (fread(image->buffer, sizeof(char), end_block.size, f) != end_block.size) cant("read", exename);
+        image->start = image->buffer;
+    }
+    if (end_block.size < sizeof(t_start_block) + sizeof(t_end_block))
+    {
+        /* Truncated glue */
+        glue_unmap(image);
+        luaL_error(L, "bad start signature in %s", exename);
+        return 0;
+    }
+    image->end = image->start + end_block.size - sizeof(t_end_block);
+    image->toc = NULL;
+    image->toc_end = NULL;
+
+    memcpy(&start_block, image->start, sizeof(t_start_block));
+    if (start_block.sig != START_SIG)
+    {
+        /* Bad start signature */
+        glue_unmap(image);
+        luaL_error(L, "bad start signature in %s", exename);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* glue_find_toc searches for the TOC block just before the end block */
+static void glue_find_toc(t_glue_image *image)
+{
+    unsigned int toc_size;
+    const char *first = image->start + sizeof(t_start_block);
+    t_block block;
+    if ((size_t)(image->end - first) < sizeof(t_block) + sizeof(unsigned int)) return;
+    memcpy(&toc_size, image->end - sizeof(unsigned int), sizeof(unsigned int));
+    if (toc_size < sizeof(t_block) + 2*sizeof(unsigned int) || toc_size > (size_t)(image->end - first)) return;
+    memcpy(&block, image->end - toc_size, sizeof(t_block));
+    if (block.type != TOC_BLOCK) return;
+    if ((size_t)sizeof(t_block) + block.name_len + block.data_len != toc_size) return;
+    if (block.data_len < 2*sizeof(unsigned int)) return; /* number of entries and size of the TOC */
+    image->toc = image->end - toc_size + sizeof(t_block) + block.name_len;
+    image->toc_end = image->end - sizeof(unsigned int);
+}
+
+/* glue_uncompress returns the decompressed data (to be freed) or NULL
+ * if the data is not compressed
+ */
+static char *glue_uncompress(lua_State *L, const char *name, const char **data, unsigned int *data_len)
+{
+#ifdef USE_Z
+    if (*data_len >= sizeof(t_z_header))
+    {
+        char *uncompressed;
+        size_t uncompressed_len;
+        double t = bl_trace_clock();
+        int n = bl_z_decompress_core(L, *data, *data_len, &uncompressed, &uncompressed_len);
+        if (n == 0) /* decompression is ok */
+        {
+            if (bl_tracing())
+            {
+                char detail[64];
+                snprintf(detail, sizeof(detail), "%s: %u -> %u bytes",
+                         bl_z_codec(*data, *data_len), *data_len, (unsigned int)uncompressed_len);
+                bl_trace("decompress", name, detail, t);
+            }
+            /* The data was compressed */
+            *data = uncompressed;
+            *data_len = uncompressed_len;
+            return uncompressed;
+        }
+        if (n > 0 && L)
+        {
+            /* The data was not compressed */
+            lua_pop(L, n);
+        }
+    }
+#endif
+    return NULL;
+}
+
+/* glue_solid_add reads the header of a solid block.
+ * Returns 0 if the solid block is corrupted or if there is not enough memory
+ * (the solid blocks already added are kept).
+ */
+static int glue_solid_add(t_glue_image *image, const char *data, unsigned int data_len)
+{
+    t_glue_solid *s = &image->solids[image->nb_solids];
+    unsigned int header[3];
+    unsigned int i, len;
+    size_t offset;
+    if (data_len < sizeof(header)) return 0;
+    memcpy(header, data, sizeof(header));
+    s->chunk_size = header[0];
+    s->size = header[1];
+    s->nb_chunks = header[2];
+    if (s->chunk_size == 0) return 0;
+    if (s->nb_chunks != s->size/s->chunk_size + (s->size%s->chunk_size != 0)) return 0;
+    if (s->nb_chunks > (data_len - sizeof(header)) / sizeof(unsigned int)) return 0;
+    offset = sizeof(header) + s->nb_chunks*sizeof(unsigned int);
+    for (i = 0; i < s->nb_chunks; i++)
+    {
+        memcpy(&len, data + sizeof(header) + i*sizeof(unsigned int), sizeof(unsigned int));
+        offset += len;
+    }
+    if (offset != data_len) return 0;
+    s->chunks = (const char **)malloc((s->nb_chunks+1) * sizeof(const char *));
+    s->chunk_lens = (unsigned int *)malloc((s->nb_chunks+1) * sizeof(unsigned int));
+    s->uncompressed = (char **)malloc((s->nb_chunks+1) * sizeof(char *));
+    s->state = (t_chunk_state *)malloc((s->nb_chunks+1) * sizeof(t_chunk_state));
+    if (!s->chunks || !s->chunk_lens || !s->uncompressed || !s->state)
+    {
+        free(s->chunks);
+        free(s->chunk_lens);
+        free(s->uncompressed);
+        free(s->state);
+        return 0;
+    }
+    offset = sizeof(header) + s->nb_chunks*sizeof(unsigned int);
+    for (i = 0; i < s->nb_chunks; i++)
+    {
+        memcpy(&s->chunk_lens[i], data + sizeof(header) + i*sizeof(unsigned int), sizeof(unsigned int));
+        s->chunks[i] = data + offset;
+        s->uncompressed[i] = NULL;
+        s->state[i] = CHUNK_TODO;
+        offset += s->chunk_lens[i];
+    }
+#ifdef BL_THREADS
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->done, NULL);
+#endif
+    image->nb_solids++;
+    return 1;
+}
+
+/* glue_solid_chunk decompresses a chunk (once).
+ * It must not use any Lua state (it is called by the threads).
+ */
+static int glue_solid_chunk(t_glue_solid *s, unsigned int i)
+{
+    t_chunk_state state;
+#ifdef BL_THREADS
+    pthread_mutex_lock(&s->mutex);
+    while (s->state[i] == CHUNK_RUNNING) pthread_cond_wait(&s->done, &s->mutex);
+#endif
+    state = s->state[i];
+    if (state == CHUNK_TODO)
+    {
+        unsigned int len = s->chunk_lens[i];
+        unsigned int expected = i < s->nb_chunks-1 ? s->chunk_size : s->size - i*s->chunk_size;
+        s->state[i] = CHUNK_RUNNING;
+#ifdef BL_THREADS
+        pthread_mutex_unlock(&s->mutex);
+#endif
+        s->uncompressed[i] = glue_uncompress(NULL, "solid chunk", &s->chunks[i], &len);
+        state = len == expected ? CHUNK_DONE : CHUNK_BAD;
+#ifdef BL_THREADS
+        pthread_mutex_lock(&s->mutex);
+#endif
+        s->state[i] = state;
+#ifdef BL_THREADS
+        pthread_cond_broadcast(&s->done);
+#endif
+    }
+#ifdef BL_THREADS
+    pthread_mutex_unlock(&s->mutex);
+#endif
+    return state == CHUNK_DONE;
+}
+
+/* glue_payload returns the payload of a block (decompressed if needed)
+ * and the buffer to be freed in *buffer (or NULL).
+ * A payload stored in a single chunk of a solid block is not copied.
+ * Returns 0 if the payload is corrupted.
+ * It must not use any Lua state (it is called by the threads).
+ */
+static int glue_payload(const char *name, int ref, const char **data, unsigned int *data_len, char **buffer)
+{
+    unsigned int r[3];
+    t_glue_solid *s;
+    unsigned int first, last, i;
+    *buffer = NULL;
+    if (!ref)
+    {
+        *buffer = glue_uncompress(NULL, name, data, data_len);
+        return 1;
+    }
+    if (*data_len != sizeof(r)) return 0;
+    memcpy(r, *data, sizeof(r));
+    if (r[0] >= (unsigned int)glue_image.nb_solids) return 0;
+    s = &glue_image.solids[r[0]];
+    if (r[1] > s->size || r[2] > s->size - r[1]) return 0;
+    *data_len = r[2];
+    if (r[2] == 0)
+    {
+        *data = "";
+        return 1;
+    }
+    first = r[1] / s->chunk_size;
+    last = (r[1] + r[2] - 1) / s->chunk_size;
+    for (i = first; i <= last; i++)
+        if (!glue_solid_chunk(s, i)) return 0;
+    if (first == last)
+    {
+        *data = s->chunks[first] + r[1] % s->chunk_size;
+    }
+    else
+    {
+        /* the payload is split across several chunks */
+        unsigned int offset = r[1], len = r[2];
+        char *p = *buffer = (char *)malloc(r[2]);
+        for (i = first; i <= last; i++)
+        {
+            unsigned int start = offset - i*s->chunk_size;
+            unsigned int n = s->chunk_size - start;
+            if (n > len) n = len;
+            memcpy(p, s->chunks[i] + start, n);
+            p += n;
+            offset += n;
+            len -= n;
+        }
+        *data = *buffer;
+    }
+    return 1;
+}
+
+/* glue_dedup_target returns the data of the block storing the payload
+ * of a deduplicated block (NULL if the reference is invalid)
+ */
+static const char *glue_dedup_target(const t_glue_image *image, const char *data, unsigned int data_len, t_block *target)
+{
+    unsigned int offset;
+    const char *p;
+    if (data_len != sizeof(unsigned int)) return NULL;
+    memcpy(&offset, data, sizeof(unsigned int));
+    if (offset > (size_t)(image->end - image->start) - sizeof(t_block)) return NULL;
+    p = image->start + offset;
+    memcpy(target, p, sizeof(t_block));
+    p += sizeof(t_block);
+    if (IS_DEDUP_REF(target->type)) return NULL;
+    if ((size_t)target->name_len + target->data_len > (size_t)(image->end - p)) return NULL;
+    return p + target->name_len;
+}
+
+/* glue_searcher is a package.searchers function
+ * that loads modules from the glue
+ */
+static int glue_searcher(lua_State *L)
+{
+    const char *modname = luaL_checkstring(L, 1);
+    const char *p = glue_image.toc;
+    unsigned int n, offset;
+    t_block block;
+    const char *name, *data;
+    char *uncompressed_data;
+    int status, ref;
+    double t;
+    if (p == NULL) return 0;
+    memcpy(&n, p, sizeof(unsigned int));
+    p += sizeof(unsigned int);
+    while (n-- > 0 && p + sizeof(unsigned int) < glue_image.toc_end)
+    {
+        size_t len;
+        memcpy(&offset, p, sizeof(unsigned int));
+        p += sizeof(unsigned int);
+        /* the name of the entry must be terminated inside the TOC */
+        if (memchr(p, '\0', glue_image.toc_end - p) == NULL) break;
+        len = strlen(p);
+        if (strcmp(p, modname) == 0)
+        {
+            if (offset > (size_t)(glue_image.end - glue_image.start) - sizeof(t_block)) break;
+            memcpy(&block, glue_image.start + offset, sizeof(t_block));
+            name = glue_image.start + offset + sizeof(t_block);
+            data = name + block.name_len;
+            if (BASE_TYPE(block.type) != MODULE_BLOCK || data + block.data_len > glue_image.end) break;
+            if (block.name_len == 0 || name[block.name_len-1] != '\0') break;
+            if (IS_DEDUP_REF(block.type))
+            {
+                /* the payload is stored by another block */
+                t_block target;
+                data = glue_dedup_target(&glue_image, data, block.data_len, &target);
+                if (data == NULL) break;
+                block.type = target.type;
+                block.data_len = target.data_len;
+            }
+            ref = IS_SOLID_REF(block.type);
+            if (!glue_payload(name, ref, &data, &block.data_len, &uncompressed_data))
+            {
+                return luaL_error(L, "error loading module '%s' from the glue:\n\tbad solid block", modname);
+            }
+            t = bl_trace_clock();
+            status = luaL_loadbuffer(L, data, block.data_len, name);
+            bl_trace("load", name, NULL, t);
+            if (uncompressed_data) free(uncompressed_data);
+            if (status != LUA_OK)
+            {
+                return luaL_error(L, "error loading module '%s' from the glue:\n\t%s",
+                                  modname, lua_tostring(L, -1));
+            }
+            lua_pushstring(L, name);
+            return 2;
+        }
+        p += len + 1;
+    }
+    lua_pushfstring(L, "\n\tno module '%s' in the glue", modname);
+    return 1;
+}
+
+/* glue_add_searcher inserts glue_searcher just after the preload searcher */
+static void glue_add_searcher(lua_State *L)
+{
+    int i, n;
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchers");
+    n = lua_rawlen(L, -1);
+    for (i = n; i >= 2; i--)
+    {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_pushcfunction(L, glue_searcher);
+    lua_rawseti(L, -2, 2);
+    lua_pop(L, 2);
+}
+
+/* Embedded files and directories (VFILE_BLOCK and VDIR_BLOCK) are not
+ * extracted. They are served by an in-memory overlay of io.open, io.lines,
+ * loadfile, fs.stat and fs.listdir. The payloads stay in the image and are
+ * decompressed on demand (the decompressed payloads are cached).
+ * Files opened for writing are not concerned by the overlay.
+ */
+
+typedef struct
+{
+    char *path;                 /* normalized absolute path */
+    int is_dir;
+    const char *data;           /* payload (in the image or decompressed) */
+    unsigned int data_len;
+    int ref;                    /* data is a reference to a solid block */
+    char *cache;                /* decompressed payload */
+    int loaded;                 /* data is the uncompressed payload */
+} t_vfs_entry;
+
+typedef struct
+{
+    t_vfs_entry *entries;
+    int nb_entries;
+    int max_entries;
+    time_t mtime;               /* date of the executable */
+} t_vfs;
+
+static t_vfs glue_vfs;
+
+/* the registry table BL_VFS maps normalized paths to entry indices */
+#define BL_VFS "bl.vfs"
+
+/* vfs_normalize builds the absolute path of name without ".", ".."
+ * and duplicate separators (the separator is always '/')
+ */
+static int vfs_normalize(const char *name, char *path)
+{
+    char full[2*BL_PATHSIZE];
+    const char *p;
+    size_t len = 0;
+    size_t root = 0;
+    full[0] = '\0';
+    if (!(name[0] == '/' || name[0] == '\\' || (name[0] && name[1] == ':')))
+    {
+        if (getcwd(full, BL_PATHSIZE) == NULL) return 0;
+        strcat(full, "/");
+    }
+    if (strlen(full) + strlen(name) >= sizeof(full)) return 0;
+    strcat(full, name);
+    p = full;
+    if (p[0] && p[1] == ':')
+    {
+        /* drive letter */
+        path[len++] = *p++;
+        path[len++] = *p++;
+        root = len;
+    }
+    while (*p)
+    {
+        const char *q;
+        size_t n;
+        while (*p == '/' || *p == '\\') p++;
+        for (q = p; *q && *q != '/' && *q != '\\'; q++) ;
+        n = q - p;
+        if (n == 0 || (n == 1 && p[0] == '.'))
+        {
+            /* nothing to add */
+        }
+        else if (n == 2 && p[0] == '.' && p[1] == '.')
+        {
+            /* remove the last component */
+            while (len > root && path[--len] != '/') ;
+        }
+        else
+        {
+            if (len + 1 + n >= BL_PATHSIZE) return 0;
+            path[len++] = '/';
+            memcpy(path+len, p, n);
+            len += n;
+        }
+        p = q;
+    }
+    if (len == root) path[len++] = '/';
+    path[len] = '\0';
+    return 1;
+}
+
+/* vfs_basename returns the name of path in the directory dir or NULL */
+static const char *vfs_basename(const char *dir, const char *path)
+{
+    size_t n = strlen(dir);
+    if (strncmp(dir, path, n) != 0) return NULL;
+    if (dir[n-1] != '/')
+    {
+        if (path[n] != '/') return NULL;
+        n++;
+    }
+    if (path[n] == '\0' || strchr(path+n, '/')) return NULL;
+    return path+n;
+}
+
+static t_vfs_entry *vfs_lookup(lua_State *L, const char *path)
+{
+    t_vfs_entry *e = NULL;
+    lua_getfield(L, LUA_REGISTRYINDEX, BL_VFS);
+    if (lua_getfield(L, -1, path) == LUA_TNUMBER)
+    {
+        e = &glue_vfs.entries[lua_tointeger(L, -1)];
+    }
+    lua_pop(L, 2);
+    return e;
+}
+
+static t_vfs_entry *vfs_find(lua_State *L, const char *name)
+{
+    char path[BL_PATHSIZE];
+    if (!vfs_normalize(name, path)) return NULL;
+    return vfs_lookup(L, path);
+}
+
+/* vfs_add adds a file or a directory (and its parent directories) to the overlay */
+static void vfs_add(lua_State *L, const char *name, int is_dir, const char *data, unsigned int data_len, int ref)
+{
+    char path[BL_PATHSIZE];
+    char *p;
+    t_vfs_entry *e;
+    if (!vfs_normalize(name, path)) luaL_error(L, "bad path: %s", name);
+    lua_getfield(L, LUA_REGISTRYINDEX, BL_VFS);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, BL_VFS);
+    }
+    for (p = strchr(path + (path[1] == ':' ? 3 : 1), '/'); ; p = strchr(p+1, '/'))
+    {
+        /* parent directories are implicitly created */
+        if (p) *p = '\0';
+        if (lua_getfield(L, -1, path) == LUA_TNUMBER)
+        {
+            e = &glue_vfs.entries[lua_tointeger(L, -1)];
+            lua_pop(L, 1);
+        }
+        else
+        {
+            lua_pop(L, 1);
+            if (glue_vfs.nb_entries == glue_vfs.max_entries)
+            {
+                glue_vfs.max_entries = glue_vfs.max_entries ? 2*glue_vfs.max_entries : 64;
+                glue_vfs.entries = (t_vfs_entry*)realloc(glue_vfs.entries, glue_vfs.max_entries*sizeof(t_vfs_entry));
+            }
+            lua_pushinteger(L, glue_vfs.nb_entries);
+            lua_setfield(L, -2, path);
+            e = &glue_vfs.entries[glue_vfs.nb_entries++];
+            e->path = strdup(path);
+            e->is_dir = 1;
+            e->data = NULL;
+            e->data_len = 0;
+            e->ref = 0;
+            e->cache = NULL;
+            e->loaded = 1;
+        }
+        if (p == NULL) break;
+        *p = '/';
+    }
+    if (!is_dir)
+    {
+        if (e->cache) free(e->cache);
+        e->is_dir = 0;
+        e->data = data;
+        e->data_len = data_len;
+        e->ref = ref;
+        e->cache = NULL;
+        e->loaded = 0;
+    }
+    lua_pop(L, 1);
+}
+
+/* vfs_load decompresses the payload of an entry (once) */
+static void vfs_load(lua_State *L, t_vfs_entry *e)
+{
+    if (!e->loaded)
+    {
+        if (!glue_payload(e->path, e->ref, &e->data, &e->data_len, &e->cache))
+        {
+            luaL_error(L, "bad solid block for %s", e->path);
+        }
+        e->loaded = 1;
+    }
+}
+
+static int vfs_fclose(lua_State *L)
+{
+    luaL_Stream *p = (luaL_Stream *)luaL_checkudata(L, 1, LUA_FILEHANDLE);
+    int res = fclose(p->f);
+    return luaL_fileresult(L, (res == 0), NULL);
+}
+
+/* vfs_newfile pushes a Lua file handle reading the payload of an entry */
+static int vfs_newfile(lua_State *L, t_vfs_entry *e, const char *name)
+{
+    luaL_Stream *p = (luaL_Stream *)lua_newuserdata(L, sizeof(luaL_Stream));
+    p->closef = NULL;
+    luaL_setmetatable(L, LUA_FILEHANDLE);
+    vfs_load(L, e);
+#ifdef __MINGW32__
+    /* no fmemopen */
+    p->f = tmpfile();
+    if (p->f != NULL)
+    {
+        if (fwrite(e->data, sizeof(char), e->data_len, p->f) != e->data_len)
+        {
+            fclose(p->f);
+            p->f = NULL;
+        }
+        else
+        {
+            rewind(p->f);
+        }
+    }
+#else
+    if (e->data_len == 0)
+        p->f = fopen("/dev/null", "rb");
+    else
+        p->f = fmemopen((void*)e->data, e->data_len, "rb");
+#endif
+    if (p->f == NULL) return luaL_fileresult(L, 0, name);
+    p->closef = &vfs_fclose;
+    return 1;
+}
+
+/* vfs_original calls the overloaded function with the same arguments */
+static int vfs_original(lua_State *L)
+{
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L)-1, LUA_MULTRET);
+    return lua_gettop(L);
+}
+
+static int vfs_io_open(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    const char *mode = luaL_optstring(L, 2, "r");
+    t_vfs_entry *e;
+    if (strpbrk(mode, "wa+") == NULL && (e = vfs_find(L, name)) && !e->is_dir)
+    {
+        return vfs_newfile(L, e, name);
+    }
+    return vfs_original(L);
+}
+
+/* vfs_lines_iter closes the file at the end like io.lines */
+static int vfs_lines_iter(lua_State *L)
+{
+    int n;
+    lua_settop(L, 0);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_call(L, 0, LUA_MULTRET);
+    n = lua_gettop(L);
+    if (n == 0 || lua_isnil(L, 1))
+    {
+        lua_pushvalue(L, lua_upvalueindex(2));
+        lua_getfield(L, -1, "close");
+        lua_insert(L, -2);
+        lua_call(L, 1, 0);
+    }
+    return n;
+}
+
+static int vfs_io_lines(lua_State *L)
+{
+    t_vfs_entry *e;
+    if (lua_isstring(L, 1) && (e = vfs_find(L, lua_tostring(L, 1))) && !e->is_dir)
+    {
+        int n = lua_gettop(L);
+        int i;
+        if (vfs_newfile(L, e, lua_tostring(L, 1)) != 1) return luaL_error(L, "%s", lua_tostring(L, -2));
+        lua_getfield(L, -1, "lines");       /* file:lines(...) */
+        lua_pushvalue(L, -2);
+        for (i = 2; i <= n; i++) lua_pushvalue(L, i);
+        lua_call(L, n, 1);
+        lua_insert(L, -2);                  /* iterator, file */
+        lua_pushcclosure(L, vfs_lines_iter, 2);
+        return 1;
+    }
+    return vfs_original(L);
+}
+
+static int vfs_loadfile(lua_State *L)
+{
+    t_vfs_entry *e;
+    if (lua_isstring(L, 1) && (e = vfs_find(L, lua_tostring(L, 1))) && !e->is_dir)
+    {
+        const char *name = lua_tostring(L, 1);
+        const char *mode = luaL_optstring(L, 2, NULL);
+        int env = (!lua_isnone(L, 3) ? 3 : 0);
+        const char *data;
+        size_t data_len;
+        vfs_load(L, e);
+        data = e->data;
+        data_len = e->data_len;
+        if (data_len > 0 && data[0] == '#')
+        {
+            /* skip the first line (but not the newline to keep line numbers) */
+            while (data_len > 0 && *data != '\n') { data++; data_len--; }
+        }
+        lua_pushfstring(L, "@%s", name);
+        if (luaL_loadbufferx(L, data, data_len, lua_tostring(L, -1), mode) == LUA_OK)
+        {
+            if (env != 0)
+            {
+                lua_pushvalue(L, env);
+                if (!lua_setupvalue(L, -2, 1)) lua_pop(L, 1);
+            }
+            return 1;
+        }
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+    return vfs_original(L);
+}
+
+static int vfs_stat(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    t_vfs_entry *e = vfs_find(L, name);
+    if (e == NULL) return vfs_original(L);
+    if (e->is_dir)
+    {
+        /* existing directories are preferred */
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushvalue(L, 1);
+        lua_call(L, 1, 1);
+        if (!lua_isnil(L, -1)) return 1;
+        lua_pop(L, 1);
+    }
+    else
+    {
+        vfs_load(L, e);
+    }
+#define STRING(VAL, ATTR) lua_pushstring(L, VAL); lua_setfield(L, -2, ATTR)
+#define INTEGER(VAL, ATTR) lua_pushinteger(L, VAL); lua_setfield(L, -2, ATTR)
+#define BOOLEAN(VAL, ATTR) lua_pushboolean(L, VAL); lua_setfield(L, -2, ATTR)
+    lua_newtable(L); /* stat */
+    STRING(name, "name");
+    INTEGER(e->data_len, "size");
+    INTEGER(glue_vfs.mtime, "mtime");
+    INTEGER(glue_vfs.mtime, "atime");
+    INTEGER(glue_vfs.mtime, "ctime");
+    STRING(e->is_dir?"directory":"file", "type");
+    INTEGER(e->is_dir?(S_IFDIR|0555):(S_IFREG|0444), "mode");
+    BOOLEAN(1, "uR"); BOOLEAN(0, "uW"); BOOLEAN(e->is_dir, "uX");
+#ifndef __MINGW32__
+    BOOLEAN(1, "gR"); BOOLEAN(0, "gW"); BOOLEAN(e->is_dir, "gX");
+    BOOLEAN(1, "oR"); BOOLEAN(0, "oW"); BOOLEAN(e->is_dir, "oX");
+#endif
+#undef STRING
+#undef INTEGER
+#undef BOOLEAN
+    return 1;
+}
+
+static int vfs_listdir(lua_State *L)
+{
+    char path[BL_PATHSIZE];
+    const char *name = lua_isnoneornil(L, 1) ? "." : luaL_checkstring(L, 1);
+    t_vfs_entry *e;
+    int i, n;
+    if (!vfs_normalize(name, path) || (e = vfs_lookup(L, path)) == NULL || !e->is_dir)
+    {
+        return vfs_original(L);
+    }
+    /* virtual entries are added to the existing ones */
+    lua_settop(L, 1);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 1);
+    if (!lua_istable(L, 2))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+    }
+    lua_newtable(L); /* set of names */
+    n = lua_rawlen(L, 2);
+    for (i = 1; i <= n; i++)
+    {
+        lua_rawgeti(L, 2, i);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, 3);
+    }
+    for (i = 0; i < glue_vfs.nb_entries; i++)
+    {
+        const char *basename = vfs_basename(path, glue_vfs.entries[i].path);
+        if (basename == NULL) continue;
+        if (lua_getfield(L, 3, basename) == LUA_TNIL)
+        {
+            lua_pushstring(L, basename);
+            lua_rawseti(L, 2, ++n);
+        }
+        lua_pop(L, 1);
+    }
+    lua_settop(L, 2);
+    return 1;
+}
+
+/* vfs_overload replaces lib.name (or the global name) by f(original) */
+static void vfs_overload(lua_State *L, const char *lib, const char *name, lua_CFunction f)
+{
+    if (lib)
+    {
+        if (lua_getglobal(L, lib) != LUA_TTABLE)
+        {
+            lua_pop(L, 1);
+            return;
+        }
+    }
+    else
+    {
+        lua_pushglobaltable(L);
+    }
+    lua_getfield(L, -1, name);
+    lua_pushcclosure(L, f, 1);
+    lua_setfield(L, -2, name);
+    lua_pop(L, 1);
+}
+
+/* glue_vfs_install installs the overlay (only when the glue contains virtual files) */
+static void glue_vfs_install(lua_State *L, const char *exename)
+{
+    struct stat st;
+    glue_vfs.mtime = stat(exename, &st) == 0 ? st.st_mtime : 0;
+    vfs_overload(L, "io", "open", vfs_io_open);
+    vfs_overload(L, "io", "lines", vfs_io_lines);
+    vfs_overload(L, NULL, "loadfile", vfs_loadfile);
+    vfs_overload(L, LUA_FSLIBNAME, "stat", vfs_stat);
+    vfs_overload(L, LUA_FSLIBNAME, "lstat", vfs_stat);
+    vfs_overload(L, LUA_FSLIBNAME, "listdir", vfs_listdir);
+    /* the native fs.walk does not see the virtual files,
+     * stdlib.lua then defines fs.walk with fs.listdir, fs.stat, fs.lstat and fs.inode
+     */
+    if (lua_getglobal(L, LUA_FSLIBNAME) == LUA_TTABLE)
+    {
+        lua_pushnil(L);
+        lua_setfield(L, -2, "walk");
+    }
+    lua_pop(L, 1);
+}
+
+/* glue_resolve returns the name of a block.
+ * Names starting with ':' are relative to the executable path.
+ */
+static const char *glue_resolve(const char *name, char *path, char *path_end)
+{
+    if (*name == ':')
+    {
+        if (*(name+1) != '\\' && *(name+1) != '/') return NULL;
+        strcpy(path_end, name+2);
+        return path;
+    }
+    return name;
+}
+
+/* At startup, the compressed blocks are decompressed by a pool of threads
+ * (one per CPU) while the main thread executes the blocks in order.
+ * Each block only waits for its own payload.
+ */
 
 typedef enum
 {
-    LUA_BLOCK       = 0x41554C23,
-    STRING_BLOCK    = 0x52545323,
-    FILE_BLOCK      = 0x53455223,
-    DIR_BLOCK       = 0x52494423,
-} t_block_type;
+    JOB_NONE,       /* nothing to decompress */
+    JOB_TODO,       /* payload waiting for a thread */
+    JOB_RUNNING,    /* payload being decompressed */
+    JOB_DONE,       /* payload ready */
+} t_job_state;
 
-typedef struct
+typedef struct t_glue_entry
 {
-    t_block_sig sig;
-} t_start_block;
+    t_block block;
+    const char *name;       /* name in the image */
+    const char *data;       /* payload (in the image or decompressed) */
+    char *uncompressed;     /* decompressed payload to be freed */
+    unsigned int offset;    /* offset of the block from the start block */
+    int ref;                /* the payload is stored in a solid block */
+    int bad;                /* the payload is corrupted */
+    struct t_glue_entry *same;  /* previous entry with the same payload */
+    int shared;             /* the payload is also used by a next entry */
+    t_job_state state;
+} t_glue_entry;
 
 typedef struct
 {
-    t_block_type type;
-    unsigned int name_len;
-    unsigned int data_len;
-} t_block;
+    t_glue_entry *entries;
+    int nb_entries;
+    int next;               /* next entry to be taken by a thread */
+#ifdef BL_THREADS
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    pthread_t *threads;
+    int nb_threads;
+#endif
+} t_glue_pool;
 
-typedef struct
+/* glue_decompress is called by the threads: it must not use any Lua state */
+static void glue_decompress(t_glue_entry *e)
 {
-    t_block_sig sig;
-    unsigned int size;
-} t_end_block;
+    e->bad = !glue_payload(e->name, e->ref, &e->data, &e->block.data_len, &e->uncompressed);
+}
 
-static int docall (lua_State *L, int narg, int nres);
-static int report (lua_State *L, int status);
+#ifdef BL_THREADS
 
-#define cant(x, name) luaL_error(L, "cannot %s %s: %s", x, name, strerror(errno))
+static void *glue_worker(void *arg)
+{
+    t_glue_pool *pool = (t_glue_pool*)arg;
+    for (;;)
+    {
+        t_glue_entry *e = NULL;
+        pthread_mutex_lock(&pool->mutex);
+        while (e == NULL && !pool->stop && pool->next < pool->nb_entries)
+        {
+            e = &pool->entries[pool->next++];
+            if (e->state == JOB_TODO) e->state = JOB_RUNNING;
+            else e = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+        if (e == NULL) return NULL;
+        glue_decompress(e);
+        pthread_mutex_lock(&pool->mutex);
+        e->state = JOB_DONE;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
 
-static void glue_setarg(lua_State *L, char **argv, int argc, int script, char *exename)
+#endif
+
+static void glue_pool_start(t_glue_pool *pool, int nb_jobs)
+{
+    pool->next = 0;
+#ifdef BL_THREADS
+    pool->stop = 0;
+    pool->threads = NULL;
+    pool->nb_threads = 0;
+    /* the main thread also decompresses the blocks it is waiting for */
+    int n = bl_cpu_count() - 1;
+    if (n > nb_jobs - 1) n = nb_jobs - 1;
+    if (n <= 0) return;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->threads = (pthread_t*)malloc(n * sizeof(pthread_t));
+    while (pool->nb_threads < n)
+    {
+        if (pthread_create(&pool->threads[pool->nb_threads], NULL, glue_worker, pool) != 0) break;
+        pool->nb_threads++;
+    }
+#endif
+}
+
+/* glue_pool_wait waits for the payload of an entry
+ * or decompresses it if no thread has taken it yet
+ */
+static void glue_pool_wait(t_glue_pool *pool, t_glue_entry *e)
+{
+#ifdef BL_THREADS
+    if (pool->nb_threads > 0)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        if (e->state == JOB_TODO)
+        {
+            e->state = JOB_RUNNING;
+            pthread_mutex_unlock(&pool->mutex);
+            glue_decompress(e);
+            pthread_mutex_lock(&pool->mutex);
+            e->state = JOB_DONE;
+        }
+        while (e->state == JOB_RUNNING) pthread_cond_wait(&pool->done, &pool->mutex);
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+#endif
+    if (e->state == JOB_TODO)
+    {
+        glue_decompress(e);
+        e->state = JOB_DONE;
+    }
+}
+
+/* glue_pool_stop stops the threads and frees all the entries */
+static void glue_pool_stop(t_glue_pool *pool)
 {
     int i;
-    lua_newtable(L);
-    lua_pushinteger(L, -1);
-    lua_pushstring(L, exename);
-    lua_rawset(L, -3);
-    for (i=1; argv[i]; i++)
+#ifdef BL_THREADS
+    if (pool->nb_threads > 0)
     {
-        lua_pushinteger(L, i);
-        lua_pushstring(L, argv[i]);
-        lua_rawset(L, -3);
+        pthread_mutex_lock(&pool->mutex);
+        pool->stop = 1;
+        pthread_mutex_unlock(&pool->mutex);
+        for (i = 0; i < pool->nb_threads; i++) pthread_join(pool->threads[i], NULL);
+        pthread_mutex_destroy(&pool->mutex);
+        pthread_cond_destroy(&pool->done);
     }
-    lua_setglobal(L, "arg");
+    if (pool->threads) free(pool->threads);
+    pool->threads = NULL;
+    pool->nb_threads = 0;
+#endif
+    for (i = 0; i < pool->nb_entries; i++)
+        if (pool->entries[i].uncompressed) free(pool->entries[i].uncompressed);
+    free(pool->entries);
+    pool->entries = NULL;
+    pool->nb_entries = 0;
 }
 
-static void glue_setarg0(lua_State *L, char *arg0)
+/* glue_find_entry returns the entry at a given offset among the n first entries */
+static t_glue_entry *glue_find_entry(t_glue_pool *pool, int n, unsigned int offset)
 {
-    lua_getglobal(L, "arg");
-    lua_pushinteger(L, 0);
-    lua_pushstring(L, arg0);
-    lua_rawset(L, -3);
-    lua_remove(L, 0);
+    int a = 0, b = n-1;
+    while (a <= b)
+    {
+        int m = (a + b) / 2;
+        if (pool->entries[m].offset == offset) return &pool->entries[m];
+        if (pool->entries[m].offset < offset) a = m+1;
+        else b = m-1;
+    }
+    return NULL;
+}
+
+/* glue_scan reads the block headers of the image.
+ * The name and data of the entries point to the memory image of the executable.
+ * It returns the number of payloads to decompress or -1 if the glue is corrupted.
+ */
+static int glue_scan(t_glue_image *image, t_glue_pool *pool)
+{
+    const char *p;
+    t_block block;
+    int n = 0;
+    int nb_solids = 0;
+    int nb_jobs = 0;
+
+    pool->entries = NULL;
+    pool->nb_entries = 0;
+
+    /* count the blocks */
+    p = image->start + sizeof(t_start_block);
+    while (p + sizeof(t_block) <= image->end)
+    {
+        memcpy(&block, p, sizeof(t_block));
+        p += sizeof(t_block);
+        if ((size_t)block.name_len + block.data_len > (size_t)(image->end - p)) return -1;
+        p += block.name_len + block.data_len;
+        if (block.type == SOLID_BLOCK) nb_solids++;
+        n++;
+    }
+    if (p != image->end) return -1;
+
+    pool->entries = (t_glue_entry*)malloc((n+1) * sizeof(t_glue_entry));
+    pool->nb_entries = n;
+    image->solids = (t_glue_solid*)malloc((nb_solids+1) * sizeof(t_glue_solid));
+    image->nb_solids = 0;
+
+    /* read the headers */
+    p = image->start + sizeof(t_start_block);
+    for (n = 0; n < pool->nb_entries; n++)
+    {
+        t_glue_entry *e = &pool->entries[n];
+        e->offset = (unsigned int)(p - image->start);
+        memcpy(&e->block, p, sizeof(t_block));
+        p += sizeof(t_block);
+        e->name = p;
+        p += e->block.name_len;
+        e->data = e->block.data_len > 0 ? p : NULL;
+        p += e->block.data_len;
+        e->uncompressed = NULL;
+        e->ref = IS_SOLID_REF(e->block.type);
+        e->bad = 0;
+        e->same = NULL;
+        e->shared = 0;
+        e->state = JOB_NONE;
+        if (e->ref)
+        {
+            /* the payload is decompressed from a solid block */
+            e->block.type = BASE_TYPE(e->block.type);
+        }
+        if (IS_DEDUP_REF(e->block.type))
+        {
+            /* the payload is stored by a previous block */
+            unsigned int offset;
+            if (e->block.data_len != sizeof(unsigned int)) return -1;
+            memcpy(&offset, e->data, sizeof(unsigned int));
+            e->same = glue_find_entry(pool, n, offset);
+            if (e->same == NULL) return -1;
+            e->block.type = BASE_TYPE(e->block.type);
+            e->data = e->same->data;
+            e->block.data_len = e->same->block.data_len;
+            e->ref = e->same->ref;
+        }
+        if (e->block.type == SOLID_BLOCK && !glue_solid_add(image, e->data, e->block.data_len)) return -1;
+        switch (e->block.type)
+        {
+            case LUA_BLOCK:
+            case STRING_BLOCK:
+            case FILE_BLOCK:
+            case TREE_BLOCK:
+                if (e->block.data_len > 0)
+                {
+                    e->state = JOB_TODO;
+                    nb_jobs++;
+                }
+                break;
+            default:
+                break;
+        }
+        if (e->same)
+        {
+            if (e->state == JOB_TODO && e->same->state == JOB_TODO)
+            {
+                /* the payload is decompressed once for both entries */
+                e->state = JOB_NONE;
+                e->same->shared = 1;
+                nb_jobs--;
+            }
+            else
+            {
+                e->same = NULL;
+            }
+        }
+    }
+    return nb_jobs;
 }
 
+/* Trees are extracted in parallel. Files that already exist with the same
+ * size and modification time are not extracted again. Files with the same
+ * size and hash only get their modification time and permissions back.
+ * The payloads of the files that are not extracted are not decompressed.
+ */
+
+typedef struct
+{
+    unsigned int kind;
+    unsigned int mode;
+    long long mtime;
+    unsigned int size;
+    const char *hash;
+    char *path;                 /* path of the extracted file */
+    t_glue_entry *payload;
+    int written;                /* the file has been (re)written */
+    const char *failed;         /* operation that failed (NULL if none) */
+    int error;                  /* errno of the failed operation */
+} t_tree_entry;
+
+enum { TREE_DIR = 0, TREE_FILE = 1 };
+
+static int glue_tree_mkdir(const char *path, unsigned int mode)
+{
 #ifdef __MINGW32__
-/* GetModuleFileName defined in windows.h */
+    (void)mode;
+    return mkdir(path);
 #else
-static int GetModuleFileName(void *null, char *exename, size_t bufsize)
+    return mkdir(path, mode | S_IRWXU);
+#endif
+}
+
+/* glue_tree_mkdirs creates a directory and its parents */
+static int glue_tree_mkdirs(char *path)
 {
-    char link[32];
-    ssize_t n;
-    sprintf(link, "/proc/%d/exe", getpid());
-    n = readlink(link, exename, bufsize);
-    if (n<0) return 0;
-    exename[n] = '\0';
+    struct stat st;
+    char *p;
+    if (stat(path, &st) == 0) return S_ISDIR(st.st_mode) ? 0 : -1;
+    for (p = path+1; *p; p++)
+    {
+        if (*p == '/' || *p == '\\')
+        {
+            char c = *p;
+            *p = '\0';
+            if (stat(path, &st) != 0 && glue_tree_mkdir(path, 0755) != 0 && errno != EEXIST)
+            {
+                *p = c;
+                return -1;
+            }
+            *p = c;
+        }
+    }
+    if (glue_tree_mkdir(path, 0755) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+static int glue_tree_settime(t_tree_entry *f)
+{
+    struct utimbuf t;
+    t.actime = (time_t)f->mtime;
+    t.modtime = (time_t)f->mtime;
+    return utime(f->path, &t);
+}
+
+/* glue_tree_same_hash checks the hash of an existing file */
+static int glue_tree_same_hash(t_tree_entry *f)
+{
+    FILE *fd;
+    char *buf;
+    char hex[33];
+    int same = 0;
+    if (f->hash[0] == '\0') return 0;
+    fd = fopen(f->path, "rb");
+    if (fd == NULL) return 0;
+    buf = (char*)malloc(f->size + 1);
+    if (buf && fread(buf, 1, f->size, fd) == f->size)
+    {
+        bl_hash(buf, f->size, hex);
+        same = strcmp(hex, f->hash) == 0;
+    }
+    free(buf);
+    fclose(fd);
+    return same;
+}
+
+#define TREE_FAIL(op) { f->failed = op; f->error = errno; return; }
+
+/* glue_tree_extract extracts a file of a tree.
+ * It must not use any Lua state (it is called by the threads).
+ */
+static void glue_tree_extract(void *ctx, int i)
+{
+    t_tree_entry *f = &((t_tree_entry*)ctx)[i];
+    struct stat st;
+    const char *data;
+    unsigned int data_len;
+    char *buffer;
+    FILE *fd;
+    if (f->kind != TREE_FILE) return;
+    if (stat(f->path, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size == f->size)
+    {
+        if ((long long)st.st_mtime == f->mtime) return;
+        if (glue_tree_same_hash(f))
+        {
+            if (glue_tree_settime(f) != 0) TREE_FAIL("touch");
+            if (chmod(f->path, f->mode) != 0) TREE_FAIL("chmod");
+            return;
+        }
+    }
+    data = f->payload->data;
+    data_len = f->payload->block.data_len;
+    if (!glue_payload(f->payload->name, f->payload->ref, &data, &data_len, &buffer) || data_len != f->size)
+    {
+        if (buffer) free(buffer);
+        errno = EINVAL;
+        TREE_FAIL("decompress");
+    }
+    chmod(f->path, f->mode | S_IWUSR); /* the file may be read only */
+    fd = fopen(f->path, "wb");
+    if (fd == NULL) { if (buffer) free(buffer); TREE_FAIL("create"); }
+    if (fwrite(data, 1, data_len, fd) != data_len) { fclose(fd); if (buffer) free(buffer); TREE_FAIL("write"); }
+    if (buffer) free(buffer);
+    if (fclose(fd) != 0) TREE_FAIL("write");
+    if (glue_tree_settime(f) != 0) TREE_FAIL("touch");
+    if (chmod(f->path, f->mode) != 0) TREE_FAIL("chmod");
+    f->written = 1;
+}
+
+#undef TREE_FAIL
+
+/* glue_tree_path checks that a relative path stays in the tree */
+static int glue_tree_path(const char *path)
+{
+    const char *p = path;
+    if (*p == '/' || *p == '\\' || (*p && p[1] == ':')) return 0;
+    while (*p)
+    {
+        const char *q = p + strcspn(p, "/\\");
+        if (q - p == 2 && p[0] == '.' && p[1] == '.') return 0;
+        p = *q ? q+1 : q;
+    }
     return 1;
 }
-#endif
+
+/* glue_tree extracts the tree described by the manifest of entry i.
+ * The payloads are in the next entries of the pool.
+ * Returns 0 (with an error message on the Lua stack) if the tree can not be extracted.
+ */
+static int glue_tree(lua_State *L, t_glue_pool *pool, int i, const char *root, const char *manifest, size_t manifest_len)
+{
+    const char *p = manifest;
+    const char *end = manifest + manifest_len;
+    unsigned int n, k;
+    int next = i + 1;
+    int written = 0;
+    int status = 1;
+    t_tree_entry *entries;
+    size_t root_len = strlen(root);
+    double t = bl_trace_clock();
+
+    if (manifest_len < sizeof(unsigned int))
+    {
+        lua_pushfstring(L, "bad tree manifest for %s", root);
+        return 0;
+    }
+    memcpy(&n, p, sizeof(unsigned int));
+    p += sizeof(unsigned int);
+    if (n > manifest_len / (3*sizeof(unsigned int) + sizeof(long long) + 2))
+    {
+        lua_pushfstring(L, "bad tree manifest for %s", root);
+        return 0;
+    }
+    entries = (t_tree_entry*)calloc(n+1, sizeof(t_tree_entry));
+
+    /* read the manifest */
+    for (k = 0; k < n; k++)
+    {
+        t_tree_entry *f = &entries[k];
+        const char *path;
+        size_t len;
+        if ((size_t)(end - p) < 3*sizeof(unsigned int) + sizeof(long long)) break;
+        memcpy(&f->kind, p, sizeof(unsigned int)); p += sizeof(unsigned int);
+        memcpy(&f->mode, p, sizeof(unsigned int)); p += sizeof(unsigned int);
+        memcpy(&f->mtime, p, sizeof(long long)); p += sizeof(long long);
+        memcpy(&f->size, p, sizeof(unsigned int)); p += sizeof(unsigned int);
+        f->hash = p;
+        p = memchr(p, '\0', end - p);
+        if (p == NULL) break;
+        path = ++p;
+        p = memchr(p, '\0', end - p);
+        if (p == NULL) break;
+        len = p++ - path;
+        if (!glue_tree_path(path)) break;
+        f->path = (char*)malloc(root_len + 1 + len + 1);
+        strcpy(f->path, root);
+        if (len > 0)
+        {
+            strcat(f->path, "/");
+            strcat(f->path, path);
+        }
+        if (f->kind == TREE_FILE)
+        {
+            if (next >= pool->nb_entries || pool->entries[next].block.type != TREE_FILE_BLOCK) break;
+            f->payload = &pool->entries[next++];
+        }
+        else if (f->kind != TREE_DIR) break;
+    }
+    if (k < n)
+    {
+        lua_pushfstring(L, "bad tree manifest for %s", root);
+        status = 0;
+    }
+
+    /* create the directories (parents first) */
+    for (k = 0; status && k < n; k++)
+    {
+        t_tree_entry *f = &entries[k];
+        if (f->kind == TREE_DIR && glue_tree_mkdirs(f->path) != 0)
+        {
+            lua_pushfstring(L, "cannot mkdir %s: %s", f->path, strerror(errno));
+            status = 0;
+        }
+    }
+
+    /* extract the files */
+    if (status) bl_parallel(n, glue_tree_extract, entries);
+    for (k = 0; status && k < n; k++)
+    {
+        t_tree_entry *f = &entries[k];
+        if (f->failed)
+        {
+            lua_pushfstring(L, "cannot %s %s: %s", f->failed, f->path, strerror(f->error));
+            status = 0;
+        }
+        written += f->written;
+    }
+
+    /* the directories get their permissions and dates back (children first) */
+    for (k = n; status && k-- > 0; )
+    {
+        t_tree_entry *f = &entries[k];
+        if (f->kind == TREE_DIR)
+        {
+            chmod(f->path, f->mode);
+            glue_tree_settime(f);
+        }
+    }
+
+    if (status && bl_tracing())
+    {
+        char detail[64];
+        snprintf(detail, sizeof(detail), "%u entries, %d files written", n, written);
+        bl_trace("extract", root, detail, t);
+    }
+
+    for (k = 0; k < n; k++) if (entries[k].path) free(entries[k].path);
+    free(entries);
+    return status;
+}
 
 static int glue(lua_State *L, char **argv, int argc, int script)
 {
     int status;
-    int i;
     FILE *f;
-    t_start_block start_block;
+    t_glue_image *image = &glue_image;
+    t_glue_pool pool;
     t_end_block end_block;
-    t_block block;
-    char *name, *data;
+    int i;
+    int nb_jobs;
+    double t;
     struct stat st;
-    long int end;
     char pathexe[BL_PATHSIZE];
     char path[BL_PATHSIZE];
     char *path_end; // pointer to the end of the path in the executable name
-    char *p;
+    char *q;
 
     /* collect arguments */
     if (!GetModuleFileName(NULL, path, sizeof(path))) cant("find", argv[0]);
     strcpy(pathexe, path);
 
-    /* open the glue */
-    f = fopen(path, "rb");
-    if (f==NULL) cant("open", argv[0]);
-
     /* path = dirname of the executable */
     path_end = NULL;
-    for (p=path; *p; p++)
-        if (*p==*LUA_DIRSEP)
-            path_end = p+1;
-
-    /* search for the start block */
-    if (fseek(f, -(ssize_t)sizeof(t_end_block), SEEK_END) != 0) cant("seek", argv[0]);
-    end = ftell(f);
-    //printf("%08X - %d - %d\n", ftell(f), sizeof(t_end_block), feof(f));
-    if (fread(&end_block, sizeof(t_end_block), 1, f) != 1) cant("read", argv[0]);
-    if (end_block.sig != END_SIG)
+    for (q=path; *q; q++)
+        if (*q==*LUA_DIRSEP)
+            path_end = q+1;
+
+    /* open the glue */
+    t = bl_trace_clock();
+    f = fopen(pathexe, "rb");
+    if (f==NULL) cant("open", argv[0]);
+    status = glue_open(L, f, argv[0], image);
+    fclose(f);
+    bl_trace("glue", "open", pathexe, t);
+    if (!status)
     {
         /* Nothing to load */
-        //printf("Nothing to load\n");
-        //printf("%08X\n", end_block.sig);
-        fclose(f);
         return 1;
     }
-    //printf("size = %d\n", -end_block.size);
 
-    if (fseek(f, -(long int)end_block.size, SEEK_END) != 0) cant("seek", argv[0]);
-    //printf("%08X - %d - %d\n", ftell(f), sizeof(t_start_block), feof(f));
-    if (fread(&start_block, sizeof(t_start_block), 1, f) != 1) cant("read", argv[0]);
-    if (start_block.sig != START_SIG)
+    /* check the end signature */
+    memcpy(&end_block, image->end, sizeof(t_end_block));
+    if (end_block.sig != END_SIG)
     {
-        /* Bad start signature */
-        fclose(f);
-        luaL_error(L, "bad start signature in %s", argv[0]);
+        glue_unmap(image);
+        luaL_error(L, "bad end signature in %s", argv[0]);
         return 0;
     }
 
-#ifdef USE_Z
-
-#define UNCOMPRESS_DATA()                                                                           \
-        char *uncompressed;                                                                         \
-        size_t uncompressed_len;                                                                    \
-        int n = bl_z_decompress_core(L, data, block.data_len, &uncompressed, &uncompressed_len);    \
-        if (n == 0) /* decompression is ok */                                                       \
-        {                                                                                           \
-            /* The data was compressed */                                                           \
-            free(data);                                                                             \
-            data = uncompressed;                                                                    \
-            block.data_len = uncompressed_len;                                                      \
-        }                                                                                           \
-        else                                                                                        \
-        {                                                                                           \
-            /* The data was not compressed */                                                       \
-            lua_pop(L, n);                                                                          \
-        }                                                                                           \
-
-#else
-
-#define UNCOMPRESS_DATA() /* no compression library */
+    /* read all the block headers before running anything
+     * so that the payloads can be decompressed in parallel
+     */
+    t = bl_trace_clock();
+    nb_jobs = glue_scan(image, &pool);
+    bl_trace("glue", "scan", NULL, t);
+    if (nb_jobs < 0)
+    {
+        if (pool.entries) free(pool.entries);
+        glue_unmap(image);
+        luaL_error(L, "bad block size in %s", argv[0]);
+        return 0;
+    }
+    glue_pool_start(&pool, nb_jobs);
 
-#endif
+    /* modules are loaded on demand by require */
+    glue_find_toc(image);
+    if (image->toc) glue_add_searcher(L);
 
-#define READ_DATA()                                                                                 \
-{                                                                                                   \
-    name = (char*)malloc(block.name_len);                                                           \
-    if (fread(name, sizeof(char), block.name_len, f) != block.name_len) cant("read", argv[0]);      \
-    if (*name == ':')                                                                               \
-    {                                                                                               \
-        if (*(name+1) != '\\' && *(name+1) != '/') luaL_error(L, "bad path: %s", name);             \
-        strcpy(path_end, name+2);                                                                   \
-        free(name);                                                                                 \
-        name = path;                                                                                \
-    }                                                                                               \
-    if (block.data_len == 0)                                                                        \
-    {                                                                                               \
-        data = NULL;                                                                                \
-    }                                                                                               \
-    else                                                                                            \
-    {                                                                                               \
-        data = (char*)malloc(block.data_len);                                                       \
-        if (fread(data, sizeof(char), block.data_len, f) != block.data_len) cant("read", argv[0]);  \
-        UNCOMPRESS_DATA();                                                                          \
-    }                                                                                               \
-}
-
-#define FREE_DATA()                 \
-{                                   \
-    if (name != path) free(name);   \
-    if (data) free(data);           \
+#define STOP()                          \
+{                                       \
+    glue_pool_stop(&pool);              \
+    glue_unmap(image);                  \
 }
 
+    /* embedded files are not extracted but served by the VFS overlay */
+    t = bl_trace_clock();
+    for (i = 0; i < pool.nb_entries; i++)
+    {
+        t_glue_entry *e = &pool.entries[i];
+        if (e->block.type == VFILE_BLOCK || e->block.type == VDIR_BLOCK)
+        {
+            const char *name = glue_resolve(e->name, path, path_end);
+            if (name == NULL)
+            {
+                STOP();
+                luaL_error(L, "bad path in %s", argv[0]);
+                return 0;
+            }
+            vfs_add(L, name, e->block.type == VDIR_BLOCK, e->data, e->block.data_len, e->ref);
+        }
+    }
+    if (glue_vfs.nb_entries > 0) glue_vfs_install(L, pathexe);
+    bl_trace("glue", "vfs", NULL, t);
+
     /* load the blocks */
-    while (ftell(f) < end && fread(&block, sizeof(block), 1, f) == 1)
+    for (i = 0; i < pool.nb_entries; i++)
     {
-        switch (block.type)
+        t_glue_entry *e = &pool.entries[i];
+        t_glue_entry *src = e->same ? e->same : e;
+        const char *name = glue_resolve(e->name, path, path_end);
+        const char *data;
+        size_t data_len;
+        if (name == NULL)
+        {
+            STOP();
+            luaL_error(L, "bad path in %s", argv[0]);
+            return 0;
+        }
+        t = bl_trace_clock();
+        glue_pool_wait(&pool, src);
+        if (src->state == JOB_DONE) bl_trace("wait", name, NULL, t);
+        if (src->bad)
+        {
+            STOP();
+            luaL_error(L, "bad solid block in %s", argv[0]);
+            return 0;
+        }
+        data = src->data;
+        data_len = src->block.data_len;
+        switch (e->block.type)
         {
             case LUA_BLOCK:
-                READ_DATA();
                 glue_setarg(L, argv, argc, script, pathexe);
                 glue_setarg0(L, name);
                 //printf("Run %s\n%s\n", name, data);
                 /* check LUA_SIGNATURE to identify precompiled chunks */
-                if (data[0]=='\033' && data[1]=='L' && data[2]=='u' && data[3]=='a')
+                if (data_len >= 4 && data[0]=='\033' && data[1]=='L' && data[2]=='u' && data[3]=='a')
                 {
                     /* precompiled chunk */
-                    status = luaL_loadbuffer(L, data, block.data_len, name);
+                    t = bl_trace_clock();
+                    status = luaL_loadbuffer(L, data, data_len, name);
+                    bl_trace("load", name, NULL, t);
+                    t = bl_trace_clock();
                     if (status == LUA_OK) status = docall(L, 0, 0);
+                    bl_trace("run", name, NULL, t);
                     status = report(L, status);
                 }
                 else
                 {
                     /* plain Lua source */
                     //status = dostring(L, data, name);
-                    status = luaL_loadbuffer(L, data, block.data_len, name);
+                    t = bl_trace_clock();
+                    status = luaL_loadbuffer(L, data, data_len, name);
+                    bl_trace("load", name, NULL, t);
+                    t = bl_trace_clock();
                     if (status == LUA_OK) status = docall(L, 0, 0);
+                    bl_trace("run", name, NULL, t);
                     status = report(L, status);
                 }
-                FREE_DATA();
+                /* the payload is not needed anymore */
+                if (e->uncompressed && !e->shared)
+                {
+                    free(e->uncompressed);
+                    e->uncompressed = NULL;
+                }
                 /* Restore the arg variable */
                 createargtable(L, argv, argc, script);
-                if (status != LUA_OK) return 0;
+                if (status != LUA_OK)
+                {
+                    STOP();
+                    return 0;
+                }
                 break;
             case STRING_BLOCK:
-                READ_DATA();
                 //printf("Load %s\n", name);
-                lua_pushlstring(L, data, block.data_len);
+                lua_pushlstring(L, data, data_len);
                 lua_setglobal(L, name);
-                FREE_DATA();
                 break;
             case FILE_BLOCK:
-                READ_DATA()
                 //printf("File %s\n", name);
+                t = bl_trace_clock();
                 if (stat(name, &st) < 0)
                 {
                     /* the file does not yet exist */
                     FILE *fd = fopen(name, "wb");
-                    if (fwrite(data, sizeof(char), block.data_len, fd) != block.data_len) cant("write", name);
+                    if (fd == NULL) { STOP(); cant("create", name); }
+                    if (fwrite(data, sizeof(char), data_len, fd) != data_len) { fclose(fd); STOP(); cant("write", name); }
                     fclose(fd);
                 }
-                FREE_DATA();
+                bl_trace("extract", name, NULL, t);
                 break;
             case DIR_BLOCK:
-                READ_DATA();
                 //printf("Dir %s\n", name);
                 if (stat(name, &st) < 0)
                 {
                     /* the directory does not yet exist */
                     #ifdef __MINGW32__
-                        if (mkdir(name)!=0) cant("mkdir", name);
+                        if (mkdir(name)!=0) { STOP(); cant("mkdir", name); }
                     #else
-                        if (mkdir(name, 0755)!=0) cant("mkdir", name);
+                        if (mkdir(name, 0755)!=0) { STOP(); cant("mkdir", name); }
                     #endif
                 }
-                FREE_DATA();
+                break;
+            case TREE_BLOCK:
+                if (!glue_tree(L, &pool, i, name, data, data_len))
+                {
+                    STOP();
+                    lua_error(L);
+                    return 0;
+                }
+                break;
+            case MODULE_BLOCK:
+            case TOC_BLOCK:
+            case VFILE_BLOCK:
+            case VDIR_BLOCK:
+            case SOLID_BLOCK:
+            case TREE_FILE_BLOCK:
+                /* not loaded at startup (or extracted with their tree) */
                 break;
             default:
                 /* Bad block type */
-                fclose(f);
+                STOP();
                 //printf("block type : %08X\n", block.type);
                 luaL_error(L, "bad block type in %s", argv[0]);
                 return 0;
         }
     }
 
+#undef STOP
+
     //printf("C'est fini...\n");
 
-    /* check the end signature */
-    //printf("%08X - %d - %d\n", ftell(f), sizeof(t_end_block), feof(f));
-    if (fread(&end_block, sizeof(t_end_block), 1, f) != 1) cant("read", argv[0]);
-    fclose(f);
-    if (end_block.sig != END_SIG)
-    {
-        luaL_error(L, "bad end signature in %s", argv[0]);
-        return 0;
-    }
+    glue_pool_stop(&pool);
+    if (image->toc == NULL && glue_vfs.nb_entries == 0) glue_unmap(image);
+
+    return 1;
+}
 
+/* bl_command runs the commands of bl ("bl bench z ...") given instead of
+ * a script name on the command line (an existing file is always a script).
+ * It returns 0 if argv[script] is not a command
+ * and 1 if the command failed (a successful command exits).
+ */
+static int bl_command(lua_State *L, char **argv, int script)
+{
+    struct stat st;
+    int status;
+    int n;
+    if (strcmp(argv[script], "bench") != 0 || stat(argv[script], &st) == 0) return 0;
+    status = luaL_loadstring(L, "require 'bl.bench' os.exit(bench.main({...}))");
+    for (n = 0; status == LUA_OK && argv[script+1+n]; n++) lua_pushstring(L, argv[script+1+n]);
+    if (status == LUA_OK) status = docall(L, n, 0);
+    report(L, status);
     return 1;
 }
@@ -8,18 +8,30 @@ usage: ]]..(arg[0] or arg[1] or arg[-1])..[[ arguments
     compile:on              turn compilation on
     compile:off             turn compilation off
     compile:min             turn compilation on when chunks are smaller than sources
+    compile:opt             as compile:min but strip debug information of the next scripts
     compress:on             turn compression on
     compress:off            turn compression off
     compress:min            turn compression on when chunks are smaller than sources
+    extract:on              extract the next files and directories at runtime
+    extract:off             serve the next files and directories from memory (default)
+    merge:on                merge the next consecutive scripts into a single chunk
+    merge:off               do not merge scripts (default)
+    solid:on                store the next compressed blocks in a solid block
+    solid:off               compress the next blocks separately (default)
+    cache:dir               keep compressed blocks in dir to speed up the next builds
 
     read:bl.exe             read bl.exe and its current glue
     lua:script.lua          add a new script
     lua:script.lua=realname add a new script with a different name
+    mod:module.lua          add a new module loaded by require (module name: module)
+    mod:name=realname       add a new module with a different name
     str:name="some text"    add a global variable name
     str:name=@filename      add a global variable, the value is in a file
     file:name               add a file (same name in the glue)
     file:name=realname      add a file with name 'name', the content is in a file
     dir:name                create a directory
+    tree:name               add a directory tree (extracted at runtime)
+    tree:name=realname      add a directory tree with a different name
     write:bl2.exe           write a new executable
 
 example:
@@ -42,17 +54,23 @@ for i, cmd in ipairs(arg) do
     else
         local action, param = string.match(cmd, "^(%w+):(.*)$")
         local param1, param2 = string.match(param, "^(.-)=(.+)$")
-        if action == "compile" and (param == 'min' or param == 'on' or param == 'off') then exe.compile(param)
+        if action == "compile" and (param == 'min' or param == 'on' or param == 'off' or param == 'opt') then exe.compile(param)
         elseif action == "compress" and (param == 'min' or param == 'on' or param == 'off') then exe.compress(param)
+        elseif action == "extract" and (param == 'on' or param == 'off') then exe.extract(param)
+        elseif action == "merge" and (param == 'on' or param == 'off') then exe.merge(param)
+        elseif action == "solid" and (param == 'on' or param == 'off') then exe.solid(param)
+        elseif action == "cache" and param ~= "" then exe.cache(param)
         elseif action == "read" then exe.read(param)
         elseif action == "write" then exe.write(param)
         elseif action == "lua" then exe.lua(param1 or param, param2)
+        elseif action == "mod" then exe.mod(param1 or param, param2)
         elseif action == "str" and param2 then
             if string.match(param2, "^@") then exe.strf(param1, string.sub(param2, 2))
             else exe.str(param1, param2)
             end
         elseif action == "file" then exe.file(param1 or param, param2)
         elseif action == "dir" then exe.dir(param)
+        elseif action == "tree" then exe.tree(param1 or param, param2)
         else error("Unrecognized parameter: "..cmd) end
     end
 end
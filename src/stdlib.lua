@@ -22,6 +22,67 @@ for k,v in pairs(mathx) do
     end
 end
 
+-----------------------------------------------------------------------------
+-- lazy loading of libraries
+-----------------------------------------------------------------------------
+
+-- package.lazy(modname, name1, ..., namen) defines the global variables
+-- name1, ..., namen as stubs that require modname when one of them is used
+-- for the first time. A name ending with "()" is a function, other names
+-- are tables (existing tables are kept).
+function package.lazy(modname, ...)
+    local stubs = {}
+    local saved = {}
+    local loaded = false
+    local function load()
+        if loaded then return end
+        loaded = true
+        for name, stub in pairs(stubs) do
+            if type(stub) == "table" then
+                setmetatable(stub, nil)
+                for k, v in pairs(saved[name]) do rawset(stub, k, v) end
+            end
+        end
+        require(modname)
+        for name, stub in pairs(stubs) do
+            local value = rawget(_G, name)
+            if type(stub) == "table" and value ~= stub then
+                -- the module has replaced the stub
+                setmetatable(stub, {__index = value, __newindex = value})
+            end
+        end
+    end
+    for i = 1, select("#", ...) do
+        local name = select(i, ...)
+        local fname = name:match("^(.*)%(%)$")
+        if fname then
+            local stub
+            stub = function(...)
+                load()
+                local f = rawget(_G, fname)
+                if f == stub then error(modname.." does not define "..fname, 2) end
+                return f(...)
+            end
+            stubs[fname] = stub
+            rawset(_G, fname, stub)
+        else
+            local stub = rawget(_G, name) or {}
+            -- the fields of an existing table are restored when the module is loaded
+            local fields = {}
+            for k, v in pairs(stub) do fields[k] = v end
+            for k in pairs(fields) do stub[k] = nil end
+            saved[name] = fields
+            stubs[name] = stub
+            setmetatable(stub, {
+                __index = function(_, k) load(); return rawget(_G, name)[k] end,
+                __newindex = function(_, k, v) load(); rawget(_G, name)[k] = v end,
+                __pairs = function() load(); return pairs(rawget(_G, name)) end,
+            })
+            rawset(_G, name, stub)
+        end
+    end
+end
+
 -----------------------------------------------------------------------------
 -- iterator functions
 -----------------------------------------------------------------------------
@@ -280,35 +341,337 @@ function fs.dir(path)
     return iter(fs.listdir(path))
 end
 
--- fs.walk(path) iterates over the file names in path and its subdirectories
-function fs.walk(path)
-    local dirs = {path or "."}
-    local files = {}
-    return function()
-        if #files > 0 then
-            return table.remove(files, 1)
-        elseif #dirs > 0 then
-            local dir = table.remove(dirs)
-            local names = fs.listdir(dir)
-            if names then
-                table.sort(names)
-                for i = 1, #names do
-                    local name = dir..fs.sep..names[i]
-                    local stat = fs.stat(name)
-                    if stat then
-                        if stat.type == "directory" then
-                            table.insert(dirs, name)
-                        else
-                            table.insert(files, name)
+-- fs.walk(path, options) iterates over the directory and file names in path and its subdirectories
+-- (each directory is followed by its files, its subdirectories are walked last).
+-- The C function fs.walk (Linux) is replaced by this one on Windows
+-- and in executables containing virtual files (fs.listdir and fs.stat see them).
+-- Symbolic links are followed unless options.follow is false (fs.lstat lists them as links).
+-- A directory having the same inode as one of its ancestors is listed as a link
+-- instead of being walked again.
+if not fs.walk then
+    function fs.walk(path, options)
+        options = options or {}
+        local max_depth = options.depth or math.huge
+        local prune = options.prune
+        local follow = options.follow ~= false
+        local stat = follow and fs.stat or fs.lstat
+        local dirs = {{path or ".", 0}}
+        local files, types, first = {}, {}, 1
+        -- loop checks if dir is one of the ancestors in node
+        local function loop(node, dir)
+            local inode = node and fs.inode(dir)
+            while inode and node do
+                if node.dev == inode.dev and node.ino == inode.ino then return true end
+                node = node.parent
+            end
+            return false
+        end
+        return function()
+            while first > #files do
+                local d = table.remove(dirs)
+                if not d then return nil end
+                local dir, depth, node = d[1], d[2], d[3]
+                local names = (depth == 0 or not (prune and prune(dir))) and fs.listdir(dir)
+                if names then
+                    files, types, first = {}, {}, 1
+                    if depth < max_depth then
+                        local inode = follow and fs.inode(dir)
+                        if inode then node = {dev=inode.dev, ino=inode.ino, parent=node} end
+                        if options.sort ~= false then table.sort(names) end
+                        for i = 1, #names do
+                            local name = dir..fs.sep..names[i]
+                            local st = stat(name)
+                            if st then
+                                if st.type == "directory" and not loop(node, name) then
+                                    dirs[#dirs+1] = {name, depth+1, node}
+                                else
+                                    files[#files+1] = name
+                                    types[#files] = st.type == "directory" and "link" or st.type
+                                end
+                            end
                         end
                     end
+                    return dir, "directory"
                 end
-                return dir
             end
+            first = first + 1
+            return files[first-1], types[first-1]
         end
     end
 end
 
+-----------------------------------------------------------------------------
+-- z package
+-----------------------------------------------------------------------------
+
+-- z.open(path, mode, options) opens a compressed file and returns an object
+-- that behaves like a Lua file (read, lines, write, flush, seek, close).
+-- The data is compressed or decompressed chunk by chunk with lib.stream.
+if z then
+
+    local BLOCK = 64*1024
+
+    -- codecs used to write files (name, library, options of lib.stream)
+    local codecs = {
+        gzip = {"zlib", {gzip=true}},
+        xz = {"lzma"},
+    }
+
+    -- codecs guessed from the file extension
+    local extensions = {gz="gzip", xz="xz", lzma="xz", lz4="lz4", zst="zstd"}
+
+    -- codecs detected from the beginning of the files
+    local magics = {
+        {"\x1F\x8B", "zlib"},               -- gzip
+        {"\xFD7zXZ\0", "lzma"},             -- xz
+        {"\x04\x22\x4D\x18", "lz4"},        -- LZ4 frame
+        {"\x28\xB5\x2F\xFD", "zstd"},       -- zstd frame
+    }
+
+    local function stream(codec, direction)
+        local c = codecs[codec] or {codec}
+        local lib = _G[c[1]]
+        if type(lib) ~= "table" or not lib.stream then error("z.open: codec not available: "..tostring(codec), 3) end
+        return lib.stream(direction, c[2])
+    end
+
+    local zfile = {}
+    zfile.__index = zfile
+
+    local function checkopen(self)
+        if self.closed then error("attempt to use a closed file", 3) end
+    end
+
+    -- fill decompresses the next chunk of the file (false when nothing more can be read)
+    local function fill(self)
+        if self.eof then return false end
+        local raw = self.file:read(BLOCK)
+        local data, err
+        if not self.stream then data = raw
+        elseif raw then data, err = self.stream:update(raw)
+        else data, err = self.stream:finish()
+        end
+        if err then error(err, 4) end
+        if not raw then self.eof = true end
+        if data and #data > 0 then
+            self.buf = self.buf:sub(self.pos)..data
+            self.pos = 1
+            return true
+        end
+        return raw ~= nil
+    end
+
+    -- available returns the number of buffered bytes (reading at least n bytes if possible)
+    local function available(self, n)
+        while #self.buf - self.pos + 1 < n and fill(self) do end
+        return #self.buf - self.pos + 1
+    end
+
+    local function consume(self, n)
+        local s = self.buf:sub(self.pos, self.pos+n-1)
+        self.pos = self.pos + #s
+        self.offset = self.offset + #s
+        return s
+    end
+
+    local function readline(self, keep)
+        local line, pos
+        repeat
+            line, pos = self.buf:match(keep and "^([^\n]*\n)()" or "^([^\n]*)\n()", self.pos)
+        until line or not fill(self)
+        if line then
+            self.offset = self.offset + pos - self.pos
+            self.pos = pos
+            return line
+        end
+        if available(self, 1) == 0 then return nil end
+        return consume(self, #self.buf-self.pos+1)
+    end
+
+    local function readnumber(self)
+        available(self, 200)
+        local s = self.buf:match("^%s*", self.pos)
+        consume(self, #s)
+        s = self.buf:match("^[%+%-]?0[xX][%x%.]*[pP]?[%+%-]?%d*", self.pos)
+         or self.buf:match("^[%+%-]?[%d%.]*[eE]?[%+%-]?%d*", self.pos)
+        consume(self, #s)
+        return math.tointeger(s) or tonumber(s)
+    end
+
+    local function readall(self)
+        local chunks = {}
+        repeat
+            chunks[#chunks+1] = consume(self, #self.buf-self.pos+1)
+        until not fill(self) and self.pos > #self.buf
+        return table.concat(chunks)
+    end
+
+    local function read1(self, fmt)
+        if math.type(fmt) == "integer" then
+            if available(self, math.max(fmt, 1)) == 0 then return nil end
+            return consume(self, fmt)
+        end
+        fmt = tostring(fmt):gsub("^%*", ""):sub(1, 1)
+        if fmt == "l" then return readline(self, false)
+        elseif fmt == "L" then return readline(self, true)
+        elseif fmt == "n" then return readnumber(self)
+        elseif fmt == "a" then return readall(self)
+        end
+        error("bad argument to 'read' (invalid format)", 3)
+    end
+
+    function zfile:read(...)
+        checkopen(self)
+        if self.writing then return nil, "z.open: file opened for writing" end
+        local n = select("#", ...)
+        if n == 0 then return read1(self, "l") end
+        local values = {}
+        for i = 1, n do
+            values[i] = read1(self, (select(i, ...)))
+            if values[i] == nil then return table.unpack(values, 1, i) end
+        end
+        return table.unpack(values, 1, n)
+    end
+
+    function zfile:lines(...)
+        local formats = table.pack(...)
+        if formats.n == 0 then
+            return function()
+                checkopen(self)
+                return readline(self, false)
+            end
+        end
+        return function()
+            return self:read(table.unpack(formats, 1, formats.n))
+        end
+    end
+
+    local function flush(self)
+        if #self.pending > 0 then
+            local data, err = self.stream:update(table.concat(self.pending))
+            if not data then error(err, 3) end
+            self.file:write(data)
+            self.pending = {}
+            self.size = 0
+        end
+    end
+
+    function zfile:write(...)
+        checkopen(self)
+        if not self.writing then return nil, "z.open: file opened for reading" end
+        for i = 1, select("#", ...) do
+            local s = tostring((select(i, ...)))
+            self.pending[#self.pending+1] = s
+            self.size = self.size + #s
+            self.offset = self.offset + #s
+        end
+        if self.size >= BLOCK then flush(self) end
+        return self
+    end
+
+    function zfile:flush()
+        checkopen(self)
+        if self.writing then
+            flush(self)
+            local data, err = self.stream:flush()
+            if not data then return nil, err end
+            self.file:write(data)
+            self.file:flush()
+        end
+        return self
+    end
+
+    -- seek only moves forward (or back to the beginning) when reading
+    -- and only returns the current position when writing
+    function zfile:seek(whence, offset)
+        checkopen(self)
+        whence = whence or "cur"
+        offset = offset or 0
+        local target
+        if whence == "set" then target = offset
+        elseif whence == "cur" then target = self.offset + offset
+        else return nil, "z.open: can not seek from the end of a compressed file"
+        end
+        if target == self.offset then return self.offset end
+        if self.writing then return nil, "z.open: can not seek in a file opened for writing" end
+        if target < 0 then return nil, "z.open: invalid position" end
+        if target < self.offset then
+            self.file:seek("set", 0)
+            self.stream = self.codec and stream(self.codec, "decompress")
+            self.buf, self.pos, self.offset, self.eof = "", 1, 0, false
+        end
+        while self.offset < target do
+            local n = math.min(target - self.offset, BLOCK)
+            if available(self, n) == 0 then break end
+            consume(self, n)
+        end
+        return self.offset
+    end
+
+    function zfile:setvbuf()
+        return true
+    end
+
+    function zfile:close()
+        checkopen(self)
+        if self.writing then
+            flush(self)
+            local data, err = self.stream:finish()
+            if not data then self.file:close(); self.closed = true; return nil, err end
+            self.file:write(data)
+        end
+        self.closed = true
+        return self.file:close()
+    end
+
+    zfile.__gc = function(self)
+        if not self.closed then pcall(self.close, self) end
+    end
+
+    zfile.__tostring = function(self)
+        return self.closed and "z file (closed)" or ("z file (%s)"):format(self.path)
+    end
+
+    -- z.open(path, [mode, [options]]) opens a compressed file
+    -- mode is "r" (default) or "w" ("b" is ignored).
+    -- options.codec is the codec ("gzip", "xz", or a compression library, e.g. "lz4").
+    -- When reading, the codec is detected from the beginning of the file
+    -- (files that are not compressed are read as is).
+    -- When writing, the default codec depends on the extension of path (gzip by default).
+    function z.open(path, mode, options)
+        mode = (mode or "r"):gsub("b", "")
+        options = options or {}
+        if mode ~= "r" and mode ~= "w" then error("z.open: invalid mode "..mode, 2) end
+        local file, err = io.open(path, mode.."b")
+        if not file then return nil, err end
+        local self = setmetatable({
+            path = path,
+            file = file,
+            writing = mode == "w",
+            buf = "", pos = 1,
+            offset = 0,
+            pending = {}, size = 0,
+        }, zfile)
+        local codec = options.codec
+        if self.writing then
+            codec = codec or extensions[path:match("%.(%w+)$") or ""] or "gzip"
+            self.stream = stream(codec, "compress")
+        else
+            if not codec then
+                local head = file:read(8) or ""
+                file:seek("set", 0)
+                for _, magic in ipairs(magics) do
+                    if head:sub(1, #magic[1]) == magic[1] then codec = magic[2] end
+                end
+            end
+            self.codec = codec
+            self.stream = codec and stream(codec, "decompress")
+        end
+        return self
+    end
+
+end
+
 -----------------------------------------------------------------------------
 -- ser package
 -----------------------------------------------------------------------------
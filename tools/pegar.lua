@@ -21,6 +21,21 @@ do
     local STRING_BLOCK  = string.unpack("<I4", "#STR")
     local FILE_BLOCK    = string.unpack("<I4", "#RES")
     local DIR_BLOCK     = string.unpack("<I4", "#DIR")
+    local MODULE_BLOCK  = string.unpack("<I4", "#MOD")
+    local TOC_BLOCK     = string.unpack("<I4", "#TOC")
+    local VFILE_BLOCK   = string.unpack("<I4", "#VFS")
+    local VDIR_BLOCK    = string.unpack("<I4", "#VDR")
+    local SOLID_BLOCK   = string.unpack("<I4", "#SLD")
+    local TREE_BLOCK    = string.unpack("<I4", "#TRE")
+    local TREE_FILE_BLOCK = string.unpack("<I4", "#TRF")
+
+    -- the type of a block whose data is a reference to its payload
+    -- starts with '@' (payload in a solid block) or '=' (payload stored by a previous block)
+    -- instead of '#'
+    local SOLID_REF     = "@"
+    local DEDUP_REF     = "="
+    local function ref_type(block_type, ref) return (block_type & ~0xFF) | string.byte(ref) end
+    local function base_type(block_type) return (block_type & ~0xFF) | string.byte "#" end
 
     local z = z
     if not z then
@@ -38,116 +53,464 @@ do
         return s
     end
 
+    local BUFSIZE = 1024*1024
+
+    -- blocks are compressed by batches of QUEUE_SIZE bytes
+    local QUEUE_SIZE = 64*1024*1024
+
+    -- solid blocks are cut in chunks of CHUNK_SIZE bytes compressed independently
+    local CHUNK_SIZE = 256*1024
+
+    -- copy size bytes of src (from offset) to dst
+    local function copy(src, offset, size, dst)
+        assert(src:seek("set", offset))
+        while size > 0 do
+            local buf = assert(src:read(math.min(size, BUFSIZE)))
+            assert(dst:write(buf))
+            size = size - #buf
+        end
+    end
+
     function Pegar()
 
         local self = {}
 
         local _compress = 'min'
         local _compile  = 'min'
+        local _extract  = 'off'
+        local _merge    = 'off'
+        local _solid    = 'off'
 
         function self.compress(mode) _compress = mode; return self end
         function self.compile(mode) _compile = mode; return self end
-
-        local stub = nil      -- BonaLuna executable
-        local glue = ""       -- additional blocks
+        function self.extract(mode) _extract = mode; return self end
+        function self.merge(mode) _merge = mode; return self end
+        function self.solid(mode) _solid = mode; return self end
+
+        -- The executable is not loaded in memory.
+        -- New blocks are appended to a temporary file
+        -- and everything is copied by chunks when the executable is written.
+        local stub = nil      -- BonaLuna executable: {path, size of the interpretor, size of its glue}
+        local blocks = nil    -- additional blocks (temporary file)
+        local glue_size = 0   -- size of the glue (start block and blocks)
+        local toc = {}        -- module index: {name, offset of the module block}
+        local modules = {}    -- names of the modules already added
+        local pending = nil   -- startup scripts to be merged: {{name, content}, ...}
+        local queue = {}      -- blocks waiting for compression: {block_type, name, candidates}
+        local queue_size = 0  -- size of the data in the queue
+        local solid = {}      -- payloads of the current solid block
+        local solid_size = 0  -- size of the current solid block
+        local nb_solids = 0   -- number of solid blocks already written
+        local payloads = {}   -- offsets of the payloads already written (indexed by hash)
+        local solid_payloads = {} -- offsets of the payloads of the current solid block
+        local cache = nil     -- directory of the compressed block cache
 
         local log = function() end
         function self.verbose() log = print; return self end
         function self.quiet() log = function() end; return self end
 
+        -- The cache stores compressed data on disk.
+        -- It is indexed by the hash of the uncompressed data and the available compressors
+        -- so that unchanged files are not compressed again by subsequent builds.
+        local engine = nil
+        function self.cache(dir)
+            if not (crypt and crypt.hash) then error("The cache requires crypt.hash") end
+            if not fs.stat(dir) then assert(fs.mkdir(dir)) end
+            cache = dir
+            if not engine then
+                local codecs = {_BL_VERSION or ""}
+                for _, name in ipairs{"minilzo", "lzo", "ucl", "qlz", "lz4", "lz4hc", "lzf", "zlib", "lzma", "zstd"} do
+                    if _G[name] then codecs[#codecs+1] = name end
+                end
+                engine = crypt.hash(table.concat(codecs, " "))
+            end
+            return self
+        end
+
         function self.read(exe)
             -- The default interpretor is the current executable
             exe = exe or arg[-1]
             log("read", exe)
             local f = assert(io.open(exe, "rb"))
-            local data = assert(f:read "*a")
-            f:close()
-            local end_sig, size = string.unpack("I4I4", string.sub(data, #data-8+1))
-            glue = string.pack("I4", START_SIG)
+            local exe_size = assert(f:seek("end"))
+            if blocks then blocks:close() end
+            blocks = assert(io.tmpfile())
+            glue_size = 4
+            toc = {}
+            modules = {}
+            pending = nil
+            queue = {}
+            queue_size = 0
+            solid = {}
+            solid_size = 0
+            nb_solids = 0
+            payloads = {}
+            solid_payloads = {}
+            local end_sig, size = 0, 0
+            if exe_size >= 8 then
+                assert(f:seek("set", exe_size-8))
+                end_sig, size = string.unpack("I4I4", assert(f:read(8)))
+            end
             if end_sig ~= END_SIG then
                 log("", exe.." is empty")
-                stub = data
+                stub = {path=exe, size=exe_size, glue=0}
+                f:close()
                 return self
             end
-            stub = string.sub(data, 1, #data-size)
-            data = string.sub(data, #data-size+1)
-            local start_sig = string.unpack("I4", data)
+            if size < 4*3 or size > exe_size then error("Invalid size in "..exe) end
+            stub = {path=exe, size=exe_size-size, glue=0}
+            -- only block headers are read, data are skipped
+            assert(f:seek("set", stub.size))
+            local start_sig = string.unpack("I4", assert(f:read(4)))
             if start_sig ~= START_SIG then error("Unrecognized start signature in "..exe) end
-            data = string.sub(data, 4+1)
-            while #data > 8 do
-                local block_type, name_len, data_len, name = string.unpack("I4I4I4z", data)
-                if block_type == LUA_BLOCK then log("", "lua", name)
+            local offset = stub.size + 4
+            local glue_end = exe_size - 8
+            while offset + 4*3 <= glue_end do
+                local block_type, name_len, data_len = string.unpack("I4I4I4", assert(f:read(4*3)))
+                local block_size = 4*3+name_len+data_len
+                if offset + block_size > glue_end then error("Invalid size in "..exe) end
+                local name = string.unpack("z", assert(f:read(name_len)))
+                block_type = base_type(block_type)
+                if block_type == SOLID_BLOCK then nb_solids = nb_solids + 1
+                elseif block_type == LUA_BLOCK then log("", "lua", name)
                 elseif block_type == STRING_BLOCK then log("", "str", name)
-                elseif block_type == FILE_BLOCK then log("", "file", name)
-                elseif block_type == DIR_BLOCK then log("", "dir", name)
+                elseif block_type == FILE_BLOCK then log("", "file", name, "(extracted)")
+                elseif block_type == DIR_BLOCK then log("", "dir", name, "(extracted)")
+                elseif block_type == VFILE_BLOCK then log("", "file", name)
+                elseif block_type == VDIR_BLOCK then log("", "dir", name)
+                elseif block_type == TREE_BLOCK then log("", "tree", name)
+                elseif block_type == TREE_FILE_BLOCK then -- file of the previous tree
+                elseif block_type == MODULE_BLOCK then log("", "mod", name)
+                elseif block_type == TOC_BLOCK then -- the TOC is rebuilt by write
                 else error("Unrecognized block in "..exe) end
-                glue = glue .. string.sub(data, 1, 4*3+name_len+data_len)
-                data = string.sub(data, 4*3+name_len+data_len+1)
+                if block_type == MODULE_BLOCK then
+                    table.insert(toc, {name, glue_size})
+                    modules[name] = true
+                end
+                if block_type ~= TOC_BLOCK then
+                    -- the existing blocks are contiguous (the TOC block is the last one)
+                    stub.glue = stub.glue + block_size
+                    glue_size = glue_size + block_size
+                end
+                offset = offset + block_size
+                assert(f:seek("set", offset))
             end
-            local end_sig, size = string.unpack("I4I4", string.sub(data, #data-8))
-            if end_sig ~= END_SIG then error("Unrecognized end signature in "..exe) end
-            if size ~= #glue+4*2 then error("Invalid size in "..exe) end
+            f:close()
+            if offset ~= glue_end then error("Invalid size in "..exe) end
             return self
         end
 
+        local flush, drain
+
+        -- write a block at the end of the glue
+        -- (ref is true if the data is a reference to a solid block)
+        -- (ref is SOLID_REF or DEDUP_REF if the data is a reference to the payload)
+        local function write_block(block_type, name, data, ref)
+            if block_type == MODULE_BLOCK then table.insert(toc, {name, glue_size}) end
+            if ref then block_type = ref_type(block_type, ref) end
+            assert(blocks:write(string.pack("I4I4I4z", block_type, #name+1, #data, name), data))
+            glue_size = glue_size + 4*3 + #name+1 + #data
+        end
+
+        -- Identical payloads are written once, the next blocks only refer
+        -- to the first block. Payloads are indexed by hash and compared
+        -- with the first payload (read back from the temporary file)
+        -- before being shared.
+        local function payload_key(data)
+            return crypt and crypt.hash and crypt.hash(data) or data
+        end
+
+        local function same_payload(data)
+            local p = payloads[payload_key(data)]
+            if not p or p.size ~= #data then return nil end
+            assert(blocks:seek("set", p.pos))
+            local same = blocks:read(#data) == data
+            assert(blocks:seek("end"))
+            if same then return p.offset end
+        end
+
+        local function write_payload(block_type, name, data)
+            local offset = #data > 4 and same_payload(data)
+            if offset then
+                write_block(block_type, name, string.pack("I4", offset), DEDUP_REF)
+            else
+                if #data > 4 then
+                    payloads[payload_key(data)] = {
+                        offset = glue_size,
+                        pos = glue_size-4-stub.glue + 4*3 + #name+1,
+                        size = #data,
+                    }
+                end
+                write_block(block_type, name, data)
+            end
+        end
+
+        -- add a block to the compression queue
+        -- (candidates is the list of the possible contents of the block, see smallest)
+        local function block(block_type, name, candidates)
+            -- merged scripts are written before any block executed at startup
+            if block_type ~= LUA_BLOCK and block_type ~= MODULE_BLOCK then flush() end
+            candidates = candidates or {compress='off', ""}
+            table.insert(queue, {block_type, name, candidates})
+            for i = 1, #candidates do queue_size = queue_size + #candidates[i] end
+            if queue_size >= QUEUE_SIZE then drain() end
+        end
+
+        local function cache_file(data)
+            return cache..fs.sep..crypt.hash(data).."-"..engine
+        end
+
+        local function cache_read(data)
+            local f = io.open(cache_file(data), "rb")
+            if not f then return nil end
+            local compressed = f:read "*a"
+            f:close()
+            return compressed
+        end
+
+        local function cache_write(data, compressed)
+            local name = cache_file(data)
+            local tmp = name..".tmp"
+            local f = io.open(tmp, "wb")
+            if not f then return end
+            local ok = f:write(compressed)
+            f:close()
+            if not (ok and os.rename(tmp, name)) then os.remove(tmp) end
+        end
+
+        -- compress_all compresses a list of strings in parallel with z.compress_list
+        -- (data found in the cache are not compressed again).
+        -- It returns a table mapping each string to its compressed string
+        -- (or to itself if it can not be compressed).
+        local function compress_all(list)
+            local compressed = {}
+            local todo = {}
+            for i = 1, #list do
+                local data = list[i]
+                if compressed[data] == nil then
+                    compressed[data] = cache and cache_read(data) or false
+                    if not compressed[data] then todo[#todo+1] = data end
+                end
+            end
+            local results = {}
+            if z.compress_list then
+                results = z.compress_list(todo)
+            else
+                for i = 1, #todo do results[i] = z.compress(todo[i]) or false end
+            end
+            for i = 1, #todo do
+                compressed[todo[i]] = results[i] or todo[i]
+                if cache then cache_write(todo[i], compressed[todo[i]]) end
+            end
+            return compressed
+        end
+
+        -- write_solid writes the current solid block.
+        -- Its chunks are compressed independently so that a payload
+        -- can be read without decompressing the whole solid block.
+        local function write_solid()
+            if solid_size == 0 then return end
+            local stream = table.concat(solid)
+            local chunks = {}
+            for i = 1, #stream, CHUNK_SIZE do
+                chunks[#chunks+1] = stream:sub(i, i+CHUNK_SIZE-1)
+            end
+            local compressed = compress_all(chunks)
+            local header = {string.pack("I4I4I4", CHUNK_SIZE, #stream, #chunks)}
+            for i = 1, #chunks do
+                chunks[i] = min(chunks[i], compressed[chunks[i]])
+                header[#header+1] = string.pack("I4", #chunks[i])
+            end
+            write_block(SOLID_BLOCK, "", table.concat(header)..table.concat(chunks))
+            nb_solids = nb_solids + 1
+            solid = {}
+            solid_size = 0
+            solid_payloads = {}
+        end
+
+        -- drain compresses the queued blocks (in parallel with z.compress_list)
+        -- and writes the smallest candidates in the order of the queue.
+        -- In solid mode, the smallest uncompressed candidate is added to the
+        -- current solid block and the block only contains a reference to it.
+        drain = function()
+            local list = {}
+            for i = 1, #queue do
+                local candidates = queue[i][3]
+                if candidates.compress ~= 'off' and not candidates.solid then
+                    for j = 1, #candidates do list[#list+1] = candidates[j] end
+                end
+            end
+            local compressed = compress_all(list)
+            for i = 1, #queue do
+                local block_type, name, candidates = table.unpack(queue[i])
+                local data = candidates.solid and min(table.unpack(candidates))
+                if data and #data > 0 then
+                    if solid_payloads[data] then
+                        -- the payload is already in the current solid block
+                        write_block(block_type, name, string.pack("I4", solid_payloads[data]), DEDUP_REF)
+                    else
+                        solid_payloads[data] = glue_size
+                        write_block(block_type, name, string.pack("I4I4I4", nb_solids, solid_size, #data), SOLID_REF)
+                        solid[#solid+1] = data
+                        solid_size = solid_size + #data
+                    end
+                else
+                    local choices = {}
+                    for j = 1, #candidates do
+                        local data = candidates[j]
+                        if candidates.compress ~= 'on' then choices[#choices+1] = data end
+                        if candidates.compress ~= 'off' then choices[#choices+1] = compressed[data] end
+                    end
+                    write_payload(block_type, name, min(table.unpack(choices)))
+                end
+            end
+            queue = {}
+            queue_size = 0
+            if solid_size >= QUEUE_SIZE then write_solid() end
+        end
+
         function self.write(exe)
             log("write", exe)
             if not stub then self.read() end
-            local f = assert(io.open(exe, "wb"))
-            assert(f:write(stub))
-            assert(f:write(glue))
-            assert(f:write(string.pack("I4I4", END_SIG, #glue+4*2)))
+            flush()
+            drain()
+            write_solid()
+            -- the executable is written in a temporary file
+            -- in case it is also the interpretor being read
+            local tmp = exe..".tmp"
+            local f = assert(io.open(tmp, "wb"))
+            local src = assert(io.open(stub.path, "rb"))
+            copy(src, 0, stub.size, f)
+            assert(f:write(string.pack("I4", START_SIG)))
+            copy(src, stub.size+4, stub.glue, f)
+            src:close()
+            assert(blocks:flush())
+            copy(blocks, 0, glue_size-4-stub.glue, f)
+            local index = ""
+            if #toc > 0 then
+                -- the TOC block is the last block so that modules
+                -- can be found at runtime without reading the whole glue
+                local entries = {string.pack("I4", #toc)}
+                for i = 1, #toc do
+                    entries[#entries+1] = string.pack("I4z", toc[i][2], toc[i][1])
+                end
+                entries = table.concat(entries)
+                local toc_size = 4*3+1+#entries+4
+                index = string.pack("I4I4I4zc"..#entries.."I4", TOC_BLOCK, 1, #entries+4, "", entries, toc_size)
+            end
+            assert(f:write(index))
+            assert(f:write(string.pack("I4I4", END_SIG, glue_size+#index+4*2)))
             f:close()
+            os.remove(exe)
+            assert(os.rename(tmp, exe))
             fs.chmod(exe, fs.aR, fs.aX, fs.uW)
             return self
         end
 
-        function self.lua(script_name, real_name)
-            log("lua", script_name)
-            if not stub then self.read() end
+        -- smallest returns the candidates of a block.
+        -- The smallest one, according to the compression mode,
+        -- is chosen when the block is compressed by drain.
+        local function smallest(...)
+            return {compress=_compress, solid=_solid == 'on' and _compress ~= 'off', ...}
+        end
+
+        local function read_script(script_name, real_name)
             local f = assert(io.open(real_name or script_name, "rb"))
             local content = assert(f:read "*a")
             f:close()
-            content = content:gsub("^#!.-([\r\n])", "%1")  -- load doesn't like "#!..."
-            local compiled_content = assert(string.dump(assert(load(content, script_name))))
-            local compressed_content = z.compress(content) or content
-            local compressed_compiled_content = z.compress(compiled_content) or compiled_content
-
-            local smallest = {
-                off = {
-                    off = content,
-                    on = compressed_content,
-                    min = min(content, compressed_content),
-                },
-                on = {
-                    off = compiled_content,
-                    on = compressed_compiled_content,
-                    min = min(compiled_content, compressed_compiled_content),
-                },
-                min = {
-                    off = min(content, compiled_content),
-                    on = min(compressed_content, compressed_compiled_content),
-                    min = min(content, compiled_content, compressed_content, compressed_compiled_content),
-                },
-            }
-
-            content = smallest[_compile][_compress]
-
-            glue = glue .. string.pack("I4I4I4zc"..#content, LUA_BLOCK, #script_name+1, #content, script_name, content)
+            return (content:gsub("^#!.-([\r\n])", "%1"))  -- load doesn't like "#!..."
+        end
+
+        -- compile returns the smallest chunk according to the compile and compress modes.
+        -- In the opt mode, debug information is stripped unless the script uses the debug library.
+        local function compile(content, script_name)
+            local strip = _compile == 'opt' and not content:match("debug%.")
+            local compiled_content = assert(string.dump(assert(load(content, script_name)), strip))
+            if _compile == 'on' then return smallest(compiled_content)
+            elseif _compile == 'off' then return smallest(content)
+            else return smallest(content, compiled_content)
+            end
+        end
+
+        local function script(block_type, script_name, real_name)
+            block(block_type, script_name, compile(read_script(script_name, real_name), script_name))
+        end
+
+        -- flush merges the pending startup scripts into a single chunk.
+        -- Each script is a function of this chunk (identical scripts share the same function)
+        -- and is executed with its own arg table as if it were in a separate block.
+        flush = function()
+            local scripts = pending
+            pending = nil
+            if scripts == nil then return end
+            if #scripts > 1 then
+                -- the locals of the merged chunk have unlikely names
+                -- as they are visible from the scripts
+                local merged = {[[
+local __pegar_arg = arg
+local function __pegar_setarg(name)
+    arg = {}
+    for k, v in pairs(__pegar_arg) do arg[k] = v end
+    if name:match("^:[/\\]") then name = __pegar_arg[-1]:match("^(.*[/\\])")..name:sub(3) end
+    arg[0] = name
+end
+local __pegar_scripts = {}
+]]}
+                local index = {}
+                for i = 1, #scripts do
+                    local name, content = scripts[i][1], scripts[i][2]
+                    merged[#merged+1] = string.format("__pegar_setarg(%q)\n", name)
+                    if not index[content] then
+                        index[content] = i
+                        merged[#merged+1] = "__pegar_scripts["..i.."] = function(...)\n"
+                        merged[#merged+1] = content
+                        merged[#merged+1] = "\nend\n"
+                    end
+                    merged[#merged+1] = "__pegar_scripts["..index[content].."](...)\n"
+                end
+                merged = table.concat(merged)
+                if load(merged, "startup") then
+                    block(LUA_BLOCK, "startup", compile(merged, "startup"))
+                    return
+                end
+            end
+            -- scripts that can not be merged are written separately
+            for i = 1, #scripts do
+                block(LUA_BLOCK, scripts[i][1], compile(scripts[i][2], scripts[i][1]))
+            end
+        end
+
+        function self.lua(script_name, real_name)
+            log("lua", script_name)
+            if not stub then self.read() end
+            if _merge == 'on' then
+                pending = pending or {}
+                table.insert(pending, {script_name, read_script(script_name, real_name)})
+            else
+                flush()
+                script(LUA_BLOCK, script_name, real_name)
+            end
+            return self
+        end
+
+        function self.mod(module_name, real_name)
+            if not real_name then
+                -- the module name is deduced from the file name
+                real_name = module_name
+                module_name = module_name:gsub("%.lua$", ""):gsub("[/\\]", ".")
+            end
+            log("mod", module_name)
+            if not stub then self.read() end
+            if modules[module_name] then error("Duplicate module: "..module_name) end
+            modules[module_name] = true
+            script(MODULE_BLOCK, module_name, real_name)
             return self
         end
 
         function self.str(name, value)
             log("str", name)
             if not stub then self.read() end
-            local compressed_value = z.compress(value) or value
-            local smallest = {
-                off = value,
-                on = compressed_value,
-                min = min(value, compressed_value),
-            }
-            value = smallest[_compress]
-            glue = glue .. string.pack("I4I4I4zc"..#value, STRING_BLOCK, #name+1, #value, name, value)
+            block(STRING_BLOCK, name, smallest(value))
             return self
         end
 
@@ -166,21 +529,48 @@ do
             local f = assert(io.open(real or name, "rb"))
             local content = assert(f:read "*a")
             f:close()
-            local compressed_content = z.compress(content) or content
-            local smallest = {
-                off = content,
-                on = compressed_content,
-                min = min(content, compressed_content),
-            }
-            content = smallest[_compress]
-            glue = glue .. string.pack("I4I4I4zc"..#content, FILE_BLOCK, #name+1, #content, name, content)
+            block(_extract == 'on' and FILE_BLOCK or VFILE_BLOCK, name, smallest(content))
             return self
         end
 
         function self.dir(name)
             log("dir", name)
             if not stub then self.read() end
-            glue = glue .. string.pack("I4I4I4z", DIR_BLOCK, #name+1, 0, name)
+            block(_extract == 'on' and DIR_BLOCK or VDIR_BLOCK, name)
+            return self
+        end
+
+        -- tree adds a directory tree extracted at runtime.
+        -- The manifest lists the directories and files with their permissions,
+        -- dates, sizes and hashes (so that unchanged files are not extracted again).
+        function self.tree(name, real)
+            log("tree", name)
+            if not stub then self.read() end
+            real = real or name
+            local manifest = {}
+            local files = {}
+            for path in fs.walk(real) do
+                local st = assert(fs.stat(path))
+                local rel = path:sub(#real+2):gsub("[/\\]", "/")
+                if st.type == "directory" then
+                    manifest[#manifest+1] = string.pack("I4I4i8I4zz", 0, st.mode & 511, st.mtime, 0, "", rel)
+                else
+                    local f = assert(io.open(path, "rb"))
+                    local content = assert(f:read "*a")
+                    f:close()
+                    local hash = crypt and crypt.hash and crypt.hash(content) or ""
+                    manifest[#manifest+1] = string.pack("I4I4i8I4zz", 1, st.mode & 511, st.mtime, #content, hash, rel)
+                    files[#files+1] = path
+                end
+            end
+            block(TREE_BLOCK, name, smallest(string.pack("I4", #manifest)..table.concat(manifest)))
+            -- the payloads follow the manifest in the same order
+            for i = 1, #files do
+                local f = assert(io.open(files[i], "rb"))
+                local content = assert(f:read "*a")
+                f:close()
+                block(TREE_FILE_BLOCK, files[i]:sub(#real+2):gsub("[/\\]", "/"), smallest(content))
+            end
             return self
         end
 
@@ -198,18 +588,30 @@ usage: ]]..(arg[0] or arg[1] or arg[-1])..[[ arguments
     compile:on              turn compilation on
     compile:off             turn compilation off
     compile:min             turn compilation on when chunks are smaller than sources
+    compile:opt             as compile:min but strip debug information
     compress:on             turn compression on
     compress:off            turn compression off
     compress:min            turn compression on when chunks are smaller than sources
+    extract:on              extract the next files and directories at runtime
+    extract:off             serve the next files and directories from memory (default)
+    merge:on                merge the next consecutive scripts into a single chunk
+    merge:off               do not merge scripts (default)
+    solid:on                store the next compressed blocks in a solid block
+    solid:off               compress the next blocks separately (default)
+    cache:dir               keep compressed blocks in dir to speed up the next builds
 
     read:bl.exe             read bl.exe and its current glue
     lua:script.lua          add a new script
     lua:script.lua=realname add a new script with a different name
+    mod:module.lua          add a new module loaded by require (module name: module)
+    mod:name=realname       add a new module with a different name
     str:name="some text"    add a global variable name
     str:name=@filename      add a global variable, the value is in a file
     file:name               add a file (same name in the glue)
     file:name=realname      add a file with name 'name', the content is in a file
     dir:name                create a directory
+    tree:name               add a directory tree (extracted at runtime)
+    tree:name=realname      add a directory tree with a different name
     write:bl2.exe           write a new executable
 
 example:
@@ -232,17 +634,23 @@ for i, cmd in ipairs(arg) do
     else
         local action, param = string.match(cmd, "^(%w+):(.*)$")
         local param1, param2 = string.match(param, "^(.-)=(.+)$")
-        if action == "compile" and (param == 'min' or param == 'on' or param == 'off') then exe.compile(param)
+        if action == "compile" and (param == 'min' or param == 'on' or param == 'off' or param == 'opt') then exe.compile(param)
         elseif action == "compress" and (param == 'min' or param == 'on' or param == 'off') then exe.compress(param)
+        elseif action == "extract" and (param == 'on' or param == 'off') then exe.extract(param)
+        elseif action == "merge" and (param == 'on' or param == 'off') then exe.merge(param)
+        elseif action == "solid" and (param == 'on' or param == 'off') then exe.solid(param)
+        elseif action == "cache" and param ~= "" then exe.cache(param)
         elseif action == "read" then exe.read(param)
         elseif action == "write" then exe.write(param)
         elseif action == "lua" then exe.lua(param1 or param, param2)
+        elseif action == "mod" then exe.mod(param1 or param, param2)
         elseif action == "str" and param2 then
             if string.match(param2, "^@") then exe.strf(param1, string.sub(param2, 2))
             else exe.str(param1, param2)
             end
         elseif action == "file" then exe.file(param1 or param, param2)
         elseif action == "dir" then exe.dir(param)
+        elseif action == "tree" then exe.tree(param1 or param, param2)
         else error("Unrecognized parameter: "..cmd) end
     end
 end